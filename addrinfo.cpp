@@ -1,10 +1,12 @@
 // Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
-// Redistribution only with this Copyright remark. Last modified: 2024-01-12
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
 
 #include "addrinfo.hpp"
 #include "port.hpp"
+#include <exception>
 #include <string>
 #include <stdexcept>
+#include <utility>
 
 namespace upnplib {
 
@@ -13,80 +15,50 @@ namespace upnplib {
 // Constructor with getting an address information.
 CAddrinfo::CAddrinfo(const std::string& a_node, const std::string& a_service,
                      const int a_family, const int a_socktype,
-                     const int a_flags, const int a_protocol)
-    : m_node(a_node), m_service(a_service),
-      m_hints{a_flags, a_family, a_socktype, a_protocol,
-              {},      nullptr,  nullptr,    nullptr} {
+                     const int a_flags, const int a_protocol) {
     TRACE2(this, " Construct upnplib::CAddrinfo(..) with arguments")
-
-    // Get new address information from the operating system.
-    m_res = this->get_new_addrinfo(); // may throw exception
+    const addrinfo hints{a_flags, a_family, a_socktype, a_protocol,
+                         {},      nullptr,  nullptr,    nullptr};
+    // may throw exception
+    m_res = CAddrinfoCache::global().get(a_node, a_service, hints);
 }
 
 // Copy constructor
-CAddrinfo::CAddrinfo(const CAddrinfo& that) {
+CAddrinfo::CAddrinfo(const CAddrinfo& that) : m_res(that.m_res) {
     TRACE2(this, " Construct copy upnplib::CAddrinfo()")
-    m_node = that.m_node;
-    m_service = that.m_service;
-    m_hints = that.m_hints;
-    m_res = this->get_new_addrinfo(); // may throw exception
 }
 
-// Copy assignment operator
-CAddrinfo& CAddrinfo::operator=(CAddrinfo that) {
-    TRACE2(this, " Executing upnplib::CAddrinfo::operator=()")
-    // The argument by value ('that') was copied to the stack by the copy
-    // constructor. It contains also a pointer (m_res) to a new allocated
-    // addrinfo.
-    std::swap(m_res, that.m_res);
-    // The no longer needed current m_res pointer has been swapped to the stack
-    // and its resource will be deallocated by the destructor of the 'that'
-    // object when leaving this function.
-
-    std::swap(m_node, that.m_node);
-    std::swap(m_service, that.m_service);
-    std::swap(m_hints, that.m_hints);
-
-    // by convention, always return *this
-    return *this;
+// Move constructor
+CAddrinfo::CAddrinfo(CAddrinfo&& that) noexcept
+    : m_res(std::move(that.m_res)) {
+    TRACE2(this, " Construct move upnplib::CAddrinfo()")
 }
 
-CAddrinfo::~CAddrinfo() {
-    TRACE2(this, " Destruct upnplib::CAddrinfo()")
-    TRACE2("Call freeaddrinfo() with m_res = ", m_res)
-    ::freeaddrinfo(m_res);
-    m_res = nullptr;
+// Constructor with a result of the resolver
+CAddrinfo::CAddrinfo(std::shared_ptr<const addrinfo> a_res)
+    : m_res(std::move(a_res)) {
+    TRACE2(this, " Construct upnplib::CAddrinfo() with result")
 }
 
-addrinfo* CAddrinfo::get_new_addrinfo() {
-    TRACE2(this, " Executing upnplib::CAddrinfo::get_new_addrinfo()")
-
-    // Get new address information with cached hints. This should always return
-    // the same address info.
-    addrinfo* new_res{nullptr};
+// Copy and move assignment operator
+CAddrinfo& CAddrinfo::operator=(CAddrinfo that) noexcept {
+    TRACE2(this, " Executing upnplib::CAddrinfo::operator=()")
+    // The argument by value ('that') was copied resp. moved to the stack. The
+    // no longer needed current result is released with it when leaving this
+    // function.
+    std::swap(m_res, that.m_res);
+    return *this;
+}
 
-    int ret = ::getaddrinfo(m_node.empty() ? nullptr : m_node.c_str(),
-                            m_service.empty() ? nullptr : m_service.c_str(),
-                            &m_hints, &new_res);
-    if (ret != 0) {
-        throw std::runtime_error(
-            "[" + std::to_string(__LINE__) +
-            "] ERROR! MSG1025: Failed to get address information: errid(" +
-            std::to_string(ret) + ")=\"" + ::gai_strerror(ret) + "\"");
-    }
+CAddrinfo::~CAddrinfo() { TRACE2(this, " Destruct upnplib::CAddrinfo()") }
 
-    // Different on platforms: Ubuntu & MacOS return protocol number, win32
-    // returns 0. We just return what was requested by the user.
-    new_res->ai_protocol = m_hints.ai_protocol;
-    // Different on platforms: Ubuntu returns set flags, MacOS & win32 return 0.
-    // We just return what was requested by the user.
-    new_res->ai_flags = m_hints.ai_flags;
+const addrinfo* CAddrinfo::operator->() const { return m_res.get(); }
 
-    TRACE2("Called getaddrinfo() with new_res = ", new_res)
-    return new_res;
+CAddrinfo::const_iterator CAddrinfo::begin() const {
+    return const_iterator(m_res.get());
 }
 
-addrinfo* CAddrinfo::operator->() const { return m_res; }
+CAddrinfo::const_iterator CAddrinfo::end() const { return const_iterator(); }
 
 std::string CAddrinfo::addr_str() const {
     TRACE2(this, " Executing upnplib::CAddrinfo::addr_str()")
@@ -111,4 +83,280 @@ uint16_t CAddrinfo::port() const {
     return ntohs(((sockaddr_in6*)m_res->ai_addr)->sin6_port);
 }
 
+// Process wide cache of address resolutions
+// ==========================================
+namespace {
+// Key of an entry. Node and service are separated by a character that
+// cannot be part of them.
+std::string cache_key(const std::string& a_node, const std::string& a_service,
+                      const addrinfo& a_hints) {
+    return a_node + '\0' + a_service + '\0' +
+           std::to_string(a_hints.ai_flags) + ',' +
+           std::to_string(a_hints.ai_family) + ',' +
+           std::to_string(a_hints.ai_socktype) + ',' +
+           std::to_string(a_hints.ai_protocol);
+}
+
+// Failures that may not occur on the next try.
+bool is_temporary_failure(int a_error) {
+#ifdef EAI_SYSTEM
+    if (a_error == EAI_SYSTEM)
+        return true;
+#endif
+    return a_error == EAI_AGAIN || a_error == EAI_MEMORY;
+}
+
+// Number of threads that resolve asynchronous lookups.
+constexpr unsigned resolver_threads{2};
+
+std::exception_ptr make_gai_error(int a_error) {
+    std::string errmsg{"["};
+    errmsg.append(std::to_string(__LINE__))
+        .append("] ERROR! MSG1025: Failed to get address information: errid(")
+        .append(std::to_string(a_error))
+        .append(")=\"")
+        .append(::gai_strerror(a_error))
+        .append("\"");
+    return std::make_exception_ptr(std::runtime_error(errmsg));
+}
+} // anonymous namespace
+
+CAddrinfoCache::CAddrinfoCache(int a_ttl_ms, int a_negative_ttl_ms,
+                               size_t a_max_entries)
+    : m_ttl(a_ttl_ms), m_negative_ttl(a_negative_ttl_ms),
+      m_max_entries(a_max_entries) {
+    TRACE2(this, " Construct upnplib::CAddrinfoCache")
+}
+
+CAddrinfoCache::~CAddrinfoCache() {
+    TRACE2(this, " Destruct upnplib::CAddrinfoCache")
+}
+
+std::shared_ptr<const addrinfo>
+CAddrinfoCache::get(const std::string& a_node, const std::string& a_service,
+                    const addrinfo& a_hints) {
+    TRACE2(this, " Executing upnplib::CAddrinfoCache::get()")
+    const std::string key = cache_key(a_node, a_service, a_hints);
+    bool start{false};
+    Entry entry;
+    Result result;
+    {
+        std::scoped_lock lock(m_mutex);
+        // A hit needs no future, that is only shared by lookups in flight.
+        if (!this->find(key, entry))
+            result = this->lookup(key, start);
+    }
+    if (!result.valid()) {
+        if (!entry.res)
+            std::rethrow_exception(entry.failure);
+        return entry.res;
+    }
+    // Resolve on this thread if no other lookup is in flight, otherwise
+    // wait for its result.
+    if (start)
+        this->resolve(key, a_node, a_service, a_hints);
+    return result.get();
+}
+
+CAddrinfoCache::Result
+CAddrinfoCache::get_async(const std::string& a_node,
+                          const std::string& a_service,
+                          const addrinfo& a_hints) {
+    TRACE2(this, " Executing upnplib::CAddrinfoCache::get_async()")
+    const std::string key = cache_key(a_node, a_service, a_hints);
+    Entry entry;
+    {
+        std::scoped_lock lock(m_mutex);
+        if (!this->find(key, entry)) {
+            bool start{false};
+            Result result = this->lookup(key, start);
+            if (start)
+                this->submit(key, a_node, a_service, a_hints);
+            return result;
+        }
+    }
+    // The ready result of a hit is made without holding the lock.
+    return ready(entry);
+}
+
+void CAddrinfoCache::get_async(const std::string& a_node,
+                               const std::string& a_service,
+                               const addrinfo& a_hints, Callback a_callback) {
+    TRACE2(this, " Executing upnplib::CAddrinfoCache::get_async(callback)")
+    const std::string key = cache_key(a_node, a_service, a_hints);
+    Entry entry;
+    {
+        std::scoped_lock lock(m_mutex);
+        if (!this->find(key, entry)) {
+            bool start{false};
+            this->lookup(key, start);
+            if (start)
+                this->submit(key, a_node, a_service, a_hints);
+            // A lookup in flight calls back when it is resolved.
+            m_in_flight[key].callbacks.push_back(std::move(a_callback));
+            return;
+        }
+    }
+    // The result was cached, call back without holding the lock.
+    a_callback(ready(entry));
+}
+
+bool CAddrinfoCache::find(const std::string& a_key, Entry& a_entry) {
+    auto it = m_entries.find(a_key);
+    if (it == m_entries.end())
+        return false;
+    if (std::chrono::steady_clock::now() >= it->second.expires) {
+        m_entries.erase(it);
+        return false;
+    }
+    m_stats.hits++;
+    if (!it->second.res)
+        m_stats.negative_hits++;
+    a_entry = it->second;
+    return true;
+}
+
+CAddrinfoCache::Result CAddrinfoCache::ready(const Entry& a_entry) {
+    std::promise<std::shared_ptr<const addrinfo>> promise;
+    if (a_entry.res)
+        promise.set_value(a_entry.res);
+    else
+        promise.set_exception(a_entry.failure);
+    return promise.get_future().share();
+}
+
+CAddrinfoCache::Result CAddrinfoCache::lookup(const std::string& a_key,
+                                              bool& a_start) {
+    auto [in_flight, inserted] = m_in_flight.try_emplace(a_key);
+    if (inserted)
+        m_stats.misses++;
+    else
+        m_stats.coalesced++;
+    a_start = inserted;
+    return in_flight->second.result;
+}
+
+void CAddrinfoCache::submit(const std::string& a_key,
+                            const std::string& a_node,
+                            const std::string& a_service,
+                            const addrinfo& a_hints) {
+    if (!m_resolver)
+        m_resolver = std::make_unique<CWorkerPool>(resolver_threads);
+    m_resolver->submit([this, a_key, a_node, a_service, a_hints] {
+        this->resolve(a_key, a_node, a_service, a_hints);
+    });
+}
+
+void CAddrinfoCache::resolve(const std::string& a_key,
+                             const std::string& a_node,
+                             const std::string& a_service,
+                             const addrinfo& a_hints) {
+    TRACE2(this, " Executing upnplib::CAddrinfoCache::resolve()")
+    // Resolve without holding the lock. An exception fails the lookup like
+    // an error of the resolver. The lookup must not stay in flight anyway,
+    // otherwise all that wait for it would hang.
+    std::shared_ptr<const addrinfo> res;
+    std::exception_ptr failure;
+    bool temporary{false};
+    try {
+        addrinfo* new_res{nullptr};
+        int ret = ::getaddrinfo(a_node.empty() ? nullptr : a_node.c_str(),
+                                a_service.empty() ? nullptr
+                                                  : a_service.c_str(),
+                                &a_hints, &new_res);
+        if (ret != 0) {
+            failure = make_gai_error(ret);
+            temporary = is_temporary_failure(ret);
+        } else {
+            // Different on platforms: Ubuntu & MacOS return protocol
+            // number, win32 returns 0. We just return what was requested by
+            // the user.
+            new_res->ai_protocol = a_hints.ai_protocol;
+            // Different on platforms: Ubuntu returns set flags, MacOS &
+            // win32 return 0. We just return what was requested by the user.
+            new_res->ai_flags = a_hints.ai_flags;
+            TRACE2("Called getaddrinfo() with new_res = ", new_res)
+            // The list is freed as a whole with freeaddrinfo(), also if
+            // creating the shared pointer throws. Its entries cannot be
+            // copied because they contain pointers.
+            res = std::shared_ptr<const addrinfo>(
+                new_res, [](const addrinfo* a_res) {
+                    TRACE2("Call freeaddrinfo() with res = ", a_res)
+                    ::freeaddrinfo(const_cast<addrinfo*>(a_res));
+                });
+        }
+    } catch (...) {
+        failure = std::current_exception();
+    }
+
+    InFlight in_flight;
+    {
+        std::scoped_lock lock(m_mutex);
+        const bool cache = !failure ? m_ttl.count() > 0
+                                    : m_negative_ttl.count() > 0 && !temporary;
+        if (cache) {
+            try {
+                if (m_entries.size() >= m_max_entries) {
+                    // Make room, expired entries first.
+                    const auto now = std::chrono::steady_clock::now();
+                    std::erase_if(m_entries, [&now](const auto& a_entry) {
+                        return a_entry.second.expires <= now;
+                    });
+                    if (m_entries.size() >= m_max_entries)
+                        m_entries.erase(m_entries.begin());
+                }
+                m_entries.insert_or_assign(
+                    a_key, Entry{res, failure,
+                                 std::chrono::steady_clock::now() +
+                                     (failure ? m_negative_ttl : m_ttl)});
+            } catch (...) {
+                // Then the result is only given to the waiters.
+                TRACE2(this, " Failed to cache address information")
+            }
+        }
+        m_stats.entries = m_entries.size();
+        // From now on new lookups find the cache entry resp. resolve again.
+        auto it = m_in_flight.find(a_key);
+        in_flight = std::move(it->second);
+        m_in_flight.erase(it);
+    }
+
+    // Give the result to all that wait for it.
+    if (!failure)
+        in_flight.promise.set_value(res);
+    else
+        in_flight.promise.set_exception(failure);
+    for (Callback& callback : in_flight.callbacks)
+        callback(in_flight.result);
+}
+
+void CAddrinfoCache::set_ttl(int a_ttl_ms, int a_negative_ttl_ms) {
+    std::scoped_lock lock(m_mutex);
+    m_ttl = std::chrono::milliseconds(a_ttl_ms);
+    m_negative_ttl = std::chrono::milliseconds(a_negative_ttl_ms);
+}
+
+std::chrono::milliseconds CAddrinfoCache::get_ttl() const {
+    std::scoped_lock lock(m_mutex);
+    return m_ttl;
+}
+
+void CAddrinfoCache::clear() {
+    std::scoped_lock lock(m_mutex);
+    m_entries.clear();
+    m_stats.entries = 0;
+}
+
+CAddrinfoCache::Stats CAddrinfoCache::get_stats() const {
+    std::scoped_lock lock(m_mutex);
+    Stats stats{m_stats};
+    stats.entries = m_entries.size();
+    return stats;
+}
+
+CAddrinfoCache& CAddrinfoCache::global() {
+    static CAddrinfoCache cache;
+    return cache;
+}
+
 } // namespace upnplib
@@ -1,10 +1,21 @@
 #ifndef UPNPLIB_INCLUDE_ADDRINFO_HPP
 #define UPNPLIB_INCLUDE_ADDRINFO_HPP
 // Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
-// Redistribution only with this Copyright remark. Last modified: 2023-04-10
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
 
 #include "port_sock.hpp"
+#include "worker-pool.hpp"
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace upnplib {
 
@@ -17,24 +28,25 @@ namespace upnplib {
 
 class CAddrinfo {
   public:
-    // Constructor for getting an address information.
+    // Constructor for getting an address information. It is taken from the
+    // process wide resolution cache (see CAddrinfoCache) if available.
     CAddrinfo(const std::string& a_node, const std::string& a_service,
               const int a_family = AF_UNSPEC, const int a_socktype = 0,
               const int a_flags = 0, const int protocol = 0);
 
-    // Rule of three: we need a copy constructor and a copy assignment operator.
-    // REF: [What is The Rule of Three?]
-    // (https://stackoverflow.com/q/4172722/5014688)
-    //
-    // copy constructor:
+    // The address information is immutable and shared by all copies. So
+    // copying and moving only counts references and never calls the
+    // resolver. A moved-from object is empty, operator->() returns nullptr.
     // Example: CAddrinfo ai2 = ai1; // ai1 is an instantiated valid object,
     // or       CAddrinfo ai2{ai1};
     CAddrinfo(const CAddrinfo& that);
+    CAddrinfo(CAddrinfo&& that) noexcept;
+    // Take a result of the resolver, e.g. from CAddrinfoCache::get_async().
+    explicit CAddrinfo(std::shared_ptr<const addrinfo> a_res);
     //
-    // copy assignment operator:
-    // Provides strong exception guarantee.
+    // copy and move assignment operator:
     // Example: ai2 = ai1; // ai1 and ai2 are instantiated valid objects.
-    CAddrinfo& operator=(CAddrinfo that);
+    CAddrinfo& operator=(CAddrinfo that) noexcept;
 
     virtual ~CAddrinfo();
 
@@ -42,7 +54,38 @@ class CAddrinfo {
     // Example: CAddrinfo ai(..); if(ai->family == AF_INET6) {..};
     // REF: [Overloading member access operators ->, .*]
     // https://stackoverflow.com/a/8782794/5014688
-    addrinfo* operator->() const;
+    const addrinfo* operator->() const;
+
+    // Iterate over all entries of the address information, e.g. the IPv6
+    // and IPv4 addresses of a node. operator->() only gives the first one.
+    // Example: for (const addrinfo& entry : ai) {..};
+    class const_iterator {
+      public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = addrinfo;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const addrinfo*;
+        using reference = const addrinfo&;
+
+        const_iterator(const addrinfo* a_entry = nullptr) : m_entry(a_entry) {}
+        reference operator*() const { return *m_entry; }
+        pointer operator->() const { return m_entry; }
+        const_iterator& operator++() {
+            m_entry = m_entry->ai_next;
+            return *this;
+        }
+        const_iterator operator++(int) {
+            const_iterator old{*this};
+            m_entry = m_entry->ai_next;
+            return old;
+        }
+        bool operator==(const const_iterator&) const = default;
+
+      private:
+        const addrinfo* m_entry;
+    };
+    const_iterator begin() const;
+    const_iterator end() const;
 
     // Getter for address string
     std::string addr_str() const;
@@ -51,27 +94,105 @@ class CAddrinfo {
     uint16_t port() const;
 
   private:
-    // This pointer is the reason why we need a copy constructor and a copy
-    // assignment operator.
-    addrinfo* m_res{nullptr};
-
-    // Cache the hints that are given by the user, so we can always get
-    // identical address information from the operating system.
-    std::string m_node;
-    std::string m_service;
-    addrinfo m_hints{};
-
-    // This is a helper method that gets a new address information from the
-    // operating system. Because we always use the same cached hints we also get
-    // the same information with new allocated memory. We cannot just copy the
-    // structure that m_res pointed to (*m_res = *that.m_res;). Copy works but
-    // MS Windows failed to destruct it with freeaddrinfo(m_res);. It throws an
-    // exception "A non-recoverable error occurred during a database lookup.".
-    // Seems there are also pointer within the addrinfo structure that are not
-    // deeply copied. So we have to go the hard way with getaddrinfo() and free
-    // it with freeaddrinfo(),
-    // Provides strong exception guarantee.
-    addrinfo* get_new_addrinfo();
+    // Shared result list of ::getaddrinfo().
+    std::shared_ptr<const addrinfo> m_res;
+};
+
+// Process wide cache of address resolutions
+// ------------------------------------------
+// Results of ::getaddrinfo() are cached by node, service and hints for a
+// time to live. Failed resolutions are also cached for a shorter time
+// (negative caching) except temporary failures. The results are immutable
+// and shared, they are released by the last CAddrinfo that uses them. A time
+// to live of 0 disables caching. Lookups of the same key that are in flight
+// are coalesced, only the first one calls the resolver and the others wait
+// for its result. Asynchronous lookups run on a small dedicated resolver
+// pool. This class is thread safe.
+class CAddrinfoCache {
+  public:
+    // Statistics of the cache.
+    struct Stats {
+        size_t hits;          // Resolutions taken from the cache.
+        size_t negative_hits; // Of them, cached failures.
+        size_t misses;        // Resolutions done by ::getaddrinfo().
+        size_t coalesced;     // Lookups that waited for one in flight.
+        size_t entries;       // Entries in the cache now.
+    };
+    // Result of an asynchronous lookup. get() rethrows a failure.
+    using Result = std::shared_future<std::shared_ptr<const addrinfo>>;
+    using Callback = std::function<void(Result)>;
+
+    CAddrinfoCache(int a_ttl_ms = 60000, int a_negative_ttl_ms = 5000,
+                   size_t a_max_entries = 1024);
+    CAddrinfoCache(const CAddrinfoCache&) = delete;
+    CAddrinfoCache& operator=(const CAddrinfoCache&) = delete;
+    virtual ~CAddrinfoCache();
+
+    // Get the address information, resolve it if it isn't cached or has
+    // expired. Throws an exception if resolution fails, also if the failure
+    // is cached.
+    std::shared_ptr<const addrinfo> get(const std::string& a_node,
+                                        const std::string& a_service,
+                                        const addrinfo& a_hints);
+    // Same without blocking. The result is ready at once if it is cached.
+    // The callback variant calls a_callback when the result is ready, on
+    // the resolver thread or on the calling thread if it is cached.
+    Result get_async(const std::string& a_node, const std::string& a_service,
+                     const addrinfo& a_hints);
+    void get_async(const std::string& a_node, const std::string& a_service,
+                   const addrinfo& a_hints, Callback a_callback);
+    // Setter for the times to live of new entries.
+    void set_ttl(int a_ttl_ms, int a_negative_ttl_ms);
+    // Getter for the time to live of new resolved entries.
+    std::chrono::milliseconds get_ttl() const;
+    // Remove all entries.
+    void clear();
+    // Getter for the statistics.
+    Stats get_stats() const;
+
+    // Cache that is used by CAddrinfo.
+    static CAddrinfoCache& global();
+
+  private:
+    struct Entry {
+        std::shared_ptr<const addrinfo> res; // nullptr if failed,
+        std::exception_ptr failure;          // then with this exception.
+        std::chrono::steady_clock::time_point expires;
+    };
+    struct InFlight {
+        std::promise<std::shared_ptr<const addrinfo>> promise;
+        Result result{promise.get_future().share()};
+        std::vector<Callback> callbacks;
+    };
+    mutable std::mutex m_mutex;
+    std::unordered_map<std::string, Entry> m_entries; // Protected by mutex.
+    std::unordered_map<std::string, InFlight>
+        m_in_flight;                          // Protected by mutex.
+    std::chrono::milliseconds m_ttl;          // Protected by mutex.
+    std::chrono::milliseconds m_negative_ttl; // Protected by mutex.
+    size_t m_max_entries;
+    Stats m_stats{}; // Protected by mutex.
+    // Resolver threads, started with the first asynchronous lookup.
+    std::unique_ptr<CWorkerPool> m_resolver; // Protected by mutex.
+
+    // Copy a cache entry that hasn't expired to a_entry. Returns false on a
+    // miss. Called with the mutex locked.
+    bool find(const std::string& a_key, Entry& a_entry);
+    // Result of a cache hit that is ready at once.
+    static Result ready(const Entry& a_entry);
+    // Look up the lookups in flight. If it misses, a new lookup is
+    // registered as in flight and a_start is set. Called with the mutex
+    // locked.
+    Result lookup(const std::string& a_key, bool& a_start);
+    // Resolve a registered lookup on the resolver pool. Called with the
+    // mutex locked.
+    void submit(const std::string& a_key, const std::string& a_node,
+                const std::string& a_service, const addrinfo& a_hints);
+    // Resolve a lookup that is in flight and give its result to all that
+    // wait for it. It doesn't throw, an exception is given to them as the
+    // result.
+    void resolve(const std::string& a_key, const std::string& a_node,
+                 const std::string& a_service, const addrinfo& a_hints);
 };
 
 } // namespace upnplib
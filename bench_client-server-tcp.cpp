@@ -0,0 +1,173 @@
+// Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+// Benchmarks of the hot paths
+// ===========================
+// Results for tracking regressions are written with e.g.
+// bench_client-server-tcp --benchmark_out=bench.json
+//                         --benchmark_out_format=json
+// or with the cmake target bench_json. The servers listen on free ports of
+// the loopback interface, so the benchmarks don't need a network.
+
+#include "client-tcp.hpp"
+#include "server-tcp.hpp"
+#include "addrinfo.hpp"
+#include "socket.hpp"
+#include <benchmark/benchmark.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace upnplib {
+
+namespace {
+
+// Server that runs on its own thread until the end of the program.
+class CBenchServer {
+  public:
+    CBenchServer(const ServerConfig& a_config)
+        : m_server("0", false, a_config),
+          m_thread(&CServerTCP::run, &m_server) {
+        m_server.wait_ready(std::chrono::seconds(10));
+    }
+    ~CBenchServer() {
+        m_server.stop(std::chrono::seconds(1));
+        m_thread.join();
+    }
+    std::string port() const { return std::to_string(m_server.get_port()); }
+
+  private:
+    CServerTCP m_server;
+    std::thread m_thread;
+};
+
+// Closes the connection after receiving one message.
+CBenchServer& oneshot_server() {
+    static CBenchServer server([] {
+        ServerConfig config;
+        config.mode = ServerMode::epoll;
+        return config;
+    }());
+    return server;
+}
+
+// Echoes the frames of persistent connections.
+CBenchServer& echo_server() {
+    static CBenchServer server([] {
+        ServerConfig config;
+        config.mode = ServerMode::epoll;
+        config.persistent = true;
+        config.socket.nodelay = true;
+        return config;
+    }());
+    return server;
+}
+
+} // anonymous namespace
+
+
+// CSocket
+// =======
+void BM_socket_construct(benchmark::State& state) {
+    WINSOCK_INIT_P
+    for (auto _ : state) {
+        CSocket sock(AF_INET6, SOCK_STREAM);
+        benchmark::DoNotOptimize(static_cast<SOCKET>(sock));
+    }
+}
+BENCHMARK(BM_socket_construct);
+
+void BM_socket_move(benchmark::State& state) {
+    WINSOCK_INIT_P
+    CSocket sock(AF_INET6, SOCK_STREAM);
+    for (auto _ : state) {
+        CSocket moved(std::move(sock));
+        sock = std::move(moved);
+        benchmark::DoNotOptimize(static_cast<SOCKET>(sock));
+    }
+}
+BENCHMARK(BM_socket_move);
+
+
+// CAddrinfo
+// =========
+// Argument 1 = taken from the resolution cache, 0 = resolved every time.
+void BM_addrinfo_construct(benchmark::State& state) {
+    WINSOCK_INIT_P
+    if (state.range(0) == 0)
+        CAddrinfoCache::global().set_ttl(0, 0);
+    for (auto _ : state) {
+        CAddrinfo ai("", "50100", AF_UNSPEC, SOCK_STREAM,
+                     AI_NUMERICHOST | AI_NUMERICSERV);
+        benchmark::DoNotOptimize(ai->ai_addr);
+    }
+    CAddrinfoCache::global().set_ttl(60000, 5000);
+}
+BENCHMARK(BM_addrinfo_construct)->Arg(0)->Arg(1);
+
+void BM_addrinfo_copy(benchmark::State& state) {
+    WINSOCK_INIT_P
+    const CAddrinfo ai("", "50100", AF_UNSPEC, SOCK_STREAM,
+                       AI_NUMERICHOST | AI_NUMERICSERV);
+    for (auto _ : state) {
+        CAddrinfo copy{ai};
+        benchmark::DoNotOptimize(copy->ai_addr);
+    }
+}
+BENCHMARK(BM_addrinfo_copy);
+
+
+// Loopback round trips
+// ====================
+// Connect, send a one shot message, and close after the server has closed.
+void BM_connect_send_close(benchmark::State& state) {
+    WINSOCK_INIT_P
+    const CAddrinfo ai("", oneshot_server().port(), AF_UNSPEC, SOCK_STREAM,
+                       AI_NUMERICHOST | AI_NUMERICSERV);
+    for (auto _ : state) {
+        CSocket sock(ai->ai_family, SOCK_STREAM);
+        if (::connect(sock, ai->ai_addr, ai->ai_addrlen) != 0) {
+            state.SkipWithError("connect failed");
+            break;
+        }
+        ::send(sock, "Hello", 5, 0);
+        ::shutdown(sock, SHUT_WR);
+        char buf[8];
+        while (::recv(sock, buf, sizeof(buf), 0) > 0)
+            ;
+    }
+}
+BENCHMARK(BM_connect_send_close)->UseRealTime();
+
+// Echo one message of range(0) bytes on each of range(1) persistent
+// connections per iteration. The messages are sent before the replies are
+// received, so the connections are served concurrently.
+void BM_echo(benchmark::State& state) {
+    WINSOCK_INIT_P
+    const size_t size = static_cast<size_t>(state.range(0));
+    const std::string msg(size, 'x');
+    std::vector<std::unique_ptr<CClientConnection>> conns;
+    for (int64_t i{0}; i < state.range(1); i++)
+        conns.push_back(
+            std::make_unique<CClientConnection>("", echo_server().port()));
+    for (auto _ : state) {
+        for (auto& conn : conns)
+            conn->send_frame(msg);
+        for (auto& conn : conns)
+            benchmark::DoNotOptimize(conn->recv_frame());
+    }
+    const int64_t messages = state.iterations() * state.range(1);
+    state.SetItemsProcessed(messages);
+    state.SetBytesProcessed(messages * state.range(0));
+}
+BENCHMARK(BM_echo)
+    ->ArgNames({"size", "connections"})
+    ->ArgsProduct({{64, 1024, 16384, 65536}, {1, 4, 16}})
+    ->UseRealTime();
+
+} // namespace upnplib
+
+BENCHMARK_MAIN();
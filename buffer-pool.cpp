@@ -0,0 +1,282 @@
+// Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+#include "buffer-pool.hpp"
+#include "port.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <climits>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace upnplib {
+
+namespace {
+// Marks a buffer that is too large for the size classes.
+constexpr unsigned oversize_class{UINT_MAX};
+// Huge pages of this size are used to back slabs.
+constexpr size_t hugepage_size{2 * 1024 * 1024};
+
+// Pools that are alive. A thread cache only gives its buffers back to a pool
+// that is alive. The mutex also prevents that a pool is destructed while a
+// thread cache gives buffers back to it.
+std::mutex& live_pools_mutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+std::unordered_set<uint64_t>& live_pools() {
+    static std::unordered_set<uint64_t> pools;
+    return pools;
+}
+std::atomic<uint64_t> next_pool_id{1};
+} // anonymous namespace
+
+// Free lists of the current thread
+// --------------------------------
+struct BufferPoolThreadCache {
+    struct Entry {
+        uint64_t id;
+        CBufferPool* pool;
+        std::vector<std::vector<std::byte*>> lists; // One per size class.
+    };
+    std::vector<Entry> entries;
+
+    Entry& get(CBufferPool& a_pool) {
+        for (Entry& entry : entries)
+            if (entry.id == a_pool.m_id)
+                return entry;
+        // First use of the pool on this thread. Drop entries of pools that
+        // are gone meanwhile.
+        {
+            std::scoped_lock lock(live_pools_mutex());
+            std::erase_if(entries, [](const Entry& a_entry) {
+                return !live_pools().contains(a_entry.id);
+            });
+        }
+        entries.push_back(
+            {a_pool.m_id, &a_pool,
+             std::vector<std::vector<std::byte*>>(a_pool.m_classes.size())});
+        return entries.back();
+    }
+
+    ~BufferPoolThreadCache() {
+        std::scoped_lock lock(live_pools_mutex());
+        for (Entry& entry : entries) {
+            if (!live_pools().contains(entry.id))
+                continue;
+            for (unsigned cls{0}; cls < entry.lists.size(); cls++)
+                entry.pool->give_free(cls, entry.lists[cls],
+                                      entry.lists[cls].size());
+        }
+    }
+};
+
+namespace {
+thread_local BufferPoolThreadCache tl_cache;
+} // anonymous namespace
+
+// Buffer from a pool
+// ==================
+CBuffer::CBuffer(CBufferPool* a_pool, std::byte* a_data, size_t a_size,
+                 unsigned a_class)
+    : m_pool(a_pool), m_data(a_data), m_size(a_size), m_class(a_class) {}
+
+CBuffer::CBuffer(CBuffer&& that) noexcept
+    : m_pool(that.m_pool), m_data(that.m_data), m_size(that.m_size),
+      m_class(that.m_class) {
+    that.m_pool = nullptr;
+    that.m_data = nullptr;
+    that.m_size = 0;
+}
+
+CBuffer& CBuffer::operator=(CBuffer&& that) noexcept {
+    if (this != &that) {
+        this->reset();
+        std::swap(m_pool, that.m_pool);
+        std::swap(m_data, that.m_data);
+        std::swap(m_size, that.m_size);
+        std::swap(m_class, that.m_class);
+    }
+    return *this;
+}
+
+CBuffer::~CBuffer() { this->reset(); }
+
+std::byte* CBuffer::data() const { return m_data; }
+
+size_t CBuffer::size() const { return m_size; }
+
+CBuffer::operator bool() const { return m_data != nullptr; }
+
+void CBuffer::reset() {
+    if (m_pool == nullptr)
+        return;
+    m_pool->release(m_data, m_size, m_class);
+    m_pool = nullptr;
+    m_data = nullptr;
+    m_size = 0;
+}
+
+// Slab allocator
+// ==============
+CBufferPool::CBufferPool(const BufferPoolConfig& a_config)
+    : m_config(a_config), m_id(next_pool_id.fetch_add(1)) {
+    TRACE2(this, " Construct upnplib::CBufferPool")
+    m_config.min_size = std::bit_ceil(std::max<size_t>(m_config.min_size, 64));
+    m_config.max_size =
+        std::bit_ceil(std::max(m_config.max_size, m_config.min_size));
+    m_config.thread_cache = std::max(m_config.thread_cache, 2u);
+    if (m_config.hugepages)
+        m_config.slab_size =
+            (m_config.slab_size + hugepage_size - 1) & ~(hugepage_size - 1);
+    m_min_shift = static_cast<unsigned>(std::countr_zero(m_config.min_size));
+
+    for (size_t size{m_config.min_size}; size <= m_config.max_size; size <<= 1)
+        m_classes.push_back(std::make_unique<SizeClass>());
+
+    std::scoped_lock lock(live_pools_mutex());
+    live_pools().insert(m_id);
+}
+
+CBufferPool::~CBufferPool() {
+    TRACE2(this, " Destruct upnplib::CBufferPool")
+    {
+        std::scoped_lock lock(live_pools_mutex());
+        live_pools().erase(m_id);
+    }
+    for (const Slab& slab : m_slabs) {
+#ifdef __linux__
+        if (slab.mmapped) {
+            ::munmap(slab.addr, slab.size);
+            continue;
+        }
+#endif
+        ::operator delete(slab.addr, std::align_val_t{4096});
+    }
+}
+
+CBuffer CBufferPool::acquire(size_t a_size) {
+    if (a_size > m_config.max_size) {
+        m_oversize++;
+        return CBuffer(this, static_cast<std::byte*>(::operator new(a_size)),
+                       a_size, oversize_class);
+    }
+    const unsigned cls =
+        a_size <= m_config.min_size
+            ? 0
+            : static_cast<unsigned>(std::bit_width(a_size - 1)) - m_min_shift;
+
+    std::vector<std::byte*>& list = tl_cache.get(*this).lists[cls];
+    if (list.empty())
+        this->take_free(cls, list, m_config.thread_cache / 2);
+    std::byte* data = list.back();
+    list.pop_back();
+    m_classes[cls]->in_use++;
+    return CBuffer(this, data, m_config.min_size << cls, cls);
+}
+
+void CBufferPool::release(std::byte* a_data, size_t a_size,
+                          unsigned a_class) {
+    if (a_class == oversize_class) {
+        ::operator delete(a_data, a_size);
+        m_oversize--;
+        return;
+    }
+    m_classes[a_class]->in_use--;
+    std::vector<std::byte*>& list = tl_cache.get(*this).lists[a_class];
+    list.push_back(a_data);
+    if (list.size() > m_config.thread_cache)
+        this->give_free(a_class, list, m_config.thread_cache / 2);
+}
+
+void CBufferPool::take_free(unsigned a_class, std::vector<std::byte*>& a_out,
+                            size_t a_count) {
+    SizeClass& sc = *m_classes[a_class];
+    std::scoped_lock lock(sc.mutex);
+    if (sc.free.empty())
+        this->add_slab(a_class);
+    const size_t count = std::min(a_count, sc.free.size());
+    a_out.insert(a_out.end(), sc.free.end() - count, sc.free.end());
+    sc.free.resize(sc.free.size() - count);
+}
+
+void CBufferPool::give_free(unsigned a_class, std::vector<std::byte*>& a_in,
+                            size_t a_count) {
+    SizeClass& sc = *m_classes[a_class];
+    std::scoped_lock lock(sc.mutex);
+    sc.free.insert(sc.free.end(), a_in.end() - a_count, a_in.end());
+    a_in.resize(a_in.size() - a_count);
+}
+
+void CBufferPool::add_slab(unsigned a_class) {
+    // Called with the mutex of the size class locked.
+    SizeClass& sc = *m_classes[a_class];
+    const size_t buf_size = m_config.min_size << a_class;
+    const size_t slab_size = std::max(m_config.slab_size, buf_size);
+    Slab slab{nullptr, slab_size, false};
+
+#ifdef __linux__
+    void* addr{MAP_FAILED};
+    if (m_config.hugepages) {
+        addr = ::mmap(nullptr, slab_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (addr != MAP_FAILED)
+            m_hugepages = true;
+    }
+    if (addr == MAP_FAILED) {
+        addr = ::mmap(nullptr, slab_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED)
+            throw std::runtime_error(
+                "ERROR! MSG1040: Failed to allocate buffer slab: errno(" +
+                std::to_string(errno) + ")=\"" + std::strerror(errno) + "\"");
+        if (m_config.hugepages)
+            ::madvise(addr, slab_size, MADV_HUGEPAGE);
+    }
+    slab.addr = addr;
+    slab.mmapped = true;
+#else
+    slab.addr = ::operator new(slab_size, std::align_val_t{4096});
+#endif
+    {
+        std::scoped_lock lock(m_slabs_mutex);
+        m_slabs.push_back(slab);
+    }
+
+    std::byte* data = static_cast<std::byte*>(slab.addr);
+    const size_t count = slab_size / buf_size;
+    // Push in reverse order so buffers are taken in address order.
+    for (size_t i{count}; i > 0; i--)
+        sc.free.push_back(data + (i - 1) * buf_size);
+    sc.slabs++;
+    sc.buffers += count;
+}
+
+std::vector<CBufferPool::Stats> CBufferPool::stats() const {
+    std::vector<Stats> stats;
+    for (unsigned cls{0}; cls < m_classes.size(); cls++) {
+        const SizeClass& sc = *m_classes[cls];
+        std::scoped_lock lock(sc.mutex);
+        stats.push_back({m_config.min_size << cls, sc.slabs, sc.buffers,
+                         sc.in_use.load()});
+    }
+    return stats;
+}
+
+size_t CBufferPool::oversize_in_use() const { return m_oversize.load(); }
+
+bool CBufferPool::is_hugepages() const { return m_hugepages.load(); }
+
+CBufferPool& CBufferPool::global() {
+    static CBufferPool pool;
+    return pool;
+}
+
+} // namespace upnplib
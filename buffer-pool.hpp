@@ -0,0 +1,139 @@
+#ifndef UPNPLIB_BUFFER_POOL_HPP
+#define UPNPLIB_BUFFER_POOL_HPP
+// Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace upnplib {
+
+class CBufferPool;
+
+// Configuration of a buffer pool
+// ------------------------------
+struct BufferPoolConfig {
+    // Size of the smallest and the largest size class. The sizes of the
+    // classes are the powers of 2 in between. Larger buffers are allocated
+    // from the heap and are not pooled.
+    size_t min_size{256};
+    size_t max_size{1024 * 1024};
+    // Memory is reserved in slabs of this size. Each slab is split into
+    // buffers of one size class.
+    size_t slab_size{2 * 1024 * 1024};
+    // Back the slabs with huge pages (Linux only). If none are available
+    // transparent huge pages are advised instead.
+    bool hugepages{false};
+    // Maximal number of free buffers of a size class that a thread keeps for
+    // itself without locking.
+    unsigned thread_cache{32};
+};
+
+// Buffer from a pool
+// ------------------
+// Owns the buffer and gives it back to its pool on destruction. The buffer
+// may be larger than requested. The pool must outlive its buffers.
+class CBuffer {
+  public:
+    CBuffer() = default;
+    CBuffer(CBuffer&& that) noexcept;
+    CBuffer& operator=(CBuffer&& that) noexcept;
+    CBuffer(const CBuffer&) = delete;
+    CBuffer& operator=(const CBuffer&) = delete;
+    virtual ~CBuffer();
+
+    std::byte* data() const;
+    size_t size() const;
+    explicit operator bool() const;
+
+    // Give the buffer back to its pool.
+    void reset();
+
+  private:
+    friend class CBufferPool;
+    CBuffer(CBufferPool* a_pool, std::byte* a_data, size_t a_size,
+            unsigned a_class);
+    CBufferPool* m_pool{nullptr};
+    std::byte* m_data{nullptr};
+    size_t m_size{0};
+    unsigned m_class{0};
+};
+
+// Slab allocator for receive and send buffers
+// -------------------------------------------
+// Buffers are taken from free lists of their size class, so there is no heap
+// allocation after the pool has warmed up. Every thread has its own free
+// lists. Only if they run empty or full a batch of buffers is moved from or
+// to the shared free list of the size class under its mutex. Memory of the
+// slabs is given back to the system when the pool is destructed.
+class CBufferPool {
+  public:
+    // Statistics of one size class.
+    struct Stats {
+        size_t size;    // Size of the buffers.
+        size_t slabs;   // Slabs reserved for the class.
+        size_t buffers; // Buffers the slabs are split into.
+        size_t in_use;  // Buffers given out and not given back.
+    };
+
+    CBufferPool(const BufferPoolConfig& a_config = BufferPoolConfig());
+    CBufferPool(const CBufferPool&) = delete;
+    CBufferPool& operator=(const CBufferPool&) = delete;
+    virtual ~CBufferPool();
+
+    // Get a buffer with at least a_size bytes. This method is thread safe.
+    CBuffer acquire(size_t a_size);
+
+    // Getter for the statistics of all size classes, the smallest first.
+    std::vector<Stats> stats() const;
+    // Getter for the number of buffers in use that are too large to be
+    // pooled.
+    size_t oversize_in_use() const;
+    // Getter if slabs are backed by explicit huge pages.
+    bool is_hugepages() const;
+
+    // Pool that is used if no other pool is given, e.g. by the client.
+    static CBufferPool& global();
+
+  private:
+    friend class CBuffer;
+    friend struct BufferPoolThreadCache;
+    struct SizeClass {
+        mutable std::mutex mutex;
+        std::vector<std::byte*> free; // Protected by mutex.
+        size_t slabs{0};              // Protected by mutex.
+        size_t buffers{0};            // Protected by mutex.
+        std::atomic<size_t> in_use{0};
+    };
+    struct Slab {
+        void* addr;
+        size_t size;
+        bool mmapped;
+    };
+
+    BufferPoolConfig m_config;
+    unsigned m_min_shift;
+    const uint64_t m_id; // Identifies the pool in the thread caches.
+    std::vector<std::unique_ptr<SizeClass>> m_classes;
+    std::atomic<size_t> m_oversize{0};
+    std::atomic<bool> m_hugepages{false};
+    std::mutex m_slabs_mutex;
+    std::vector<Slab> m_slabs; // Protected by mutex.
+
+    void release(std::byte* a_data, size_t a_size, unsigned a_class);
+    // Move up to a_count free buffers of a class to a_out, reserve a new slab
+    // if there are none.
+    void take_free(unsigned a_class, std::vector<std::byte*>& a_out,
+                   size_t a_count);
+    void give_free(unsigned a_class, std::vector<std::byte*>& a_in,
+                   size_t a_count);
+    void add_slab(unsigned a_class);
+};
+
+} // namespace upnplib
+
+#endif // UPNPLIB_BUFFER_POOL_HPP
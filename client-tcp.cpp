@@ -1,47 +1,65 @@
 // Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
-// Redistribution only with this Copyright remark. Last modified: 2024-01-12
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
 
 #include "client-tcp.hpp"
 #include "port.hpp"
 #include "addrinfo.hpp"
 #include "socket.hpp"
+#include "metrics.hpp"
+#include "uring.hpp"
 
+#include <algorithm>
 #include <cstring>
+#include <exception>
 #include <stdexcept>
+#include <vector>
+#ifndef _MSC_VER
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#endif
 
 namespace upnplib {
 
-void quit_server() {
+static inline void throw_error(std::string errmsg) {
+    // error number given by WSAGetLastError(), resp. contained in errno is
+    // used to specify details of the error.
+#ifdef _WIN32
+    std::runtime_error error(errmsg + " WSAGetLastError()=" +
+                             std::to_string(WSAGetLastError()));
+#else
+    std::runtime_error error(errmsg + " errno(" + std::to_string(errno) +
+                             ")=\"" + std::strerror(errno) + "\"");
+#endif
+    CMetrics::count_error(errmsg);
+    throw error;
+}
+
+// Wait for events on one socket, like ::poll().
+static inline int poll_socket(pollfd& a_pfd, int a_timeout_ms) {
+#ifdef _MSC_VER
+    return ::WSAPoll(&a_pfd, 1, a_timeout_ms);
+#else
+    return ::poll(&a_pfd, 1, a_timeout_ms);
+#endif
+}
+
+void quit_server(const std::string& a_port) {
     TRACE("[Client] Executing upnplib::quit_server().")
     WINSOCK_INIT_P
 
-    // Get a socket.
-    CSocket sock(AF_INET6, SOCK_STREAM);
-
     // Get address information that should be connected.
     // -------------------------------------------------
-    // The host address must fit to the protocol family (AF_*) of the socket
-    // and the addrinfo hint. Host and port flags set to numeric use to avoid
-    // expensive name resolution. With empty node the loopback interface is
-    // selected.
-    CAddrinfo ai("", "4433", AF_UNSPEC, SOCK_STREAM,
+    // Host and port flags set to numeric use to avoid expensive name
+    // resolution. With empty node the loopback interface is selected, its
+    // IPv6 and IPv4 address are tried.
+    CAddrinfo ai("", a_port, AF_UNSPEC, SOCK_STREAM,
                  AI_NUMERICHOST | AI_NUMERICSERV);
 
     // Connect to address.
     // -------------------
     // Should be finished with shuthdown()
-    int ret = ::connect(sock, ai->ai_addr, ai->ai_addrlen);
-    if (ret != 0) {
-#ifdef _WIN32
-        throw std::runtime_error(
-            "[Client] ERROR! MSG1018: Failed to connect: WSAGetLastError()=" +
-            std::to_string(WSAGetLastError()));
-#else
-        throw std::runtime_error(
-            "[Client] ERROR! MSG1019: Failed to connect: errno(" +
-            std::to_string(errno) + ")=\"" + std::strerror(errno) + "\"");
-#endif
-    }
+    CSocket sock = connect_happy_eyeballs(ai, default_connect_timeout_ms);
 
     // Send Quit message to the server.
     ssize_t valsend = ::send(sock, "Q", 1, 0);
@@ -64,4 +82,654 @@ void quit_server() {
     TRACE("[Client] \"Q\" sent (Quit server).")
 }
 
+// Persistent client connection
+// ============================
+// At most one send and one receive are in flight. Their message headers and
+// vectors must stay valid until their completion.
+struct CClientConnection::Uring {
+#ifdef UPNPLIB_WITH_IO_URING
+    CUring ring{4};
+    std::vector<io_uring_cqe> cqes;
+    iovec send_iov[max_iov];
+    msghdr send_msg{};
+    iovec recv_iov[2];
+    msghdr recv_msg{};
+#endif
+};
+
+#ifdef UPNPLIB_WITH_IO_URING
+namespace {
+// user_data of the operations, completions of cancels have 0.
+constexpr uint64_t uring_client_send{1};
+constexpr uint64_t uring_client_recv{2};
+} // anonymous namespace
+#endif
+
+CClientConnection::CClientConnection(const std::string& a_node,
+                                     const std::string& a_port,
+                                     uint32_t a_max_frame_size,
+                                     int a_connect_timeout_ms)
+    : m_frames(a_max_frame_size) {
+    TRACE2(this, " Construct upnplib::CClientConnection")
+    WINSOCK_INIT_P
+
+    CAddrinfo ai(a_node, a_port, AF_UNSPEC, SOCK_STREAM,
+                 a_node.empty() ? AI_NUMERICHOST | AI_NUMERICSERV
+                                : AI_NUMERICSERV);
+    m_sock = connect_happy_eyeballs(ai, a_connect_timeout_ms);
+    m_open = true;
+    CMetrics::add(Counter::client_connects);
+}
+
+CClientConnection::CClientConnection(CSocket&& a_sock,
+                                     uint32_t a_max_frame_size)
+    : m_sock(std::move(a_sock)), m_frames(a_max_frame_size) {
+    TRACE2(this, " Construct upnplib::CClientConnection")
+    m_open = true;
+}
+
+CClientConnection::CClientConnection(const sockaddr* a_addr,
+                                     socklen_t a_addrlen,
+                                     uint32_t a_max_frame_size,
+                                     const SocketOptions& a_opts,
+                                     int a_connect_timeout_ms)
+    : m_frames(a_max_frame_size) {
+    TRACE2(this, " Construct upnplib::CClientConnection")
+    WINSOCK_INIT_P
+    this->connect(a_addr, a_addrlen, a_opts, a_connect_timeout_ms);
+}
+
+void CClientConnection::connect(const sockaddr* a_addr, socklen_t a_addrlen,
+                                const SocketOptions& a_opts,
+                                int a_timeout_ms) {
+    CSocket sock(a_addr->sa_family, SOCK_STREAM);
+    SocketOptions opts{a_opts};
+    if (opts.fastopen_connect) {
+        opts.fastopen_connect = false;
+        try {
+            sock.set_fastopen_connect();
+            m_fastopen = true;
+        } catch (const std::runtime_error& e) {
+            TRACE2("[Client] TCP Fast Open not available: ", e.what())
+        }
+    }
+    sock.set_options(opts);
+    // Non-blocking with a deadline, a blocking connect waits as long as the
+    // system retries the handshake.
+    set_nonblocking(sock);
+    if (::connect(sock, a_addr, a_addrlen) != 0) {
+        if (SOCKET_ERRNO_P != EWOULDBLOCK_P && SOCKET_ERRNO_P != EINPROGRESS)
+            throw_error("[Client] ERROR! MSG1037: Failed to connect:");
+        using clock = std::chrono::steady_clock;
+        const clock::time_point deadline =
+            clock::now() + std::chrono::milliseconds(a_timeout_ms);
+        pollfd pfd{};
+        pfd.fd = sock;
+        pfd.events = POLLOUT;
+        for (;;) {
+            const int timeout_ms = static_cast<int>(std::max<int64_t>(
+                0, std::chrono::ceil<std::chrono::milliseconds>(deadline -
+                                                                clock::now())
+                       .count()));
+            const int n = poll_socket(pfd, timeout_ms);
+            if (n > 0)
+                break;
+            if (n == 0)
+                throw std::runtime_error(
+                    "[Client] ERROR! MSG1037: Failed to connect: \"timeout\"");
+#ifndef _MSC_VER
+            if (errno == EINTR)
+                continue;
+#endif
+            throw_error("[Client] ERROR! MSG1037: Failed to connect:");
+        }
+        // Getting the error also resets it.
+        const int error = sock.get_sockerr();
+        if (error != 0) {
+#ifdef _MSC_VER
+            ::WSASetLastError(error);
+#else
+            errno = error;
+#endif
+            throw_error("[Client] ERROR! MSG1037: Failed to connect:");
+        }
+    }
+    set_nonblocking(sock, false);
+    m_sock = std::move(sock);
+    m_open = true;
+    CMetrics::add(Counter::client_connects);
+}
+
+CClientConnection::~CClientConnection() {
+    TRACE2(this, " Destruct upnplib::CClientConnection")
+    this->close();
+}
+
+void CClientConnection::send_frame(std::string_view a_msg) {
+    const std::span<const std::byte> part{
+        reinterpret_cast<const std::byte*>(a_msg.data()), a_msg.size()};
+    this->send_frame(std::span(&part, 1));
+}
+
+void CClientConnection::send_frame(
+    std::span<const std::span<const std::byte>> a_parts) {
+    TRACE2(this, " Executing upnplib::CClientConnection::send_frame()")
+    size_t size{0};
+    for (std::span<const std::byte> part : a_parts)
+        size += part.size();
+    std::byte header[frame_header_size];
+    write_frame_header(header, size);
+
+    // Header and parts are gathered by the system call.
+    std::vector<std::span<const std::byte>> bufs{header};
+    for (std::span<const std::byte> part : a_parts)
+        if (!part.empty())
+            bufs.push_back(part);
+    if (m_uring) {
+        std::vector<std::string> none;
+        this->exchange_uring(bufs, none, 0);
+        return;
+    }
+    size_t first{0};
+    while (first < bufs.size()) {
+        ssize_t valsend = send_vectored(m_sock, std::span(bufs).subspan(first));
+        if (valsend == SOCKET_ERROR)
+            throw_error("[Client] ERROR! MSG1038: Failed to send frame:");
+        CMetrics::add(Counter::client_bytes_sent,
+                      static_cast<uint64_t>(valsend));
+        size_t sent = static_cast<size_t>(valsend);
+        while (first < bufs.size() && sent >= bufs[first].size())
+            sent -= bufs[first++].size();
+        if (first < bufs.size())
+            bufs[first] = bufs[first].subspan(sent);
+    }
+}
+
+std::string CClientConnection::recv_frame() {
+    TRACE2(this, " Executing upnplib::CClientConnection::recv_frame()")
+    if (m_uring) {
+        std::vector<std::span<const std::byte>> none;
+        std::vector<std::string> replies;
+        this->exchange_uring(none, replies, 1);
+        return std::move(replies.front());
+    }
+    std::string_view payload;
+    while (!m_frames.next(payload)) {
+        ssize_t valread = recv_vectored(m_sock, m_frames.prepare(4096));
+        if (valread == 0)
+            throw std::runtime_error("[Client] ERROR! MSG1039: Failed to "
+                                     "receive frame: \"connection closed by "
+                                     "server\"");
+        if (valread == SOCKET_ERROR)
+            throw_error("[Client] ERROR! MSG1039: Failed to receive frame:");
+        CMetrics::add(Counter::client_bytes_received,
+                      static_cast<uint64_t>(valread));
+        m_frames.commit(static_cast<size_t>(valread));
+    }
+    return std::string(payload);
+}
+
+std::vector<std::string>
+CClientConnection::pipeline(std::span<const std::string_view> a_msgs) {
+    TRACE2(this, " Executing upnplib::CClientConnection::pipeline()")
+    // All frames are gathered from their headers and the messages.
+    std::vector<std::byte> headers(a_msgs.size() * frame_header_size);
+    std::vector<std::span<const std::byte>> bufs;
+    bufs.reserve(a_msgs.size() * 2);
+    for (size_t i{0}; i < a_msgs.size(); i++) {
+        std::byte* header = headers.data() + i * frame_header_size;
+        write_frame_header(header, a_msgs[i].size());
+        bufs.emplace_back(header, frame_header_size);
+        if (!a_msgs[i].empty())
+            bufs.push_back(std::as_bytes(std::span(a_msgs[i])));
+    }
+
+    std::vector<std::string> replies;
+    replies.reserve(a_msgs.size());
+    if (m_uring) {
+        this->exchange_uring(bufs, replies, a_msgs.size());
+        return replies;
+    }
+    size_t first{0};
+    set_nonblocking(m_sock);
+    try {
+        while (first < bufs.size() || replies.size() < a_msgs.size()) {
+            pollfd pfd{};
+            pfd.fd = m_sock;
+            pfd.events = first < bufs.size() ? POLLIN | POLLOUT : POLLIN;
+            if (poll_socket(pfd, -1) == SOCKET_ERROR) {
+#ifndef _MSC_VER
+                if (errno == EINTR)
+                    continue;
+#endif
+                throw_error("[Client] ERROR! MSG1042: Failed to wait for "
+                            "the connection:");
+            }
+
+            // Send as much as the socket buffer takes.
+            while ((pfd.revents & POLLOUT) && first < bufs.size()) {
+                ssize_t valsend =
+                    send_vectored(m_sock, std::span(bufs).subspan(first));
+                if (valsend == SOCKET_ERROR) {
+                    if (SOCKET_ERRNO_P == EWOULDBLOCK_P)
+                        break;
+#ifndef _MSC_VER
+                    // TCP Fast Open without cookie, the data is sent after
+                    // the handshake.
+                    if (errno == EINPROGRESS)
+                        break;
+#endif
+                    throw_error(
+                        "[Client] ERROR! MSG1038: Failed to send frame:");
+                }
+                CMetrics::add(Counter::client_bytes_sent,
+                              static_cast<uint64_t>(valsend));
+                size_t sent = static_cast<size_t>(valsend);
+                while (first < bufs.size() && sent >= bufs[first].size())
+                    sent -= bufs[first++].size();
+                if (first < bufs.size())
+                    bufs[first] = bufs[first].subspan(sent);
+            }
+
+            // Replies arrive in the order of the messages.
+            if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+                ssize_t valread =
+                    recv_vectored(m_sock, m_frames.prepare(4096));
+                if (valread == 0)
+                    throw std::runtime_error(
+                        "[Client] ERROR! MSG1039: Failed to receive frame: "
+                        "\"connection closed by server\"");
+                if (valread == SOCKET_ERROR) {
+                    if (SOCKET_ERRNO_P != EWOULDBLOCK_P)
+                        throw_error("[Client] ERROR! MSG1039: Failed to "
+                                    "receive frame:");
+                    continue;
+                }
+                CMetrics::add(Counter::client_bytes_received,
+                              static_cast<uint64_t>(valread));
+                m_frames.commit(static_cast<size_t>(valread));
+                std::string_view payload;
+                while (replies.size() < a_msgs.size() &&
+                       m_frames.next(payload))
+                    replies.emplace_back(payload);
+            }
+        }
+    } catch (...) {
+        set_nonblocking(m_sock, false);
+        throw;
+    }
+    set_nonblocking(m_sock, false);
+    return replies;
+}
+
+void CClientConnection::close() {
+    if (!m_open)
+        return;
+    m_open = false;
+    ::shutdown(m_sock, SHUT_RDWR);
+}
+
+bool CClientConnection::is_healthy() const {
+    if (!m_open || m_frames.buffered() > 0)
+        return false;
+    // An idle connection must not be readable. Otherwise the server has
+    // closed it, an error is pending or there are unexpected bytes.
+    pollfd pfd{};
+    pfd.fd = m_sock;
+    pfd.events = POLLIN;
+    return poll_socket(pfd, 0) == 0;
+}
+
+std::optional<bool> CClientConnection::take_fastopen_result() {
+    if (!m_fastopen)
+        return std::nullopt;
+#if defined(__linux__) && defined(TCPI_OPT_SYN_DATA)
+    tcp_info info{};
+    socklen_t optlen{sizeof(info)};
+    if (::getsockopt(m_sock, IPPROTO_TCP, TCP_INFO, &info, &optlen) != 0 ||
+        info.tcpi_state == TCP_SYN_SENT)
+        return std::nullopt;
+    m_fastopen = false;
+    return (info.tcpi_options & TCPI_OPT_SYN_DATA) != 0;
+#else
+    return std::nullopt;
+#endif
+}
+
+bool CClientConnection::use_io_uring() {
+#ifdef UPNPLIB_WITH_IO_URING
+    if (!m_uring) {
+        try {
+            m_uring = std::make_unique<Uring>();
+        } catch (const std::runtime_error& e) {
+            TRACE2("[Client] io_uring not available: ", e.what())
+        }
+    }
+#endif
+    return m_uring != nullptr;
+}
+
+bool CClientConnection::is_io_uring() const { return m_uring != nullptr; }
+
+void CClientConnection::exchange_uring(
+    [[maybe_unused]] std::vector<std::span<const std::byte>>& a_bufs,
+    [[maybe_unused]] std::vector<std::string>& a_replies,
+    [[maybe_unused]] size_t a_count) {
+    TRACE2(this, " Executing upnplib::CClientConnection::exchange_uring()")
+#ifdef UPNPLIB_WITH_IO_URING
+    // Each round submits the next send and receive together with waiting
+    // for completions. An error doesn't return at once, the operation that
+    // is still in flight is cancelled and must complete before the buffers
+    // it uses may be released.
+    Uring& u = *m_uring;
+    size_t first{0};
+    bool send_busy{false};
+    bool recv_busy{false};
+    bool cancelled{false};
+    std::exception_ptr failure;
+    auto guard = [&failure](auto a_step) {
+        if (failure)
+            return;
+        try {
+            a_step();
+        } catch (...) {
+            failure = std::current_exception();
+        }
+    };
+    // Replies arrive in the order of the messages.
+    auto take_replies = [this, &a_replies, a_count] {
+        std::string_view payload;
+        while (a_replies.size() < a_count && m_frames.next(payload))
+            a_replies.emplace_back(payload);
+    };
+
+    guard(take_replies);
+    for (;;) {
+        if (failure) {
+            if (!cancelled) {
+                cancelled = true;
+                if (send_busy)
+                    u.ring.prep_cancel(uring_client_send);
+                if (recv_busy)
+                    u.ring.prep_cancel(uring_client_recv);
+            }
+        } else {
+            if (!send_busy && first < a_bufs.size()) {
+                const size_t count = std::min(a_bufs.size() - first, max_iov);
+                for (size_t i{0}; i < count; i++)
+                    u.send_iov[i] = {
+                        const_cast<std::byte*>(a_bufs[first + i].data()),
+                        a_bufs[first + i].size()};
+                u.send_msg = {};
+                u.send_msg.msg_iov = u.send_iov;
+                u.send_msg.msg_iovlen = count;
+                u.ring.prep_sendmsg(m_sock, &u.send_msg, uring_client_send);
+                send_busy = true;
+            }
+            if (!recv_busy && a_replies.size() < a_count) {
+                const std::array<std::span<std::byte>, 2> bufs =
+                    m_frames.prepare(4096);
+                for (size_t i{0}; i < bufs.size(); i++)
+                    u.recv_iov[i] = {bufs[i].data(), bufs[i].size()};
+                u.recv_msg = {};
+                u.recv_msg.msg_iov = u.recv_iov;
+                u.recv_msg.msg_iovlen = bufs.size();
+                u.ring.prep_recvmsg(m_sock, &u.recv_msg, uring_client_recv);
+                recv_busy = true;
+            }
+        }
+        if (!send_busy && !recv_busy)
+            break;
+
+        u.ring.submit_and_wait(1);
+        u.ring.reap(u.cqes);
+        for (const io_uring_cqe& cqe : u.cqes) {
+            if (cqe.user_data == uring_client_send) {
+                send_busy = false;
+                // TCP Fast Open without cookie, the data is sent after the
+                // handshake with the next send.
+                if (cqe.res == -EINPROGRESS)
+                    continue;
+                if (cqe.res < 0) {
+                    guard([&cqe] {
+                        errno = -cqe.res;
+                        throw_error(
+                            "[Client] ERROR! MSG1038: Failed to send frame:");
+                    });
+                    continue;
+                }
+                CMetrics::add(Counter::client_bytes_sent,
+                              static_cast<uint64_t>(cqe.res));
+                size_t sent = static_cast<size_t>(cqe.res);
+                while (first < a_bufs.size() && sent >= a_bufs[first].size())
+                    sent -= a_bufs[first++].size();
+                if (first < a_bufs.size())
+                    a_bufs[first] = a_bufs[first].subspan(sent);
+            } else if (cqe.user_data == uring_client_recv) {
+                recv_busy = false;
+                if (cqe.res == 0) {
+                    guard([] {
+                        throw std::runtime_error(
+                            "[Client] ERROR! MSG1039: Failed to receive "
+                            "frame: \"connection closed by server\"");
+                    });
+                    continue;
+                }
+                if (cqe.res < 0) {
+                    guard([&cqe] {
+                        errno = -cqe.res;
+                        throw_error("[Client] ERROR! MSG1039: Failed to "
+                                    "receive frame:");
+                    });
+                    continue;
+                }
+                CMetrics::add(Counter::client_bytes_received,
+                              static_cast<uint64_t>(cqe.res));
+                m_frames.commit(static_cast<size_t>(cqe.res));
+                guard(take_replies);
+            }
+        }
+    }
+    if (failure)
+        std::rethrow_exception(failure);
+#endif
+}
+
+// Lease of a connection from the pool
+// ===================================
+CClientTCP::CLease::CLease(CClientTCP* a_client,
+                           std::pair<std::string, std::string> a_key,
+                           std::unique_ptr<CClientConnection> a_conn)
+    : m_client(a_client), m_key(std::move(a_key)), m_conn(std::move(a_conn)) {}
+
+CClientTCP::CLease&
+CClientTCP::CLease::operator=(CLease&& that) noexcept {
+    if (this != &that) {
+        if (m_conn)
+            m_client->checkin(m_key, std::move(m_conn));
+        m_client = that.m_client;
+        m_key = std::move(that.m_key);
+        m_conn = std::move(that.m_conn);
+    }
+    return *this;
+}
+
+CClientTCP::CLease::~CLease() {
+    if (m_conn)
+        m_client->checkin(m_key, std::move(m_conn));
+}
+
+CClientConnection& CClientTCP::CLease::operator*() const { return *m_conn; }
+
+CClientConnection* CClientTCP::CLease::operator->() const {
+    return m_conn.get();
+}
+
+CClientTCP::CLease::operator bool() const { return m_conn != nullptr; }
+
+void CClientTCP::CLease::discard() { m_conn.reset(); }
+
+// Client with a pool of persistent connections
+// ============================================
+CClientTCP::CClientTCP(const ClientConfig& a_config) : m_config(a_config) {
+    TRACE2(this, " Construct upnplib::CClientTCP")
+    m_config.max_idle = std::max(m_config.max_idle, m_config.min_idle);
+}
+
+CClientTCP::~CClientTCP() { TRACE2(this, " Destruct upnplib::CClientTCP") }
+
+CClientTCP::CLease CClientTCP::checkout(const std::string& a_node,
+                                        const std::string& a_port) {
+    TRACE2(this, " Executing upnplib::CClientTCP::checkout()")
+    std::pair<std::string, std::string> key{a_node, a_port};
+    std::unique_ptr<CClientConnection> conn;
+    sockaddr_storage addr{};
+    socklen_t addrlen{0};
+    std::chrono::steady_clock::time_point expires;
+    {
+        std::scoped_lock lock(m_mutex);
+        auto it = m_endpoints.find(key);
+        if (it != m_endpoints.end()) {
+            Endpoint& ep = it->second;
+            // The most recently used connection is tried first.
+            while (!conn && !ep.idle.empty()) {
+                std::unique_ptr<CClientConnection> idle =
+                    std::move(ep.idle.back());
+                ep.idle.pop_back();
+                if (idle->is_healthy()) {
+                    conn = std::move(idle);
+                    m_stats.reuses++;
+                } else {
+                    m_stats.broken++;
+                }
+            }
+            addr = ep.addr;
+            addrlen = ep.addrlen;
+            expires = ep.expires;
+        }
+    }
+
+    if (!conn && addrlen > 0 && std::chrono::steady_clock::now() < expires) {
+        try {
+            conn = std::make_unique<CClientConnection>(
+                reinterpret_cast<const sockaddr*>(&addr), addrlen,
+                m_config.max_frame_size, m_config.socket,
+                m_config.connect_timeout_ms);
+            std::scoped_lock lock(m_mutex);
+            m_stats.connects++;
+        } catch (const std::runtime_error& e) {
+            // The address may have changed, drop it and resolve it again.
+            TRACE2("[Client] Cached address failed: ", e.what())
+            std::scoped_lock lock(m_mutex);
+            auto it = m_endpoints.find(key);
+            if (it != m_endpoints.end() && it->second.expires == expires)
+                it->second.addrlen = 0;
+        }
+    }
+    if (!conn) {
+        // First use of the endpoint, or its address has expired or failed.
+        // Resolve it and keep the one that connects first.
+        CAddrinfo ai(a_node, a_port, AF_UNSPEC, SOCK_STREAM,
+                     a_node.empty() ? AI_NUMERICHOST | AI_NUMERICSERV
+                                    : AI_NUMERICSERV);
+        CSocket sock = connect_happy_eyeballs(ai, m_config.connect_timeout_ms);
+        SocketOptions opts{m_config.socket};
+        opts.fastopen_connect = false;
+        sock.set_options(opts);
+        addrlen = sizeof(addr);
+        if (::getpeername(sock, reinterpret_cast<sockaddr*>(&addr),
+                          &addrlen) != 0)
+            throw_error("[Client] ERROR! MSG1037: Failed to connect:");
+        conn = std::make_unique<CClientConnection>(std::move(sock),
+                                                   m_config.max_frame_size);
+        CMetrics::add(Counter::client_connects);
+        std::scoped_lock lock(m_mutex);
+        Endpoint& ep = m_endpoints[key];
+        ep.addr = addr;
+        ep.addrlen = addrlen;
+        ep.expires = std::chrono::steady_clock::now() +
+                     CAddrinfoCache::global().get_ttl();
+        m_stats.connects++;
+    }
+    if (m_config.io_uring && !conn->is_io_uring())
+        conn->use_io_uring();
+    CLease lease(this, key, std::move(conn));
+
+    // Keep the minimal number of idle connections.
+    for (size_t i{this->idle(a_node, a_port)}; i < m_config.min_idle; i++) {
+        try {
+            std::unique_ptr<CClientConnection> warm =
+                std::make_unique<CClientConnection>(
+                    reinterpret_cast<const sockaddr*>(&addr), addrlen,
+                    m_config.max_frame_size, m_config.socket,
+                    m_config.connect_timeout_ms);
+            {
+                std::scoped_lock lock(m_mutex);
+                m_stats.connects++;
+            }
+            this->checkin(key, std::move(warm));
+        } catch (const std::runtime_error&) {
+            // Not needed for this request, the next checkout tries again.
+            break;
+        }
+    }
+    return lease;
+}
+
+std::string CClientTCP::request(const std::string& a_node,
+                                const std::string& a_port,
+                                std::string_view a_msg) {
+    CLease lease = this->checkout(a_node, a_port);
+    try {
+        lease->send_frame(a_msg);
+        return lease->recv_frame();
+    } catch (...) {
+        // The state of the connection is unknown, don't reuse it.
+        lease.discard();
+        throw;
+    }
+}
+
+std::vector<std::string>
+CClientTCP::pipeline(const std::string& a_node, const std::string& a_port,
+                     std::span<const std::string_view> a_msgs) {
+    CLease lease = this->checkout(a_node, a_port);
+    try {
+        return lease->pipeline(a_msgs);
+    } catch (...) {
+        lease.discard();
+        throw;
+    }
+}
+
+void CClientTCP::checkin(const std::pair<std::string, std::string>& a_key,
+                         std::unique_ptr<CClientConnection> a_conn) {
+    const std::optional<bool> fastopen = a_conn->take_fastopen_result();
+    std::scoped_lock lock(m_mutex);
+    if (fastopen)
+        (*fastopen ? m_stats.fastopen_hits : m_stats.fastopen_misses)++;
+    std::vector<std::unique_ptr<CClientConnection>>& idle =
+        m_endpoints[a_key].idle;
+    if (idle.size() < m_config.max_idle)
+        idle.push_back(std::move(a_conn));
+}
+
+size_t CClientTCP::idle(const std::string& a_node,
+                        const std::string& a_port) const {
+    std::scoped_lock lock(m_mutex);
+    auto it = m_endpoints.find({a_node, a_port});
+    return it == m_endpoints.end() ? 0 : it->second.idle.size();
+}
+
+CClientTCP::Stats CClientTCP::get_stats() const {
+    std::scoped_lock lock(m_mutex);
+    return m_stats;
+}
+
+void CClientTCP::clear() {
+    std::scoped_lock lock(m_mutex);
+    for (auto& [key, ep] : m_endpoints)
+        ep.idle.clear();
+}
+
 } // namespace upnplib
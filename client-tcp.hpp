@@ -1,13 +1,228 @@
 #ifndef UPNPLIB_INCLUDE_CLIENT_TCP_HPP
 #define UPNPLIB_INCLUDE_CLIENT_TCP_HPP
 // Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
-// Redistribution only with this Copyright remark. Last modified: 2023-03-21
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+#include "socket.hpp"
+#include "frame.hpp"
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 namespace upnplib {
 
-// Send a quit signal to the server.
+// Maximal time to establish a connection.
+constexpr int default_connect_timeout_ms{10000};
+
+// Send a quit signal to the server on the loopback interface at a_port. The
+// server must run with ServerConfig::quit_message.
 // Inspired by https://www.geeksforgeeks.org/socket-programming-cc
-void quit_server();
+void quit_server(const std::string& a_port = "4433");
+
+// Persistent client connection
+// ----------------------------
+// Connects to a server that runs with ServerConfig::persistent and exchanges
+// any number of messages as length-prefixed frames (see frame.hpp) over the
+// one connection. With empty node the loopback interface is connected.
+// All addresses of the node are tried with connect_happy_eyeballs().
+class CClientConnection {
+  public:
+    CClientConnection(const std::string& a_node, const std::string& a_port,
+                      uint32_t a_max_frame_size = default_max_frame_size,
+                      int a_connect_timeout_ms = default_connect_timeout_ms);
+    // Connect to an already resolved address. The options are set before
+    // connecting. With fastopen_connect the connection is opened with TCP
+    // Fast Open if the system supports it, otherwise as usual. Then the
+    // handshake is done by the first send, and errors of the connection are
+    // only thrown by it.
+    CClientConnection(const sockaddr* a_addr, socklen_t a_addrlen,
+                      uint32_t a_max_frame_size = default_max_frame_size,
+                      const SocketOptions& a_opts = {},
+                      int a_connect_timeout_ms = default_connect_timeout_ms);
+    // Take over a connected socket in blocking mode.
+    CClientConnection(CSocket&& a_sock,
+                      uint32_t a_max_frame_size = default_max_frame_size);
+    virtual ~CClientConnection();
+
+    // Send one message as frame. This call is blocking until all bytes are
+    // handed over to the operating system. The message can be gathered from
+    // several parts without copying them.
+    void send_frame(std::string_view a_msg);
+    void send_frame(std::span<const std::span<const std::byte>> a_parts);
+    // Receive the next message. This call is blocking until a complete frame
+    // is received. Throws an exception if the server has closed the
+    // connection.
+    std::string recv_frame();
+    // Pipeline messages: send all of them back to back without waiting for
+    // replies and return the replies in the same order. Sending and
+    // receiving are interleaved, so neither side blocks on full socket
+    // buffers. Replies of frames sent before with send_frame() must have
+    // been received.
+    std::vector<std::string>
+    pipeline(std::span<const std::string_view> a_msgs);
+    // Shut down the connection. It is also done by the destructor.
+    void close();
+    // Check without blocking if the connection can be used for a new
+    // request: it is open, no received bytes are left over, and the peer
+    // has neither closed it nor sent anything unexpected.
+    bool is_healthy() const;
+    // Result of TCP Fast Open: true if the server has accepted the data in
+    // the SYN, false if it was sent after the handshake, e.g. without a
+    // valid cookie. Gives nothing if the connection wasn't opened with TCP
+    // Fast Open or the handshake isn't done yet. The result is given only
+    // once.
+    std::optional<bool> take_fastopen_result();
+    // Exchange frames with io_uring (see uring.hpp) if the system supports
+    // it. Then send_frame(), recv_frame() and pipeline() submit their send
+    // and receive operations together and wait for their completions with
+    // one system call per round. Returns false if io_uring isn't available,
+    // blocking system calls are used then.
+    bool use_io_uring();
+    bool is_io_uring() const;
+
+  private:
+    CSocket m_sock;
+    CFrameDecoder m_frames;
+    bool m_open{false};
+    bool m_fastopen{false}; // Opened with TCP Fast Open, result not taken.
+    // Ring and operation buffers, defined by the implementation.
+    struct Uring;
+    std::unique_ptr<Uring> m_uring;
+
+    void connect(const sockaddr* a_addr, socklen_t a_addrlen,
+                 const SocketOptions& a_opts, int a_timeout_ms);
+    // Send the buffers from a_bufs and receive replies until a_replies has
+    // a_count of them, with io_uring.
+    void exchange_uring(std::vector<std::span<const std::byte>>& a_bufs,
+                        std::vector<std::string>& a_replies, size_t a_count);
+};
+
+// Configuration of a client
+// -------------------------
+struct ClientConfig {
+    // Number of idle connections that are kept open per endpoint. Missing
+    // ones are connected in advance on checkout.
+    size_t min_idle{0};
+    // Maximal number of idle connections per endpoint. Connections that are
+    // given back beyond are closed.
+    size_t max_idle{8};
+    // Maximal payload size of a received frame.
+    uint32_t max_frame_size{default_max_frame_size};
+    // Maximal time to establish a connection.
+    int connect_timeout_ms{default_connect_timeout_ms};
+    // Options of the connections, e.g. TCP_NODELAY for short requests. The
+    // backlog isn't used. The first connection to an endpoint gets them
+    // after it is established, the other ones before they connect. With
+    // fastopen_connect the first request on a new connection is sent in the
+    // SYN (TCP Fast Open). The first connection to an endpoint races its
+    // addresses and doesn't use it.
+    SocketOptions socket;
+    // Exchange frames with io_uring if the system supports it, see
+    // CClientConnection::use_io_uring().
+    bool io_uring{false};
+};
+
+// Client with a pool of persistent connections
+// --------------------------------------------
+// Keeps warm connections per endpoint (node and port), so a request doesn't
+// pay for name resolution and the TCP handshake. The address of an endpoint
+// is resolved only once. The first connection races all its addresses with
+// connect_happy_eyeballs(), further ones use the address that has won. A
+// connection is checked out exclusively for one or more requests and given
+// back to the pool if the lease is destructed. Before an idle connection is
+// handed out it is checked with CClientConnection::is_healthy(), broken ones
+// are closed and replaced. This class is thread safe.
+class CClientTCP {
+  public:
+    // Lease of a connection from the pool
+    // -----------------------------------
+    // Gives the connection back to the pool on destruction. If an error
+    // occurred on the connection it must be discarded so it is closed
+    // instead.
+    class CLease {
+      public:
+        CLease() = default;
+        CLease(CLease&&) noexcept = default;
+        CLease& operator=(CLease&& that) noexcept;
+        virtual ~CLease();
+
+        CClientConnection& operator*() const;
+        CClientConnection* operator->() const;
+        explicit operator bool() const;
+        // Close the connection instead of giving it back.
+        void discard();
+
+      private:
+        friend class CClientTCP;
+        CLease(CClientTCP* a_client, std::pair<std::string, std::string> a_key,
+               std::unique_ptr<CClientConnection> a_conn);
+        CClientTCP* m_client{nullptr};
+        std::pair<std::string, std::string> m_key;
+        std::unique_ptr<CClientConnection> m_conn;
+    };
+
+    // Statistics of the pool.
+    struct Stats {
+        size_t connects; // New connections.
+        size_t reuses;   // Checkouts of idle connections.
+        size_t broken;   // Idle connections that failed the health check.
+        size_t fastopen_hits;   // Connections with data accepted in the SYN,
+        size_t fastopen_misses; // resp. sent after the handshake.
+    };
+
+    CClientTCP(const ClientConfig& a_config = ClientConfig());
+    CClientTCP(const CClientTCP&) = delete;
+    CClientTCP& operator=(const CClientTCP&) = delete;
+    virtual ~CClientTCP();
+
+    // Get a connection to the endpoint, a warm one if available. With empty
+    // node the loopback interface is connected. The client must outlive the
+    // lease.
+    CLease checkout(const std::string& a_node, const std::string& a_port);
+    // Send one message and wait for its reply on a pooled connection.
+    std::string request(const std::string& a_node, const std::string& a_port,
+                        std::string_view a_msg);
+    // Pipeline messages on a pooled connection, see
+    // CClientConnection::pipeline().
+    std::vector<std::string>
+    pipeline(const std::string& a_node, const std::string& a_port,
+             std::span<const std::string_view> a_msgs);
+
+    // Getter for the number of idle connections to an endpoint.
+    size_t idle(const std::string& a_node, const std::string& a_port) const;
+    // Getter for the statistics.
+    Stats get_stats() const;
+    // Close all idle connections.
+    void clear();
+
+  private:
+    // The address that has connected first is used for all connections to
+    // the endpoint. It is resolved again when it fails to connect or the
+    // time to live of the address cache has expired.
+    struct Endpoint {
+        sockaddr_storage addr;
+        socklen_t addrlen{0};
+        std::chrono::steady_clock::time_point expires;
+        std::vector<std::unique_ptr<CClientConnection>> idle; // LIFO
+    };
+    ClientConfig m_config;
+    mutable std::mutex m_mutex;
+    std::map<std::pair<std::string, std::string>, Endpoint>
+        m_endpoints;  // Protected by mutex.
+    Stats m_stats{}; // Protected by mutex.
+
+    // Give a connection back to the pool.
+    void checkin(const std::pair<std::string, std::string>& a_key,
+                 std::unique_ptr<CClientConnection> a_conn);
+};
 
 } // namespace upnplib
 
@@ -0,0 +1,253 @@
+// Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+#include "connection.hpp"
+#include "port.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace upnplib {
+
+namespace {
+// Free space that is at least offered to receive into.
+constexpr size_t recv_chunk{4096};
+// Minimal size of a buffer for copied replies. Small replies are collected
+// in it.
+constexpr size_t send_chunk{4096};
+} // anonymous namespace
+
+CConnection::CConnection(SOCKET a_sfd, bool a_persistent,
+                         uint32_t a_max_frame_size, CBufferPool& a_pool)
+    : m_sfd(a_sfd), m_persistent(a_persistent), m_pool(a_pool),
+      m_frames(a_max_frame_size, a_pool) {
+    TRACE2(this, " Construct upnplib::CConnection")
+}
+
+SOCKET CConnection::sfd() const { return m_sfd; }
+
+bool CConnection::is_persistent() const { return m_persistent; }
+
+void CConnection::set_peer(const sockaddr_storage& a_addr,
+                           socklen_t a_addrlen) {
+    m_peer = a_addr;
+    m_peer_len = a_addrlen;
+}
+
+const sockaddr_storage& CConnection::peer() const { return m_peer; }
+
+socklen_t CConnection::peer_len() const { return m_peer_len; }
+
+void CConnection::received(const char* a_data, size_t a_len) {
+    m_frames.append(a_data, a_len);
+}
+
+std::array<std::span<std::byte>, 2> CConnection::receive_buffers() {
+    return m_frames.prepare(recv_chunk);
+}
+
+void CConnection::received(size_t a_len) { m_frames.commit(a_len); }
+
+size_t CConnection::buffered() const { return m_frames.buffered(); }
+
+bool CConnection::next_message(std::string_view& a_msg) {
+    return m_persistent && m_frames.next(a_msg);
+}
+
+std::span<const std::byte> CConnection::take_message(CBuffer& a_owner) {
+    return m_frames.take_pending(a_owner);
+}
+
+void CConnection::send(std::string_view a_msg) {
+    this->send(std::as_bytes(std::span(a_msg)));
+}
+
+void CConnection::send(std::span<const std::byte> a_msg) {
+    this->send(std::span<const std::span<const std::byte>>(&a_msg, 1));
+}
+
+void CConnection::send_borrowed(std::span<const std::byte> a_msg,
+                                std::shared_ptr<const void> a_owner) {
+    this->send_borrowed(std::span<const std::span<const std::byte>>(&a_msg, 1),
+                        std::move(a_owner));
+}
+
+void CConnection::send(std::span<const std::span<const std::byte>> a_parts) {
+    size_t size{0};
+    for (std::span<const std::byte> part : a_parts)
+        size += part.size();
+    if (!m_persistent && size == 0)
+        return;
+    const size_t hdr_size = m_persistent ? frame_header_size : 0;
+    Segment& seg = this->owned_tail(hdr_size + size);
+    std::byte* out = seg.owned.data() + seg.len;
+    if (m_persistent)
+        write_frame_header(out, size);
+    out += hdr_size;
+    for (std::span<const std::byte> part : a_parts) {
+        if (part.empty())
+            continue;
+        std::memcpy(out, part.data(), part.size());
+        out += part.size();
+    }
+    seg.len += hdr_size + size;
+}
+
+void CConnection::send_borrowed(
+    std::span<const std::span<const std::byte>> a_parts,
+    std::shared_ptr<const void> a_owner) {
+    if (m_persistent) {
+        size_t size{0};
+        for (std::span<const std::byte> part : a_parts)
+            size += part.size();
+        Segment& seg = this->owned_tail(frame_header_size);
+        write_frame_header(seg.owned.data() + seg.len, size);
+        seg.len += frame_header_size;
+    }
+    for (std::span<const std::byte> part : a_parts)
+        if (!part.empty())
+            m_output.push_back({CBuffer(), 0, part, a_owner});
+}
+
+std::span<const std::byte> CConnection::bytes(const Segment& a_seg) {
+    return a_seg.borrowed.empty()
+               ? std::span<const std::byte>(a_seg.owned.data(), a_seg.len)
+               : a_seg.borrowed;
+}
+
+std::string_view CConnection::output() {
+    std::span<const std::byte> buf;
+    if (this->output(std::span(&buf, 1)) == 0)
+        return {};
+    return std::string_view(reinterpret_cast<const char*>(buf.data()),
+                            buf.size());
+}
+
+size_t CConnection::output(std::span<std::span<const std::byte>> a_bufs,
+                           bool* a_zerocopy) {
+    size_t count = std::min(a_bufs.size(), m_output.size() - m_head);
+    bool zerocopy{false};
+    for (size_t i{0}; i < count; i++) {
+        a_bufs[i] = bytes(m_output[m_head + i]);
+        if (i == 0)
+            a_bufs[0] = a_bufs[0].subspan(m_sent);
+        if (m_zc_threshold > 0 && a_bufs[i].size() >= m_zc_threshold) {
+            // A large buffer is sent alone with zero copy.
+            zerocopy = (i == 0);
+            count = zerocopy ? 1 : i;
+            break;
+        }
+    }
+    if (a_zerocopy != nullptr)
+        *a_zerocopy = zerocopy;
+    m_handed_end = std::max(m_handed_end, m_head + count);
+    return count;
+}
+
+void CConnection::written(size_t a_len, bool a_zerocopy) {
+    if (a_zerocopy && a_len > 0) {
+        Segment& seg = m_output[m_head];
+        seg.zerocopy = true;
+        seg.zc_id = m_zc_next++;
+    }
+    m_sent += a_len;
+    while (m_head < m_output.size()) {
+        Segment& seg = m_output[m_head];
+        const size_t size = bytes(seg).size();
+        if (m_sent < size)
+            break;
+        // Segment is complete, give its buffer back to the pool resp.
+        // release a borrowed buffer. If the kernel still uses it, this is
+        // done on completion.
+        m_sent -= size;
+        if (seg.zerocopy &&
+            static_cast<int32_t>(seg.zc_id - m_zc_done) >= 0)
+            m_zc_held.push_back(std::move(seg));
+        seg = Segment();
+        m_head++;
+    }
+    if (m_head == m_output.size()) {
+        m_output.clear();
+        m_head = 0;
+        m_handed_end = 0;
+    } else if (m_head >= 16 && m_head * 2 >= m_output.size()) {
+        // Output is never drained, drop the written segments. The bytes of
+        // the segments do not move.
+        m_output.erase(m_output.begin(),
+                       m_output.begin() + static_cast<ptrdiff_t>(m_head));
+        m_handed_end -= std::min(m_handed_end, m_head);
+        m_head = 0;
+    }
+}
+
+bool CConnection::has_output() const { return m_head < m_output.size(); }
+
+void CConnection::append_output(CConnection& a_other) {
+    for (size_t i{a_other.m_head}; i < a_other.m_output.size(); i++)
+        m_output.push_back(std::move(a_other.m_output[i]));
+    a_other.m_output.clear();
+    a_other.m_head = 0;
+    a_other.m_handed_end = 0;
+}
+
+CConnection::Segment& CConnection::owned_tail(size_t a_len) {
+    // Segments that are handed out must not change, they may be in use by an
+    // asynchronous send.
+    if (m_output.size() > std::max(m_head, m_handed_end)) {
+        Segment& last = m_output.back();
+        if (last.owned && last.owned.size() - last.len >= a_len)
+            return last;
+    }
+    m_output.push_back({m_pool.acquire(std::max(a_len, send_chunk)), 0,
+                        std::span<const std::byte>(), nullptr});
+    return m_output.back();
+}
+
+void CConnection::set_zerocopy_threshold(size_t a_threshold) {
+    m_zc_threshold = a_threshold;
+}
+
+void CConnection::zerocopy_completed([[maybe_unused]] uint32_t a_lo,
+                                     uint32_t a_hi) {
+    if (static_cast<int32_t>(a_hi + 1 - m_zc_done) > 0)
+        m_zc_done = a_hi + 1;
+    size_t done{0};
+    while (done < m_zc_held.size() &&
+           static_cast<int32_t>(m_zc_held[done].zc_id - m_zc_done) < 0)
+        done++;
+    m_zc_held.erase(m_zc_held.begin(),
+                    m_zc_held.begin() + static_cast<ptrdiff_t>(done));
+}
+
+uint32_t CConnection::zerocopy_in_flight() const {
+    return m_zc_next - m_zc_done;
+}
+
+bool CConnection::is_send_busy() const { return m_send_busy; }
+
+void CConnection::set_send_busy(bool a_busy) { m_send_busy = a_busy; }
+
+bool CConnection::is_handler_busy() const { return m_handler_busy; }
+
+void CConnection::set_handler_busy(bool a_busy) { m_handler_busy = a_busy; }
+
+bool CConnection::is_eof() const { return m_eof; }
+
+void CConnection::set_eof(bool a_eof) { m_eof = a_eof; }
+
+bool CConnection::is_closing() const { return m_closing; }
+
+void CConnection::set_closing(bool a_closing) { m_closing = a_closing; }
+
+bool CConnection::is_idle() const {
+    return m_frames.buffered() == 0 && !this->has_output() && !m_send_busy &&
+           !m_handler_busy;
+}
+
+uint32_t CConnection::tag() const { return m_tag; }
+
+void CConnection::set_tag(uint32_t a_tag) { m_tag = a_tag; }
+
+CConnection::Timestamps& CConnection::timestamps() { return m_timestamps; }
+
+} // namespace upnplib
@@ -0,0 +1,204 @@
+#ifndef UPNPLIB_CONNECTION_HPP
+#define UPNPLIB_CONNECTION_HPP
+// Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+#include "port_sock.hpp"
+#include "buffer-pool.hpp"
+#include "frame.hpp"
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace upnplib {
+
+// State of an accepted connection on the server
+// ---------------------------------------------
+// This holds the protocol state independent of how the server does its I/O
+// (blocking, epoll or io_uring). The server feeds received bytes and takes
+// the bytes to send. There are two protocols:
+// one shot   = the whole byte stream until the peer shuts down sending is one
+//              message. Nothing is sent back.
+// persistent = the byte stream is a sequence of length-prefixed frames, each
+//              one is a message. Replies are sent as frames too.
+// The object does not own the socket file descriptor. A message handler (see
+// message-handler.hpp) replies with the send methods. Received bytes and
+// copied replies are kept in buffers from the given pool.
+class CConnection {
+  public:
+    CConnection(SOCKET a_sfd, bool a_persistent,
+                uint32_t a_max_frame_size = default_max_frame_size,
+                CBufferPool& a_pool = CBufferPool::global());
+
+    SOCKET sfd() const;
+    bool is_persistent() const;
+    // Address of the peer, e.g. got from accept_nonblocking(). Its length is
+    // 0 if it isn't set.
+    void set_peer(const sockaddr_storage& a_addr, socklen_t a_addrlen);
+    const sockaddr_storage& peer() const;
+    socklen_t peer_len() const;
+
+    // Input
+    // -----
+    // Feed received bytes.
+    void received(const char* a_data, size_t a_len);
+    // Alternative without copying: receive into the free space of the ring
+    // buffer given by receive_buffers(), e.g. with recv_vectored(), and
+    // confirm the number of bytes with received().
+    std::array<std::span<std::byte>, 2> receive_buffers();
+    void received(size_t a_len);
+    // Number of received bytes that aren't taken as message so far.
+    size_t buffered() const;
+    // Get the next complete message of a persistent connection. The view is
+    // valid until the next call of another input method. Throws an exception
+    // on an invalid frame.
+    bool next_message(std::string_view& a_msg);
+    // Take the message of a one shot connection after end of file. It stays
+    // in its buffer from the pool that is moved to a_owner, so the message
+    // is valid as long as a_owner.
+    std::span<const std::byte> take_message(CBuffer& a_owner);
+
+    // Output
+    // ------
+    // Queue a reply message. It is sent as frame on a persistent connection
+    // and as is on a one shot connection. The bytes are copied.
+    void send(std::string_view a_msg);
+    void send(std::span<const std::byte> a_msg);
+    // Queue a reply message without copying it. The buffer is referenced
+    // until it is written. a_owner is held until then and can keep the buffer
+    // alive. Without owner the buffer must be valid as long as the
+    // connection.
+    void send_borrowed(std::span<const std::byte> a_msg,
+                       std::shared_ptr<const void> a_owner = nullptr);
+    // Vectored variants: queue one reply message that is gathered from the
+    // parts.
+    void send(std::span<const std::span<const std::byte>> a_parts);
+    void send_borrowed(std::span<const std::span<const std::byte>> a_parts,
+                       std::shared_ptr<const void> a_owner = nullptr);
+
+    // Get the bytes to write next, this may be only a part of the queued
+    // replies. They stay valid and unchanged until they are confirmed with
+    // written(), also if more replies are queued meanwhile. So they can be
+    // used by asynchronous send operations.
+    std::string_view output();
+    // Get the bytes to write next as up to a_bufs.size() buffers, e.g. for
+    // send_vectored(). Returns the number of buffers filled in. They stay
+    // valid like with output(). If a_zerocopy is given it is set if the
+    // buffer should be sent with MSG_ZEROCOPY. Such a buffer is always given
+    // alone.
+    size_t output(std::span<std::span<const std::byte>> a_bufs,
+                  bool* a_zerocopy = nullptr);
+    // Confirm written bytes, also across several buffers. a_zerocopy tells
+    // if they were sent with MSG_ZEROCOPY.
+    void written(size_t a_len, bool a_zerocopy = false);
+    bool has_output() const;
+    // Queue the replies of a_other after the own ones and take their
+    // buffers, e.g. of a connection object that a handler has used on
+    // another thread. Nothing of a_other may have been written.
+    void append_output(CConnection& a_other);
+
+    // Zero copy
+    // ---------
+    // Buffers with at least a_threshold bytes should be sent with
+    // MSG_ZEROCOPY, 0 = never. Their memory is only given back to the pool
+    // resp. to its owner after the kernel has completed the send. Destructing
+    // the connection gives them back at once, so the socket must not send
+    // from them anymore, i.e. all sends are completed or its send queue is
+    // discarded.
+    void set_zerocopy_threshold(size_t a_threshold);
+    // The kernel has completed the zero copy sends with the numbers a_lo to
+    // a_hi. Sends are numbered from 0 on per socket. Completions of TCP
+    // sockets are reported in order.
+    void zerocopy_completed(uint32_t a_lo, uint32_t a_hi);
+    // Number of zero copy sends that are not completed.
+    uint32_t zerocopy_in_flight() const;
+
+    // State of the I/O backend
+    // ------------------------
+    // Send busy: waiting for the socket to become writable, resp. for the
+    // completion of a send operation.
+    bool is_send_busy() const;
+    void set_send_busy(bool a_busy);
+    // Handler busy: messages are handled on another thread, their replies
+    // are not queued yet.
+    bool is_handler_busy() const;
+    void set_handler_busy(bool a_busy);
+    // End of file: the peer has shut down sending. A persistent connection
+    // is closed as soon as all replies are written.
+    bool is_eof() const;
+    void set_eof(bool a_eof);
+    // Closing: the connection is closed but its object must be kept until
+    // the send operation resp. the handler in progress has completed.
+    bool is_closing() const;
+    void set_closing(bool a_closing);
+    // Idle: no partial message is buffered, no message is handled and no
+    // reply is pending, so a persistent connection can be closed without
+    // losing a request.
+    bool is_idle() const;
+    // Tag: a value the backend keeps with the connection, e.g. to tell its
+    // operations from those of an earlier connection with the same socket
+    // file descriptor.
+    uint32_t tag() const;
+    void set_tag(uint32_t a_tag);
+
+    // Latency
+    // -------
+    // Timestamps of the server for its latency histograms (see metrics.hpp)
+    // in nanoseconds of CMetrics::clock_ns(), 0 = not set.
+    struct Timestamps {
+        uint64_t accepted{0}; // Until the first bytes are received.
+        uint64_t output{0};   // Replies queued until all are written.
+    };
+    Timestamps& timestamps();
+
+  private:
+    SOCKET m_sfd;
+    bool m_persistent;
+    socklen_t m_peer_len{0};
+    sockaddr_storage m_peer{};
+    CBufferPool& m_pool;
+    // Received bytes. The one shot protocol doesn't use frames, it only uses
+    // the buffer.
+    CFrameDecoder m_frames;
+
+    // Queued replies. Copied bytes are collected in owned segments, borrowed
+    // buffers get their own segment. Segments before m_head are already
+    // written, so the vector is only cleared when all are written and keeps
+    // its capacity.
+    struct Segment {
+        CBuffer owned;
+        size_t len{0}; // Bytes used in owned.
+        std::span<const std::byte> borrowed;
+        std::shared_ptr<const void> owner;
+        bool zerocopy{false}; // Sent with MSG_ZEROCOPY,
+        uint32_t zc_id{0};    // last time with this number.
+    };
+    std::vector<Segment> m_output;
+    size_t m_head{0};
+    size_t m_handed_end{0}; // Segments before are given by output().
+    size_t m_sent{0};       // Confirmed bytes of the first segment.
+    static std::span<const std::byte> bytes(const Segment& a_seg);
+    // Get an owned segment with room for a_len more bytes at the end.
+    Segment& owned_tail(size_t a_len);
+
+    size_t m_zc_threshold{0};
+    uint32_t m_zc_next{0}; // Number of the next zero copy send.
+    uint32_t m_zc_done{0}; // Sends before this number are completed.
+    // Written segments that wait for completion, ordered by number.
+    std::vector<Segment> m_zc_held;
+
+    bool m_send_busy{false};
+    bool m_handler_busy{false};
+    bool m_eof{false};
+    bool m_closing{false};
+    uint32_t m_tag{0};
+    Timestamps m_timestamps;
+};
+
+} // namespace upnplib
+
+#endif // UPNPLIB_CONNECTION_HPP
@@ -0,0 +1,274 @@
+// Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+#include "executor.hpp"
+#include "port.hpp"
+#include "socket.hpp"
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+namespace upnplib {
+
+static inline void throw_error(std::string errmsg) {
+    // error number given by WSAGetLastError(), resp. contained in errno is
+    // used to specify details of the error.
+#ifdef _WIN32
+    throw std::runtime_error(
+        errmsg + " WSAGetLastError()=" + std::to_string(WSAGetLastError()));
+#else
+    throw std::runtime_error(errmsg + " errno(" + std::to_string(errno) +
+                             ")=\"" + std::strerror(errno) + "\"");
+#endif
+}
+
+// Event loop that drives coroutines
+// =================================
+CExecutor::CIoWait::CIoWait(CExecutor& a_exec, SOCKET a_sfd,
+                            uint32_t a_events)
+    : m_exec(a_exec), m_sfd(a_sfd), m_events(a_events) {}
+
+void CExecutor::CIoWait::await_suspend(std::coroutine_handle<> a_handle) {
+    Waiters& waiters = m_exec.m_waiters[m_sfd];
+    if (m_events & CPoller::READABLE)
+        waiters.reader = a_handle;
+    if (m_events & CPoller::WRITABLE)
+        waiters.writer = a_handle;
+    m_exec.update(m_sfd, waiters);
+}
+
+CExecutor::CExecutor() { TRACE2(this, " Construct upnplib::CExecutor") }
+
+CExecutor::~CExecutor() {
+    TRACE2(this, " Destruct upnplib::CExecutor")
+    // Destroy tasks that have not finished. Destroying a spawned task also
+    // destroys the tasks it awaits.
+    for (void* address : m_spawned)
+        std::coroutine_handle<>::from_address(address).destroy();
+}
+
+void CExecutor::spawn(CTask<void> a_task) {
+    std::coroutine_handle<CTask<void>::promise_type> handle =
+        std::exchange(a_task.m_handle, nullptr);
+    handle.promise().executor = this;
+    m_spawned.insert(handle.address());
+    m_ready.push_back(handle);
+}
+
+void CExecutor::run() {
+    TRACE2(this, " Executing upnplib::CExecutor::run()")
+    m_stop = false;
+    while (!m_stop && !m_spawned.empty()) {
+        // Resume all ready coroutines. They may make others ready.
+        while (!m_ready.empty() && !m_stop) {
+            std::coroutine_handle<> handle = m_ready.front();
+            m_ready.pop_front();
+            handle.resume();
+        }
+        {
+            std::scoped_lock lock(m_posted_mutex);
+            m_ready.insert(m_ready.end(), m_posted.begin(), m_posted.end());
+            m_posted.clear();
+        }
+        if (m_stop || m_spawned.empty() || !m_ready.empty())
+            continue;
+
+        for (const CPoller::Event& ev : m_poller.wait(-1)) {
+            auto it = m_waiters.find(ev.sfd);
+            if (it == m_waiters.end())
+                continue;
+            Waiters& waiters = it->second;
+            std::coroutine_handle<> reader;
+            std::coroutine_handle<> writer;
+            if (ev.events & (CPoller::READABLE | CPoller::HANGUP))
+                reader = std::exchange(waiters.reader, nullptr);
+            if (ev.events & (CPoller::WRITABLE | CPoller::HANGUP))
+                writer = std::exchange(waiters.writer, nullptr);
+            // A coroutine that waits for both is resumed only once.
+            if (reader) {
+                m_ready.push_back(reader);
+                if (waiters.writer == reader)
+                    waiters.writer = nullptr;
+            }
+            if (writer && writer != reader) {
+                m_ready.push_back(writer);
+                if (waiters.reader == writer)
+                    waiters.reader = nullptr;
+            }
+            this->update(ev.sfd, waiters);
+        }
+    }
+}
+
+void CExecutor::stop() {
+    m_stop = true;
+    m_poller.wakeup();
+}
+
+void CExecutor::post(std::coroutine_handle<> a_handle) {
+    {
+        std::scoped_lock lock(m_posted_mutex);
+        m_posted.push_back(a_handle);
+    }
+    m_poller.wakeup();
+}
+
+CExecutor::CIoWait CExecutor::wait(SOCKET a_sfd, uint32_t a_events) {
+    return CIoWait(*this, a_sfd, a_events);
+}
+
+void CExecutor::update(SOCKET a_sfd, Waiters& a_waiters) {
+    const uint32_t events = (a_waiters.reader ? CPoller::READABLE : 0) |
+                            (a_waiters.writer ? CPoller::WRITABLE : 0);
+    if (events == a_waiters.events)
+        return;
+    // A socket without waiters is removed from the poller, otherwise a hang
+    // up would be reported again and again.
+    if (events == 0) {
+        m_poller.remove(a_sfd);
+        m_waiters.erase(a_sfd);
+        return;
+    }
+    if (a_waiters.events == 0)
+        m_poller.add(a_sfd, events);
+    else
+        m_poller.modify(a_sfd, events);
+    a_waiters.events = events;
+}
+
+void CExecutor::finished(void* a_address, std::exception_ptr a_error) {
+    m_spawned.erase(a_address);
+    if (!a_error)
+        return;
+    m_failed++;
+    try {
+        std::rethrow_exception(a_error);
+    } catch ([[maybe_unused]] const std::exception& e) {
+        TRACE2("[Executor] Task failed: ", e.what())
+    } catch (...) {
+    }
+}
+
+size_t CExecutor::get_running() const { return m_spawned.size(); }
+
+size_t CExecutor::get_failed() const { return m_failed; }
+
+// Asynchronous socket operations
+// ==============================
+namespace {
+// Wait for the result of an asynchronous lookup, use with co_await.
+class CResolveWait {
+  public:
+    CResolveWait(CExecutor& a_exec, const std::string& a_node,
+                 const std::string& a_service, const addrinfo& a_hints)
+        : m_exec(a_exec), m_node(a_node), m_service(a_service),
+          m_hints(a_hints) {}
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> a_handle) {
+        // The callback is called on a resolver thread, resp. at once if the
+        // result is cached. Either way the coroutine is resumed by run().
+        CAddrinfoCache::global().get_async(
+            m_node, m_service, m_hints,
+            [this, a_handle](CAddrinfoCache::Result a_result) {
+                m_result = std::move(a_result);
+                m_exec.post(a_handle);
+            });
+    }
+    std::shared_ptr<const addrinfo> await_resume() { return m_result.get(); }
+
+  private:
+    CExecutor& m_exec;
+    const std::string& m_node;
+    const std::string& m_service;
+    addrinfo m_hints;
+    CAddrinfoCache::Result m_result;
+};
+} // anonymous namespace
+
+CTask<SOCKET> async_accept(CExecutor& a_exec, SOCKET a_listen_sfd) {
+    for (;;) {
+        SOCKET sfd = accept_nonblocking(a_listen_sfd);
+        if (sfd != INVALID_SOCKET)
+            co_return sfd;
+        if (SOCKET_ERRNO_P != EWOULDBLOCK_P) {
+#ifndef _MSC_VER
+            // The peer may have aborted the connection meanwhile.
+            if (errno == ECONNABORTED || errno == EINTR)
+                continue;
+#endif
+            throw_error("ERROR! MSG1043: Failed to accept an incomming "
+                        "request:");
+        }
+        co_await a_exec.wait(a_listen_sfd, CPoller::READABLE);
+    }
+}
+
+CTask<void> async_connect(CExecutor& a_exec, SOCKET a_sfd,
+                          const sockaddr* a_addr, socklen_t a_addrlen) {
+    set_nonblocking(a_sfd);
+    if (::connect(a_sfd, a_addr, a_addrlen) == 0)
+        co_return;
+    if (SOCKET_ERRNO_P != EWOULDBLOCK_P && SOCKET_ERRNO_P != EINPROGRESS)
+        throw_error("ERROR! MSG1046: Failed to connect:");
+    co_await a_exec.wait(a_sfd, CPoller::WRITABLE);
+    // The result of the connection attempt.
+    int so_error{0};
+    socklen_t optlen{sizeof(so_error)};
+    if (::getsockopt(a_sfd, SOL_SOCKET, SO_ERROR, (char*)&so_error,
+                     &optlen) != 0)
+        throw_error("ERROR! MSG1046: Failed to connect:");
+    if (so_error != 0) {
+#ifdef _MSC_VER
+        ::WSASetLastError(so_error);
+#else
+        errno = so_error;
+#endif
+        throw_error("ERROR! MSG1046: Failed to connect:");
+    }
+}
+
+CTask<size_t> async_read(CExecutor& a_exec, SOCKET a_sfd,
+                         std::span<std::byte> a_buf) {
+    const std::span<std::byte> bufs[]{a_buf};
+    co_return co_await async_read(a_exec, a_sfd, bufs);
+}
+
+CTask<size_t> async_read(CExecutor& a_exec, SOCKET a_sfd,
+                         std::span<const std::span<std::byte>> a_bufs) {
+    for (;;) {
+        ssize_t valread = recv_vectored(a_sfd, a_bufs);
+        if (valread != SOCKET_ERROR)
+            co_return static_cast<size_t>(valread);
+        if (SOCKET_ERRNO_P != EWOULDBLOCK_P)
+            throw_error("ERROR! MSG1044: Failed to read from socket:");
+        co_await a_exec.wait(a_sfd, CPoller::READABLE);
+    }
+}
+
+CTask<void> async_write(CExecutor& a_exec, SOCKET a_sfd,
+                        std::span<const std::byte> a_buf) {
+    while (!a_buf.empty()) {
+        const std::span<const std::byte> bufs[]{a_buf};
+        ssize_t valsend = send_vectored(a_sfd, bufs);
+        if (valsend != SOCKET_ERROR) {
+            a_buf = a_buf.subspan(static_cast<size_t>(valsend));
+            continue;
+        }
+        if (SOCKET_ERRNO_P != EWOULDBLOCK_P)
+            throw_error("ERROR! MSG1045: Failed to write to socket:");
+        co_await a_exec.wait(a_sfd, CPoller::WRITABLE);
+    }
+}
+
+CTask<CAddrinfo> async_resolve(CExecutor& a_exec, std::string a_node,
+                               std::string a_service, int a_family,
+                               int a_socktype, int a_flags) {
+    const addrinfo hints{a_flags, a_family, a_socktype, 0,
+                         {},      nullptr,  nullptr,    nullptr};
+    co_return CAddrinfo(
+        co_await CResolveWait(a_exec, a_node, a_service, hints));
+}
+
+} // namespace upnplib
@@ -0,0 +1,241 @@
+#ifndef UPNPLIB_EXECUTOR_HPP
+#define UPNPLIB_EXECUTOR_HPP
+// Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+#include "port_sock.hpp"
+#include "addrinfo.hpp"
+#include "poller.hpp"
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace upnplib {
+
+class CExecutor;
+
+// Result of a coroutine task
+// --------------------------
+template <typename T> struct TaskResult {
+    std::optional<T> value;
+    void return_value(T a_value) { value = std::move(a_value); }
+    T get() { return std::move(*value); }
+};
+template <> struct TaskResult<void> {
+    void return_void() {}
+    void get() {}
+};
+
+// Promise of a coroutine task without its result.
+struct TaskPromiseBase {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+    CExecutor* executor{nullptr}; // Set if spawned.
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+
+    // Resume the awaiting coroutine, resp. tell the executor that a spawned
+    // task has finished.
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename P>
+        std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<P> a_handle) noexcept;
+        void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+};
+
+// Coroutine task
+// --------------
+// A coroutine that returns CTask<T> is started lazily when it is awaited with
+// co_await, or when it is spawned on an executor. Awaiting it suspends the
+// awaiting coroutine until the task has finished, then gives its result resp.
+// rethrows its exception. A task can only be awaited once. It is move only
+// and destroys the coroutine if it was never started.
+template <typename T = void> class [[nodiscard]] CTask {
+  public:
+    struct promise_type : TaskPromiseBase, TaskResult<T> {
+        CTask get_return_object() {
+            return CTask(
+                std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+    };
+
+    CTask(CTask&& that) noexcept
+        : m_handle(std::exchange(that.m_handle, nullptr)) {}
+    CTask& operator=(CTask&& that) noexcept {
+        if (this != &that) {
+            if (m_handle)
+                m_handle.destroy();
+            m_handle = std::exchange(that.m_handle, nullptr);
+        }
+        return *this;
+    }
+    CTask(const CTask&) = delete;
+    CTask& operator=(const CTask&) = delete;
+    virtual ~CTask() {
+        if (m_handle)
+            m_handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<> a_awaiting) noexcept {
+        m_handle.promise().continuation = a_awaiting;
+        return m_handle;
+    }
+    T await_resume() {
+        promise_type& promise = m_handle.promise();
+        if (promise.error)
+            std::rethrow_exception(promise.error);
+        return promise.get();
+    }
+
+  private:
+    friend class CExecutor;
+    explicit CTask(std::coroutine_handle<promise_type> a_handle)
+        : m_handle(a_handle) {}
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+// Event loop that drives coroutines
+// ---------------------------------
+// Tasks are spawned on the executor and run on the thread that calls run().
+// A coroutine that waits for a socket is suspended and only costs its
+// coroutine frame, there is no thread or stack per connection. Readiness of
+// the sockets is watched with one CPoller. Like the poller, an executor is
+// not thread safe except post() and stop().
+class CExecutor {
+  public:
+    // Wait until a socket becomes ready, use with co_await.
+    class CIoWait {
+      public:
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> a_handle);
+        void await_resume() const noexcept {}
+
+      private:
+        friend class CExecutor;
+        CIoWait(CExecutor& a_exec, SOCKET a_sfd, uint32_t a_events);
+        CExecutor& m_exec;
+        SOCKET m_sfd;
+        uint32_t m_events;
+    };
+
+    CExecutor();
+    CExecutor(const CExecutor&) = delete;
+    CExecutor& operator=(const CExecutor&) = delete;
+    virtual ~CExecutor();
+
+    // Start a task, it is owned by the executor until it has finished. An
+    // exception thrown by the task is caught and counted as failed. Tasks
+    // that have not finished are destroyed with the executor.
+    void spawn(CTask<void> a_task);
+    // Run spawned tasks until all have finished or stop() is called.
+    void run();
+    // Let run() return. This method is thread safe.
+    void stop();
+    // Resume a suspended coroutine of a spawned task on the thread that
+    // calls run(). This method is thread safe, e.g. to complete an operation
+    // on another thread.
+    void post(std::coroutine_handle<> a_handle);
+
+    // Wait until the socket is readable resp. writable. Only one coroutine
+    // may wait for each direction of a socket. A hang up or an error wakes
+    // up both.
+    CIoWait wait(SOCKET a_sfd, uint32_t a_events);
+
+    // Getter for the number of tasks that have not finished, and of them
+    // that have thrown an exception.
+    size_t get_running() const;
+    size_t get_failed() const;
+
+  private:
+    friend struct TaskPromiseBase::FinalAwaiter;
+    struct Waiters {
+        std::coroutine_handle<> reader;
+        std::coroutine_handle<> writer;
+        uint32_t events{0}; // Registered on the poller.
+    };
+
+    CPoller m_poller;
+    std::deque<std::coroutine_handle<>> m_ready;
+    std::unordered_map<SOCKET, Waiters> m_waiters;
+    // Addresses of the spawned tasks that have not finished.
+    std::unordered_set<void*> m_spawned;
+    size_t m_failed{0};
+    std::atomic<bool> m_stop{false};
+    // Coroutines posted by other threads.
+    std::mutex m_posted_mutex;
+    std::vector<std::coroutine_handle<>> m_posted; // Protected by mutex.
+
+    // Register the events that are waited for on the poller.
+    void update(SOCKET a_sfd, Waiters& a_waiters);
+    // Called when a spawned task has finished.
+    void finished(void* a_address, std::exception_ptr a_error);
+};
+
+template <typename P>
+std::coroutine_handle<> TaskPromiseBase::FinalAwaiter::await_suspend(
+    std::coroutine_handle<P> a_handle) noexcept {
+    TaskPromiseBase& promise = a_handle.promise();
+    if (promise.continuation)
+        return promise.continuation;
+    if (promise.executor != nullptr) {
+        // A spawned task has no owner but the executor.
+        CExecutor* executor = promise.executor;
+        std::exception_ptr error = promise.error;
+        void* address = a_handle.address();
+        a_handle.destroy();
+        executor->finished(address, error);
+    }
+    return std::noop_coroutine();
+}
+
+// Asynchronous socket operations
+// ------------------------------
+// They complete without blocking if possible, otherwise they suspend the
+// awaiting coroutine until the socket is ready. The sockets must be in
+// non-blocking mode (see set_nonblocking()) except for async_connect(), it
+// sets the mode. Errors are thrown as exceptions.
+//
+// Accept a connection, the new socket is in non-blocking mode.
+CTask<SOCKET> async_accept(CExecutor& a_exec, SOCKET a_listen_sfd);
+// Connect the socket.
+CTask<void> async_connect(CExecutor& a_exec, SOCKET a_sfd,
+                          const sockaddr* a_addr, socklen_t a_addrlen);
+// Read available bytes, at least one. Returns 0 at end of file. The
+// vectored variant reads into several buffers, e.g. those given by
+// CConnection::receive_buffers().
+CTask<size_t> async_read(CExecutor& a_exec, SOCKET a_sfd,
+                         std::span<std::byte> a_buf);
+CTask<size_t> async_read(CExecutor& a_exec, SOCKET a_sfd,
+                         std::span<const std::span<std::byte>> a_bufs);
+// Write all bytes.
+CTask<void> async_write(CExecutor& a_exec, SOCKET a_sfd,
+                        std::span<const std::byte> a_buf);
+// Resolve an address without blocking the executor. The lookup is done by
+// the process wide CAddrinfoCache on its resolver threads, a cached result
+// completes at once. The executor must not be destructed while a resolution
+// is pending.
+CTask<CAddrinfo> async_resolve(CExecutor& a_exec, std::string a_node,
+                               std::string a_service,
+                               int a_family = AF_UNSPEC, int a_socktype = 0,
+                               int a_flags = 0);
+
+} // namespace upnplib
+
+#endif // UPNPLIB_EXECUTOR_HPP
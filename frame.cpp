@@ -0,0 +1,155 @@
+// Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+#include "frame.hpp"
+#include "port.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace upnplib {
+
+static inline uint32_t read_frame_header(const std::byte* a_hdr) {
+    return (std::to_integer<uint32_t>(a_hdr[0]) << 24) |
+           (std::to_integer<uint32_t>(a_hdr[1]) << 16) |
+           (std::to_integer<uint32_t>(a_hdr[2]) << 8) |
+           std::to_integer<uint32_t>(a_hdr[3]);
+}
+
+void write_frame_header(std::byte* a_out, size_t a_len) {
+    if (a_len > UINT32_MAX)
+        throw std::runtime_error("ERROR! MSG1036: Invalid frame: \"payload "
+                                 "size exceeds 32 bit\"");
+    const uint32_t len = static_cast<uint32_t>(a_len);
+    a_out[0] = static_cast<std::byte>(len >> 24);
+    a_out[1] = static_cast<std::byte>(len >> 16);
+    a_out[2] = static_cast<std::byte>(len >> 8);
+    a_out[3] = static_cast<std::byte>(len);
+}
+
+void append_frame_header(std::string& a_out, size_t a_len) {
+    std::byte header[frame_header_size];
+    write_frame_header(header, a_len);
+    a_out.append(reinterpret_cast<const char*>(header), frame_header_size);
+}
+
+void append_frame(std::string& a_out, std::string_view a_payload) {
+    append_frame_header(a_out, a_payload.size());
+    a_out.append(a_payload);
+}
+
+CFrameDecoder::CFrameDecoder(uint32_t a_max_frame_size, CBufferPool& a_pool)
+    : m_pool(a_pool), m_max_frame_size(a_max_frame_size) {
+    TRACE2(this, " Construct upnplib::CFrameDecoder")
+}
+
+void CFrameDecoder::copy_out(size_t a_offset, size_t a_len,
+                             std::byte* a_out) const {
+    const size_t cap = m_ring.size();
+    const size_t start = (m_head + a_offset) % cap;
+    const size_t first = std::min(a_len, cap - start);
+    std::memcpy(a_out, m_ring.data() + start, first);
+    std::memcpy(a_out + first, m_ring.data(), a_len - first);
+}
+
+std::string_view CFrameDecoder::view(size_t a_offset, size_t a_len) {
+    if (a_len == 0)
+        return {};
+    const size_t start = (m_head + a_offset) % m_ring.size();
+    if (start + a_len <= m_ring.size())
+        return std::string_view(
+            reinterpret_cast<const char*>(m_ring.data()) + start, a_len);
+    if (m_linear.size() < a_len)
+        m_linear = m_pool.acquire(a_len);
+    this->copy_out(a_offset, a_len, m_linear.data());
+    return std::string_view(reinterpret_cast<const char*>(m_linear.data()),
+                            a_len);
+}
+
+void CFrameDecoder::reserve(size_t a_free) {
+    if (m_ring.size() - m_size >= a_free)
+        return;
+    CBuffer ring = m_pool.acquire(m_size + a_free);
+    if (m_size > 0)
+        this->copy_out(0, m_size, ring.data());
+    m_ring = std::move(ring);
+    m_head = 0;
+}
+
+void CFrameDecoder::append(const char* a_data, size_t a_len) {
+    size_t done{0};
+    for (std::span<std::byte> buf : this->prepare(a_len)) {
+        const size_t len = std::min(buf.size(), a_len - done);
+        std::memcpy(buf.data(), a_data + done, len);
+        done += len;
+    }
+    this->commit(a_len);
+}
+
+std::array<std::span<std::byte>, 2> CFrameDecoder::prepare(size_t a_min) {
+    if (m_size >= frame_header_size) {
+        std::byte hdr[frame_header_size];
+        this->copy_out(0, frame_header_size, hdr);
+        const uint32_t len = read_frame_header(hdr);
+        // An invalid frame is reported by next().
+        if (len <= m_max_frame_size && frame_header_size + len > m_size)
+            a_min = std::max(a_min, frame_header_size + len - m_size);
+    }
+    this->reserve(a_min);
+
+    const size_t cap = m_ring.size();
+    // Without a ring, e.g. after take_pending(), nothing is requested.
+    if (cap == 0)
+        return {std::span<std::byte>(), std::span<std::byte>()};
+    const size_t tail = (m_head + m_size) % cap;
+    if (m_size > 0 && tail <= m_head)
+        return {std::span<std::byte>(m_ring.data() + tail, m_head - tail),
+                std::span<std::byte>()};
+    return {std::span<std::byte>(m_ring.data() + tail, cap - tail),
+            std::span<std::byte>(m_ring.data(), m_head)};
+}
+
+void CFrameDecoder::commit(size_t a_len) { m_size += a_len; }
+
+bool CFrameDecoder::next(std::string_view& a_payload) {
+    if (m_size < frame_header_size)
+        return false;
+    std::byte hdr[frame_header_size];
+    this->copy_out(0, frame_header_size, hdr);
+    const uint32_t len = read_frame_header(hdr);
+    if (len > m_max_frame_size)
+        throw std::runtime_error(
+            "ERROR! MSG1036: Invalid frame: \"payload size " +
+            std::to_string(len) + " exceeds maximum " +
+            std::to_string(m_max_frame_size) + "\"");
+    if (m_size - frame_header_size < len)
+        return false;
+
+    a_payload = this->view(frame_header_size, len);
+    m_head = (m_head + frame_header_size + len) % m_ring.size();
+    m_size -= frame_header_size + len;
+    if (m_size == 0)
+        // Everything is returned, the next bytes start at the beginning.
+        m_head = 0;
+    return true;
+}
+
+size_t CFrameDecoder::buffered() const { return m_size; }
+
+std::string_view CFrameDecoder::pending() { return this->view(0, m_size); }
+
+std::span<const std::byte> CFrameDecoder::take_pending(CBuffer& a_owner) {
+    const std::string_view bytes = this->view(0, m_size);
+    // Only bytes that wrap around the end of the ring were copied.
+    if (!bytes.empty() &&
+        bytes.data() == reinterpret_cast<const char*>(m_linear.data()))
+        a_owner = std::move(m_linear);
+    else
+        a_owner = std::move(m_ring);
+    m_head = 0;
+    m_size = 0;
+    return std::as_bytes(std::span(bytes));
+}
+
+} // namespace upnplib
@@ -0,0 +1,92 @@
+#ifndef UPNPLIB_FRAME_HPP
+#define UPNPLIB_FRAME_HPP
+// Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+#include "buffer-pool.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+
+namespace upnplib {
+
+// Length-prefixed framing
+// -----------------------
+// A frame is the length of its payload as 32 bit unsigned integer in network
+// byte order, followed by the payload. So messages of any size (up to a
+// configurable maximum) can be exchanged over one persistent connection.
+constexpr size_t frame_header_size{4};
+constexpr uint32_t default_max_frame_size{16 * 1024 * 1024};
+
+// Append a frame with the given payload to a_out.
+void append_frame(std::string& a_out, std::string_view a_payload);
+// Append only the header of a frame with a payload of a_len bytes to a_out,
+// e.g. if the payload is sent from its own buffer.
+void append_frame_header(std::string& a_out, size_t a_len);
+// Write the header of a frame with a payload of a_len bytes to the
+// frame_header_size bytes at a_out.
+void write_frame_header(std::byte* a_out, size_t a_len);
+
+// Reassemble frames from a byte stream
+// ------------------------------------
+// Received bytes can be appended in pieces of any size, e.g. as got from
+// partial reads. Complete frames are then returned one after the other. The
+// bytes are kept in a ring buffer from the pool, so returned frames never
+// have to be moved to the front. The ring is only exchanged for a larger one
+// if a frame does not fit.
+class CFrameDecoder {
+  public:
+    CFrameDecoder(uint32_t a_max_frame_size = default_max_frame_size,
+                  CBufferPool& a_pool = CBufferPool::global());
+
+    // Append received bytes.
+    void append(const char* a_data, size_t a_len);
+
+    // Alternative to append() without copying: get the free space of the
+    // ring, at least a_min bytes, to receive into directly, e.g. with
+    // recv_vectored(). It consists of up to two buffers, the second one may
+    // be empty. Confirm the received bytes with commit(). If an incomplete
+    // frame is buffered the free space is large enough for the rest of it.
+    std::array<std::span<std::byte>, 2> prepare(size_t a_min);
+    void commit(size_t a_len);
+
+    // Get the payload of the next complete frame. Returns false if there is
+    // no complete frame. The view is valid until the next call of any other
+    // method. Throws an exception if the announced payload exceeds the
+    // maximal frame size. A frame that wraps around the end of the ring is
+    // copied to a linear buffer, all others are returned in place.
+    bool next(std::string_view& a_payload);
+
+    // Number of bytes buffered that are not returned as frame so far.
+    size_t buffered() const;
+    // The bytes buffered that are not returned as frame so far, e.g. an
+    // unframed message. The view is valid until the next call of any other
+    // method.
+    std::string_view pending();
+    // Take the bytes of pending() together with the buffer that holds them,
+    // e.g. to hand an unframed message to another thread without copying
+    // it. The decoder is empty afterwards.
+    std::span<const std::byte> take_pending(CBuffer& a_owner);
+
+  private:
+    CBufferPool& m_pool;
+    CBuffer m_ring;
+    size_t m_head{0}; // Start of the first not returned frame.
+    size_t m_size{0}; // Bytes buffered from m_head on, may wrap around.
+    CBuffer m_linear; // Copy of a frame that wraps around.
+    uint32_t m_max_frame_size;
+
+    // Make room for a_free bytes after the buffered bytes.
+    void reserve(size_t a_free);
+    // Copy a_len bytes starting a_offset bytes after m_head to a_out.
+    void copy_out(size_t a_offset, size_t a_len, std::byte* a_out) const;
+    // Get a_len bytes starting a_offset bytes after m_head as linear view.
+    std::string_view view(size_t a_offset, size_t a_len);
+};
+
+} // namespace upnplib
+
+#endif // UPNPLIB_FRAME_HPP
@@ -0,0 +1,13 @@
+// Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+#include "message-handler.hpp"
+
+namespace upnplib {
+
+void CEchoHandler::on_message(std::span<const std::byte> a_msg,
+                              CConnection& a_conn) {
+    a_conn.send(a_msg);
+}
+
+} // namespace upnplib
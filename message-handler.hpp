@@ -0,0 +1,41 @@
+#ifndef UPNPLIB_MESSAGE_HANDLER_HPP
+#define UPNPLIB_MESSAGE_HANDLER_HPP
+// Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+#include "connection.hpp"
+#include <cstddef>
+#include <span>
+
+namespace upnplib {
+
+// Interface of a message handler
+// ------------------------------
+// The server calls the handler for each complete message it has received,
+// except for the quit message "Q". The message is a view into the receive
+// buffer of the connection. It is only valid during the call and must be
+// copied if it is needed later. Replies are queued with the send methods of
+// the connection. If the handler throws an exception the connection is
+// closed.
+// The handler may be called from several threads at the same time, e.g. with
+// a sharded server or a worker pool, so it must be thread safe. On a worker
+// of the pool the connection is an object of the worker that only collects
+// the replies, the event loop sends them afterwards.
+class CMessageHandler {
+  public:
+    virtual ~CMessageHandler() = default;
+    virtual void on_message(std::span<const std::byte> a_msg,
+                            CConnection& a_conn) = 0;
+};
+
+// Send every message back to the peer. This is used by the server on
+// persistent connections if no handler is configured.
+class CEchoHandler : public CMessageHandler {
+  public:
+    void on_message(std::span<const std::byte> a_msg,
+                    CConnection& a_conn) override;
+};
+
+} // namespace upnplib
+
+#endif // UPNPLIB_MESSAGE_HANDLER_HPP
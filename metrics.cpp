@@ -0,0 +1,482 @@
+// Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+#include "metrics.hpp"
+#include "port.hpp"
+#include "addrinfo.hpp"
+#include "poller.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+#include <unordered_map>
+
+namespace upnplib {
+
+// Log-linear histogram
+// ====================
+size_t CHistogram::bucket(uint64_t a_value) {
+    constexpr uint64_t sub_buckets{1u << sub_bucket_bits};
+    if (a_value < sub_buckets)
+        return static_cast<size_t>(a_value);
+    const unsigned shift =
+        static_cast<unsigned>(std::bit_width(a_value)) - 1 - sub_bucket_bits;
+    if (shift > max_bits - 1 - sub_bucket_bits)
+        return buckets - 1;
+    return (static_cast<size_t>(shift) << sub_bucket_bits) +
+           static_cast<size_t>(a_value >> shift);
+}
+
+uint64_t CHistogram::highest_value(size_t a_bucket) {
+    if (a_bucket < (2u << sub_bucket_bits))
+        return a_bucket;
+    const unsigned shift =
+        static_cast<unsigned>(a_bucket >> sub_bucket_bits) - 1;
+    const uint64_t lowest = (a_bucket - (static_cast<size_t>(shift)
+                                         << sub_bucket_bits))
+                            << shift;
+    return lowest + (uint64_t{1} << shift) - 1;
+}
+
+CHistogram::CHistogram() : m_counts(buckets) {}
+
+void CHistogram::record(uint64_t a_value) {
+    m_counts[bucket(a_value)]++;
+    m_count++;
+    m_sum += a_value;
+}
+
+void CHistogram::merge(const CHistogram& a_other) {
+    for (size_t i{0}; i < buckets; i++)
+        m_counts[i] += a_other.m_counts[i];
+    m_count += a_other.m_count;
+    m_sum += a_other.m_sum;
+}
+
+uint64_t CHistogram::count() const { return m_count; }
+
+uint64_t CHistogram::sum() const { return m_sum; }
+
+uint64_t CHistogram::percentile(double a_percent) const {
+    if (m_count == 0)
+        return 0;
+    const uint64_t rank = std::clamp<uint64_t>(
+        static_cast<uint64_t>(
+            std::ceil(a_percent / 100.0 * static_cast<double>(m_count))),
+        1, m_count);
+    uint64_t seen{0};
+    for (size_t i{0}; i < buckets; i++) {
+        seen += m_counts[i];
+        if (seen >= rank)
+            return highest_value(i);
+    }
+    return highest_value(buckets - 1);
+}
+
+uint64_t CHistogram::max() const {
+    for (size_t i{buckets}; i > 0; i--)
+        if (m_counts[i - 1] > 0)
+            return highest_value(i - 1);
+    return 0;
+}
+
+
+// Process wide metrics
+// ====================
+namespace {
+// Size of a cache line on the common platforms. The standard
+// std::hardware_destructive_interference_size isn't used because its value
+// may differ between compilers.
+constexpr size_t cache_line_size{64};
+
+struct alignas(cache_line_size) Slot {
+    std::array<std::atomic<uint64_t>, CMetrics::counters> counters{};
+    std::array<std::atomic<int64_t>, CMetrics::gauges> gauges{};
+    std::array<std::array<std::atomic<uint64_t>, CHistogram::buckets>,
+               CMetrics::phases>
+        latencies{};
+    std::array<std::atomic<uint64_t>, CMetrics::phases> latency_sums{};
+};
+
+// All slots that were ever used. Slots are never destructed before the end
+// of the program, so threads can record until they finish.
+struct Registry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Slot>> slots; // Protected by mutex.
+    std::vector<Slot*> free;                  // Protected by mutex.
+    std::array<std::atomic<uint64_t>, CMetrics::msg_ids> errors{};
+    // Latencies up to the last reset.
+    std::array<CHistogram, CMetrics::phases> baselines; // Protected by mutex.
+
+    Slot* acquire() {
+        std::scoped_lock lock(mutex);
+        if (!free.empty()) {
+            Slot* slot = free.back();
+            free.pop_back();
+            return slot;
+        }
+        slots.push_back(std::make_unique<Slot>());
+        return slots.back().get();
+    }
+};
+
+Registry& registry() {
+    static Registry registry;
+    return registry;
+}
+
+// Gives the slot back to the registry when the thread finishes. Thread local
+// objects are destructed before the static registry.
+struct ThreadSlot {
+    Slot* slot{nullptr};
+
+    ~ThreadSlot() {
+        if (slot == nullptr)
+            return;
+        Registry& reg = registry();
+        std::scoped_lock lock(reg.mutex);
+        reg.free.push_back(slot);
+    }
+};
+
+thread_local ThreadSlot tl_slot;
+
+inline Slot& thread_slot() {
+    if (tl_slot.slot == nullptr) [[unlikely]]
+        tl_slot.slot = registry().acquire();
+    return *tl_slot.slot;
+}
+
+// Only the owning thread writes a slot, so a plain load and store is enough.
+// Atomics are still needed because a snapshot reads them concurrently.
+template <typename T> inline void add_to(std::atomic<T>& a_value, T a_add) {
+    a_value.store(a_value.load(std::memory_order_relaxed) + a_add,
+                  std::memory_order_relaxed);
+}
+
+// Names and help texts in the Prometheus exposition format.
+struct Description {
+    const char* name;
+    const char* help;
+};
+constexpr Description counter_descs[CMetrics::counters]{
+    {"upnplib_sockets_total", "Sockets created."},
+    {"upnplib_server_accepted_total", "Connections accepted by the server."},
+    {"upnplib_server_messages_total", "Messages handled by the server."},
+    {"upnplib_server_received_bytes_total", "Bytes received by the server."},
+    {"upnplib_server_sent_bytes_total", "Bytes sent by the server."},
+    {"upnplib_client_connects_total", "Connections opened by the client."},
+    {"upnplib_client_received_bytes_total", "Bytes received by the client."},
+    {"upnplib_client_sent_bytes_total", "Bytes sent by the client."}};
+constexpr Description gauge_descs[CMetrics::gauges]{
+    {"upnplib_sockets_open", "Sockets that are open."},
+    {"upnplib_server_connections", "Open connections of the server."}};
+constexpr Description phase_descs[CMetrics::phases]{
+    {"upnplib_server_accept_wait_seconds",
+     "Wait in the accept queue of the kernel, only waits of at least 1 ms."},
+    {"upnplib_server_first_byte_seconds",
+     "From accept to the first received bytes."},
+    {"upnplib_server_service_seconds",
+     "From a complete message until its handler has returned."},
+    {"upnplib_server_write_seconds",
+     "From queued replies until all of them are written."}};
+
+void append_seconds(std::string& a_out, uint64_t a_nanoseconds) {
+    char buf[32];
+    const std::to_chars_result res =
+        std::to_chars(buf, buf + sizeof(buf),
+                      static_cast<double>(a_nanoseconds) / 1e9);
+    a_out.append(buf, res.ptr);
+}
+
+void append_header(std::string& a_out, const Description& a_desc,
+                   const char* a_type) {
+    a_out.append("# HELP ").append(a_desc.name).append(" ");
+    a_out.append(a_desc.help).append("\n# TYPE ").append(a_desc.name);
+    a_out.append(" ").append(a_type).append("\n");
+}
+} // anonymous namespace
+
+uint64_t CMetrics::Snapshot::get(Counter a_counter) const {
+    return counter_values[static_cast<size_t>(a_counter)];
+}
+
+int64_t CMetrics::Snapshot::get(Gauge a_gauge) const {
+    return gauge_values[static_cast<size_t>(a_gauge)];
+}
+
+uint64_t CMetrics::Snapshot::get_errors(unsigned a_msg_id) const {
+    for (const auto& [msg_id, count] : errors)
+        if (msg_id == a_msg_id)
+            return count;
+    return 0;
+}
+
+void CMetrics::add(Counter a_counter, uint64_t a_value) {
+    add_to(thread_slot().counters[static_cast<size_t>(a_counter)], a_value);
+}
+
+void CMetrics::add(Gauge a_gauge, int64_t a_value) {
+    add_to(thread_slot().gauges[static_cast<size_t>(a_gauge)], a_value);
+}
+
+void CMetrics::record(Phase a_phase, uint64_t a_nanoseconds) {
+    Slot& slot = thread_slot();
+    const size_t phase = static_cast<size_t>(a_phase);
+    add_to(slot.latencies[phase][CHistogram::bucket(a_nanoseconds)],
+           uint64_t{1});
+    add_to(slot.latency_sums[phase], a_nanoseconds);
+}
+
+void CMetrics::count_error(std::string_view a_errmsg) {
+    const size_t pos = a_errmsg.find("MSG");
+    if (pos == std::string_view::npos || a_errmsg.size() < pos + 7)
+        return;
+    unsigned msg_id{0};
+    for (char c : a_errmsg.substr(pos + 3, 4)) {
+        if (c < '0' || c > '9')
+            return;
+        msg_id = msg_id * 10 + static_cast<unsigned>(c - '0');
+    }
+    if (msg_id < first_msg_id || msg_id >= first_msg_id + msg_ids)
+        return;
+    registry().errors[msg_id - first_msg_id].fetch_add(
+        1, std::memory_order_relaxed);
+}
+
+CMetrics::Snapshot CMetrics::snapshot() {
+    Snapshot snap{};
+    Registry& reg = registry();
+    {
+        std::scoped_lock lock(reg.mutex);
+        for (const std::unique_ptr<Slot>& slot : reg.slots) {
+            for (size_t i{0}; i < counters; i++)
+                snap.counter_values[i] +=
+                    slot->counters[i].load(std::memory_order_relaxed);
+            for (size_t i{0}; i < gauges; i++)
+                snap.gauge_values[i] +=
+                    slot->gauges[i].load(std::memory_order_relaxed);
+        }
+    }
+    for (unsigned i{0}; i < msg_ids; i++) {
+        const uint64_t count = reg.errors[i].load(std::memory_order_relaxed);
+        if (count > 0)
+            snap.errors.emplace_back(first_msg_id + i, count);
+    }
+    return snap;
+}
+
+CHistogram CMetrics::latency(Phase a_phase, bool a_reset) {
+    const size_t phase = static_cast<size_t>(a_phase);
+    Registry& reg = registry();
+    std::scoped_lock lock(reg.mutex);
+    CHistogram hist = sum_latencies(phase);
+    CHistogram& baseline = reg.baselines[phase];
+    CHistogram since{hist};
+    for (size_t i{0}; i < CHistogram::buckets; i++)
+        since.m_counts[i] -= baseline.m_counts[i];
+    since.m_count -= baseline.m_count;
+    since.m_sum -= baseline.m_sum;
+    if (a_reset)
+        baseline = std::move(hist);
+    return since;
+}
+
+CHistogram CMetrics::sum_latencies(size_t a_phase) {
+    CHistogram hist;
+    for (const std::unique_ptr<Slot>& slot : registry().slots) {
+        for (size_t i{0}; i < CHistogram::buckets; i++) {
+            const uint64_t count =
+                slot->latencies[a_phase][i].load(std::memory_order_relaxed);
+            hist.m_counts[i] += count;
+            hist.m_count += count;
+        }
+        hist.m_sum +=
+            slot->latency_sums[a_phase].load(std::memory_order_relaxed);
+    }
+    return hist;
+}
+
+uint64_t CMetrics::clock_ns() {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+}
+
+std::string CMetrics::prometheus() {
+    const Snapshot snap = snapshot();
+    std::string out;
+    for (size_t i{0}; i < counters; i++) {
+        append_header(out, counter_descs[i], "counter");
+        out.append(counter_descs[i].name).append(" ");
+        out.append(std::to_string(snap.counter_values[i])).append("\n");
+    }
+    for (size_t i{0}; i < gauges; i++) {
+        append_header(out, gauge_descs[i], "gauge");
+        out.append(gauge_descs[i].name).append(" ");
+        out.append(std::to_string(snap.gauge_values[i])).append("\n");
+    }
+    for (size_t i{0}; i < phases; i++) {
+        CHistogram hist;
+        {
+            Registry& reg = registry();
+            std::scoped_lock lock(reg.mutex);
+            hist = sum_latencies(i);
+        }
+        const char* name = phase_descs[i].name;
+        append_header(out, phase_descs[i], "summary");
+        for (const auto& [quantile, percent] :
+             {std::pair{"0.5", 50.0}, {"0.99", 99.0}, {"0.999", 99.9}}) {
+            out.append(name).append("{quantile=\"").append(quantile);
+            out.append("\"} ");
+            append_seconds(out, hist.percentile(percent));
+            out.append("\n");
+        }
+        out.append(name).append("_sum ");
+        append_seconds(out, hist.sum());
+        out.append("\n").append(name).append("_count ");
+        out.append(std::to_string(hist.count())).append("\n");
+    }
+    append_header(out, {"upnplib_errors_total", "Errors by message id."},
+                  "counter");
+    for (const auto& [msg_id, count] : snap.errors) {
+        out.append("upnplib_errors_total{msg=\"MSG");
+        out.append(std::to_string(msg_id)).append("\"} ");
+        out.append(std::to_string(count)).append("\n");
+    }
+    return out;
+}
+
+
+// Prometheus endpoint
+// ===================
+CMetricsEndpoint::CMetricsEndpoint(const std::string& a_port)
+    : m_listen_sfd(AF_INET6, SOCK_STREAM),
+      m_poller(std::make_unique<CPoller>()) {
+    TRACE2(this, " Construct upnplib::CMetricsEndpoint")
+    // Like CServerTCP the socket serves both IPv6 and IPv4.
+    CAddrinfo ai("", a_port, AF_INET6, SOCK_STREAM,
+                 AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV);
+    m_listen_sfd.bind(ai);
+    m_listen_sfd.listen();
+    set_nonblocking(m_listen_sfd);
+    m_poller->add(m_listen_sfd, CPoller::READABLE);
+    m_thread = std::thread(&CMetricsEndpoint::run, this);
+}
+
+CMetricsEndpoint::~CMetricsEndpoint() {
+    TRACE2(this, " Destruct upnplib::CMetricsEndpoint")
+    m_quit = true;
+    m_poller->wakeup();
+    m_thread.join();
+}
+
+uint16_t CMetricsEndpoint::get_port() const {
+    return m_listen_sfd.get_port();
+}
+
+void CMetricsEndpoint::run() {
+    TRACE2(this, " Executing upnplib::CMetricsEndpoint::run()")
+    // Received bytes of a request until it is complete, then its reply and
+    // how much of it is sent. The sockets stay non-blocking, so a scraper
+    // that doesn't read its reply cannot stall the endpoint.
+    struct Request {
+        std::string received;
+        std::string reply;
+        size_t sent{0};
+    };
+    std::unordered_map<SOCKET, Request> requests;
+    auto close_request = [this, &requests](SOCKET a_sfd) {
+        m_poller->remove(a_sfd);
+        requests.erase(a_sfd);
+        ::shutdown(a_sfd, SHUT_RDWR);
+        CLOSE_SOCKET_P(a_sfd);
+    };
+    // Send as much of the reply as the socket buffer takes. Returns false
+    // if the connection is finished, either sent completely or failed.
+    auto send_reply = [](SOCKET a_sfd, Request& a_request) {
+        while (a_request.sent < a_request.reply.size()) {
+            ssize_t valsend =
+                ::send(a_sfd, a_request.reply.data() + a_request.sent,
+                       a_request.reply.size() - a_request.sent, MSG_NOSIGNAL);
+            if (valsend == SOCKET_ERROR && SOCKET_ERRNO_P == EWOULDBLOCK_P)
+                return true;
+            if (valsend <= 0)
+                return false;
+            a_request.sent += static_cast<size_t>(valsend);
+        }
+        return false;
+    };
+
+    while (!m_quit) {
+        for (const CPoller::Event& ev : m_poller->wait(-1)) {
+            if (ev.sfd == m_listen_sfd) {
+                SOCKET sfd = accept_nonblocking(m_listen_sfd);
+                if (sfd == INVALID_SOCKET)
+                    continue;
+                requests.try_emplace(sfd);
+                m_poller->add(sfd, CPoller::READABLE);
+                continue;
+            }
+            auto it = requests.find(ev.sfd);
+            if (it == requests.end())
+                continue;
+            Request& request = it->second;
+            if (!request.reply.empty()) {
+                // The rest of the reply, the socket buffer has room again.
+                if (!send_reply(ev.sfd, request))
+                    close_request(ev.sfd);
+                continue;
+            }
+            char buffer[1024];
+            ssize_t valread = ::recv(ev.sfd, buffer, sizeof(buffer), 0);
+            if (valread == SOCKET_ERROR && SOCKET_ERRNO_P == EWOULDBLOCK_P)
+                continue;
+            if (valread <= 0) {
+                close_request(ev.sfd);
+                continue;
+            }
+            request.received.append(buffer, static_cast<size_t>(valread));
+            if (request.received.size() > max_request) {
+                close_request(ev.sfd);
+                continue;
+            }
+            if (request.received.find("\r\n\r\n") == std::string::npos)
+                continue;
+
+            std::string body;
+            std::string& reply = request.reply;
+            if (request.received.starts_with("GET /metrics ") ||
+                request.received.starts_with("GET /metrics?")) {
+                body = CMetrics::prometheus();
+                reply = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; "
+                        "version=0.0.4; charset=utf-8\r\n";
+            } else {
+                body = "Not Found\n";
+                reply = "HTTP/1.1 404 Not Found\r\nContent-Type: "
+                        "text/plain\r\n";
+            }
+            reply.append("Content-Length: ").append(std::to_string(
+                body.size()));
+            reply.append("\r\nConnection: close\r\n\r\n").append(body);
+            // Usually the reply fits into the empty socket buffer and is sent
+            // at once. Otherwise the rest is sent when the socket is
+            // writable, further requests are not read.
+            if (send_reply(ev.sfd, request))
+                m_poller->modify(ev.sfd, CPoller::WRITABLE);
+            else
+                close_request(ev.sfd);
+        }
+    }
+
+    for (auto& request : requests) {
+        SOCKET sfd{request.first};
+        CLOSE_SOCKET_P(sfd);
+    }
+}
+
+} // namespace upnplib
@@ -0,0 +1,185 @@
+#ifndef UPNPLIB_METRICS_HPP
+#define UPNPLIB_METRICS_HPP
+// Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+#include "socket.hpp"
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace upnplib {
+
+class CPoller;
+
+// Counters only increase. Payload bytes are the bytes of the messages
+// including frame headers.
+enum class Counter : unsigned {
+    sockets,               // Sockets created by CSocket.
+    server_accepted,       // Connections accepted by the server.
+    server_messages,       // Messages given to the message handler.
+    server_bytes_received, // Bytes received by the server.
+    server_bytes_sent,     // Bytes sent by the server.
+    client_connects,       // Connections opened by the client.
+    client_bytes_received, // Bytes received by the client.
+    client_bytes_sent,     // Bytes sent by the client.
+    count_                 // Number of counters.
+};
+
+// Gauges go up and down.
+enum class Gauge : unsigned {
+    sockets_open,       // Sockets of CSocket objects that are not closed.
+    server_connections, // Accepted connections that are not closed.
+    count_              // Number of gauges.
+};
+
+// Latency phases of the connections of the server. The kernel reports the
+// wait in the accept queue with a granularity of 1 ms, so only waits of at
+// least 1 ms are recorded.
+enum class Phase : unsigned {
+    accept_wait, // Waiting in the accept queue of the kernel (Linux only).
+    first_byte,  // From accept to the first received bytes.
+    service,     // From a complete message until its handler has returned.
+    write,       // From queued replies until all of them are written.
+    count_       // Number of phases.
+};
+
+// Log-linear histogram
+// --------------------
+// Values, e.g. nanoseconds, are counted in buckets like with an HDR
+// histogram: every power of 2 is split into 2^sub_bucket_bits linear
+// buckets, so a value is known with a relative error of at most 1/32. Values
+// below 32 are exact, values from 2^max_bits on are counted in the last
+// bucket. Histograms of the same layout can be merged by adding the bucket
+// counts.
+class CHistogram {
+  public:
+    static constexpr unsigned sub_bucket_bits{5};
+    static constexpr unsigned max_bits{36}; // About 68 s in nanoseconds.
+    static constexpr size_t buckets{(max_bits - sub_bucket_bits + 1)
+                                    << sub_bucket_bits};
+
+    // Index of the bucket of a_value.
+    static size_t bucket(uint64_t a_value);
+    // Highest value that is counted in a_bucket.
+    static uint64_t highest_value(size_t a_bucket);
+
+    CHistogram();
+
+    void record(uint64_t a_value);
+    void merge(const CHistogram& a_other);
+
+    // Number and sum of the recorded values.
+    uint64_t count() const;
+    uint64_t sum() const;
+    // Value that a_percent of the recorded values don't exceed, e.g. 99.9.
+    // It is the highest value of its bucket, 0 if there are no values.
+    uint64_t percentile(double a_percent) const;
+    uint64_t max() const;
+
+  private:
+    friend class CMetrics;
+    std::vector<uint64_t> m_counts;
+    uint64_t m_count{0};
+    uint64_t m_sum{0};
+};
+
+// Process wide metrics
+// --------------------
+// Every thread records into its own slot that is padded to a cache line, so
+// threads never write the same cache line. There are no locks and no atomic
+// read-modify-write on the hot path. A snapshot sums the slots of all
+// threads. The slot of a finished thread is kept and reused by the next new
+// thread, so no counts get lost. Errors are rare, they are counted by their
+// message id in shared atomic counters. Latencies are recorded into one
+// histogram per phase on the slot.
+class CMetrics {
+  public:
+    static constexpr size_t counters{static_cast<size_t>(Counter::count_)};
+    static constexpr size_t gauges{static_cast<size_t>(Gauge::count_)};
+    static constexpr size_t phases{static_cast<size_t>(Phase::count_)};
+    // Message ids MSG1000 to MSG1255 are counted.
+    static constexpr unsigned first_msg_id{1000};
+    static constexpr unsigned msg_ids{256};
+
+    struct Snapshot {
+        std::array<uint64_t, counters> counter_values;
+        std::array<int64_t, gauges> gauge_values;
+        // Message id and count of errors that have occurred.
+        std::vector<std::pair<unsigned, uint64_t>> errors;
+
+        uint64_t get(Counter a_counter) const;
+        int64_t get(Gauge a_gauge) const;
+        uint64_t get_errors(unsigned a_msg_id) const;
+    };
+
+    // Record on the slot of the calling thread.
+    static void add(Counter a_counter, uint64_t a_value = 1);
+    static void add(Gauge a_gauge, int64_t a_value);
+    static void record(Phase a_phase, uint64_t a_nanoseconds);
+    // Count an error by the message id "MSGnnnn" within a_errmsg, e.g. the
+    // message of an exception. A message without id is ignored.
+    static void count_error(std::string_view a_errmsg);
+
+    // Sum the slots of all threads. This method is thread safe. Values of
+    // different threads are not read at the same instant, so they may not
+    // fit exactly together, e.g. a connection closed but not yet accepted.
+    static Snapshot snapshot();
+    // Merge the latency histograms of a phase of all threads. With a_reset
+    // the next call only gets the latencies recorded after this one. The
+    // slots are not modified for it, so it doesn't race with recording.
+    static CHistogram latency(Phase a_phase, bool a_reset = false);
+    // Monotonic clock for the latencies in nanoseconds.
+    static uint64_t clock_ns();
+    // Get a snapshot in the Prometheus text exposition format. Latencies are
+    // given as summaries in seconds with the quantiles 0.5, 0.99 and 0.999
+    // of all recorded values, independent of a reset.
+    static std::string prometheus();
+
+  private:
+    // Sum the latency histograms of a phase of all threads. The mutex of the
+    // slots must be locked.
+    static CHistogram sum_latencies(size_t a_phase);
+};
+
+// Prometheus endpoint
+// -------------------
+// Serves the metrics in the Prometheus text format on its own listening
+// socket and thread, e.g. to "curl http://[::1]:9100/metrics". It is made
+// for a scraper: a connection gets one reply to a request of "GET /metrics",
+// a 404 to any other request, and is then closed. Requests larger than
+// max_request bytes are closed without reply.
+class CMetricsEndpoint {
+  public:
+    static constexpr size_t max_request{8192};
+
+    // Listen on a_port ("0" = any free port) and start serving.
+    CMetricsEndpoint(const std::string& a_port);
+    CMetricsEndpoint(const CMetricsEndpoint&) = delete;
+    CMetricsEndpoint& operator=(const CMetricsEndpoint&) = delete;
+    // Stop serving and close all connections.
+    virtual ~CMetricsEndpoint();
+
+    // Getter for the port the endpoint is bound.
+    uint16_t get_port() const;
+
+  private:
+    WINSOCK_INIT_P
+    CSocket m_listen_sfd;
+    std::unique_ptr<CPoller> m_poller;
+    std::atomic<bool> m_quit{false};
+    std::thread m_thread;
+
+    void run();
+};
+
+} // namespace upnplib
+
+#endif // UPNPLIB_METRICS_HPP
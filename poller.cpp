@@ -0,0 +1,222 @@
+// Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+#include "poller.hpp"
+#include "port.hpp"
+
+#include <algorithm>
+#include <string>
+#include <cstring>
+#include <stdexcept>
+// clang-format off
+#ifdef __linux__
+  #include <sys/eventfd.h>
+#elif !defined(_MSC_VER)
+  #include <fcntl.h>
+#endif
+// clang-format on
+
+namespace upnplib {
+
+static inline void throw_error(std::string errmsg) {
+    // error number given by WSAGetLastError(), resp. contained in errno is
+    // used to specify details of the error.
+#ifdef _MSC_VER
+    throw std::runtime_error(
+        errmsg + " WSAGetLastError()=" + std::to_string(WSAGetLastError()));
+#else
+    throw std::runtime_error(errmsg + " errno(" + std::to_string(errno) +
+                             ")=\"" + std::strerror(errno) + "\"");
+#endif
+}
+
+#ifdef __linux__
+// Wait for readiness with epoll
+// -----------------------------
+static inline uint32_t to_epoll(uint32_t a_events) {
+    return ((a_events & CPoller::READABLE) ? EPOLLIN : 0u) |
+           ((a_events & CPoller::WRITABLE) ? EPOLLOUT : 0u);
+}
+
+CPoller::CPoller() : m_epevents(256) {
+    TRACE2(this, " Construct upnplib::CPoller")
+    m_epfd = ::epoll_create1(EPOLL_CLOEXEC);
+    if (m_epfd < 0)
+        throw_error("ERROR! MSG1026: Failed to create epoll instance:");
+
+    m_wakefd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = m_wakefd;
+    if (m_wakefd < 0 ||
+        ::epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_wakefd, &ev) != 0) {
+        int err{errno};
+        if (m_wakefd >= 0)
+            ::close(m_wakefd);
+        ::close(m_epfd);
+        errno = err;
+        throw_error("ERROR! MSG1026: Failed to create epoll instance:");
+    }
+}
+
+CPoller::~CPoller() {
+    TRACE2(this, " Destruct upnplib::CPoller")
+    ::close(m_wakefd);
+    ::close(m_epfd);
+}
+
+void CPoller::wakeup() {
+    const uint64_t one{1};
+    // If the counter is already set, the poller is woken up anyway.
+    [[maybe_unused]] ssize_t ret = ::write(m_wakefd, &one, sizeof(one));
+}
+
+void CPoller::add(SOCKET a_sfd, uint32_t a_events) {
+    epoll_event ev{};
+    ev.events = to_epoll(a_events);
+    ev.data.fd = a_sfd;
+    if (::epoll_ctl(m_epfd, EPOLL_CTL_ADD, a_sfd, &ev) != 0)
+        throw_error("ERROR! MSG1027: Failed to add socket to poller:");
+}
+
+void CPoller::modify(SOCKET a_sfd, uint32_t a_events) {
+    epoll_event ev{};
+    ev.events = to_epoll(a_events);
+    ev.data.fd = a_sfd;
+    if (::epoll_ctl(m_epfd, EPOLL_CTL_MOD, a_sfd, &ev) != 0)
+        throw_error("ERROR! MSG1028: Failed to modify socket on poller:");
+}
+
+void CPoller::remove(SOCKET a_sfd) {
+    // Errors are ignored. The socket may already be closed, that removes it
+    // from the interest list anyway.
+    ::epoll_ctl(m_epfd, EPOLL_CTL_DEL, a_sfd, nullptr);
+}
+
+const std::vector<CPoller::Event>& CPoller::wait(int a_timeout_ms) {
+    m_events.clear();
+    int n = ::epoll_wait(m_epfd, m_epevents.data(),
+                         static_cast<int>(m_epevents.size()), a_timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR)
+            return m_events;
+        throw_error("ERROR! MSG1029: Failed to wait for socket events:");
+    }
+    for (int i{0}; i < n; i++) {
+        if (m_epevents[i].data.fd == m_wakefd) {
+            uint64_t count;
+            [[maybe_unused]] ssize_t ret =
+                ::read(m_wakefd, &count, sizeof(count));
+            continue;
+        }
+        const uint32_t ev = m_epevents[i].events;
+        m_events.push_back(
+            {m_epevents[i].data.fd,
+             ((ev & EPOLLIN) ? READABLE : 0u) |
+                 ((ev & EPOLLOUT) ? WRITABLE : 0u) |
+                 ((ev & (EPOLLHUP | EPOLLERR)) ? HANGUP : 0u)});
+    }
+    return m_events;
+}
+
+#else
+// Wait for readiness with poll() on other platforms
+// -------------------------------------------------
+static inline short to_poll(uint32_t a_events) {
+    return static_cast<short>(((a_events & CPoller::READABLE) ? POLLIN : 0) |
+                              ((a_events & CPoller::WRITABLE) ? POLLOUT : 0));
+}
+
+#ifdef _MSC_VER
+CPoller::CPoller() { TRACE2(this, " Construct upnplib::CPoller") }
+
+CPoller::~CPoller() { TRACE2(this, " Destruct upnplib::CPoller") }
+
+void CPoller::wakeup() {
+    // Nothing to do, wait() returns after max_wait_ms at the latest.
+}
+#else
+CPoller::CPoller() {
+    TRACE2(this, " Construct upnplib::CPoller")
+    // The read end of the self pipe is always the first watched descriptor.
+    if (::pipe(m_wakepipe) != 0)
+        throw_error("ERROR! MSG1026: Failed to create poll wakeup pipe:");
+    for (int fd : m_wakepipe) {
+        ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    m_pollfds.push_back({m_wakepipe[0], POLLIN, 0});
+}
+
+CPoller::~CPoller() {
+    TRACE2(this, " Destruct upnplib::CPoller")
+    ::close(m_wakepipe[0]);
+    ::close(m_wakepipe[1]);
+}
+
+void CPoller::wakeup() {
+    // If the pipe is full, the poller is woken up anyway.
+    [[maybe_unused]] ssize_t ret = ::write(m_wakepipe[1], "W", 1);
+}
+#endif
+
+void CPoller::add(SOCKET a_sfd, uint32_t a_events) {
+    m_pollfds.push_back({a_sfd, to_poll(a_events), 0});
+}
+
+void CPoller::modify(SOCKET a_sfd, uint32_t a_events) {
+    auto it =
+        std::find_if(m_pollfds.begin(), m_pollfds.end(),
+                     [a_sfd](const pollfd& pfd) { return pfd.fd == a_sfd; });
+    if (it == m_pollfds.end())
+        throw std::runtime_error("ERROR! MSG1028: Failed to modify socket on "
+                                 "poller: \"socket not registered\"");
+    it->events = to_poll(a_events);
+}
+
+void CPoller::remove(SOCKET a_sfd) {
+    std::erase_if(m_pollfds,
+                  [a_sfd](const pollfd& pfd) { return pfd.fd == a_sfd; });
+}
+
+const std::vector<CPoller::Event>& CPoller::wait(int a_timeout_ms) {
+    m_events.clear();
+#ifdef _MSC_VER
+    if (a_timeout_ms < 0 || a_timeout_ms > max_wait_ms)
+        a_timeout_ms = max_wait_ms;
+    int n = ::WSAPoll(m_pollfds.data(), static_cast<ULONG>(m_pollfds.size()),
+                      a_timeout_ms);
+#else
+    int n = ::poll(m_pollfds.data(), static_cast<nfds_t>(m_pollfds.size()),
+                   a_timeout_ms);
+#endif
+    if (n == SOCKET_ERROR) {
+#ifndef _MSC_VER
+        if (errno == EINTR)
+            return m_events;
+#endif
+        throw_error("ERROR! MSG1029: Failed to wait for socket events:");
+    }
+    for (const pollfd& pfd : m_pollfds) {
+        if (pfd.revents == 0)
+            continue;
+#ifndef _MSC_VER
+        if (pfd.fd == m_wakepipe[0]) {
+            char buf[64];
+            while (::read(m_wakepipe[0], buf, sizeof(buf)) > 0)
+                ;
+            continue;
+        }
+#endif
+        m_events.push_back(
+            {pfd.fd, ((pfd.revents & POLLIN) ? READABLE : 0u) |
+                         ((pfd.revents & POLLOUT) ? WRITABLE : 0u) |
+                         ((pfd.revents & (POLLHUP | POLLERR | POLLNVAL))
+                              ? HANGUP
+                              : 0u)});
+    }
+    return m_events;
+}
+#endif // __linux__
+
+} // namespace upnplib
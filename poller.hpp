@@ -0,0 +1,77 @@
+#ifndef UPNPLIB_POLLER_HPP
+#define UPNPLIB_POLLER_HPP
+// Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+#include "port_sock.hpp"
+#include <cstdint>
+#include <vector>
+
+// clang-format off
+#ifdef __linux__
+  #include <sys/epoll.h>
+#elif !defined(_MSC_VER)
+  #include <poll.h>
+#endif
+// clang-format on
+
+namespace upnplib {
+
+// Wait for readiness of many sockets with one system call
+// -------------------------------------------------------
+// On Linux this wraps epoll in level triggered mode. Other platforms fall back
+// to ::poll(), resp. ::WSAPoll() on Microsoft Windows, with the same
+// interface. An object is intended to be owned by the one thread that runs an
+// event loop, so it is not thread safe except wakeup(). Copying a poller
+// doesn't make sense.
+class CPoller {
+  public:
+    // Event flags, they can be combined. HANGUP is only reported.
+    static constexpr uint32_t READABLE{0x1};
+    static constexpr uint32_t WRITABLE{0x2};
+    static constexpr uint32_t HANGUP{0x4};
+
+    struct Event {
+        SOCKET sfd;
+        uint32_t events;
+    };
+
+    CPoller();
+    CPoller(const CPoller&) = delete;
+    CPoller& operator=(const CPoller&) = delete;
+    virtual ~CPoller();
+
+    // Register, change or unregister the events to watch for a socket.
+    void add(SOCKET a_sfd, uint32_t a_events);
+    void modify(SOCKET a_sfd, uint32_t a_events);
+    void remove(SOCKET a_sfd);
+
+    // Wait up to a_timeout_ms milliseconds (-1 = infinite) for events. An
+    // interrupted wait or a timeout return an empty list. The returned
+    // reference is valid until the next call.
+    const std::vector<Event>& wait(int a_timeout_ms);
+
+    // Wake up a waiting wait() from another thread. It then returns an empty
+    // list. On Microsoft Windows there is no file descriptor that can wake up
+    // ::WSAPoll(), so there wait() only blocks up to max_wait_ms and the
+    // wakeup is only noticed then.
+    void wakeup();
+    static constexpr int max_wait_ms{50};
+
+  private:
+#ifdef __linux__
+    int m_epfd{-1};
+    std::vector<epoll_event> m_epevents;
+    int m_wakefd{-1}; // eventfd
+#else
+    std::vector<pollfd> m_pollfds;
+#ifndef _MSC_VER
+    int m_wakepipe[2]{-1, -1}; // Self pipe
+#endif
+#endif
+    std::vector<Event> m_events;
+};
+
+} // namespace upnplib
+
+#endif // UPNPLIB_POLLER_HPP
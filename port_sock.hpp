@@ -1,7 +1,7 @@
 #ifndef UPNPLIB_INCLUDE_PORT_SOCK_HPP
 #define UPNPLIB_INCLUDE_PORT_SOCK_HPP
 // Copyright (C) 2021+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
-// Redistribution only with this Copyright remark. Last modified: 2023-04-10
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
 
 // clang-format off
 #include <string>
@@ -23,6 +23,14 @@
   #define SHUT_WR SD_SEND
   #define SHUT_RDWR SD_BOTH
 
+  // Error number of the last socket operation and the error number that
+  // tells that an operation on a non-blocking socket would block.
+  #define SOCKET_ERRNO_P WSAGetLastError()
+  #define EWOULDBLOCK_P WSAEWOULDBLOCK
+
+  // There is no SIGPIPE on Microsoft Windows.
+  #define MSG_NOSIGNAL 0
+
 #else
 
   #include <sys/socket.h>
@@ -30,6 +38,7 @@
   #include <arpa/inet.h>
   #include <unistd.h> // Also needed here to use 'close()' for a socket.
   #include <netdb.h>  // for getaddrinfo etc.
+  #include <cerrno>
 
   // This typedef makes the code slightly more WIN32 tolerant. On WIN32 systems,
   // SOCKET is unsigned and is not a file descriptor.
@@ -41,6 +50,17 @@
   #define INVALID_SOCKET (-1)
   // some function returns SOCKET_ERROR on win32.
   #define SOCKET_ERROR (-1)
+
+  // Error number of the last socket operation and the error number that
+  // tells that an operation on a non-blocking socket would block.
+  #define SOCKET_ERRNO_P errno
+  #define EWOULDBLOCK_P EWOULDBLOCK
+
+  // MacOS does not know this flag for send(). There SIGPIPE must be disabled
+  // with socket option SO_NOSIGPIPE.
+  #ifndef MSG_NOSIGNAL
+    #define MSG_NOSIGNAL 0
+  #endif
 #endif
 
 // clang-format on
@@ -0,0 +1,131 @@
+// Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+#include "ready-signal.hpp"
+#include "port.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+// clang-format off
+#ifdef __linux__
+  #include <sys/eventfd.h>
+  #include <unistd.h>
+#elif !defined(_MSC_VER)
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+// clang-format on
+
+namespace upnplib {
+
+[[maybe_unused]] static inline void throw_error(std::string errmsg) {
+    // error number contained in errno is used to specify details of the
+    // error.
+    throw std::runtime_error(errmsg + " errno(" + std::to_string(errno) +
+                             ")=\"" + std::strerror(errno) + "\"");
+}
+
+CReadySignal::CReadySignal() {
+    TRACE2(this, " Construct upnplib::CReadySignal")
+}
+
+CReadySignal::~CReadySignal() {
+    TRACE2(this, " Destruct upnplib::CReadySignal")
+#ifndef _MSC_VER
+    if (m_fd >= 0)
+        ::close(m_fd);
+#endif
+#if !defined(__linux__) && !defined(_MSC_VER)
+    if (m_write_fd >= 0)
+        ::close(m_write_fd);
+#endif
+}
+
+void CReadySignal::set() {
+    std::vector<Callback> callbacks;
+    {
+        std::scoped_lock lock(m_mutex);
+        if (m_set)
+            return;
+        m_set = true;
+        callbacks.swap(m_callbacks);
+        this->signal_fd();
+    }
+    m_cond.notify_all();
+    for (Callback& callback : callbacks)
+        callback();
+}
+
+bool CReadySignal::is_set() const { return m_set; }
+
+void CReadySignal::wait() const {
+    if (m_set)
+        return;
+    std::unique_lock lock(m_mutex);
+    m_cond.wait(lock, [this] { return m_set.load(); });
+}
+
+bool CReadySignal::wait(std::chrono::microseconds a_timeout) const {
+    if (m_set)
+        return true;
+    std::unique_lock lock(m_mutex);
+    return m_cond.wait_for(lock, a_timeout, [this] { return m_set.load(); });
+}
+
+void CReadySignal::on_ready(Callback a_callback) {
+    {
+        std::scoped_lock lock(m_mutex);
+        if (!m_set) {
+            m_callbacks.push_back(std::move(a_callback));
+            return;
+        }
+    }
+    a_callback();
+}
+
+int CReadySignal::get_fd() {
+    std::scoped_lock lock(m_mutex);
+    if (m_fd >= 0)
+        return m_fd;
+#if defined(__linux__)
+    m_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_fd < 0)
+        throw_error("ERROR! MSG1050: Failed to create ready signal "
+                    "descriptor:");
+#elif !defined(_MSC_VER)
+    int fds[2];
+    if (::pipe(fds) != 0)
+        throw_error("ERROR! MSG1050: Failed to create ready signal "
+                    "descriptor:");
+    for (int fd : fds) {
+        ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    m_fd = fds[0];
+    m_write_fd = fds[1];
+#else
+    return -1;
+#endif
+    if (m_set)
+        this->signal_fd();
+    return m_fd;
+}
+
+void CReadySignal::signal_fd() {
+    // The descriptor is never read by us, so it stays readable.
+#if defined(__linux__)
+    if (m_fd >= 0) {
+        const uint64_t one{1};
+        [[maybe_unused]] ssize_t ret = ::write(m_fd, &one, sizeof(one));
+    }
+#elif !defined(_MSC_VER)
+    if (m_write_fd >= 0) {
+        [[maybe_unused]] ssize_t ret = ::write(m_write_fd, "R", 1);
+    }
+#endif
+}
+
+} // namespace upnplib
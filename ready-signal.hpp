@@ -0,0 +1,66 @@
+#ifndef UPNPLIB_READY_SIGNAL_HPP
+#define UPNPLIB_READY_SIGNAL_HPP
+// Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace upnplib {
+
+// Signal that something has become ready
+// --------------------------------------
+// A one time event, e.g. a server that has started serving. Other threads
+// can wait for it with a timeout, register a callback, or watch a file
+// descriptor with poll() or epoll. The signal is only set once and stays
+// set. All methods are thread safe.
+class CReadySignal {
+  public:
+    using Callback = std::function<void()>;
+
+    CReadySignal();
+    CReadySignal(const CReadySignal&) = delete;
+    CReadySignal& operator=(const CReadySignal&) = delete;
+    virtual ~CReadySignal();
+
+    // Set the signal. Waiting threads return, the callbacks are called on
+    // the calling thread and the file descriptor becomes readable. Setting
+    // it again does nothing.
+    void set();
+    bool is_set() const;
+
+    // Wait until the signal is set, resp. up to a_timeout. Returns if it is
+    // set.
+    void wait() const;
+    bool wait(std::chrono::microseconds a_timeout) const;
+
+    // Call a_callback when the signal is set, resp. at once on the calling
+    // thread if it is already set. The callback must not throw.
+    void on_ready(Callback a_callback);
+
+    // Get a file descriptor that becomes readable when the signal is set. It
+    // is owned by the signal and created on the first call. It is an
+    // eventfd on Linux and the read end of a pipe on other platforms. On
+    // Microsoft Windows there is none, -1 is returned.
+    int get_fd();
+
+  private:
+    std::atomic<bool> m_set{false};
+    mutable std::mutex m_mutex;
+    mutable std::condition_variable m_cond;
+    std::vector<Callback> m_callbacks; // Protected by mutex.
+    int m_fd{-1};                      // Protected by mutex.
+#if !defined(__linux__) && !defined(_MSC_VER)
+    int m_write_fd{-1}; // Write end of the pipe, protected by mutex.
+#endif
+    // Make the file descriptor readable. The mutex must be locked.
+    void signal_fd();
+};
+
+} // namespace upnplib
+
+#endif // UPNPLIB_READY_SIGNAL_HPP
@@ -1,12 +1,36 @@
 // Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
-// Redistribution only with this Copyright remark. Last modified: 2024-01-12
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
 
 #include "server-tcp.hpp"
 #include "port.hpp"
 #include "addrinfo.hpp"
+#include "poller.hpp"
+#include "uring.hpp"
+#include "connection.hpp"
+#include "message-handler.hpp"
+#include "metrics.hpp"
+#include <algorithm>
 #include <thread>
+#include <unordered_set>
+#include <condition_variable>
 #include <cstring>
+#include <exception>
+#include <functional>
 #include <stdexcept>
+#include <utility>
+#ifdef __linux__
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+#ifdef UPNPLIB_WITH_IO_URING
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+#ifdef UPNPLIB_WITH_ZEROCOPY
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#endif
 
 namespace upnplib {
 
@@ -14,20 +38,269 @@ static inline void throw_error(std::string errmsg) {
     // error number given by WSAGetLastError(), resp. contained in errno is
     // used to specify details of the error.
 #ifdef _WIN32
-    throw std::runtime_error(
-        errmsg + " WSAGetLastError()=" + std::to_string(WSAGetLastError()));
+    std::runtime_error error(errmsg + " WSAGetLastError()=" +
+                             std::to_string(WSAGetLastError()));
 #else
-    throw std::runtime_error(errmsg + " errno(" + std::to_string(errno) +
+    std::runtime_error error(errmsg + " errno(" + std::to_string(errno) +
                              ")=\"" + std::strerror(errno) + "\"");
 #endif
+    CMetrics::count_error(errmsg);
+    throw error;
 }
 
 // Simple TCP Server
 // =================
+// Maximal number of bytes read from a persistent connection on one event
+// before other connections are served.
+constexpr size_t read_burst{256 * 1024};
+// Interval in milliseconds to check a closed connection for completions of
+// its zero copy sends.
+constexpr int zerocopy_poll_ms{10};
+
+#ifdef UPNPLIB_WITH_IO_URING
+// Size of the submission queue, and the provided buffer ring with its buffer
+// group id, number of buffers (power of 2) and size of one buffer.
+constexpr unsigned uring_entries{256};
+constexpr uint16_t uring_bgid{0};
+constexpr unsigned uring_buf_count{256};
+constexpr unsigned uring_buf_size{4096};
+
+// The user data of an io_uring operation contain the socket file descriptor
+// in the lower 32 bits, the operation in the next 8 bits and the generation
+// of the connection in the upper 24 bits. Accepted sockets soon reuse the
+// file descriptor of a closed connection, so a late completion of an
+// operation of the closed one is told apart by its generation.
+constexpr uint64_t uring_op_accept{1ull << 32};
+constexpr uint64_t uring_op_recv{2ull << 32};
+constexpr uint64_t uring_op_send{3ull << 32};
+constexpr uint64_t uring_op_stop{4ull << 32};
+constexpr uint64_t uring_op_wake{5ull << 32};
+constexpr uint64_t uring_op_mask{0xFFull << 32};
+constexpr unsigned uring_gen_shift{40};
+constexpr uint32_t uring_gen_mask{0xFFFFFF};
+
+// User data of an operation on a connection.
+static inline uint64_t uring_data(uint64_t a_op, const CConnection& a_conn) {
+    return a_op | (uint64_t{a_conn.tag()} << uring_gen_shift) |
+           static_cast<uint32_t>(a_conn.sfd());
+}
+#endif
+
+// Disable SIGPIPE on a socket if the platform cannot suppress it per send()
+// with MSG_NOSIGNAL (MacOS). Errors are ignored.
+static inline void set_nosigpipe([[maybe_unused]] SOCKET a_sfd) {
+#ifdef SO_NOSIGPIPE
+    int so_option{1};
+    ::setsockopt(a_sfd, SOL_SOCKET, SO_NOSIGPIPE, (char*)&so_option,
+                 sizeof(so_option));
+#endif
+}
+
+// Count an accepted connection, resp. close it.
+static inline void count_accepted() {
+    CMetrics::add(Counter::server_accepted);
+    CMetrics::add(Gauge::server_connections, 1);
+}
+static inline void close_accepted(SOCKET a_sfd) {
+    CLOSE_SOCKET_P(a_sfd);
+    CMetrics::add(Gauge::server_connections, -1);
+}
+
+// View of the bytes of a message, e.g. to compare it.
+static inline std::string_view
+as_string_view(std::span<const std::byte> a_msg) {
+    return std::string_view(reinterpret_cast<const char*>(a_msg.data()),
+                            a_msg.size());
+}
+
+// Close an accepted connection with a reset. The kernel discards its send
+// queue, so the buffers of zero copy sends that are not completed aren't
+// used anymore when they are given back.
+static void abort_accepted(SOCKET a_sfd) {
+    linger so_linger{1, 0};
+    ::setsockopt(a_sfd, SOL_SOCKET, SO_LINGER, (char*)&so_linger,
+                 sizeof(so_linger));
+    close_accepted(a_sfd);
+}
+
+// Whether the kernel has received bytes resp. end of file on a connection
+// that aren't read yet. The socket must be non-blocking, or a_flags must
+// contain MSG_DONTWAIT.
+static bool input_pending(SOCKET a_sfd, int a_flags = 0) {
+    char byte;
+    return ::recv(a_sfd, &byte, 1, MSG_PEEK | a_flags) >= 0;
+}
+
+// Record the latency of a phase that has started at a_start, if it is set.
+static inline void record_since(Phase a_phase, uint64_t a_start) {
+    if (a_start != 0)
+        CMetrics::record(a_phase, CMetrics::clock_ns() - a_start);
+}
+
+// Record the time an accepted connection has waited in the accept queue and
+// return the time it is accepted. Linux reports the time since the last
+// packet of the peer in milliseconds, that is the final ACK of the handshake
+// if the peer hasn't sent data yet. Shorter waits are reported as 0 and not
+// recorded, they would only hide the real ones. Other platforms report
+// nothing.
+static uint64_t accepted_at([[maybe_unused]] SOCKET a_sfd) {
+#ifdef __linux__
+    tcp_info info{};
+    socklen_t optlen{sizeof(info)};
+    if (::getsockopt(a_sfd, IPPROTO_TCP, TCP_INFO, &info, &optlen) == 0 &&
+        info.tcpi_last_ack_recv > 0)
+        CMetrics::record(Phase::accept_wait,
+                         uint64_t{info.tcpi_last_ack_recv} * 1000000);
+#endif
+    return CMetrics::clock_ns();
+}
+
+// Start the latency of writing replies that have been queued.
+static inline void mark_output(CConnection& a_conn) {
+    if (a_conn.has_output() && a_conn.timestamps().output == 0)
+        a_conn.timestamps().output = CMetrics::clock_ns();
+}
+
+// Write output of a connection until it is empty or the socket would block.
+// Returns false on a connection error.
+// Many small replies are written with one system call. Large ones are
+// written with zero copy if the connection asks for it.
+static bool flush_output(CConnection& a_conn) {
+    std::span<const std::byte> bufs[max_iov];
+    while (a_conn.has_output()) {
+        bool zerocopy{false};
+        const size_t count = a_conn.output(bufs, &zerocopy);
+        const std::span<const std::span<const std::byte>> out{bufs, count};
+        ssize_t valsend{SOCKET_ERROR};
+#ifdef UPNPLIB_WITH_ZEROCOPY
+        if (zerocopy) {
+            valsend = send_vectored(a_conn.sfd(), out, MSG_ZEROCOPY);
+            // Out of memory to pin the pages, send a copy instead.
+            if (valsend == SOCKET_ERROR && errno == ENOBUFS)
+                zerocopy = false;
+        }
+#endif
+        if (!zerocopy)
+            valsend = send_vectored(a_conn.sfd(), out);
+        if (valsend == SOCKET_ERROR)
+            return SOCKET_ERRNO_P == EWOULDBLOCK_P;
+        CMetrics::add(Counter::server_bytes_sent,
+                      static_cast<uint64_t>(valsend));
+        a_conn.written(static_cast<size_t>(valsend), zerocopy);
+    }
+    record_since(Phase::write, std::exchange(a_conn.timestamps().output, 0));
+    return true;
+}
+
+void CServerTCP::drain_zerocopy([[maybe_unused]] CConnection& a_conn) {
+    // Completions of zero copy sends are reported on the error queue of the
+    // socket. Reading it never blocks.
+#ifdef UPNPLIB_WITH_ZEROCOPY
+    for (;;) {
+        char control[128];
+        msghdr msg{};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (::recvmsg(a_conn.sfd(), &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+            return;
+        for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr;
+             cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+            const sock_extended_err* serr =
+                reinterpret_cast<const sock_extended_err*>(CMSG_DATA(cm));
+            if (serr->ee_errno != 0 ||
+                serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            a_conn.zerocopy_completed(serr->ee_info, serr->ee_data);
+            const uint64_t count = serr->ee_data - serr->ee_info + 1;
+            m_zc_completed += count;
+            // The kernel could not avoid to copy, e.g. on loopback.
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                m_zc_copied += count;
+        }
+    }
+#endif
+}
+
+// Used on persistent connections if no message handler is configured.
+static CEchoHandler echo_handler;
+
+// Replies of batches handled by the worker pool
+// ---------------------------------------------
+// Workers post the connection objects of their batches, the event loop that
+// has submitted them takes them after it was woken up.
+class CServerTCP::CReplyQueue {
+  public:
+    struct Replies {
+        SOCKET sfd;
+        CConnection conn; // Holds the replies of the batch.
+        bool failed;      // The handler has failed.
+    };
+
+    CReplyQueue(std::function<void()> a_wake) : m_wake(std::move(a_wake)) {}
+    // Batches must not post to a destructed queue, also if an event loop
+    // has thrown an exception.
+    ~CReplyQueue() { this->wait_idle(); }
+
+    // Count a batch that is submitted.
+    void submitted() {
+        std::scoped_lock lock(m_mutex);
+        m_in_flight++;
+    }
+
+    // Post the replies of a batch and wake up the event loop. The queue is
+    // not touched anymore after the lock is released, so the event loop can
+    // destroy it as soon as wait_idle() returns.
+    void post(Replies&& a_replies) {
+        std::scoped_lock lock(m_mutex);
+        m_posted.push_back(std::move(a_replies));
+        m_wake();
+        m_in_flight--;
+        m_idle_cond.notify_all();
+    }
+
+    // Take all posted replies, a_replies is cleared before.
+    void take(std::vector<Replies>& a_replies) {
+        a_replies.clear();
+        std::scoped_lock lock(m_mutex);
+        a_replies.swap(m_posted);
+    }
+
+    // Wait until all submitted batches are posted.
+    void wait_idle() {
+        std::unique_lock lock(m_mutex);
+        m_idle_cond.wait(lock, [this] { return m_in_flight == 0; });
+    }
+
+  private:
+    std::function<void()> m_wake;
+    std::mutex m_mutex;
+    std::condition_variable m_idle_cond;
+    std::vector<Replies> m_posted; // Protected by mutex.
+    size_t m_in_flight{0};         // Protected by mutex.
+};
+
+// Pin the calling thread to a CPU. Errors are ignored, the thread then just
+// runs on any CPU.
+static void pin_thread([[maybe_unused]] unsigned a_cpu) {
+#ifdef __linux__
+    const unsigned ncpu = std::thread::hardware_concurrency();
+    if (ncpu == 0)
+        return;
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(a_cpu % ncpu, &cpuset);
+    ::pthread_setaffinity_np(::pthread_self(), sizeof(cpuset), &cpuset);
+#endif
+}
 
 CServerTCP::CServerTCP(const std::string& a_port,
-                       [[maybe_unused]] const bool a_reuse_addr)
-    : m_listen_sfd(AF_INET6, SOCK_STREAM) {
+                       [[maybe_unused]] const bool a_reuse_addr,
+                       const ServerConfig& a_config)
+    : m_config(a_config), m_buffers(a_config.buffers),
+      m_listen_sfd(AF_INET6, SOCK_STREAM) {
     TRACE2(this, " Construct upnplib::CServerTCP")
 
     // Get local address information that can be bound to the socket.
@@ -39,14 +312,88 @@ CServerTCP::CServerTCP(const std::string& a_port,
     CAddrinfo ai("", a_port.c_str(), AF_INET6, SOCK_STREAM,
                  AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV);
 
+    // Only Linux balances connections over sockets bound with SO_REUSEPORT.
+#ifdef __linux__
+    if (m_config.mode != ServerMode::epoll || m_config.shards == 0)
+        m_config.shards = 1;
+#else
+    m_config.shards = 1;
+#endif
+    if (m_config.shards > 1)
+        m_listen_sfd.set_reuse_port();
+    // Set before listen so the buffer sizes match the TCP window.
+    m_listen_sfd.set_options(m_config.socket);
+
     // Bind socket to a local address.
     // -------------------------------
     m_listen_sfd.bind(ai);
 
     // Listen specifies passive usage of the socket for incomming connections.
     // -----------------------------------------------------------------------
-    m_listen_sfd.listen();
+    m_listen_sfd.listen(m_config.socket.backlog);
+
+    // Listening sockets of the other shards.
+    // --------------------------------------
+    // They bind the port that was actually bound so this also works with an
+    // ephemeral port ("0").
+    if (m_config.shards > 1) {
+        CAddrinfo shard_ai("", std::to_string(m_listen_sfd.get_port()),
+                           AF_INET6, SOCK_STREAM,
+                           AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV);
+        for (unsigned i{1}; i < m_config.shards; i++) {
+            CSocket sock(AF_INET6, SOCK_STREAM);
+            sock.set_reuse_port();
+            sock.set_options(m_config.socket);
+            sock.bind(shard_ai);
+            sock.listen(m_config.socket.backlog);
+            m_shard_sfds.push_back(std::move(sock));
+        }
+    }
+
+    // Setup io_uring if requested, otherwise fall back to blocking mode.
+    // -----------------------------------------------------------------
+    if (m_config.mode == ServerMode::io_uring) {
+#ifdef UPNPLIB_WITH_IO_URING
+        try {
+            m_uring = std::make_unique<CUring>(uring_entries);
+            m_uring->setup_buf_ring(uring_bgid, uring_buf_count,
+                                    uring_buf_size);
+        } catch (const std::runtime_error& e) {
+            TRACE2("[Server] io_uring not available, use blocking mode: ",
+                   e.what())
+            m_uring.reset();
+            m_config.mode = ServerMode::blocking;
+        }
+#else
+        m_config.mode = ServerMode::blocking;
+#endif
+    }
+
+    // Enable zero copy sending if requested. Accepted sockets inherit the
+    // option. It is not used with io_uring mode and one shot connections.
+    // -----------------------------------------------------------------------
+    if (m_config.mode == ServerMode::io_uring || !m_config.persistent)
+        m_config.zerocopy_threshold = 0;
+    if (m_config.zerocopy_threshold > 0) {
+        try {
+            m_listen_sfd.set_zerocopy();
+            for (CSocket& sock : m_shard_sfds)
+                sock.set_zerocopy();
+        } catch (const std::runtime_error& e) {
+            TRACE2("[Server] Zero copy not available: ", e.what())
+            m_config.zerocopy_threshold = 0;
+        }
+    }
 
+    // Start the worker pool if requested.
+    // -----------------------------------
+    if (m_config.workers > 0 && m_config.mode != ServerMode::blocking)
+        m_pool = std::make_unique<CWorkerPool>(m_config.workers);
+
+    // Start the metrics endpoint if requested.
+    // ----------------------------------------
+    if (!m_config.metrics_port.empty())
+        m_metrics = std::make_unique<CMetricsEndpoint>(m_config.metrics_port);
 } // end constructor
 
 
@@ -54,40 +401,223 @@ CServerTCP::~CServerTCP() { TRACE2(this, " Destruct upnplib::CServerTCP") }
 
 
 void CServerTCP::run() {
+    m_running = true;
+    try {
+        if (!m_stopping.is_set()) {
+            switch (m_config.mode) {
+            case ServerMode::epoll:
+                if (m_shard_sfds.empty())
+                    this->run_epoll(m_listen_sfd);
+                else
+                    this->run_sharded();
+                break;
+            case ServerMode::io_uring:
+                this->run_io_uring();
+                break;
+            default:
+                this->run_blocking();
+            }
+        }
+    } catch (...) {
+        m_stopped.set();
+        throw;
+    }
+    m_stopped.set();
+}
+
+CServerTCP::StopStats CServerTCP::stop(std::chrono::milliseconds a_deadline) {
+    TRACE2(this, " Executing upnplib::CServerTCP::stop()")
+    m_stopping.set();
+    this->wake_all();
+    // If run() starts after this check it sees m_stopping and returns at
+    // once.
+    if (m_running && !m_stopped.wait(a_deadline)) {
+        m_forcing.set();
+        this->wake_all();
+        m_stopped.wait();
+    }
+    return {m_drained, m_closed};
+}
+
+namespace {
+// Register the poller of an event loop for its lifetime, so it can be woken
+// up from other threads.
+class CPollerRegistration {
+  public:
+    CPollerRegistration(CPoller& a_poller, std::mutex& a_mutex,
+                        std::vector<CPoller*>& a_pollers)
+        : m_poller(a_poller), m_mutex(a_mutex), m_pollers(a_pollers) {
+        std::scoped_lock lock(m_mutex);
+        m_pollers.push_back(&m_poller);
+    }
+    ~CPollerRegistration() {
+        std::scoped_lock lock(m_mutex);
+        std::erase(m_pollers, &m_poller);
+    }
+
+  private:
+    CPoller& m_poller;
+    std::mutex& m_mutex;
+    std::vector<CPoller*>& m_pollers;
+};
+} // anonymous namespace
+
+void CServerTCP::run_blocking() {
     // TODO: Improve protocol handling
     // REF: [close vs shutdown socket?]
     // (https://stackoverflow.com/q/4160347/5014688)
     //
     // This method can run in a thread and should be thread safe.
     // Method will quit if we have received a single "Q" string (['Q', '\0']).
-    TRACE2(this, " executing upnplib::CServerTCP::run()")
+    // Sockets are only read when a poller has reported them readable, so
+    // stop() can wake up the loop.
+    TRACE2(this, " executing upnplib::CServerTCP::run_blocking()")
 
-    // Accept an incomming request. This call is blocking.
-    // ---------------------------------------------------
-    // Should be finished with shutdown()
-    SOCKET accept_sfd{INVALID_SOCKET};
-    char buffer[1024]{};
-    ssize_t valread{};
+    CPoller poller;
+    poller.add(m_listen_sfd, CPoller::READABLE);
+    CPollerRegistration registration(poller, m_pollers_mutex, m_pollers);
+
+    // Wait until a connection is pending resp. the socket is readable. The
+    // other one is not watched meanwhile. Returns false if the poller was
+    // woken up.
+    auto poll_readable = [&poller](SOCKET a_sfd) {
+        for (const CPoller::Event& ev : poller.wait(-1))
+            if (ev.sfd == a_sfd)
+                return true;
+        return false;
+    };
 
-    // Now we are ready to accept requests and flag this. To be thread safe we
-    // should do it normaly after calling accept() but we cannot do it because
-    // it is blocking. In this case it should not matter because incomming
-    // characters are cached by the operating system?
-    m_ready = true;
+    // Now we are ready to accept requests and flag this. The socket is
+    // already listening, so incomming connections are queued by the
+    // operating system.
+    m_ready.set();
 
-    while (buffer[0] != 'Q' || valread != 1) {
-        accept_sfd = ::accept(m_listen_sfd, nullptr, nullptr);
+    if (m_config.persistent) {
+        // Serve one persistent connection after the other until it is closed
+        // by the peer.
+        while (!m_quit && !m_stopping.is_set()) {
+            if (!poll_readable(m_listen_sfd))
+                continue;
+            // The handle closes the connection also on an exception, e.g.
+            // on an invalid frame.
+            const CSocketHandle conn_sfd(
+                ::accept(m_listen_sfd, nullptr, nullptr));
+            if (conn_sfd == INVALID_SOCKET)
+                throw_error("[Server] ERROR! MSG1022: Failed to accept an "
+                            "incomming request:");
+            count_accepted();
+            CConnection conn(conn_sfd, true, m_config.max_frame_size,
+                             m_buffers);
+            conn.set_zerocopy_threshold(m_config.zerocopy_threshold);
+            if (m_config.latency)
+                conn.timestamps().accepted = accepted_at(conn_sfd);
+            poller.remove(m_listen_sfd);
+            poller.add(conn_sfd, CPoller::READABLE);
+            for (;;) {
+                // When stopping an idle connection is closed. A request that
+                // has started is served until the deadline.
+                if (m_forcing.is_set() ||
+                    (m_stopping.is_set() && conn.is_idle()))
+                    break;
+                if (!poll_readable(conn_sfd))
+                    continue;
+                ssize_t valread =
+                    recv_vectored(conn_sfd, conn.receive_buffers());
+                if (valread <= 0)
+                    break;
+                CMetrics::add(Counter::server_bytes_received,
+                              static_cast<uint64_t>(valread));
+                record_since(Phase::first_byte,
+                             std::exchange(conn.timestamps().accepted, 0));
+                conn.received(static_cast<size_t>(valread));
+                if (!this->process_messages(conn) || !flush_output(conn))
+                    break;
+                if (conn.zerocopy_in_flight() > 0)
+                    this->drain_zerocopy(conn);
+            }
+            poller.remove(conn_sfd);
+            poller.add(m_listen_sfd, CPoller::READABLE);
+            ::shutdown(conn_sfd, SHUT_RDWR);
+            // The kernel may still send from buffers of zero copy sends, so
+            // they are only given back after completion, resp. after the
+            // send queue is discarded at the deadline.
+            while (conn.zerocopy_in_flight() > 0 && !m_forcing.is_set()) {
+                std::this_thread::sleep_for(
+                    std::chrono::milliseconds(zerocopy_poll_ms));
+                this->drain_zerocopy(conn);
+            }
+            if (conn.zerocopy_in_flight() > 0) {
+                linger so_linger{1, 0};
+                ::setsockopt(conn_sfd, SOL_SOCKET, SO_LINGER,
+                             (char*)&so_linger, sizeof(so_linger));
+            }
+            CMetrics::add(Gauge::server_connections, -1);
+            if (m_forcing.is_set())
+                m_closed++;
+            else if (m_stopping.is_set())
+                m_drained++;
+        }
+        TRACE2(this, " [Server] Quit.")
+        return;
+    }
+
+    // Accept an incomming request. This call doesn't block.
+    // -----------------------------------------------------
+    // Should be finished with shutdown()
+    char buffer[1024]{};
+    while (!m_stopping.is_set()) {
+        if (!poll_readable(m_listen_sfd))
+            continue;
+        SOCKET accept_sfd = ::accept(m_listen_sfd, nullptr, nullptr);
         if (accept_sfd == INVALID_SOCKET)
             throw_error("[Server] ERROR! MSG1022: Failed to accept an "
                         "incomming request:");
+        count_accepted();
+        const uint64_t accepted =
+            m_config.latency ? accepted_at(accept_sfd) : 0;
 
         // Read accepted connection.
         // -------------------------
-        valread = ::recv(accept_sfd, buffer, sizeof(buffer) - 1, 0);
+        poller.remove(m_listen_sfd);
+        poller.add(accept_sfd, CPoller::READABLE);
+        bool readable{false};
+        while (!readable && !m_forcing.is_set())
+            readable = poll_readable(accept_sfd);
+        ssize_t valread{SOCKET_ERROR};
+        bool quit{false};
+        if (readable) {
+            valread = ::recv(accept_sfd, buffer, sizeof(buffer) - 1, 0);
+            quit = valread > 0 &&
+                   this->is_quit_message(std::string_view(
+                       buffer, static_cast<size_t>(valread)));
+            if (valread > 0) {
+                CMetrics::add(Counter::server_bytes_received,
+                              static_cast<uint64_t>(valread));
+                record_since(Phase::first_byte, accepted);
+                if (!quit) {
+                    const uint64_t complete =
+                        m_config.latency ? CMetrics::clock_ns() : 0;
+                    CMetrics::add(Counter::server_messages);
+                    this->handle_message(
+                        accept_sfd,
+                        std::as_bytes(
+                            std::span(buffer, static_cast<size_t>(valread))));
+                    record_since(Phase::service, complete);
+                }
+            }
+        }
+        poller.remove(accept_sfd);
+        poller.add(m_listen_sfd, CPoller::READABLE);
 
         ::shutdown(accept_sfd, SHUT_RDWR);
-        CLOSE_SOCKET_P(accept_sfd);
+        close_accepted(accept_sfd);
 
+        if (!readable) {
+            m_closed++;
+            break;
+        }
+        if (m_stopping.is_set())
+            m_drained++;
         switch (valread) {
         case 0:
             throw_error(
@@ -98,19 +628,797 @@ void CServerTCP::run() {
             throw_error("[Server] ERROR! MSG1024: Failed to read an incomming "
                         "request:");
         }
-        buffer[valread] = '\0';
+        if (quit)
+            break;
     } // while
 
     TRACE2(this, " [Server] Quit.")
 }
 
+void CServerTCP::quit_all() {
+    m_quit = true;
+    this->wake_all();
+}
+
+void CServerTCP::wake_all() {
+    std::scoped_lock lock(m_pollers_mutex);
+    for (CPoller* poller : m_pollers)
+        poller->wakeup();
+}
+
+bool CServerTCP::is_quit_message(std::string_view a_msg) const {
+    return m_config.quit_message && a_msg == "Q";
+}
+
+void CServerTCP::run_epoll(SOCKET a_listen_sfd) {
+    // This method multiplexes all connections of one listening socket on the
+    // calling thread. With the one shot protocol a message is complete when
+    // the peer has shut down sending. Persistent connections exchange frames
+    // until the peer closes. Errors on a single connection only close that
+    // connection but not the server. The method will quit if we have received
+    // a message that is exactly "Q", also if another shard has received it.
+    TRACE2(this, " executing upnplib::CServerTCP::run_epoll()")
+
+    set_nonblocking(a_listen_sfd);
+    CPoller poller;
+    poller.add(a_listen_sfd, CPoller::READABLE);
+    CPollerRegistration registration(poller, m_pollers_mutex, m_pollers);
+
+    // Accepted connections. Their tag is the events the poller watches.
+    std::unordered_map<SOCKET, CConnection> conns;
+    // Replies of frames handled by the worker pool.
+    CReplyQueue replies([&poller] { poller.wakeup(); });
+    std::vector<CReplyQueue::Replies> posted;
+
+    if (++m_accepting == m_config.shards)
+        m_ready.set();
+
+    // Close a connection. Its object and socket file descriptor are kept
+    // until a batch of its frames is handled, so the descriptor isn't
+    // reused meanwhile. They are also kept until the kernel has completed
+    // the zero copy sends, it may still send from their buffers. Such
+    // lingering connections are checked for completions periodically.
+    bool stopping{false};
+    std::vector<SOCKET> lingering;
+    auto close_conn = [this, &conns, &poller, &stopping,
+                       &lingering](decltype(conns)::iterator a_it) {
+        const SOCKET sfd{a_it->first};
+        CConnection& conn = a_it->second;
+        if (!conn.is_closing()) {
+            conn.set_closing(true);
+            poller.remove(sfd);
+            ::shutdown(sfd, SHUT_RDWR);
+            if (stopping)
+                m_drained++;
+        }
+        if (conn.is_handler_busy())
+            return;
+        if (conn.zerocopy_in_flight() > 0)
+            this->drain_zerocopy(conn);
+        if (conn.zerocopy_in_flight() > 0) {
+            if (std::find(lingering.begin(), lingering.end(), sfd) ==
+                lingering.end())
+                lingering.push_back(sfd);
+            return;
+        }
+        std::erase(lingering, sfd);
+        conns.erase(a_it);
+        close_accepted(sfd);
+    };
+
+    // Watch a persistent connection for the events it waits for. It isn't
+    // read while its frames are handled by the worker pool, nor after end of
+    // file.
+    auto watch = [&poller](CConnection& a_conn) {
+        const uint32_t events =
+            (a_conn.is_handler_busy() || a_conn.is_eof() ? 0
+                                                         : CPoller::READABLE) |
+            (a_conn.has_output() ? CPoller::WRITABLE : 0);
+        a_conn.set_send_busy(a_conn.has_output());
+        if (events != a_conn.tag()) {
+            poller.modify(a_conn.sfd(), events);
+            a_conn.set_tag(events);
+        }
+    };
+
+    // Handle complete frames of a persistent connection inline or with the
+    // worker pool.
+    auto handle_frames = [this, &replies](CConnection& a_conn) {
+        return m_pool ? this->submit_messages(a_conn, replies)
+                      : this->process_messages(a_conn);
+    };
+
+    // Serve a persistent connection after its input has changed: handle
+    // complete frames and write replies as far as possible. If the socket
+    // buffer is full we wait until it becomes writable. Completed zero copy
+    // sends are also reported by an event.
+    auto serve = [this, &close_conn, &watch, &handle_frames,
+                  &stopping](decltype(conns)::iterator a_it, bool a_eof) {
+        CConnection& conn = a_it->second;
+        if (a_eof)
+            conn.set_eof(true);
+        if (conn.zerocopy_in_flight() > 0)
+            this->drain_zerocopy(conn);
+        if (!handle_frames(conn) || !flush_output(conn)) {
+            close_conn(a_it);
+            return;
+        }
+        // After end of file the connection is closed when all replies are
+        // written, so a peer that has half-closed still gets them. When
+        // stopping it is closed as soon as it is idle and nothing more is
+        // received.
+        if ((conn.is_eof() && !conn.has_output() && !conn.is_handler_busy()) ||
+            (stopping && conn.is_idle() && !input_pending(a_it->first))) {
+            close_conn(a_it);
+            return;
+        }
+        watch(conn);
+    };
+
+    while (!m_quit && !m_forcing.is_set()) {
+        if (!stopping && m_stopping.is_set()) {
+            // Accept what the kernel has already queued, then stop accepting.
+            // On Linux shutdown removes the socket from the SO_REUSEPORT
+            // group, so new connections go to the other sockets of the
+            // port, e.g. of a new server process.
+            stopping = true;
+            this->accept_pending(a_listen_sfd, poller, conns, 0);
+            poller.remove(a_listen_sfd);
+            ::shutdown(a_listen_sfd, SHUT_RDWR);
+            // Idle connections are closed, except those with requests that
+            // the kernel has already received. They are served first.
+            for (auto it = conns.begin(); it != conns.end();) {
+                auto next = std::next(it);
+                if (it->second.is_persistent() && it->second.is_idle() &&
+                    !it->second.is_closing() && !input_pending(it->first))
+                    close_conn(it);
+                it = next;
+            }
+        }
+        if (stopping && conns.empty())
+            break;
+
+        for (const CPoller::Event& ev :
+             poller.wait(lingering.empty() ? -1 : zerocopy_poll_ms)) {
+            if (ev.sfd == a_listen_sfd) {
+                this->accept_pending(a_listen_sfd, poller, conns,
+                                     m_config.accept_batch);
+                continue;
+            }
+            auto it = conns.find(ev.sfd);
+            if (it == conns.end())
+                continue;
+            CConnection& conn = it->second;
+
+            // Read available bytes directly into the free space of the ring
+            // buffer of the connection, a burst of up to read_burst bytes so
+            // other connections aren't starved. The event is reported again
+            // if there are more bytes. A one shot message that exceeds
+            // max_frame_size closes the connection. From a persistent
+            // connection pipelined frames are read. They are handled after
+            // each read, so the buffer does not grow more than needed for
+            // the next frame, and all replies are written together.
+            bool eof{false};
+            bool failed{false};
+            if (ev.events & (CPoller::READABLE | CPoller::HANGUP)) {
+                size_t burst{0};
+                for (;;) {
+                    ssize_t valread =
+                        recv_vectored(ev.sfd, conn.receive_buffers());
+                    if (valread > 0) {
+                        CMetrics::add(Counter::server_bytes_received,
+                                      static_cast<uint64_t>(valread));
+                        record_since(
+                            Phase::first_byte,
+                            std::exchange(conn.timestamps().accepted, 0));
+                        conn.received(static_cast<size_t>(valread));
+                        burst += static_cast<size_t>(valread);
+                        if (!conn.is_persistent()) {
+                            if (conn.buffered() > m_config.max_frame_size)
+                                failed = true;
+                            else if (burst < read_burst)
+                                continue;
+                            break;
+                        }
+                        if (!handle_frames(conn))
+                            failed = true;
+                        else if (burst < read_burst &&
+                                 !conn.is_handler_busy())
+                            continue;
+                        break;
+                    }
+                    if (valread == 0)
+                        eof = true;
+                    else if (SOCKET_ERRNO_P != EWOULDBLOCK_P)
+                        failed = true;
+                    break;
+                }
+            }
+
+            if (!conn.is_persistent()) {
+                if (!eof && !failed)
+                    continue;
+                // End of message or connection error. An incomplete message
+                // isn't handled.
+                CBuffer owner;
+                std::span<const std::byte> msg{conn.take_message(owner)};
+                if (!eof)
+                    msg = {};
+                else if (this->is_quit_message(as_string_view(msg)))
+                    this->quit_all();
+                poller.remove(ev.sfd);
+                conns.erase(it);
+                this->dispatch(ev.sfd, std::move(owner), msg);
+                if (stopping)
+                    m_drained++;
+                continue;
+            }
+
+            if (failed)
+                close_conn(it);
+            else
+                serve(it, eof);
+        }
+
+        // Queue the replies of batches that are handled and serve their
+        // connections again, meanwhile more frames may have been received.
+        replies.take(posted);
+        for (CReplyQueue::Replies& batch : posted) {
+            auto it = conns.find(batch.sfd);
+            if (it == conns.end())
+                continue;
+            CConnection& conn = it->second;
+            conn.set_handler_busy(false);
+            if (conn.is_closing() || batch.failed) {
+                close_conn(it);
+                continue;
+            }
+            conn.append_output(batch.conn);
+            if (m_config.latency)
+                mark_output(conn);
+            serve(it, false);
+        }
+        posted.clear();
+
+        // Finish closing connections whose zero copy sends are completed.
+        for (size_t i{lingering.size()}; i-- > 0;) {
+            auto it = conns.find(lingering[i]);
+            if (it != conns.end())
+                close_conn(it);
+        }
+    } // while
+
+    // Close connections that are still open. Batches that are still handled
+    // must be posted before their queue is destructed. The send queue of a
+    // connection with zero copy sends in flight is discarded.
+    replies.wait_idle();
+    for (auto& conn : conns) {
+        if (stopping && !conn.second.is_closing())
+            m_closed++;
+        if (conn.second.zerocopy_in_flight() > 0)
+            abort_accepted(conn.first);
+        else
+            close_accepted(conn.first);
+    }
+    set_nonblocking(a_listen_sfd, false);
+
+    TRACE2(this, " [Server] Quit.")
+}
+
+bool CServerTCP::process_messages(CConnection& a_conn) {
+    CMessageHandler& handler =
+        m_config.handler ? *m_config.handler : echo_handler;
+    std::string_view msg;
+    try {
+        while (a_conn.next_message(msg)) {
+            if (this->is_quit_message(msg)) {
+                this->quit_all();
+                continue;
+            }
+            CMetrics::add(Counter::server_messages);
+            const uint64_t complete =
+                m_config.latency ? CMetrics::clock_ns() : 0;
+            handler.on_message(std::as_bytes(std::span(msg)), a_conn);
+            record_since(Phase::service, complete);
+        }
+        if (m_config.latency)
+            mark_output(a_conn);
+    } catch (const std::exception& e) {
+        TRACE2("[Server] Close connection: ", e.what())
+        return false;
+    }
+    return true;
+}
+
+bool CServerTCP::submit_messages(CConnection& a_conn,
+                                 CReplyQueue& a_replies) {
+    if (a_conn.is_handler_busy())
+        return true;
+    // The frames are copied to the connection object of the batch. Their
+    // views are only valid until the next frame is taken.
+    CConnection batch(a_conn.sfd(), true, m_config.max_frame_size, m_buffers);
+    batch.set_peer(a_conn.peer(), a_conn.peer_len());
+    std::string_view msg;
+    bool empty{true};
+    try {
+        while (a_conn.next_message(msg)) {
+            std::byte hdr[frame_header_size];
+            write_frame_header(hdr, msg.size());
+            batch.received(reinterpret_cast<const char*>(hdr),
+                           frame_header_size);
+            batch.received(msg.data(), msg.size());
+            empty = false;
+        }
+    } catch (const std::exception& e) {
+        TRACE2("[Server] Close connection: ", e.what())
+        return false;
+    }
+    if (empty)
+        return true;
+
+    a_conn.set_handler_busy(true);
+    a_replies.submitted();
+    m_pool->submit([this, &a_replies, batch = std::move(batch)]() mutable {
+        const bool handled = this->process_messages(batch);
+        a_replies.post({batch.sfd(), std::move(batch), !handled});
+    });
+    return true;
+}
+
+void CServerTCP::handle_message(SOCKET a_sfd,
+                                std::span<const std::byte> a_msg) {
+    if (!m_config.handler)
+        return;
+    CConnection conn(a_sfd, false, default_max_frame_size, m_buffers);
+    try {
+        m_config.handler->on_message(a_msg, conn);
+        if (m_config.latency)
+            mark_output(conn);
+        flush_output(conn);
+    } catch (const std::exception& e) {
+        TRACE2("[Server] Close connection: ", e.what())
+    }
+}
+
+void CServerTCP::dispatch(SOCKET a_sfd, CBuffer&& a_owner,
+                          std::span<const std::byte> a_msg) {
+    // The service time includes the wait in the queue of the worker pool.
+    // The task owns the buffer of the message until it is handled.
+    const uint64_t complete = m_config.latency ? CMetrics::clock_ns() : 0;
+    auto handle = [this, a_sfd, complete, owner = std::move(a_owner),
+                   msg = a_msg]() {
+        SOCKET sfd{a_sfd};
+        if (!msg.empty() && !this->is_quit_message(as_string_view(msg))) {
+            CMetrics::add(Counter::server_messages);
+            set_nonblocking(sfd, false);
+            this->handle_message(sfd, msg);
+            record_since(Phase::service, complete);
+        }
+        ::shutdown(sfd, SHUT_RDWR);
+        close_accepted(sfd);
+    };
+    if (m_pool)
+        m_pool->submit(std::move(handle));
+    else
+        handle();
+}
+
+void CServerTCP::run_sharded() {
+    // Every shard runs its own event loop on its own thread. The calling
+    // thread only waits for them, so it is not pinned to a CPU. The first
+    // exception of a shard quits all shards and is rethrown here.
+    TRACE2(this, " executing upnplib::CServerTCP::run_sharded()")
+    std::mutex error_mutex;
+    std::exception_ptr error;
+
+    auto run_shard = [this, &error_mutex, &error](SOCKET a_listen_sfd,
+                                                  unsigned a_shard) {
+        if (m_config.pin_shards)
+            pin_thread(a_shard);
+        try {
+            this->run_epoll(a_listen_sfd);
+        } catch (...) {
+            std::scoped_lock lock(error_mutex);
+            if (!error)
+                error = std::current_exception();
+            this->quit_all();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.emplace_back(run_shard, static_cast<SOCKET>(m_listen_sfd), 0);
+    for (unsigned i{0}; i < m_shard_sfds.size(); i++)
+        threads.emplace_back(run_shard, static_cast<SOCKET>(m_shard_sfds[i]),
+                             i + 1);
+    for (std::thread& thread : threads)
+        thread.join();
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+void CServerTCP::accept_pending(
+    SOCKET a_listen_sfd, CPoller& a_poller,
+    std::unordered_map<SOCKET, CConnection>& a_conns, unsigned a_batch) {
+    // The listening socket is non-blocking, so we accept until the queue of
+    // pending connections is empty, but not more than a batch. The poller
+    // is level triggered and reports the rest with the next wait.
+    sockaddr_storage peer;
+    socklen_t peer_len;
+    for (unsigned i{0}; a_batch == 0 || i < a_batch; i++) {
+        SOCKET accept_sfd = accept_nonblocking(a_listen_sfd, &peer, &peer_len);
+        if (accept_sfd == INVALID_SOCKET) {
+            if (SOCKET_ERRNO_P == EWOULDBLOCK_P)
+                return;
+#ifndef _MSC_VER
+            // The peer may have aborted the connection meanwhile, or we are
+            // out of file descriptors. Try again with the next event.
+            if (errno == ECONNABORTED || errno == EINTR || errno == EMFILE ||
+                errno == ENFILE)
+                return;
+#endif
+            throw_error("[Server] ERROR! MSG1022: Failed to accept an "
+                        "incomming request:");
+        }
+        count_accepted();
+        set_nosigpipe(accept_sfd);
+        a_poller.add(accept_sfd, CPoller::READABLE);
+        auto [it, inserted] =
+            a_conns.try_emplace(accept_sfd, accept_sfd, m_config.persistent,
+                                m_config.max_frame_size, m_buffers);
+        it->second.set_peer(peer, peer_len);
+        it->second.set_tag(CPoller::READABLE);
+        it->second.set_zerocopy_threshold(m_config.zerocopy_threshold);
+        if (m_config.latency)
+            it->second.timestamps().accepted = accepted_at(accept_sfd);
+    }
+}
+
+void CServerTCP::run_io_uring() {
+    // Same behavior as run_epoll() but all operations are completion based.
+    // New operations are only collected while processing completions and
+    // submitted together with waiting for the next completions.
+    TRACE2(this, " executing upnplib::CServerTCP::run_io_uring()")
+#ifdef UPNPLIB_WITH_IO_URING
+    CUring& ring = *m_uring;
+    // Accepted connections and the generation of the last one.
+    std::unordered_map<SOCKET, CConnection> conns;
+    uint32_t generation{0};
+    std::vector<io_uring_cqe> cqes;
+    // Connections with replies to send after the completions are handled.
+    std::vector<SOCKET> replied;
+    // Replies of frames handled by the worker pool. Workers wake up the
+    // ring with an eventfd it polls.
+    const int wake_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0)
+        throw_error("[Server] ERROR! MSG1051: Failed to create wakeup "
+                    "descriptor:");
+    CReplyQueue replies([wake_fd] {
+        const uint64_t one{1};
+        [[maybe_unused]] ssize_t ret = ::write(wake_fd, &one, sizeof(one));
+    });
+    std::vector<CReplyQueue::Replies> posted;
+
+    // Submit a send of pending replies if there is no send in progress. The
+    // bytes given by output() stay valid until written() is called.
+    auto send_output = [&ring](CConnection& a_conn) {
+        if (a_conn.is_send_busy() || !a_conn.has_output())
+            return;
+        std::string_view out = a_conn.output();
+        ring.prep_send(a_conn.sfd(), out.data(),
+                       static_cast<unsigned>(out.size()),
+                       uring_data(uring_op_send, a_conn));
+        a_conn.set_send_busy(true);
+    };
+    // A connection must not be destroyed while a send is in progress because
+    // the kernel still uses its output buffer, nor while a batch of its
+    // frames is handled.
+    // Idle connections whose receive is cancelled when stopping.
+    std::unordered_set<SOCKET> cancelled;
+    auto close_conn = [&conns, &cancelled](decltype(conns)::iterator a_it) {
+        SOCKET sfd{a_it->first};
+        ::shutdown(sfd, SHUT_RDWR);
+        cancelled.erase(sfd);
+        if (a_it->second.is_send_busy() || a_it->second.is_handler_busy()) {
+            a_it->second.set_closing(true);
+            return;
+        }
+        conns.erase(a_it);
+        close_accepted(sfd);
+    };
+
+    // Handle complete frames of a persistent connection inline or with the
+    // worker pool.
+    auto handle_frames = [this, &replies](CConnection& a_conn) {
+        return m_pool ? this->submit_messages(a_conn, replies)
+                      : this->process_messages(a_conn);
+    };
+    // After end of file a persistent connection is closed when all replies
+    // are written.
+    auto is_done = [](const CConnection& a_conn) {
+        return a_conn.is_eof() && !a_conn.has_output() &&
+               !a_conn.is_send_busy() && !a_conn.is_handler_busy();
+    };
+
+    // stop() sets its signals from another thread, their file descriptors
+    // are polled by the ring (lower bits 0 = stopping, 1 = forcing).
+    bool stopping{false};
+    bool forcing{false};
+
+    // Close a persistent connection that is done. When stopping it is also
+    // closed if it is idle, but not before the bytes that the kernel has
+    // already received are served. Its receive is cancelled, then the final
+    // completion of the receive tells if there are more.
+    auto close_if_done = [this, &ring, &cancelled, &close_conn, &is_done,
+                          &stopping](decltype(conns)::iterator a_it) {
+        CConnection& conn = a_it->second;
+        if (!conn.is_persistent() || conn.is_closing())
+            return;
+        if (is_done(conn)) {
+            close_conn(a_it);
+            if (stopping)
+                m_drained++;
+        } else if (stopping && conn.is_idle() &&
+                   cancelled.insert(a_it->first).second) {
+            ring.prep_cancel(uring_data(uring_op_recv, conn));
+        }
+    };
+    ring.prep_poll_add(m_stopping.get_fd(), uring_op_stop | 0);
+    ring.prep_poll_add(m_forcing.get_fd(), uring_op_stop | 1);
+    ring.prep_poll_add(wake_fd, uring_op_wake);
+
+    // Submit the accept before flagging that we are ready.
+    ring.prep_accept_multishot(m_listen_sfd, uring_op_accept);
+    ring.submit_and_wait(0);
+    m_ready.set();
+
+    while (!m_quit && !forcing && !(stopping && conns.empty())) {
+        ring.submit_and_wait(1);
+        ring.reap(cqes);
+        for (const io_uring_cqe& cqe : cqes) {
+            const uint64_t op = cqe.user_data & uring_op_mask;
+            const bool more = cqe.flags & IORING_CQE_F_MORE;
+
+            if (op == uring_op_stop) {
+                if (cqe.user_data & 1) {
+                    forcing = true;
+                    continue;
+                }
+                // Stop accepting like run_epoll() and close idle
+                // connections. Connections that were accepted before the
+                // cancel took effect are served.
+                stopping = true;
+                ring.prep_cancel(uring_op_accept);
+                ::shutdown(m_listen_sfd, SHUT_RDWR);
+                for (auto it = conns.begin(); it != conns.end();) {
+                    auto next = std::next(it);
+                    close_if_done(it);
+                    it = next;
+                }
+                continue;
+            }
+
+            if (op == uring_op_wake) {
+                // Queue the replies of batches that are handled. Meanwhile
+                // more frames may have been received.
+                uint64_t count;
+                [[maybe_unused]] ssize_t ret =
+                    ::read(wake_fd, &count, sizeof(count));
+                ring.prep_poll_add(wake_fd, uring_op_wake);
+                replies.take(posted);
+                for (CReplyQueue::Replies& batch : posted) {
+                    auto it = conns.find(batch.sfd);
+                    if (it == conns.end())
+                        continue;
+                    CConnection& conn = it->second;
+                    conn.set_handler_busy(false);
+                    if (conn.is_closing() || batch.failed) {
+                        close_conn(it);
+                        continue;
+                    }
+                    conn.append_output(batch.conn);
+                    if (m_config.latency)
+                        mark_output(conn);
+                    if (handle_frames(conn))
+                        replied.push_back(batch.sfd);
+                    else
+                        close_conn(it);
+                }
+                posted.clear();
+                continue;
+            }
+
+            if (op == uring_op_accept) {
+                if (cqe.res >= 0) {
+                    count_accepted();
+                    auto [it, inserted] = conns.try_emplace(
+                        cqe.res, cqe.res, m_config.persistent,
+                        m_config.max_frame_size, m_buffers);
+                    generation = (generation + 1) & uring_gen_mask;
+                    it->second.set_tag(generation);
+                    if (m_config.latency)
+                        it->second.timestamps().accepted =
+                            accepted_at(cqe.res);
+                    ring.prep_recv_multishot(
+                        cqe.res, uring_bgid,
+                        uring_data(uring_op_recv, it->second));
+                    close_if_done(it);
+                } else if (!stopping && cqe.res != -ECONNABORTED &&
+                           cqe.res != -EINTR && cqe.res != -EMFILE &&
+                           cqe.res != -ENFILE) {
+                    errno = -cqe.res;
+                    throw_error("[Server] ERROR! MSG1022: Failed to accept an "
+                                "incomming request:");
+                }
+                if (!more && !stopping)
+                    ring.prep_accept_multishot(m_listen_sfd, uring_op_accept);
+                continue;
+            }
+
+            // A completion of an earlier connection with the same socket
+            // file descriptor is handled like one of a closed connection.
+            const SOCKET sfd = static_cast<SOCKET>(cqe.user_data);
+            auto it = conns.find(sfd);
+            if (it != conns.end() &&
+                it->second.tag() != (cqe.user_data >> uring_gen_shift))
+                it = conns.end();
+            if (op == uring_op_send) {
+                if (it == conns.end())
+                    continue;
+                CConnection& conn = it->second;
+                conn.set_send_busy(false);
+                if (conn.is_closing() || cqe.res < 0) {
+                    close_conn(it);
+                    continue;
+                }
+                CMetrics::add(Counter::server_bytes_sent,
+                              static_cast<uint64_t>(cqe.res));
+                conn.written(static_cast<size_t>(cqe.res));
+                if (!conn.has_output())
+                    record_since(Phase::write,
+                                 std::exchange(conn.timestamps().output, 0));
+                send_output(conn);
+                close_if_done(it);
+                continue;
+            }
+            if (op != uring_op_recv)
+                continue;
+
+            // The final completion of a cancelled receive.
+            const bool checked{!more && it != conns.end() &&
+                               cancelled.erase(sfd) > 0};
+
+            if (cqe.res > 0) {
+                const uint16_t bid =
+                    static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                CMetrics::add(Counter::server_bytes_received,
+                              static_cast<uint64_t>(cqe.res));
+                if (it != conns.end() && !it->second.is_closing()) {
+                    record_since(
+                        Phase::first_byte,
+                        std::exchange(it->second.timestamps().accepted, 0));
+                    it->second.received(ring.buffer(bid),
+                                        static_cast<size_t>(cqe.res));
+                }
+                ring.recycle_buffer(bid);
+                if (it == conns.end() || it->second.is_closing())
+                    continue;
+                if (!it->second.is_persistent() &&
+                    it->second.buffered() > m_config.max_frame_size) {
+                    // A one shot message that is too large isn't handled.
+                    // Shutdown also terminates its receive operation.
+                    ::shutdown(sfd, SHUT_RDWR);
+                    if (stopping)
+                        m_drained++;
+                    conns.erase(it);
+                    this->dispatch(sfd, CBuffer(), {});
+                    continue;
+                }
+                if (!more)
+                    ring.prep_recv_multishot(sfd, uring_bgid, cqe.user_data);
+                if (it->second.is_persistent()) {
+                    if (handle_frames(it->second))
+                        replied.push_back(sfd);
+                    else
+                        close_conn(it);
+                }
+                continue;
+            }
+            if (it == conns.end() || it->second.is_closing())
+                continue;
+            if (checked && (cqe.res == -ECANCELED || cqe.res == -ENOBUFS)) {
+                // All completions with received bytes are handled. Bytes
+                // that have arrived since then are still in the socket.
+                if (it->second.is_idle() && !input_pending(sfd, MSG_DONTWAIT)) {
+                    close_conn(it);
+                    m_drained++;
+                } else
+                    ring.prep_recv_multishot(sfd, uring_bgid, cqe.user_data);
+                continue;
+            }
+            if (cqe.res == -ENOBUFS) {
+                // All provided buffers were in use, just try again.
+                ring.prep_recv_multishot(sfd, uring_bgid, cqe.user_data);
+                continue;
+            }
+            // End of message (0) or connection error. Replies that are
+            // still pending on a persistent connection are written first.
+            if (it->second.is_persistent() && cqe.res == 0) {
+                it->second.set_eof(true);
+                if (!is_done(it->second))
+                    continue;
+            }
+            if (stopping)
+                m_drained++;
+            if (it->second.is_persistent()) {
+                close_conn(it);
+                continue;
+            }
+            CBuffer owner;
+            std::span<const std::byte> msg{it->second.take_message(owner)};
+            if (cqe.res != 0)
+                msg = {};
+            else if (this->is_quit_message(as_string_view(msg)))
+                this->quit_all();
+            conns.erase(it);
+            this->dispatch(sfd, std::move(owner), msg);
+        }
+
+        // Replies to all frames received with this batch of completions are
+        // sent together.
+        // When stopping a connection without replies is closed if idle.
+        for (SOCKET sfd : replied) {
+            auto it = conns.find(sfd);
+            if (it == conns.end() || it->second.is_closing())
+                continue;
+            send_output(it->second);
+            close_if_done(it);
+        }
+        replied.clear();
+    } // while
+
+    if (stopping)
+        for (auto& conn : conns)
+            if (!conn.second.is_closing())
+                m_closed++;
+
+    // Stop accepting and close connections that are still open. Shutdown
+    // also terminates their pending receive operations. Sends in progress
+    // are cancelled before their output buffers are destroyed. Batches that
+    // are still handled must be posted before their queue is destructed.
+    replies.wait_idle();
+    ring.prep_cancel(uring_op_wake);
+    ring.prep_cancel(uring_op_accept);
+    for (auto& conn : conns) {
+        SOCKET sfd{conn.first};
+        if (conn.second.is_send_busy())
+            ring.prep_cancel(uring_data(uring_op_send, conn.second));
+        ::shutdown(sfd, SHUT_RDWR);
+    }
+    ring.submit_and_wait(0);
+    ::close(wake_fd);
+    for (auto& conn : conns)
+        close_accepted(conn.first);
+#endif
+    TRACE2(this, " [Server] Quit.")
+}
+
+ServerMode CServerTCP::get_mode() const { return m_config.mode; }
+
 bool CServerTCP::ready(int a_delay) const {
-    if (!m_ready)
-        // This is only to aviod busy polling from the calling thread.
-        std::this_thread::sleep_for(std::chrono::microseconds(a_delay));
-    return m_ready;
+    return m_ready.wait(std::chrono::microseconds(a_delay));
 }
 
+bool CServerTCP::wait_ready(std::chrono::microseconds a_timeout) const {
+    return m_ready.wait(a_timeout);
+}
+
+void CServerTCP::on_ready(CReadySignal::Callback a_callback) {
+    m_ready.on_ready(std::move(a_callback));
+}
+
+int CServerTCP::get_ready_fd() { return m_ready.get_fd(); }
+
 bool CServerTCP::is_v6only() const {
     TRACE2(this, " Executing upnplib::CServerTCP::get_v6only()")
     return m_listen_sfd.is_v6only();
@@ -131,4 +1439,26 @@ bool CServerTCP::is_listen() const {
     return m_listen_sfd.is_listen();
 }
 
+unsigned CServerTCP::get_shards() const { return m_config.shards; }
+
+std::vector<CWorkerPool::Stats> CServerTCP::get_worker_stats() const {
+    return m_pool ? m_pool->stats() : std::vector<CWorkerPool::Stats>();
+}
+
+std::vector<CBufferPool::Stats> CServerTCP::get_buffer_stats() const {
+    return m_buffers.stats();
+}
+
+size_t CServerTCP::get_zerocopy_threshold() const {
+    return m_config.zerocopy_threshold;
+}
+
+CServerTCP::ZerocopyStats CServerTCP::get_zerocopy_stats() const {
+    return {m_zc_completed.load(), m_zc_copied.load()};
+}
+
+uint16_t CServerTCP::get_metrics_port() const {
+    return m_metrics ? m_metrics->get_port() : 0;
+}
+
 } // namespace upnplib
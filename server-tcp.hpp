@@ -1,13 +1,106 @@
 #ifndef SERVER_TCP_HPP
 #define SERVER_TCP_HPP
 // Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
-// Redistribution only with this Copyright remark. Last modified: 2023-04-10
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
 
 #include "socket.hpp"
+#include "buffer-pool.hpp"
+#include "frame.hpp"
+#include "message-handler.hpp"
+#include "worker-pool.hpp"
+#include "ready-signal.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <span>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 namespace upnplib {
 
+class CPoller;
+class CUring;
+class CMetricsEndpoint;
+
+// Run modes of the server
+// -----------------------
+// blocking = accept and read one connection after the other on the calling
+//            thread, a slow peer blocks all following peers.
+// epoll    = non-blocking event loop that multiplexes all connections on the
+//            calling thread. It uses epoll on Linux and poll() on other
+//            platforms.
+// io_uring = completion based event loop with multishot accept, multishot
+//            receive into a provided buffer ring and batched submission, so
+//            there is one system call for a batch of operations. Needs Linux
+//            6.0 or later. If io_uring isn't available the server falls back
+//            to blocking mode (see get_mode()).
+enum class ServerMode { blocking, epoll, io_uring };
+
+// Configuration of the server
+// ---------------------------
+struct ServerConfig {
+    ServerMode mode{ServerMode::blocking};
+    // Number of listening sockets that are bound to the same port with
+    // SO_REUSEPORT. Each one is served by its own thread and event loop and
+    // the kernel balances incomming connections over them. It is only used
+    // with epoll mode on Linux, otherwise it is ignored. 1 = no sharding.
+    unsigned shards{1};
+    // Pin the thread of shard n to CPU (n modulo number of CPUs).
+    bool pin_shards{true};
+    // Number of threads of a work-stealing pool that handles complete
+    // messages, so a slow handler doesn't stall the event loop. 0 = handle
+    // messages inline on the thread of the event loop. Frames of a
+    // persistent connection are handled in batches, one batch after the
+    // other, so the replies keep their order. No more bytes are read from
+    // the connection while a batch is handled. Not used with blocking mode.
+    unsigned workers{0};
+    // Keep connections open and exchange messages as length-prefixed frames
+    // (see frame.hpp) instead of one message per connection. Frames with a
+    // payload larger than max_frame_size close the connection, so do one
+    // shot messages without handling them.
+    bool persistent{false};
+    uint32_t max_frame_size{default_max_frame_size};
+    // Handles all received messages except the quit message "Q" if
+    // quit_message is set. Without a handler messages on persistent
+    // connections are echoed and messages on one shot connections are
+    // ignored. Replies on one shot connections are written before the
+    // connection is closed.
+    std::shared_ptr<CMessageHandler> handler;
+    // Pool of the receive and send buffers of the connections.
+    BufferPoolConfig buffers;
+    // Replies of at least this size are sent with MSG_ZEROCOPY on persistent
+    // connections, 0 = never. Pinning the pages and handling the completion
+    // costs more than copying small buffers, so it should not be below 64
+    // KiB. Only available on Linux and not used with io_uring mode.
+    size_t zerocopy_threshold{0};
+    // Options of the listening sockets, e.g. the backlog. On Linux accepted
+    // sockets inherit them, except TCP_QUICKACK that isn't permanent anyway.
+    SocketOptions socket;
+    // Maximal number of connections that are accepted at once when a
+    // listening socket is ready, 0 = until none is pending. Connections
+    // that are left over are accepted on the next round of the event loop,
+    // so a storm of new connections doesn't starve the established ones.
+    // Only used with epoll mode.
+    unsigned accept_batch{64};
+    // Quit the server if a client sends the message "Q" (see quit_server()).
+    // Then any peer can quit the server, so only enable it for tests resp.
+    // trusted networks. Without it the server can only be stopped with
+    // stop(), and "Q" is handled like any other message.
+    bool quit_message{false};
+    // Serve the process wide metrics (see metrics.hpp) in the Prometheus
+    // text format on this second port, "0" = any free port (see
+    // get_metrics_port()). Empty = no metrics endpoint. It is served from
+    // the construction of the server on.
+    std::string metrics_port;
+    // Record the latencies of the phases of connections, see
+    // CMetrics::latency(). It costs a few clock reads per message.
+    bool latency{false};
+};
+
 // Simple TCP Server
 // =================
 // Inspired by https://www.geeksforgeeks.org/socket-programming-cc
@@ -16,15 +109,51 @@ namespace upnplib {
 
 class CServerTCP {
   public:
-    CServerTCP(const std::string& a_port, const bool a_reuse_addr = false);
+    CServerTCP(const std::string& a_port, const bool a_reuse_addr = false,
+               const ServerConfig& a_config = ServerConfig());
     virtual ~CServerTCP();
 
     // Run the server to accept messages. This method can be run in its own
-    // thread.
+    // thread. It returns after a client has sent the quit message "Q", resp.
+    // when the server is stopped.
     virtual void run();
 
-    // Return if the server is ready to run.
+    // Stop the server gracefully and wait until run() has returned. It stops
+    // accepting, with epoll and io_uring mode connections already queued by
+    // the kernel are still accepted. Then a connection is closed as soon as
+    // it has completed its message, a persistent one when it is idle and
+    // the kernel hasn't received more of it. Connections that are left at
+    // a_deadline are closed forcibly. Must be called from
+    // another thread than run(), but not from a message handler. If run()
+    // isn't running it will return at once.
+    struct StopStats {
+        size_t drained; // Connections that were completed after stopping.
+        size_t closed;  // Connections that were closed at the deadline.
+    };
+    StopStats stop(std::chrono::milliseconds a_deadline);
+
+    // Getter for the effective run mode. It may differ from the configured
+    // mode if that isn't available on the running system.
+    ServerMode get_mode() const;
+
+    // Readiness of the server
+    // -----------------------
+    // The server is ready when run() accepts connections, with shards when
+    // all of them do. Incomming connections are queued by the kernel already
+    // from the construction on.
+    //
+    // Return if the server is ready, waiting up to delay microseconds.
     bool ready(int delay) const;
+    // Wait until the server is ready, up to a_timeout. Returns if it is
+    // ready.
+    bool wait_ready(std::chrono::microseconds a_timeout) const;
+    // Call a_callback when the server becomes ready, on the thread that runs
+    // the server, resp. at once if it is already ready.
+    void on_ready(CReadySignal::Callback a_callback);
+    // Getter for a file descriptor that becomes readable when the server is
+    // ready, e.g. to watch it with CPoller. It is -1 if the platform has
+    // none (Microsoft Windows).
+    int get_ready_fd();
 
     // Getter for the v6only flag:
     // true  = server supports only IPv6 protocol stack
@@ -45,10 +174,114 @@ class CServerTCP {
     // false = server is not set to listen
     bool is_listen() const;
 
+    // Getter for the number of listening sockets, each with its own event
+    // loop. It is 1 if the server isn't sharded.
+    unsigned get_shards() const;
+
+    // Getter for the statistics of the workers, e.g. their queue depth. It is
+    // empty if there is no worker pool.
+    std::vector<CWorkerPool::Stats> get_worker_stats() const;
+
+    // Getter for the occupancy of the buffer pool per size class.
+    std::vector<CBufferPool::Stats> get_buffer_stats() const;
+
+    // Getter for the effective zero copy threshold. It is 0 if zero copy
+    // sending isn't used.
+    size_t get_zerocopy_threshold() const;
+
+    // Statistics of zero copy sending.
+    struct ZerocopyStats {
+        uint64_t completed; // Sends completed by the kernel.
+        uint64_t copied;    // Of them, sends the kernel had to copy anyway.
+    };
+    ZerocopyStats get_zerocopy_stats() const;
+
+    // Getter for the port of the metrics endpoint. It is 0 if there is none.
+    uint16_t get_metrics_port() const;
+
   private:
     WINSOCK_INIT_P
-    bool m_ready{false};
+    CReadySignal m_ready;
+    ServerConfig m_config;
+    // Must be destructed after all connections.
+    CBufferPool m_buffers;
     CSocket m_listen_sfd;
+    // Only used with io_uring mode. It must be destructed before the
+    // listening socket because it may still reference it.
+    std::unique_ptr<CUring> m_uring;
+    // Listening sockets of shard 1 to n. Shard 0 uses m_listen_sfd.
+    std::vector<CSocket> m_shard_sfds;
+    // Handles complete messages if configured.
+    std::unique_ptr<CWorkerPool> m_pool;
+    // Serves the metrics if configured.
+    std::unique_ptr<CMetricsEndpoint> m_metrics;
+
+    // Set if the server should quit. Event loops that are running are woken
+    // up with the poller they have registered.
+    std::atomic<bool> m_quit{false};
+    std::mutex m_pollers_mutex;
+    std::vector<CPoller*> m_pollers; // Protected by mutex.
+    void quit_all();
+    void wake_all();
+
+    // Set by stop(), resp. at its deadline. Event loops that can't be woken
+    // up by a poller watch their file descriptors.
+    CReadySignal m_stopping;
+    CReadySignal m_forcing;
+    // Set while run() is running, resp. when it has returned.
+    std::atomic<bool> m_running{false};
+    CReadySignal m_stopped;
+    std::atomic<size_t> m_drained{0};
+    std::atomic<size_t> m_closed{0};
+    // Number of event loops that accept connections. The server is ready
+    // when all shards do.
+    std::atomic<unsigned> m_accepting{0};
+
+    // Run loops of the different server modes.
+    void run_blocking();
+    void run_epoll(SOCKET a_listen_sfd);
+    void run_sharded();
+    void run_io_uring();
+
+    // Helper for the event loops: handle a complete message of a connection
+    // that has already been removed from the event loop and close it. This is
+    // done by the worker pool if there is one. The message is a view into
+    // a_owner, e.g. the receive buffer of the connection, so it isn't copied.
+    void dispatch(SOCKET a_sfd, CBuffer&& a_owner,
+                  std::span<const std::byte> a_msg);
+
+    // Helper: call the handler for the message of a one shot connection and
+    // write its replies. The socket must be blocking.
+    void handle_message(SOCKET a_sfd, std::span<const std::byte> a_msg);
+
+    // Helper for the event loop: accept pending connections up to a_batch
+    // (0 = until none is pending) and register them on the poller.
+    void accept_pending(SOCKET a_listen_sfd, CPoller& a_poller,
+                        std::unordered_map<SOCKET, CConnection>& a_conns,
+                        unsigned a_batch);
+
+    // Helper for the event loops: check if a message is the quit message.
+    bool is_quit_message(std::string_view a_msg) const;
+
+    // Helper for the event loops: give back buffers of completed zero copy
+    // sends of a connection.
+    void drain_zerocopy(CConnection& a_conn);
+    std::atomic<uint64_t> m_zc_completed{0};
+    std::atomic<uint64_t> m_zc_copied{0};
+
+    // Helper for the event loops: handle all complete messages of a
+    // persistent connection. Returns false if the connection must be closed
+    // due to an invalid frame or a failed handler.
+    bool process_messages(CConnection& a_conn);
+
+    // Helper for the event loops: hand all complete messages of a
+    // persistent connection to the worker pool as one batch, unless a batch
+    // of the connection is still handled. The handler queues its replies on
+    // a connection object of the batch that is posted to a_replies when it
+    // is done. The event loop then takes the replies with append_output().
+    // Returns false on an invalid frame.
+    class CReplyQueue;
+    bool submit_messages(CConnection& a_conn, CReplyQueue& a_replies);
 };
 
 } // namespace upnplib
@@ -0,0 +1,581 @@
+// Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+#include "server-udp.hpp"
+#include "port.hpp"
+#include "addrinfo.hpp"
+#include "poller.hpp"
+#include <algorithm>
+#include <thread>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#ifdef __linux__
+#include <netinet/udp.h>
+#endif
+
+// Receive offload (UDP_GRO) is available since Linux 5.0, segmentation
+// offload (UDP_SEGMENT) since Linux 4.18.
+#if defined(__linux__) && defined(UDP_GRO) && defined(UDP_SEGMENT)
+#define UPNPLIB_WITH_UDP_OFFLOAD
+#endif
+
+namespace upnplib {
+
+static inline void throw_error(std::string errmsg) {
+    // error number given by WSAGetLastError(), resp. contained in errno is
+    // used to specify details of the error.
+#ifdef _WIN32
+    throw std::runtime_error(
+        errmsg + " WSAGetLastError()=" + std::to_string(WSAGetLastError()));
+#else
+    throw std::runtime_error(errmsg + " errno(" + std::to_string(errno) +
+                             ")=\"" + std::strerror(errno) + "\"");
+#endif
+}
+
+// Simple UDP Server
+// =================
+// Size of a receive buffer with GRO. The kernel coalesces up to this size.
+constexpr size_t gro_buffer_size{65535};
+
+// Limits of a buffer that is segmented by the kernel: the number of
+// segments, the size of the buffer, and the size of a segment that fits
+// into the MTU of every IPv6 path. Larger replies are sent one by one.
+constexpr unsigned gso_max_segments{64};
+constexpr size_t gso_max_bytes{63 * 1024};
+constexpr size_t gso_max_segment{1232};
+
+// Used if no message handler is configured.
+static CEchoHandler echo_handler;
+
+struct CServerUDP::Batch {
+    // Receive buffers, one slot per datagram.
+    std::vector<std::byte> data;
+    struct Datagram {
+        size_t len{0};
+        size_t segment{0}; // Size of the coalesced datagrams, resp. len.
+        sockaddr_storage peer{};
+        socklen_t peer_len{0};
+        bool truncated{false};
+    };
+    std::vector<Datagram> in;
+
+    // Gathered replies, their buffers are in bufs.
+    struct Reply {
+        size_t buf;   // Index of the first buffer,
+        size_t count; // number of buffers
+        size_t size;  // and their size.
+    };
+    std::vector<Reply> replies;
+    std::vector<std::span<const std::byte>> bufs;
+
+#ifdef __linux__
+    // Messages for recvmmsg() resp. sendmmsg().
+    union Control {
+        cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    };
+    std::vector<mmsghdr> msgs;
+    std::vector<iovec> iovs;
+    std::vector<Control> ctrls;
+    std::vector<unsigned> segs; // Replies per sent message.
+#else
+    std::string linear; // A reply gathered from its buffers.
+#endif
+};
+
+// Confirm all output of a connection without sending it.
+static void clear_output(CConnection& a_conn) {
+    std::span<const std::byte> bufs[max_iov];
+    while (a_conn.has_output()) {
+        const size_t count = a_conn.output(bufs);
+        size_t len{0};
+        for (size_t i{0}; i < count; i++)
+            len += bufs[i].size();
+        a_conn.written(len);
+    }
+}
+
+#ifdef UPNPLIB_WITH_UDP_OFFLOAD
+static bool same_peer(const CConnection& a_conn1, const CConnection& a_conn2) {
+    return a_conn1.peer_len() == a_conn2.peer_len() &&
+           std::memcmp(&a_conn1.peer(), &a_conn2.peer(), a_conn1.peer_len()) ==
+               0;
+}
+
+// Enable an offload on a socket. Returns false if it isn't available.
+static bool set_udp_offload(SOCKET a_sfd, int a_optname, int a_value) {
+    return ::setsockopt(a_sfd, SOL_UDP, a_optname, &a_value,
+                        sizeof(a_value)) == 0;
+}
+#endif
+
+CServerUDP::CServerUDP(const std::string& a_port,
+                       const UdpServerConfig& a_config)
+    : m_config(a_config), m_slot_size(a_config.max_datagram),
+      m_buffers(a_config.buffers), m_sfd(AF_INET6, SOCK_DGRAM) {
+    TRACE2(this, " Construct upnplib::CServerUDP")
+
+    // Get local address information that can be bound to the socket. Like
+    // with CServerTCP it serves both IPv4 and IPv6.
+    CAddrinfo ai("", a_port.c_str(), AF_INET6, SOCK_DGRAM,
+                 AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV);
+
+    // Only Linux balances datagrams over sockets bound with SO_REUSEPORT.
+#ifdef __linux__
+    if (m_config.shards == 0)
+        m_config.shards = 1;
+#else
+    m_config.shards = 1;
+#endif
+    if (m_config.batch == 0)
+        m_config.batch = 1;
+    if (m_config.shards > 1)
+        m_sfd.set_reuse_port();
+    m_sfd.set_options(m_config.socket);
+
+    // Bind socket to a local address.
+    // -------------------------------
+    m_sfd.bind(ai);
+
+    // Sockets of the other shards.
+    // ----------------------------
+    // They bind the port that was actually bound so this also works with an
+    // ephemeral port ("0").
+    if (m_config.shards > 1) {
+        CAddrinfo shard_ai("", std::to_string(m_sfd.get_port()), AF_INET6,
+                           SOCK_DGRAM,
+                           AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV);
+        for (unsigned i{1}; i < m_config.shards; i++) {
+            CSocket sock(AF_INET6, SOCK_DGRAM);
+            sock.set_reuse_port();
+            sock.set_options(m_config.socket);
+            sock.bind(shard_ai);
+            m_shard_sfds.push_back(std::move(sock));
+        }
+    }
+
+    // Enable the offloads if requested.
+    // ---------------------------------
+    // Segmentation is requested per send, here it is only checked if the
+    // kernel knows the option.
+#ifdef UPNPLIB_WITH_UDP_OFFLOAD
+    if (m_config.gro) {
+        m_config.gro = set_udp_offload(m_sfd, UDP_GRO, 1);
+        for (CSocket& sock : m_shard_sfds)
+            m_config.gro = m_config.gro && set_udp_offload(sock, UDP_GRO, 1);
+    }
+    if (m_config.gso)
+        m_config.gso = set_udp_offload(m_sfd, UDP_SEGMENT, 0);
+#else
+    m_config.gro = false;
+    m_config.gso = false;
+#endif
+    if (m_config.gro)
+        m_slot_size = std::max(m_slot_size, gro_buffer_size);
+    m_slot_size = std::max<size_t>(m_slot_size, 1);
+} // end constructor
+
+
+CServerUDP::~CServerUDP() { TRACE2(this, " Destruct upnplib::CServerUDP") }
+
+
+void CServerUDP::run() {
+    // Every shard runs on its own thread, the calling thread only waits for
+    // them. The first exception of a shard quits all shards and is rethrown
+    // here.
+    TRACE2(this, " Executing upnplib::CServerUDP::run()")
+    {
+        std::scoped_lock lock(m_pollers_mutex);
+        m_pollers.clear();
+        for (unsigned i{0}; i < m_config.shards; i++)
+            m_pollers.push_back(std::make_unique<CPoller>());
+    }
+
+    if (m_shard_sfds.empty()) {
+        this->run_socket(m_sfd, *m_pollers[0]);
+        TRACE2(this, " [Server] Quit.")
+        return;
+    }
+
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    auto run_shard = [this, &error_mutex, &error](SOCKET a_sfd,
+                                                  unsigned a_shard) {
+        try {
+            this->run_socket(a_sfd, *m_pollers[a_shard]);
+        } catch (...) {
+            std::scoped_lock lock(error_mutex);
+            if (!error)
+                error = std::current_exception();
+            this->quit_all();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.emplace_back(run_shard, static_cast<SOCKET>(m_sfd), 0);
+    for (unsigned i{0}; i < m_shard_sfds.size(); i++)
+        threads.emplace_back(run_shard, static_cast<SOCKET>(m_shard_sfds[i]),
+                             i + 1);
+    for (std::thread& thread : threads)
+        thread.join();
+
+    if (error)
+        std::rethrow_exception(error);
+    TRACE2(this, " [Server] Quit.")
+}
+
+void CServerUDP::stop() {
+    TRACE2(this, " Executing upnplib::CServerUDP::stop()")
+    this->quit_all();
+}
+
+void CServerUDP::quit_all() {
+    m_quit = true;
+    std::scoped_lock lock(m_pollers_mutex);
+    for (std::unique_ptr<CPoller>& poller : m_pollers)
+        poller->wakeup();
+}
+
+void CServerUDP::run_socket(SOCKET a_sfd, CPoller& a_poller) {
+    // Datagrams are received in batches until none is available. The handler
+    // is called for each one and the replies of a batch are sent together.
+    // Only then the poller waits again. Errors of a single datagram only
+    // drop that datagram but not the server. The method will quit when the
+    // server is stopped, resp. with the quit message if we have received a
+    // datagram that is exactly "Q", also if another shard has received it.
+    TRACE2(this, " executing upnplib::CServerUDP::run_socket()")
+
+    set_nonblocking(a_sfd);
+    a_poller.add(a_sfd, CPoller::READABLE);
+    if (++m_receiving == m_config.shards)
+        m_ready.set();
+
+    Batch batch;
+    batch.data.resize(m_config.batch * m_slot_size);
+    batch.in.resize(m_config.batch);
+#ifdef __linux__
+    batch.msgs.resize(m_config.batch);
+    batch.iovs.resize(m_config.batch);
+    batch.ctrls.resize(m_config.batch);
+#endif
+    // One connection per handled datagram that has replies. They are reused
+    // for the next batches and don't move.
+    std::deque<CConnection> replies;
+
+    while (!m_quit) {
+        const unsigned count = this->receive(a_sfd, batch);
+        if (count == 0) {
+            a_poller.wait(-1);
+            continue;
+        }
+        const size_t used = this->handle(a_sfd, batch, count, replies);
+        if (used > 0)
+            this->send_replies(a_sfd, batch, replies, used);
+    }
+}
+
+unsigned CServerUDP::receive(SOCKET a_sfd, Batch& a_batch) {
+    const unsigned batch{m_config.batch};
+#ifdef __linux__
+    for (unsigned i{0}; i < batch; i++) {
+        Batch::Datagram& dg = a_batch.in[i];
+        a_batch.iovs[i] = {a_batch.data.data() + i * m_slot_size,
+                           m_slot_size};
+        msghdr& hdr = a_batch.msgs[i].msg_hdr;
+        hdr = {};
+        hdr.msg_name = &dg.peer;
+        hdr.msg_namelen = sizeof(dg.peer);
+        hdr.msg_iov = &a_batch.iovs[i];
+        hdr.msg_iovlen = 1;
+        if (m_config.gro) {
+            hdr.msg_control = &a_batch.ctrls[i];
+            hdr.msg_controllen = sizeof(Batch::Control);
+        }
+    }
+    const int count =
+        ::recvmmsg(a_sfd, a_batch.msgs.data(), batch, MSG_DONTWAIT, nullptr);
+    if (count == -1) {
+        if (errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        throw_error("[Server] ERROR! MSG1049: Failed to receive datagrams:");
+    }
+    m_recv_calls++;
+
+    for (int i{0}; i < count; i++) {
+        Batch::Datagram& dg = a_batch.in[i];
+        msghdr& hdr = a_batch.msgs[i].msg_hdr;
+        dg.len = a_batch.msgs[i].msg_len;
+        dg.segment = dg.len;
+        dg.peer_len = hdr.msg_namelen;
+        dg.truncated = hdr.msg_flags & MSG_TRUNC;
+#ifdef UPNPLIB_WITH_UDP_OFFLOAD
+        // Coalesced datagrams all have the given size except the last one.
+        for (cmsghdr* cm = CMSG_FIRSTHDR(&hdr); cm != nullptr;
+             cm = CMSG_NXTHDR(&hdr, cm)) {
+            if (cm->cmsg_level != SOL_UDP || cm->cmsg_type != UDP_GRO)
+                continue;
+            int segment{0};
+            std::memcpy(&segment, CMSG_DATA(cm), sizeof(segment));
+            if (segment > 0)
+                dg.segment = static_cast<size_t>(segment);
+        }
+#endif
+    }
+    return static_cast<unsigned>(count);
+#else
+    unsigned count{0};
+    while (count < batch) {
+        Batch::Datagram& dg = a_batch.in[count];
+        dg.peer_len = sizeof(dg.peer);
+        dg.truncated = false;
+        const int valread = static_cast<int>(::recvfrom(
+            a_sfd, (char*)a_batch.data.data() + count * m_slot_size,
+            static_cast<int>(m_slot_size), 0, (sockaddr*)&dg.peer,
+            &dg.peer_len));
+        if (valread == SOCKET_ERROR) {
+            if (SOCKET_ERRNO_P == EWOULDBLOCK_P)
+                break;
+#ifdef _MSC_VER
+            // The datagram didn't fit into the buffer and is truncated.
+            if (WSAGetLastError() == WSAEMSGSIZE) {
+                dg.len = m_slot_size;
+                dg.segment = dg.len;
+                dg.truncated = true;
+                count++;
+                continue;
+            }
+            // An earlier reply was not delivered.
+            if (WSAGetLastError() == WSAECONNRESET)
+                continue;
+#endif
+            throw_error(
+                "[Server] ERROR! MSG1049: Failed to receive datagrams:");
+        }
+        m_recv_calls++;
+        dg.len = static_cast<size_t>(valread);
+        dg.segment = dg.len;
+        count++;
+    }
+    return count;
+#endif
+}
+
+size_t CServerUDP::handle(SOCKET a_sfd, Batch& a_batch, unsigned a_count,
+                          std::deque<CConnection>& a_replies) {
+    CMessageHandler& handler =
+        m_config.handler ? *m_config.handler : echo_handler;
+    size_t used{0};
+    uint64_t received{0};
+    for (unsigned i{0}; i < a_count; i++) {
+        const Batch::Datagram& dg = a_batch.in[i];
+        if (dg.truncated) {
+            m_dropped++;
+            continue;
+        }
+        const std::byte* data = a_batch.data.data() + i * m_slot_size;
+        for (size_t offset{0}; offset < dg.len; offset += dg.segment) {
+            const std::span<const std::byte> msg(
+                data + offset, std::min(dg.segment, dg.len - offset));
+            received++;
+            if (m_config.quit_message && msg.size() == 1 &&
+                msg[0] == std::byte{'Q'}) {
+                this->quit_all();
+                continue;
+            }
+            if (used == a_replies.size())
+                a_replies.emplace_back(a_sfd, false, default_max_frame_size,
+                                       m_buffers);
+            CConnection& conn = a_replies[used];
+            conn.set_peer(dg.peer, dg.peer_len);
+            try {
+                handler.on_message(msg, conn);
+            } catch ([[maybe_unused]] const std::exception& e) {
+                TRACE2("[Server] Drop datagram: ", e.what())
+                m_failed++;
+                clear_output(conn);
+                continue;
+            }
+            // A reply is gathered from at most max_iov buffers into one
+            // datagram. A longer one would be truncated, so it is dropped.
+            std::span<const std::byte> bufs[max_iov + 1];
+            if (conn.has_output() && conn.output(bufs) > max_iov) {
+                TRACE2("[Server] Drop reply, buffers > ", max_iov)
+                m_dropped++;
+                clear_output(conn);
+                continue;
+            }
+            if (conn.has_output())
+                used++;
+        }
+    }
+    m_received += received;
+    return used;
+}
+
+void CServerUDP::send_replies(SOCKET a_sfd, Batch& a_batch,
+                              std::deque<CConnection>& a_replies,
+                              size_t a_count) {
+    // Gather the replies, each has at most max_iov buffers (see handle()).
+    a_batch.replies.clear();
+    a_batch.bufs.clear();
+    for (size_t r{0}; r < a_count; r++) {
+        std::span<const std::byte> bufs[max_iov];
+        const size_t count = a_replies[r].output(bufs);
+        Batch::Reply reply{a_batch.bufs.size(), count, 0};
+        for (size_t i{0}; i < count; i++) {
+            reply.size += bufs[i].size();
+            a_batch.bufs.push_back(bufs[i]);
+        }
+        a_batch.replies.push_back(reply);
+    }
+
+    uint64_t sent{0};
+    uint64_t dropped{0};
+#ifdef __linux__
+    // Build one message per reply. With GSO consecutive replies to the same
+    // peer become one message if they have the same size, only the last one
+    // may be shorter. The kernel segments it into datagrams again.
+    if (a_batch.iovs.size() < a_batch.bufs.size())
+        a_batch.iovs.resize(a_batch.bufs.size());
+    if (a_batch.msgs.size() < a_count) {
+        a_batch.msgs.resize(a_count);
+        a_batch.ctrls.resize(a_count);
+    }
+    for (size_t i{0}; i < a_batch.bufs.size(); i++)
+        a_batch.iovs[i] = {const_cast<std::byte*>(a_batch.bufs[i].data()),
+                           a_batch.bufs[i].size()};
+    a_batch.segs.clear();
+    size_t nmsgs{0};
+    for (size_t r{0}; r < a_count;) {
+        const size_t first{r};
+        const Batch::Reply& head = a_batch.replies[r];
+        size_t iovlen{head.count};
+        size_t total{head.size};
+        unsigned segs{1};
+        r++;
+#ifdef UPNPLIB_WITH_UDP_OFFLOAD
+        while (m_config.gso && r < a_count && head.size <= gso_max_segment &&
+               segs < gso_max_segments) {
+            const Batch::Reply& next = a_batch.replies[r];
+            if (next.size > head.size || total + next.size > gso_max_bytes ||
+                iovlen + next.count > max_iov ||
+                !same_peer(a_replies[first], a_replies[r]))
+                break;
+            iovlen += next.count;
+            total += next.size;
+            segs++;
+            r++;
+            if (next.size < head.size)
+                break;
+        }
+#endif
+        const CConnection& conn = a_replies[first];
+        msghdr& hdr = a_batch.msgs[nmsgs].msg_hdr;
+        hdr = {};
+        hdr.msg_name = const_cast<sockaddr_storage*>(&conn.peer());
+        hdr.msg_namelen = conn.peer_len();
+        hdr.msg_iov = &a_batch.iovs[head.buf];
+        hdr.msg_iovlen = iovlen;
+#ifdef UPNPLIB_WITH_UDP_OFFLOAD
+        if (segs > 1) {
+            hdr.msg_control = &a_batch.ctrls[nmsgs];
+            hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+            cmsghdr* cm = CMSG_FIRSTHDR(&hdr);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            const uint16_t segment = static_cast<uint16_t>(head.size);
+            std::memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+        }
+#endif
+        a_batch.segs.push_back(segs);
+        nmsgs++;
+    }
+
+    for (size_t done{0}; done < nmsgs;) {
+        const unsigned count = static_cast<unsigned>(
+            std::min<size_t>(nmsgs - done, m_config.batch));
+        const int valsend = ::sendmmsg(a_sfd, &a_batch.msgs[done], count, 0);
+        if (valsend == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EWOULDBLOCK) {
+                // The send buffer is full. The replies are dropped like the
+                // network would drop them.
+                for (; done < nmsgs; done++)
+                    dropped += a_batch.segs[done];
+                break;
+            }
+            // The first message failed, e.g. its peer is unreachable.
+            TRACE2("[Server] Drop reply, errno=", errno)
+            dropped += a_batch.segs[done];
+            done++;
+            continue;
+        }
+        m_send_calls++;
+        for (int i{0}; i < valsend; i++)
+            sent += a_batch.segs[done + static_cast<size_t>(i)];
+        done += static_cast<size_t>(valsend);
+    }
+#else
+    for (size_t r{0}; r < a_count; r++) {
+        const Batch::Reply& reply = a_batch.replies[r];
+        a_batch.linear.clear();
+        for (size_t i{reply.buf}; i < reply.buf + reply.count; i++)
+            a_batch.linear.append(
+                reinterpret_cast<const char*>(a_batch.bufs[i].data()),
+                a_batch.bufs[i].size());
+        const CConnection& conn = a_replies[r];
+        if (::sendto(a_sfd, a_batch.linear.data(),
+                     static_cast<int>(a_batch.linear.size()), 0,
+                     (const sockaddr*)&conn.peer(),
+                     conn.peer_len()) == SOCKET_ERROR) {
+            dropped++;
+            continue;
+        }
+        m_send_calls++;
+        sent++;
+    }
+#endif
+
+    for (size_t r{0}; r < a_count; r++)
+        clear_output(a_replies[r]);
+    m_sent += sent;
+    m_dropped += dropped;
+}
+
+bool CServerUDP::ready(int a_delay) const {
+    return m_ready.wait(std::chrono::microseconds(a_delay));
+}
+
+bool CServerUDP::wait_ready(std::chrono::microseconds a_timeout) const {
+    return m_ready.wait(a_timeout);
+}
+
+void CServerUDP::on_ready(CReadySignal::Callback a_callback) {
+    m_ready.on_ready(std::move(a_callback));
+}
+
+int CServerUDP::get_ready_fd() { return m_ready.get_fd(); }
+
+uint16_t CServerUDP::get_port() const {
+    TRACE2(this, " Executing upnplib::CServerUDP::get_port()")
+    return m_sfd.get_port();
+}
+
+unsigned CServerUDP::get_shards() const { return m_config.shards; }
+
+bool CServerUDP::is_gro() const { return m_config.gro; }
+
+bool CServerUDP::is_gso() const { return m_config.gso; }
+
+CServerUDP::Stats CServerUDP::get_stats() const {
+    return {m_received, m_sent, m_recv_calls, m_send_calls, m_dropped,
+            m_failed};
+}
+
+} // namespace upnplib
@@ -0,0 +1,169 @@
+#ifndef SERVER_UDP_HPP
+#define SERVER_UDP_HPP
+// Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+#include "socket.hpp"
+#include "buffer-pool.hpp"
+#include "connection.hpp"
+#include "message-handler.hpp"
+#include "ready-signal.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace upnplib {
+
+class CPoller;
+
+// Configuration of the datagram server
+// ------------------------------------
+struct UdpServerConfig {
+    // Number of sockets that are bound to the same port with SO_REUSEPORT.
+    // Each one is served by its own thread and the kernel balances the peers
+    // over them. It is only used on Linux, otherwise it is ignored. 1 = no
+    // sharding.
+    unsigned shards{1};
+    // Maximal number of datagrams that are received resp. sent with one
+    // system call. recvmmsg() and sendmmsg() are only available on Linux,
+    // other platforms use one system call per datagram.
+    unsigned batch{64};
+    // Received datagrams that are larger are dropped. With GRO the receive
+    // buffers have the maximal size of a datagram anyway.
+    size_t max_datagram{2048};
+    // Let the kernel coalesce received datagrams of a flow into one buffer
+    // (UDP_GRO), and send consecutive replies of equal size to the same peer
+    // as one buffer that the kernel segments (UDP_SEGMENT). Only available
+    // on Linux, otherwise they are ignored (see is_gro() and is_gso()).
+    bool gro{false};
+    bool gso{false};
+    // Quit the server if a client sends the datagram "Q", like
+    // ServerConfig::quit_message. Then any peer can quit the server, even
+    // with a forged sender address. Without it the server can only be
+    // stopped with stop(), and "Q" is handled like any other datagram.
+    bool quit_message{false};
+    // Handles all received datagrams except the quit message "Q" if
+    // quit_message is set. All replies the handler queues for a datagram are
+    // sent back to its sender as one datagram. It is dropped if it has more
+    // than max_iov buffers, e.g. of borrowed parts. Without a handler
+    // datagrams are echoed.
+    std::shared_ptr<CMessageHandler> handler;
+    // Pool of the reply buffers.
+    BufferPoolConfig buffers;
+    // Options of the sockets, e.g. the receive buffer size. The backlog and
+    // the TCP options are not used.
+    SocketOptions socket;
+};
+
+// Simple UDP Server
+// =================
+// The datagram sibling of CServerTCP. Every datagram is one message that is
+// given to the message handler with a CConnection on the server socket. Its
+// peer (see CConnection::peer()) is the sender of the datagram.
+
+class CServerUDP {
+  public:
+    CServerUDP(const std::string& a_port,
+               const UdpServerConfig& a_config = UdpServerConfig());
+    virtual ~CServerUDP();
+
+    // Run the server to receive datagrams. This method can be run in its own
+    // thread. It returns after a client has sent the quit message "Q", resp.
+    // when the server is stopped.
+    virtual void run();
+
+    // Stop the server. run() returns after the datagrams that all shards
+    // have already received are handled. Must be called from another thread
+    // than run(). If run() isn't running it will return at once when it is
+    // called.
+    void stop();
+
+    // Readiness of the server, like with CServerTCP. The server is ready
+    // when run() receives datagrams, with shards when all of them do.
+    bool ready(int delay) const;
+    bool wait_ready(std::chrono::microseconds a_timeout) const;
+    void on_ready(CReadySignal::Callback a_callback);
+    int get_ready_fd();
+
+    // Getter for the port the server is bound.
+    uint16_t get_port() const;
+
+    // Getter for the number of sockets, each with its own thread. It is 1 if
+    // the server isn't sharded.
+    unsigned get_shards() const;
+
+    // Getter if receive offload resp. segmentation offload is used. This may
+    // differ from the configuration if it isn't available on the running
+    // system.
+    bool is_gro() const;
+    bool is_gso() const;
+
+    // Statistics of the server.
+    struct Stats {
+        uint64_t received;   // Datagrams, a coalesced buffer counts each.
+        uint64_t sent;       // Replies, a segmented buffer counts each.
+        uint64_t recv_calls; // System calls that received datagrams.
+        uint64_t send_calls; // System calls that sent replies.
+        uint64_t dropped;    // Too large datagrams and unsent replies.
+        uint64_t failed;     // Datagrams the handler has thrown on.
+    };
+    Stats get_stats() const;
+
+  private:
+    WINSOCK_INIT_P
+    CReadySignal m_ready;
+    UdpServerConfig m_config;
+    // Size of one receive buffer.
+    size_t m_slot_size;
+    // Must be destructed after all connections.
+    CBufferPool m_buffers;
+    CSocket m_sfd;
+    // Sockets of shard 1 to n. Shard 0 uses m_sfd.
+    std::vector<CSocket> m_shard_sfds;
+
+    // Set if the server should quit. Running shards are woken up with their
+    // poller. The pollers are only created and destructed by run(), guarded
+    // by the mutex because stop() wakes them up from another thread.
+    std::atomic<bool> m_quit{false};
+    std::mutex m_pollers_mutex;
+    std::vector<std::unique_ptr<CPoller>> m_pollers;
+    void quit_all();
+    // Number of shards that receive datagrams.
+    std::atomic<unsigned> m_receiving{0};
+
+    std::atomic<uint64_t> m_received{0};
+    std::atomic<uint64_t> m_sent{0};
+    std::atomic<uint64_t> m_recv_calls{0};
+    std::atomic<uint64_t> m_send_calls{0};
+    std::atomic<uint64_t> m_dropped{0};
+    std::atomic<uint64_t> m_failed{0};
+
+    // Receive and send buffers of one shard, defined by the implementation.
+    struct Batch;
+
+    // Run loop of one shard.
+    void run_socket(SOCKET a_sfd, CPoller& a_poller);
+
+    // Helper for the run loop: receive available datagrams up to the batch
+    // size. Returns their number, 0 if there are none.
+    unsigned receive(SOCKET a_sfd, Batch& a_batch);
+
+    // Helper for the run loop: give the received datagrams to the handler.
+    // Returns the number of connections in a_replies that have output.
+    size_t handle(SOCKET a_sfd, Batch& a_batch, unsigned a_count,
+                  std::deque<CConnection>& a_replies);
+
+    // Helper for the run loop: send the replies and clear their output.
+    void send_replies(SOCKET a_sfd, Batch& a_batch,
+                      std::deque<CConnection>& a_replies, size_t a_count);
+};
+
+} // namespace upnplib
+
+#endif // SERVER_UDP_HPP
@@ -1,12 +1,24 @@
 // Copyright (C) 2021+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
-// Redistribution only with this Copyright remark. Last modified: 2024-01-12
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
 
 #include "socket.hpp"
 #include "port.hpp"
+#include "metrics.hpp"
 
+#include <algorithm>
+#include <chrono>
 #include <string>
 #include <cstring>
 #include <stdexcept>
+#include <utility>
+#include <vector>
+#ifndef _MSC_VER
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/uio.h>
+#endif
 
 namespace upnplib {
 
@@ -29,17 +41,19 @@ CWSAStartup::~CWSAStartup() {
 #endif // MSC_VER
 
 
-static inline void throw_error(std::string errmsg) {
+[[noreturn]] static inline void throw_error(std::string errmsg) {
     // error number given by WSAGetLastError(), resp. contained in errno is
     // used to specify details of the error. It is important that these error
     // numbers hasn't been modified by executing other statements.
 #ifdef _MSC_VER
-    throw std::runtime_error(
-        errmsg + " WSAGetLastError()=" + std::to_string(WSAGetLastError()));
+    std::runtime_error error(errmsg + " WSAGetLastError()=" +
+                             std::to_string(WSAGetLastError()));
 #else
-    throw std::runtime_error(errmsg + " errno(" + std::to_string(errno) +
+    std::runtime_error error(errmsg + " errno(" + std::to_string(errno) +
                              ")=\"" + std::strerror(errno) + "\"");
 #endif
+    CMetrics::count_error(errmsg);
+    throw error;
 }
 
 // Wrap socket() system call
@@ -100,35 +114,24 @@ CSocket::CSocket(int a_domain, int a_type, int a_protocol) {
 
     // Store socket file descriptor and settings
     m_sfd = sfd;
-    m_af = a_domain;
+    m_state = static_cast<uint32_t>(a_domain) & af_mask;
+    CMetrics::add(Counter::sockets);
+    CMetrics::add(Gauge::sockets_open, 1);
 }
 
 // Move constructor
 CSocket::CSocket(CSocket&& that) {
     TRACE2(this, " Construct move upnplib::CSocket()")
-    m_af = that.m_af;
-    that.m_af = -1;
     m_sfd = that.m_sfd;
     that.m_sfd = INVALID_SOCKET;
-
-    // Following variables are protected
-    std::scoped_lock lock(m_bound_mutex, m_listen_mutex);
-    m_bound = that.m_bound;
-    that.m_bound = false;
-    m_listen = that.m_listen;
-    that.m_listen = false;
+    m_state = that.m_state.exchange(0);
 }
 
 // Assignment operator (parameter as value)
 CSocket& CSocket::operator=(CSocket that) {
     TRACE2(this, " Executing upnplib::CSocket::operator=()")
     std::swap(m_sfd, that.m_sfd);
-    std::swap(m_af, that.m_af);
-
-    // Following variables are protected
-    std::scoped_lock lock(m_bound_mutex, m_listen_mutex);
-    std::swap(m_bound, that.m_bound);
-    std::swap(m_listen, that.m_listen);
+    that.m_state = m_state.exchange(that.m_state);
 
     return *this;
 }
@@ -136,6 +139,8 @@ CSocket& CSocket::operator=(CSocket that) {
 // Destructor
 CSocket::~CSocket() {
     TRACE2(this, " Destruct upnplib::CSocket()")
+    if (m_sfd != INVALID_SOCKET)
+        CMetrics::add(Gauge::sockets_open, -1);
     CLOSE_SOCKET_P(m_sfd);
 }
 
@@ -179,29 +184,179 @@ void CSocket::bind(const CAddrinfo& ai) {
             std::to_string(ai->ai_socktype) + ") does not match socket type (" +
             std::to_string(so_option) + ")\"");
 
-    // Protect binding and storing its state (m_bound).
-    std::scoped_lock lock(m_bound_mutex);
-
     if (::bind(m_sfd, ai->ai_addr, ai->ai_addrlen) == SOCKET_ERROR)
         throw_error("ERROR! MSG1009: Due to default socket reuse_addr=false, "
                     "failed to bind socket to an address:");
 
-    m_bound = true;
+    m_state |= bound_flag;
 }
 
 // Setter: set socket to listen
-void CSocket::listen() {
+void CSocket::listen(int a_backlog) {
     TRACE2(this, " Executing upnplib::CSocket::listen()")
 
-    // Protect set listen and storing its state (m_listen).
-    std::scoped_lock lock(m_listen_mutex);
-
-    // Second argument backlog (maximum length of the queue for pending
-    // connections) is hard coded set to 1 for now.
-    if (::listen(m_sfd, 1) != 0)
+    if (::listen(m_sfd, a_backlog) != 0)
         throw_error("ERROR! MSG1010: Failed to set socket to listen:");
 
-    m_listen = true;
+    m_state |= listen_flag;
+}
+
+// Setter: set socket option SO_REUSEPORT
+void CSocket::set_reuse_port([[maybe_unused]] bool a_reuse) {
+    TRACE2(this, " Executing upnplib::CSocket::set_reuse_port()")
+#ifdef SO_REUSEPORT
+    int so_option = a_reuse ? 1 : 0;
+    constexpr socklen_t optlen{sizeof(so_option)};
+    if (::setsockopt(m_sfd, SOL_SOCKET, SO_REUSEPORT, (char*)&so_option,
+                     optlen) != 0)
+        throw_error(
+            "ERROR! MSG1035: Failed to set socket option SO_REUSEPORT:");
+#else
+    throw std::runtime_error("ERROR! MSG1035: Failed to set socket option "
+                             "SO_REUSEPORT: \"not supported\"");
+#endif
+}
+
+void CSocket::set_zerocopy([[maybe_unused]] bool a_zerocopy) {
+    TRACE2(this, " Executing upnplib::CSocket::set_zerocopy()")
+#ifdef UPNPLIB_WITH_ZEROCOPY
+    int so_option = a_zerocopy ? 1 : 0;
+    constexpr socklen_t optlen{sizeof(so_option)};
+    if (::setsockopt(m_sfd, SOL_SOCKET, SO_ZEROCOPY, (char*)&so_option,
+                     optlen) != 0)
+        throw_error("ERROR! MSG1041: Failed to set socket option SO_ZEROCOPY:");
+#else
+    throw std::runtime_error("ERROR! MSG1041: Failed to set socket option "
+                             "SO_ZEROCOPY: \"not supported\"");
+#endif
+}
+
+// Setter: set performance options
+void CSocket::set_nodelay(bool a_nodelay) {
+    this->setsockopt_int(IPPROTO_TCP, TCP_NODELAY, a_nodelay ? 1 : 0,
+                         "TCP_NODELAY");
+}
+
+void CSocket::set_quickack([[maybe_unused]] bool a_quickack) {
+#ifdef TCP_QUICKACK
+    this->setsockopt_int(IPPROTO_TCP, TCP_QUICKACK, a_quickack ? 1 : 0,
+                         "TCP_QUICKACK");
+#else
+    throw std::runtime_error("ERROR! MSG1048: Failed to set socket option "
+                             "TCP_QUICKACK: \"not supported\"");
+#endif
+}
+
+void CSocket::set_rcvbuf(int a_bytes) {
+    this->setsockopt_int(SOL_SOCKET, SO_RCVBUF, a_bytes, "SO_RCVBUF");
+}
+
+void CSocket::set_sndbuf(int a_bytes) {
+    this->setsockopt_int(SOL_SOCKET, SO_SNDBUF, a_bytes, "SO_SNDBUF");
+}
+
+void CSocket::set_busy_poll([[maybe_unused]] int a_usec) {
+#ifdef SO_BUSY_POLL
+    this->setsockopt_int(SOL_SOCKET, SO_BUSY_POLL, a_usec, "SO_BUSY_POLL");
+#else
+    throw std::runtime_error("ERROR! MSG1048: Failed to set socket option "
+                             "SO_BUSY_POLL: \"not supported\"");
+#endif
+}
+
+void CSocket::set_defer_accept([[maybe_unused]] int a_sec) {
+#ifdef TCP_DEFER_ACCEPT
+    this->setsockopt_int(IPPROTO_TCP, TCP_DEFER_ACCEPT, a_sec,
+                         "TCP_DEFER_ACCEPT");
+#else
+    throw std::runtime_error("ERROR! MSG1048: Failed to set socket option "
+                             "TCP_DEFER_ACCEPT: \"not supported\"");
+#endif
+}
+
+void CSocket::set_notsent_lowat([[maybe_unused]] int a_bytes) {
+#ifdef TCP_NOTSENT_LOWAT
+    this->setsockopt_int(IPPROTO_TCP, TCP_NOTSENT_LOWAT, a_bytes,
+                         "TCP_NOTSENT_LOWAT");
+#else
+    throw std::runtime_error("ERROR! MSG1048: Failed to set socket option "
+                             "TCP_NOTSENT_LOWAT: \"not supported\"");
+#endif
+}
+
+void CSocket::set_user_timeout([[maybe_unused]] int a_ms) {
+#ifdef TCP_USER_TIMEOUT
+    this->setsockopt_int(IPPROTO_TCP, TCP_USER_TIMEOUT, a_ms,
+                         "TCP_USER_TIMEOUT");
+#else
+    throw std::runtime_error("ERROR! MSG1048: Failed to set socket option "
+                             "TCP_USER_TIMEOUT: \"not supported\"");
+#endif
+}
+
+void CSocket::set_fastopen([[maybe_unused]] int a_qlen) {
+#ifdef TCP_FASTOPEN
+    this->setsockopt_int(IPPROTO_TCP, TCP_FASTOPEN, a_qlen, "TCP_FASTOPEN");
+#else
+    throw std::runtime_error("ERROR! MSG1048: Failed to set socket option "
+                             "TCP_FASTOPEN: \"not supported\"");
+#endif
+}
+
+void CSocket::set_fastopen_connect([[maybe_unused]] bool a_fastopen) {
+#ifdef TCP_FASTOPEN_CONNECT
+    this->setsockopt_int(IPPROTO_TCP, TCP_FASTOPEN_CONNECT, a_fastopen ? 1 : 0,
+                         "TCP_FASTOPEN_CONNECT");
+#else
+    throw std::runtime_error("ERROR! MSG1048: Failed to set socket option "
+                             "TCP_FASTOPEN_CONNECT: \"not supported\"");
+#endif
+}
+
+void CSocket::set_options(const SocketOptions& a_opts) {
+    TRACE2(this, " Executing upnplib::CSocket::set_options()")
+    if (a_opts.nodelay)
+        this->set_nodelay();
+    if (a_opts.quickack)
+        this->set_quickack();
+    if (a_opts.rcvbuf > 0)
+        this->set_rcvbuf(a_opts.rcvbuf);
+    if (a_opts.sndbuf > 0)
+        this->set_sndbuf(a_opts.sndbuf);
+    if (a_opts.busy_poll_us > 0)
+        this->set_busy_poll(a_opts.busy_poll_us);
+    if (a_opts.defer_accept_s > 0)
+        this->set_defer_accept(a_opts.defer_accept_s);
+    if (a_opts.notsent_lowat > 0)
+        this->set_notsent_lowat(a_opts.notsent_lowat);
+    if (a_opts.user_timeout_ms > 0)
+        this->set_user_timeout(a_opts.user_timeout_ms);
+    if (a_opts.fastopen_qlen > 0)
+        this->set_fastopen(a_opts.fastopen_qlen);
+    if (a_opts.fastopen_connect)
+        this->set_fastopen_connect();
+}
+
+// Asynchronous operations
+CTask<SOCKET> CSocket::async_accept(CExecutor& a_exec) const {
+    return upnplib::async_accept(a_exec, m_sfd);
+}
+
+CTask<void> CSocket::async_connect(CExecutor& a_exec,
+                                   const CAddrinfo& a_addrObj) const {
+    return upnplib::async_connect(a_exec, m_sfd, a_addrObj->ai_addr,
+                                  static_cast<socklen_t>(
+                                      a_addrObj->ai_addrlen));
+}
+
+CTask<size_t> CSocket::async_read(CExecutor& a_exec,
+                                  std::span<std::byte> a_buf) const {
+    return upnplib::async_read(a_exec, m_sfd, a_buf);
+}
+
+CTask<void> CSocket::async_write(CExecutor& a_exec,
+                                 std::span<const std::byte> a_buf) const {
+    return upnplib::async_write(a_exec, m_sfd, a_buf);
 }
 
 // Getter
@@ -234,13 +389,46 @@ bool CSocket::is_reuse_addr() const {
     return this->getsockopt_int(SOL_SOCKET, SO_REUSEADDR, "SO_REUSEADDR");
 }
 
+bool CSocket::is_zerocopy() const {
+    TRACE2(this, " Executing upnplib::CSocket::is_zerocopy()")
+#ifdef UPNPLIB_WITH_ZEROCOPY
+    return this->getsockopt_int(SOL_SOCKET, SO_ZEROCOPY, "SO_ZEROCOPY");
+#else
+    return false;
+#endif
+}
+
+bool CSocket::is_nodelay() const {
+    TRACE2(this, " Executing upnplib::CSocket::is_nodelay()")
+    return this->getsockopt_int(IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY");
+}
+
+int CSocket::get_rcvbuf() const {
+    TRACE2(this, " Executing upnplib::CSocket::get_rcvbuf()")
+    return this->getsockopt_int(SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF");
+}
+
+int CSocket::get_sndbuf() const {
+    TRACE2(this, " Executing upnplib::CSocket::get_sndbuf()")
+    return this->getsockopt_int(SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF");
+}
+
+bool CSocket::is_reuse_port() const {
+    TRACE2(this, " Executing upnplib::CSocket::is_reuse_port()")
+#ifdef SO_REUSEPORT
+    return this->getsockopt_int(SOL_SOCKET, SO_REUSEPORT, "SO_REUSEPORT");
+#else
+    return false;
+#endif
+}
+
 bool CSocket::is_v6only() const {
     TRACE2(this, " Executing upnplib::CSocket::is_v6only()")
     if (m_sfd == INVALID_SOCKET)
         throw std::runtime_error("ERROR! MSG1014: Failed to get socket option "
                                  "'is_v6only': \"Bad file descriptor\"");
     // We can have v6only with AF_INET6. Otherwise always false is returned.
-    return (m_af == AF_INET6)
+    return ((m_state & af_mask) == AF_INET6)
                ? this->getsockopt_int(IPPROTO_IPV6, IPV6_V6ONLY, "IPV6_V6ONLY")
                : false;
 }
@@ -251,9 +439,7 @@ bool CSocket::is_bind() const {
         throw std::runtime_error("ERROR! MSG1015: Failed to get socket option "
                                  "'is_bind': \"Bad file descriptor\"");
 
-    // m_bound is protected.
-    std::scoped_lock lock(m_bound_mutex);
-    return m_bound;
+    return (m_state & bound_flag) != 0;
 }
 
 bool CSocket::is_listen() const {
@@ -262,9 +448,7 @@ bool CSocket::is_listen() const {
         throw std::runtime_error("ERROR! MSG1016: Failed to get socket option "
                                  "'is_Listen': \"Bad file descriptor\"");
 
-    // m_listen is protected.
-    std::scoped_lock lock(m_listen_mutex);
-    return m_listen;
+    return (m_state & listen_flag) != 0;
 }
 
 int CSocket::getsockopt_int(int a_level, int a_optname,
@@ -283,4 +467,252 @@ int CSocket::getsockopt_int(int a_level, int a_optname,
     return so_option;
 }
 
+void CSocket::setsockopt_int(int a_level, int a_optname, int a_value,
+                             const std::string& a_optname_str) {
+    TRACE2(this,
+           " Executing upnplib::CSocket::setsockopt_int(), " + a_optname_str)
+    constexpr socklen_t optlen{sizeof(a_value)};
+    // Type cast (char*)&a_value is needed for Microsoft Windows.
+    if (::setsockopt(m_sfd, a_level, a_optname, (char*)&a_value, optlen) != 0)
+        throw_error("ERROR! MSG1048: Failed to set socket option " +
+                    a_optname_str + ":");
+}
+
+// Slim handle of a connected socket
+// =================================
+CSocketHandle::CSocketHandle(SOCKET a_sfd) noexcept : m_sfd(a_sfd) {}
+
+CSocketHandle::CSocketHandle(CSocketHandle&& that) noexcept
+    : m_sfd(std::exchange(that.m_sfd, INVALID_SOCKET)) {}
+
+CSocketHandle& CSocketHandle::operator=(CSocketHandle that) noexcept {
+    // The old socket is closed with the argument.
+    std::swap(m_sfd, that.m_sfd);
+    return *this;
+}
+
+CSocketHandle::~CSocketHandle() {
+    if (m_sfd != INVALID_SOCKET)
+        CLOSE_SOCKET_P(m_sfd);
+}
+
+CSocketHandle::operator SOCKET() const noexcept { return m_sfd; }
+
+SOCKET CSocketHandle::release() noexcept {
+    return std::exchange(m_sfd, INVALID_SOCKET);
+}
+
+// Set a socket file descriptor to non-blocking or blocking mode
+void set_nonblocking(SOCKET a_sfd, bool a_nonblocking) {
+    TRACE("Executing upnplib::set_nonblocking()")
+#ifdef _MSC_VER
+    u_long mode = a_nonblocking ? 1 : 0;
+    if (::ioctlsocket(a_sfd, FIONBIO, &mode) != 0)
+#else
+    int flags = ::fcntl(a_sfd, F_GETFL, 0);
+    if (flags == -1 ||
+        ::fcntl(a_sfd, F_SETFL,
+                a_nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK)) ==
+            -1)
+#endif
+        throw_error("ERROR! MSG1030: Failed to set socket non-blocking mode:");
+}
+
+// Accept a connection in non-blocking mode
+SOCKET accept_nonblocking(SOCKET a_listen_sfd, sockaddr_storage* a_peer,
+                          socklen_t* a_peerlen) {
+    socklen_t len{sizeof(sockaddr_storage)};
+    sockaddr* addr = reinterpret_cast<sockaddr*>(a_peer);
+#ifdef __linux__
+    SOCKET sfd = ::accept4(a_listen_sfd, addr, a_peer ? &len : nullptr,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    SOCKET sfd = ::accept(a_listen_sfd, addr, a_peer ? &len : nullptr);
+    if (sfd != INVALID_SOCKET) {
+        set_nonblocking(sfd);
+#ifndef _MSC_VER
+        ::fcntl(sfd, F_SETFD, FD_CLOEXEC);
+#endif
+    }
+#endif
+    if (sfd != INVALID_SOCKET && a_peerlen != nullptr)
+        *a_peerlen = a_peer ? len : 0;
+    return sfd;
+}
+
+// Connect to the best address of a node (Happy Eyeballs)
+CSocket connect_happy_eyeballs(const CAddrinfo& a_ai, int a_timeout_ms,
+                               int a_delay_ms) {
+    TRACE("Executing upnplib::connect_happy_eyeballs()")
+    using clock = std::chrono::steady_clock;
+
+    // Alternate the address families. getaddrinfo() has already sorted the
+    // entries by preference (RFC 6724), so the first family is preferred.
+    std::vector<const addrinfo*> preferred;
+    std::vector<const addrinfo*> other;
+    for (const addrinfo& entry : a_ai)
+        (entry.ai_family == a_ai->ai_family ? preferred : other)
+            .push_back(&entry);
+    std::vector<const addrinfo*> candidates;
+    for (size_t i{0}; i < std::max(preferred.size(), other.size()); i++) {
+        if (i < preferred.size())
+            candidates.push_back(preferred[i]);
+        if (i < other.size())
+            candidates.push_back(other[i]);
+    }
+
+    const clock::time_point deadline =
+        clock::now() + std::chrono::milliseconds(a_timeout_ms);
+    clock::time_point next_start = clock::now();
+    size_t next{0};
+    std::vector<CSocket> attempts;
+    std::vector<pollfd> pfds;
+    int error{0}; // Of the last failed attempt.
+
+    for (;;) {
+        const clock::time_point now = clock::now();
+        if (now >= deadline)
+            break;
+        if (next < candidates.size() &&
+            (now >= next_start || attempts.empty())) {
+            // Start the next attempt.
+            const addrinfo* cand = candidates[next++];
+            try {
+                CSocket sock(cand->ai_family, SOCK_STREAM);
+                set_nonblocking(sock);
+                if (::connect(sock, cand->ai_addr,
+                              static_cast<socklen_t>(cand->ai_addrlen)) ==
+                    0) {
+                    set_nonblocking(sock, false);
+                    return sock;
+                }
+                error = SOCKET_ERRNO_P;
+                if (error == EWOULDBLOCK_P || error == EINPROGRESS) {
+                    pollfd pfd{};
+                    pfd.fd = sock;
+                    pfd.events = POLLOUT;
+                    pfds.push_back(pfd);
+                    attempts.push_back(std::move(sock));
+                    next_start = now + std::chrono::milliseconds(a_delay_ms);
+                    continue;
+                }
+            } catch (const std::runtime_error&) {
+                // E.g. the address family isn't supported.
+                error = SOCKET_ERRNO_P;
+            }
+            // The attempt has failed at once, e.g. the network is
+            // unreachable. The next one doesn't wait for the attempt delay
+            // (RFC 8305, section 5).
+            next_start = now;
+            continue;
+        }
+        if (attempts.empty())
+            break; // All attempts have failed.
+
+        // Wait for an attempt to finish, up to the start of the next one.
+        const clock::time_point until =
+            next < candidates.size() ? std::min(deadline, next_start)
+                                     : deadline;
+        const int timeout_ms = static_cast<int>(
+            std::chrono::ceil<std::chrono::milliseconds>(until - now)
+                .count());
+#ifdef _MSC_VER
+        int n = ::WSAPoll(pfds.data(), static_cast<ULONG>(pfds.size()),
+                          timeout_ms);
+#else
+        int n = ::poll(pfds.data(), static_cast<nfds_t>(pfds.size()),
+                       timeout_ms);
+#endif
+        if (n == SOCKET_ERROR) {
+#ifndef _MSC_VER
+            if (errno == EINTR)
+                continue;
+#endif
+            throw_error("ERROR! MSG1047: Failed to connect:");
+        }
+        for (size_t i{pfds.size()}; n > 0 && i > 0; i--) {
+            if (pfds[i - 1].revents == 0)
+                continue;
+            // Getting the error also resets it.
+            error = attempts[i - 1].get_sockerr();
+            if (error == 0) {
+                set_nonblocking(attempts[i - 1], false);
+                return std::move(attempts[i - 1]);
+            }
+            attempts.erase(attempts.begin() + static_cast<ptrdiff_t>(i - 1));
+            pfds.erase(pfds.begin() + static_cast<ptrdiff_t>(i - 1));
+            // Neither does the next one after a failed attempt.
+            next_start = clock::now();
+        }
+    }
+
+    if (!attempts.empty() || next < candidates.size())
+        throw std::runtime_error(
+            "ERROR! MSG1047: Failed to connect: \"timeout\"");
+#ifdef _MSC_VER
+    ::WSASetLastError(error);
+#else
+    errno = error;
+#endif
+    throw_error("ERROR! MSG1047: Failed to connect:");
+}
+
+ssize_t recv_vectored(SOCKET a_sfd,
+                      std::span<const std::span<std::byte>> a_bufs) {
+    const size_t count = std::min(a_bufs.size(), max_iov);
+#ifdef _MSC_VER
+    WSABUF bufs[max_iov];
+    for (size_t i{0}; i < count; i++) {
+        bufs[i].buf = reinterpret_cast<char*>(a_bufs[i].data());
+        bufs[i].len = static_cast<ULONG>(a_bufs[i].size());
+    }
+    DWORD bytes{0};
+    DWORD flags{0};
+    if (::WSARecv(a_sfd, bufs, static_cast<DWORD>(count), &bytes, &flags,
+                  nullptr, nullptr) == SOCKET_ERROR)
+        return SOCKET_ERROR;
+    return static_cast<ssize_t>(bytes);
+#else
+    iovec iov[max_iov];
+    for (size_t i{0}; i < count; i++) {
+        iov[i].iov_base = a_bufs[i].data();
+        iov[i].iov_len = a_bufs[i].size();
+    }
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    return ::recvmsg(a_sfd, &msg, 0);
+#endif
+}
+
+ssize_t send_vectored(SOCKET a_sfd,
+                      std::span<const std::span<const std::byte>> a_bufs,
+                      int a_flags) {
+    const size_t count = std::min(a_bufs.size(), max_iov);
+#ifdef _MSC_VER
+    WSABUF bufs[max_iov];
+    for (size_t i{0}; i < count; i++) {
+        bufs[i].buf =
+            const_cast<char*>(reinterpret_cast<const char*>(a_bufs[i].data()));
+        bufs[i].len = static_cast<ULONG>(a_bufs[i].size());
+    }
+    DWORD bytes{0};
+    if (::WSASend(a_sfd, bufs, static_cast<DWORD>(count), &bytes,
+                  static_cast<DWORD>(a_flags), nullptr,
+                  nullptr) == SOCKET_ERROR)
+        return SOCKET_ERROR;
+    return static_cast<ssize_t>(bytes);
+#else
+    iovec iov[max_iov];
+    for (size_t i{0}; i < count; i++) {
+        iov[i].iov_base = const_cast<std::byte*>(a_bufs[i].data());
+        iov[i].iov_len = a_bufs[i].size();
+    }
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    return ::sendmsg(a_sfd, &msg, MSG_NOSIGNAL | a_flags);
+#endif
+}
+
 } // namespace upnplib
@@ -1,11 +1,21 @@
 #ifndef UPNPLIB_SOCKET_CLASS_HPP
 #define UPNPLIB_SOCKET_CLASS_HPP
 // Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
-// Redistribution only with this Copyright remark. Last modified: 2023-04-13
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
 
 #include "port_sock.hpp"
+#include "port.hpp"
 #include "addrinfo.hpp"
-#include <mutex>
+#include "executor.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+// Sending with MSG_ZEROCOPY is available since Linux 4.14.
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define UPNPLIB_WITH_ZEROCOPY
+#endif
 
 namespace upnplib {
 
@@ -24,6 +34,28 @@ class CWSAStartup {
 #endif
 
 
+// Performance options of a socket
+// -------------------------------
+// Used with CSocket::set_options() and by the configurations of the server
+// and the client. Options with value 0 resp. false are not set, the socket
+// keeps the default of the operating system.
+struct SocketOptions {
+    // Maximal length of the queue of connections that are not accepted yet.
+    // Only used on listen(). The kernel may limit it, e.g. Linux to
+    // net.core.somaxconn.
+    int backlog{SOMAXCONN};
+    bool nodelay{false};          // TCP_NODELAY
+    bool quickack{false};         // TCP_QUICKACK
+    int rcvbuf{0};                // SO_RCVBUF in bytes
+    int sndbuf{0};                // SO_SNDBUF in bytes
+    int busy_poll_us{0};          // SO_BUSY_POLL
+    int defer_accept_s{0};        // TCP_DEFER_ACCEPT
+    int notsent_lowat{0};         // TCP_NOTSENT_LOWAT in bytes
+    int user_timeout_ms{0};       // TCP_USER_TIMEOUT
+    int fastopen_qlen{0};         // TCP_FASTOPEN of a listening socket
+    bool fastopen_connect{false}; // TCP_FASTOPEN_CONNECT before connect()
+};
+
 // Wrap socket() system call
 // -------------------------
 // To copy a socket doesn't make sense. So this class only supports moving a
@@ -71,12 +103,88 @@ class CSocket {
     // this flag has to be managed here. Look for details at
     // REF: [How to get option on MacOS if a socket is set to listen?]
     //      (https://stackoverflow.com/q/75942911/5014688)
-    void listen();
+    // a_backlog is the maximal length of the queue of connections that are
+    // not accepted yet. A short queue drops connection requests on bursts.
+    void listen(int a_backlog = SOMAXCONN);
+
+    // Setter: set socket option SO_REUSEPORT.
+    // Several sockets with this option can bind the same address and port.
+    // On Linux incoming connections are then load balanced over all listening
+    // sockets. It must be set before bind(). Not supported on Microsoft
+    // Windows, there it throws an exception.
+    void set_reuse_port(bool a_reuse = true);
+
+    // Setter: set socket option SO_ZEROCOPY.
+    // Then send() with flag MSG_ZEROCOPY doesn't copy the bytes but pins
+    // their pages until the kernel reports completion on the error queue of
+    // the socket. Sockets accepted from a listening socket inherit the
+    // option. Only supported on Linux, otherwise it throws an exception.
+    void set_zerocopy(bool a_zerocopy = true);
+
+    // Setter: set performance options.
+    // TCP_NODELAY       sends small segments at once, without the Nagle
+    //                   algorithm. Good for request/response latency.
+    // TCP_QUICKACK      acknowledges at once instead of delayed. The kernel
+    //                   may switch back, so it is not permanent.
+    // SO_RCVBUF/SNDBUF  size of the receive resp. send buffer. Set it before
+    //                   connect() resp. listen() for a matching TCP window.
+    // SO_BUSY_POLL      busy polls the device queue up to a_usec on a
+    //                   blocking receive instead of waiting for interrupts.
+    // TCP_DEFER_ACCEPT  wakes up a listening socket only when data has
+    //                   arrived, but at least after a_sec.
+    // TCP_NOTSENT_LOWAT reports a socket writable only if less than a_bytes
+    //                   are not sent yet. Keeps the send buffer short.
+    // TCP_USER_TIMEOUT  aborts the connection if sent data isn't
+    //                   acknowledged within a_ms.
+    // TCP_FASTOPEN      accepts data in the SYN of a connection request
+    //                   with a valid cookie (TCP Fast Open). a_qlen limits
+    //                   the requests that wait for accept() with such data.
+    //                   Set it before listen().
+    // TCP_FASTOPEN_CONNECT  sends the first data of a connection in the SYN.
+    //                   Set it before connect(), that then returns at once
+    //                   and the handshake is done by the first send. The
+    //                   kernel requests a cookie resp. falls back to send
+    //                   after the handshake if it has no valid cookie.
+    // TCP_NODELAY, SO_RCVBUF and SO_SNDBUF are portable, TCP_NOTSENT_LOWAT
+    // and TCP_FASTOPEN are available on Linux and MacOS, the other ones only
+    // on Linux. An option that isn't supported throws an exception. TCP Fast
+    // Open must also be enabled by the system, on Linux with sysctl
+    // net.ipv4.tcp_fastopen.
+    void set_nodelay(bool a_nodelay = true);
+    void set_quickack(bool a_quickack = true);
+    void set_rcvbuf(int a_bytes);
+    void set_sndbuf(int a_bytes);
+    void set_busy_poll(int a_usec);
+    void set_defer_accept(int a_sec);
+    void set_notsent_lowat(int a_bytes);
+    void set_user_timeout(int a_ms);
+    void set_fastopen(int a_qlen);
+    void set_fastopen_connect(bool a_fastopen = true);
+    // Set all options that are given except the backlog.
+    void set_options(const SocketOptions& a_opts);
+
+    // Asynchronous operations
+    // Awaitable with co_await in a coroutine that runs on a_exec, see the
+    // functions of the same name in executor.hpp. async_connect() sets the
+    // socket to non-blocking mode, the other ones need it already. The
+    // address must be valid until the task has finished.
+    CTask<SOCKET> async_accept(CExecutor& a_exec) const;
+    CTask<void> async_connect(CExecutor& a_exec,
+                              const CAddrinfo& a_addrObj) const;
+    CTask<size_t> async_read(CExecutor& a_exec,
+                             std::span<std::byte> a_buf) const;
+    CTask<void> async_write(CExecutor& a_exec,
+                            std::span<const std::byte> a_buf) const;
 
     // Getter
     uint16_t get_port() const;
     int get_sockerr() const;
     bool is_reuse_addr() const;
+    bool is_reuse_port() const;
+    bool is_zerocopy() const;
+    bool is_nodelay() const;
+    int get_rcvbuf() const;
+    int get_sndbuf() const;
     bool is_v6only() const;
     bool is_bind() const;
     bool is_listen() const;
@@ -84,15 +192,41 @@ class CSocket {
   private:
     SOCKET m_sfd{INVALID_SOCKET};
 
-    // Cache if system functions where called.
-    int m_af{-1}; // used address family e.g. AF_INET6
-    mutable std::mutex m_bound_mutex;
-    bool m_bound{false}; // Protected by mutex.
-    mutable std::mutex m_listen_mutex;
-    bool m_listen{false}; // Protected by mutex.
+    // Cache if system functions where called. The state is packed into one
+    // word that is read and modified lock free: the used address family
+    // (e.g. AF_INET6) in the low bits and flags above.
+    static constexpr uint32_t af_mask{0xffff};
+    static constexpr uint32_t bound_flag{1u << 16};
+    static constexpr uint32_t listen_flag{1u << 17};
+    std::atomic<uint32_t> m_state{0};
 
     int getsockopt_int(int a_level, int a_optname,
                        const std::string& a_optname_str) const;
+    void setsockopt_int(int a_level, int a_optname, int a_value,
+                        const std::string& a_optname_str);
+};
+
+// Slim handle of a connected socket
+// ---------------------------------
+// Owns a socket file descriptor, e.g. got from ::accept(), and closes it on
+// destruction. It has no further state and no virtual methods, so it is not
+// larger than the file descriptor. That matters with very many connections.
+// Like CSocket it can only be moved, a moved-from handle contains an
+// INVALID_SOCKET.
+class CSocketHandle final {
+  public:
+    explicit CSocketHandle(SOCKET a_sfd = INVALID_SOCKET) noexcept;
+    CSocketHandle(CSocketHandle&& that) noexcept;
+    CSocketHandle& operator=(CSocketHandle that) noexcept;
+    ~CSocketHandle();
+
+    // Get the socket, e.g.: SOCKET sfd = handle;
+    operator SOCKET() const noexcept;
+    // Give up the ownership without closing the socket.
+    SOCKET release() noexcept;
+
+  private:
+    SOCKET m_sfd;
 };
 
 // Wrapper function to get an integer socket option
@@ -100,6 +234,49 @@ class CSocket {
 bool getsockopt_int(int a_sockfd, int a_level, int a_optname,
                     const std::string& a_optname_str);
 
+// Set a socket file descriptor to non-blocking or blocking mode
+// -------------------------------------------------------------
+// This is also usable with raw file descriptors, e.g. got from ::accept().
+void set_nonblocking(SOCKET a_sfd, bool a_nonblocking = true);
+
+// Accept a connection in non-blocking mode
+// ----------------------------------------
+// Like ::accept() on a listening socket but the new socket is in
+// non-blocking mode and closed on exec(). On Linux this is done with one
+// ::accept4() system call, otherwise with additional calls. The address of
+// the peer is stored in a_peer and a_peerlen if given. Returns
+// INVALID_SOCKET on error, that is given by errno resp. WSAGetLastError().
+SOCKET accept_nonblocking(SOCKET a_listen_sfd,
+                          sockaddr_storage* a_peer = nullptr,
+                          socklen_t* a_peerlen = nullptr);
+
+// Connect to the best address of a node (Happy Eyeballs)
+// -------------------------------------------------------
+// Tries all entries of the address information like RFC 8305: address
+// families alternate, beginning with the family of the first entry.
+// Attempts are non-blocking and race each other. The next attempt is
+// started if the previous ones haven't succeeded after a_delay_ms, or at
+// once if one has failed, also if ::connect() fails synchronously. The
+// first established connection is returned in blocking mode, the others
+// are closed. Throws an exception if all attempts fail or a_timeout_ms has
+// elapsed.
+CSocket connect_happy_eyeballs(const CAddrinfo& a_ai, int a_timeout_ms,
+                               int a_delay_ms = 250);
+
+// Scatter/gather I/O
+// ------------------
+// Receive into resp. send from several buffers with one system call, like
+// ::recv() and ::send() with flags 0 resp. MSG_NOSIGNAL. Sending can add
+// flags, e.g. MSG_ZEROCOPY. Only the first max_iov buffers are used. On
+// error SOCKET_ERROR is returned and the error is given by errno resp.
+// WSAGetLastError().
+constexpr size_t max_iov{64};
+ssize_t recv_vectored(SOCKET a_sfd,
+                      std::span<const std::span<std::byte>> a_bufs);
+ssize_t send_vectored(SOCKET a_sfd,
+                      std::span<const std::span<const std::byte>> a_bufs,
+                      int a_flags = 0);
+
 } // namespace upnplib
 
 #endif // UPNPLIB_SOCKET_CLASS_HPP
@@ -1,12 +1,19 @@
 // Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
-// Redistribution only with this Copyright remark. Last modified: 2024-01-12
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
 
 #include "client-tcp.hpp"
 #include "server-tcp.hpp"
+#include "server-udp.hpp"
 #include "addrinfo.hpp"
+#include "frame.hpp"
+#include "connection.hpp"
+#include "executor.hpp"
+#include "poller.hpp"
+#include "metrics.hpp"
 #include "gmock/gmock.h"
 #include <thread>
 #include <cstring>
+#include <future>
 
 using testing::HasSubstr;
 using testing::StartsWith;
@@ -287,6 +294,128 @@ TEST(SocketTestSuite, listen_successful) {
 }
 #endif
 
+TEST(SocketTestSuite, state_is_read_while_set) {
+    WINSOCK_INIT_P
+
+    CSocket sock(AF_INET6, SOCK_STREAM);
+    const CAddrinfo ai("", "50016", AF_INET6, SOCK_STREAM,
+                       AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV);
+
+    // Test Unit, the getters don't block and see the state once it is set.
+    std::thread t1([&sock, &ai]() {
+        sock.bind(ai);
+        sock.listen();
+    });
+    while (!sock.is_listen())
+        std::this_thread::yield();
+    EXPECT_TRUE(sock.is_bind());
+    t1.join();
+
+    // The state is moved with the socket.
+    CSocket sock2 = std::move(sock);
+    EXPECT_TRUE(sock2.is_bind());
+    EXPECT_TRUE(sock2.is_listen());
+    EXPECT_FALSE(sock2.is_v6only());
+}
+
+TEST(SocketTestSuite, handle_owns_connected_socket) {
+    WINSOCK_INIT_P
+
+    static_assert(sizeof(CSocketHandle) == sizeof(SOCKET));
+    const SOCKET sfd = ::socket(AF_INET6, SOCK_STREAM, 0);
+    ASSERT_NE(sfd, INVALID_SOCKET);
+
+    // Test Unit, the ownership is moved and given up.
+    CSocketHandle handle1(sfd);
+    CSocketHandle handle2 = std::move(handle1);
+    EXPECT_EQ(handle1, INVALID_SOCKET);
+    EXPECT_EQ(handle2, sfd);
+    SOCKET released = handle2.release();
+    EXPECT_EQ(handle2, INVALID_SOCKET);
+    EXPECT_EQ(released, sfd);
+
+    // The socket is closed with the handle.
+    {
+        const CSocketHandle handle3(released);
+    }
+    int so_type{0};
+    socklen_t optlen{sizeof(so_type)};
+    EXPECT_NE(::getsockopt(sfd, SOL_SOCKET, SO_TYPE, (char*)&so_type, &optlen),
+              0);
+}
+
+TEST(SocketTestSuite, set_reuse_port) {
+#ifdef _MSC_VER
+    GTEST_SKIP() << "SO_REUSEPORT is not supported on Microsoft Windows";
+#endif
+    WINSOCK_INIT_P
+
+    const CAddrinfo ai("", "50015", AF_INET6, SOCK_STREAM,
+                       AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV);
+
+    // Test Unit. Two sockets with SO_REUSEPORT can bind the same address.
+    CSocket sock1(AF_INET6, SOCK_STREAM);
+    CSocket sock2(AF_INET6, SOCK_STREAM);
+    EXPECT_FALSE(sock1.is_reuse_port());
+    ASSERT_NO_THROW(sock1.set_reuse_port());
+    ASSERT_NO_THROW(sock2.set_reuse_port());
+    EXPECT_TRUE(sock1.is_reuse_port());
+
+    ASSERT_NO_THROW(sock1.bind(ai));
+    ASSERT_NO_THROW(sock2.bind(ai));
+    EXPECT_EQ(sock2.get_port(), 50015);
+}
+
+TEST(SocketTestSuite, set_zerocopy) {
+    WINSOCK_INIT_P
+    CSocket sock(AF_INET6, SOCK_STREAM);
+#ifdef UPNPLIB_WITH_ZEROCOPY
+    EXPECT_FALSE(sock.is_zerocopy());
+    ASSERT_NO_THROW(sock.set_zerocopy());
+    EXPECT_TRUE(sock.is_zerocopy());
+#else
+    EXPECT_THAT([&sock]() { sock.set_zerocopy(); },
+                ThrowsMessage<std::runtime_error>(HasSubstr("! MSG1041: ")));
+    EXPECT_FALSE(sock.is_zerocopy());
+#endif
+}
+
+TEST(SocketTestSuite, set_performance_options) {
+    WINSOCK_INIT_P
+
+    CSocket sock(AF_INET6, SOCK_STREAM);
+    ASSERT_FALSE(sock.is_nodelay());
+
+    // Test Unit
+    sock.set_nodelay();
+    EXPECT_TRUE(sock.is_nodelay());
+    sock.set_nodelay(false);
+    EXPECT_FALSE(sock.is_nodelay());
+    // The kernel may round the size, Linux doubles it for bookkeeping.
+    sock.set_rcvbuf(64 * 1024);
+    EXPECT_GE(sock.get_rcvbuf(), 64 * 1024);
+
+    SocketOptions opts;
+    opts.nodelay = true;
+    opts.sndbuf = 128 * 1024;
+#ifdef __linux__
+    opts.quickack = true;
+    opts.busy_poll_us = 50;
+    opts.defer_accept_s = 1;
+    opts.notsent_lowat = 16 * 1024;
+    opts.user_timeout_ms = 5000;
+#endif
+    ASSERT_NO_THROW(sock.set_options(opts));
+    EXPECT_TRUE(sock.is_nodelay());
+    EXPECT_GE(sock.get_sndbuf(), 128 * 1024);
+
+    // Errors of the system call are thrown.
+    CSocket invalid_sock;
+    EXPECT_THAT([&invalid_sock]() { invalid_sock.set_rcvbuf(4096); },
+                ThrowsMessage<std::runtime_error>(StartsWith(
+                    "ERROR! MSG1048: Failed to set socket option SO_RCVBUF:")));
+}
+
 TEST(SocketTestSuite, check_af_inet6_v6only) {
     WINSOCK_INIT_P
 
@@ -469,6 +598,404 @@ TEST(AddrinfoTestSuite, assign_other_object_successful) {
     EXPECT_EQ(ai1.port(), 50004);
 }
 
+TEST(AddrinfoTestSuite, copy_and_move_share_the_result) {
+    CAddrinfo ai1("::1", "50008", AF_INET6, SOCK_STREAM,
+                  AI_NUMERICHOST | AI_NUMERICSERV);
+
+    // Test Unit
+    CAddrinfo ai2{ai1};
+    EXPECT_EQ(ai2.operator->(), ai1.operator->());
+    CAddrinfo ai3{std::move(ai2)};
+    EXPECT_EQ(ai3.operator->(), ai1.operator->());
+    EXPECT_EQ(ai2.operator->(), nullptr);
+    ai2 = ai3;
+    EXPECT_EQ(ai2.port(), 50008);
+}
+
+TEST(AddrinfoTestSuite, cache_resolutions) {
+    CAddrinfoCache cache(60000, 60000);
+    addrinfo hints{};
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    hints.ai_family = AF_INET6;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo wrong_hints{hints};
+    wrong_hints.ai_family = AF_INET;
+
+    // Test Unit, the second get is a hit with the same result.
+    std::shared_ptr<const addrinfo> res1 = cache.get("::1", "50009", hints);
+    std::shared_ptr<const addrinfo> res2 = cache.get("::1", "50009", hints);
+    EXPECT_EQ(res1, res2);
+    // Other hints are another entry.
+    EXPECT_THAT(
+        ([&cache, &wrong_hints]() {
+            static_cast<void>(cache.get("::1", "50009", wrong_hints));
+        }),
+        ThrowsMessage<std::runtime_error>(HasSubstr("! MSG1025: ")));
+    // The failure is cached too.
+    EXPECT_THAT(
+        ([&cache, &wrong_hints]() {
+            static_cast<void>(cache.get("::1", "50009", wrong_hints));
+        }),
+        ThrowsMessage<std::runtime_error>(HasSubstr("! MSG1025: ")));
+    CAddrinfoCache::Stats stats = cache.get_stats();
+    EXPECT_EQ(stats.hits, 2);
+    EXPECT_EQ(stats.negative_hits, 1);
+    EXPECT_EQ(stats.misses, 2);
+    EXPECT_EQ(stats.entries, 2);
+
+    // Expired entries are resolved again.
+    cache.clear();
+    cache.set_ttl(0, 0);
+    res2 = cache.get("::1", "50009", hints);
+    EXPECT_NE(res1, res2);
+    EXPECT_EQ(cache.get_stats().entries, 0);
+    EXPECT_EQ(cache.get_stats().misses, 3);
+}
+
+TEST(AddrinfoTestSuite, resolve_asynchronously) {
+    // "localhost" is resolved from the hosts file, no name server is needed.
+    CAddrinfoCache cache(60000, 60000);
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    // Test Unit, the second lookup waits for the first one in flight resp.
+    // takes its cached result.
+    CAddrinfoCache::Result result1 =
+        cache.get_async("localhost", "50010", hints);
+    CAddrinfoCache::Result result2 =
+        cache.get_async("localhost", "50010", hints);
+    std::shared_ptr<const addrinfo> res = result1.get();
+    EXPECT_EQ(result2.get(), res);
+    EXPECT_EQ(CAddrinfo(res).port(), 50010);
+    CAddrinfoCache::Stats stats = cache.get_stats();
+    EXPECT_EQ(stats.misses, 1);
+    EXPECT_EQ(stats.hits + stats.coalesced, 1);
+
+    // A cached result calls back at once.
+    bool called{false};
+    cache.get_async("localhost", "50010", hints,
+                    [&called, &res](CAddrinfoCache::Result a_result) {
+                        called = (a_result.get() == res);
+                    });
+    EXPECT_TRUE(called);
+
+    // Failures are given by the result.
+    hints.ai_flags = AI_NUMERICHOST;
+    CAddrinfoCache::Result failed =
+        cache.get_async("localhost", "50010", hints);
+    EXPECT_THAT(([&failed]() { static_cast<void>(failed.get()); }),
+                ThrowsMessage<std::runtime_error>(HasSubstr("! MSG1025: ")));
+}
+
+TEST(AddrinfoTestSuite, iterate_over_all_entries) {
+    // Get loopback addresses of both families.
+    const CAddrinfo ai("", "4450", AF_UNSPEC, SOCK_STREAM,
+                       AI_NUMERICHOST | AI_NUMERICSERV);
+
+    // Test Unit
+    std::vector<int> families;
+    for (const addrinfo& entry : ai)
+        families.push_back(entry.ai_family);
+    ASSERT_FALSE(families.empty());
+    EXPECT_EQ(families.front(), ai->ai_family);
+    EXPECT_EQ(std::distance(ai.begin(), ai.end()),
+              static_cast<ptrdiff_t>(families.size()));
+    EXPECT_EQ(ai.begin()->ai_next == nullptr, families.size() == 1);
+}
+
+TEST(SocketTestSuite, connect_happy_eyeballs) {
+    WINSOCK_INIT_P
+
+    const CAddrinfo ai("", "4450", AF_UNSPEC, SOCK_STREAM,
+                       AI_NUMERICHOST | AI_NUMERICSERV);
+    if (ai->ai_family != AF_INET6 || ai->ai_next == nullptr ||
+        ai->ai_next->ai_family != AF_INET)
+        GTEST_SKIP() << "loopback addresses are not IPv6 before IPv4";
+
+    // The IPv6 address doesn't answer: its listen queue is full, so further
+    // connects hang. The IPv4 address is fine.
+    CSocket listen6(AF_INET6, SOCK_STREAM);
+    listen6.bind(CAddrinfo("::1", "4450", AF_INET6, SOCK_STREAM,
+                           AI_NUMERICHOST | AI_NUMERICSERV));
+    listen6.listen(1);
+    std::vector<CSocket> fill;
+    for (int i{0}; i < 16; i++) {
+        CSocket sock(AF_INET6, SOCK_STREAM);
+        set_nonblocking(sock);
+        ::connect(sock, ai->ai_addr, ai->ai_addrlen);
+        CPoller poller;
+        poller.add(sock, CPoller::WRITABLE);
+        const bool connected = !poller.wait(100).empty();
+        poller.remove(sock);
+        fill.push_back(std::move(sock));
+        if (!connected)
+            break;
+    }
+    CSocket listen4(AF_INET, SOCK_STREAM);
+    listen4.bind(CAddrinfo("127.0.0.1", "4450", AF_INET, SOCK_STREAM,
+                           AI_NUMERICHOST | AI_NUMERICSERV));
+    listen4.listen();
+
+    // Test Unit, IPv4 wins after the attempt delay instead of waiting for a
+    // SYN timeout of IPv6.
+    const auto start = std::chrono::steady_clock::now();
+    CSocket sock = connect_happy_eyeballs(ai, 5000, 50);
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    EXPECT_LT(elapsed, std::chrono::milliseconds(1000));
+    sockaddr_storage peer{};
+    socklen_t peerlen{sizeof(peer)};
+    ASSERT_EQ(::getpeername(sock, reinterpret_cast<sockaddr*>(&peer),
+                            &peerlen),
+              0);
+    EXPECT_EQ(peer.ss_family, AF_INET);
+
+    // Test Unit, only the hanging address.
+    const CAddrinfo ai6("::1", "4450", AF_INET6, SOCK_STREAM,
+                        AI_NUMERICHOST | AI_NUMERICSERV);
+    EXPECT_THAT(
+        [&ai6]() { connect_happy_eyeballs(ai6, 100); },
+        ThrowsMessage<std::runtime_error>(HasSubstr("! MSG1047: ")));
+}
+
+TEST(FrameTestSuite, decode_frames_from_partial_reads) {
+    std::string stream;
+    append_frame(stream, "Hello");
+    append_frame(stream, "");
+    append_frame(stream, std::string(3000, 'x'));
+
+    // Test Unit, feed the stream byte by byte.
+    CFrameDecoder decoder;
+    std::vector<std::string> msgs;
+    std::string_view payload;
+    for (char c : stream) {
+        decoder.append(&c, 1);
+        while (decoder.next(payload))
+            msgs.emplace_back(payload);
+    }
+    ASSERT_EQ(msgs.size(), 3);
+    EXPECT_EQ(msgs[0], "Hello");
+    EXPECT_EQ(msgs[1], "");
+    EXPECT_EQ(msgs[2], std::string(3000, 'x'));
+    EXPECT_EQ(decoder.buffered(), 0);
+
+    // A frame that exceeds the maximal size is rejected.
+    CFrameDecoder small_decoder(4);
+    small_decoder.append(stream.data(), stream.size());
+    EXPECT_THAT(
+        ([&small_decoder, &payload]() { small_decoder.next(payload); }),
+        ThrowsMessage<std::runtime_error>(HasSubstr("! MSG1036: ")));
+}
+
+TEST(FrameTestSuite, decode_frames_wrapping_around_the_ring) {
+    CFrameDecoder decoder;
+    std::string_view payload;
+
+    // Test Unit, receive frames of 1000 bytes into a ring of 4096 bytes.
+    for (int i{0}; i < 20; i++) {
+        std::string frame;
+        append_frame(frame, std::string(996, static_cast<char>('a' + i)));
+        size_t done{0};
+        for (std::span<std::byte> buf : decoder.prepare(frame.size())) {
+            const size_t len = std::min(buf.size(), frame.size() - done);
+            std::memcpy(buf.data(), frame.data() + done, len);
+            done += len;
+        }
+        ASSERT_EQ(done, frame.size());
+        decoder.commit(frame.size());
+        ASSERT_TRUE(decoder.next(payload));
+        EXPECT_EQ(payload, std::string(996, static_cast<char>('a' + i)));
+        EXPECT_FALSE(decoder.next(payload));
+    }
+}
+
+TEST(FrameTestSuite, take_pending_bytes_with_their_buffer) {
+    CBufferPool pool;
+    CFrameDecoder decoder(default_max_frame_size, pool);
+    const std::string msg(1000, 'm');
+    decoder.append(msg.data(), msg.size());
+
+    // Test Unit, the bytes are not copied and stay valid with their owner.
+    CBuffer owner;
+    const std::span<const std::byte> bytes = decoder.take_pending(owner);
+    EXPECT_EQ(decoder.buffered(), 0);
+    ASSERT_TRUE(owner);
+    EXPECT_GE(bytes.data(), owner.data());
+    EXPECT_LE(bytes.data() + bytes.size(), owner.data() + owner.size());
+    decoder.append("x", 1);
+    EXPECT_EQ(std::string_view(reinterpret_cast<const char*>(bytes.data()),
+                               bytes.size()),
+              msg);
+    // Only the new ring of "x" is left in use.
+    owner.reset();
+    size_t in_use{0};
+    for (const CBufferPool::Stats& stats : pool.stats())
+        in_use += stats.in_use;
+    EXPECT_EQ(in_use, 1);
+}
+
+TEST(FrameTestSuite, prepare_nothing_without_ring) {
+    CFrameDecoder decoder;
+    std::string_view payload;
+
+    // Test Unit, no ring is allocated for nothing.
+    decoder.append("", 0);
+    for (std::span<std::byte> buf : decoder.prepare(0))
+        EXPECT_TRUE(buf.empty());
+    EXPECT_FALSE(decoder.next(payload));
+    // Neither after the ring was taken.
+    decoder.append("x", 1);
+    CBuffer owner;
+    EXPECT_EQ(decoder.take_pending(owner).size(), 1);
+    decoder.append("", 0);
+    EXPECT_EQ(decoder.buffered(), 0);
+    // The ring is allocated again on demand.
+    std::string frame;
+    append_frame(frame, "Hello");
+    decoder.append(frame.data(), frame.size());
+    ASSERT_TRUE(decoder.next(payload));
+    EXPECT_EQ(payload, "Hello");
+}
+
+TEST(ConnectionTestSuite, gather_output_of_replies) {
+    CConnection conn(INVALID_SOCKET, true);
+    static const std::string borrowed(10000, 'b');
+    const std::span<const std::byte> parts[]{
+        std::as_bytes(std::span(borrowed)),
+        std::as_bytes(std::span(borrowed.data(), 5))};
+
+    // Test Unit
+    conn.send(std::string_view("Hello"));
+    conn.send_borrowed(parts);
+    conn.send(parts);
+
+    std::span<const std::byte> bufs[max_iov];
+    ASSERT_EQ(conn.output(bufs), 4);
+    EXPECT_EQ(bufs[0].size(), 2 * frame_header_size + 5);
+    EXPECT_EQ(bufs[1].data(), parts[0].data());
+    EXPECT_EQ(bufs[2].data(), parts[1].data());
+    EXPECT_EQ(bufs[3].size(), frame_header_size + 10005);
+
+    // Replies queued meanwhile do not change the buffers given out.
+    conn.send(std::string_view("World"));
+    conn.written(bufs[0].size() + 10000 + 2);
+    ASSERT_EQ(conn.output(bufs), 3);
+    EXPECT_EQ(bufs[0].size(), 3);
+    EXPECT_EQ(bufs[1].size(), frame_header_size + 10005);
+    EXPECT_EQ(bufs[2].size(), frame_header_size + 5);
+    conn.written(3 + frame_header_size + 10005 + frame_header_size + 5);
+    EXPECT_FALSE(conn.has_output());
+}
+
+TEST(BufferPoolTestSuite, reuse_buffers_of_size_classes) {
+    BufferPoolConfig config;
+    config.min_size = 256;
+    config.max_size = 4096;
+    config.slab_size = 64 * 1024;
+    CBufferPool pool(config);
+    ASSERT_EQ(pool.stats().size(), 5); // 256, 512, 1024, 2048, 4096
+
+    // Test Unit
+    std::byte* data;
+    {
+        CBuffer buf = pool.acquire(300);
+        EXPECT_EQ(buf.size(), 512);
+        data = buf.data();
+        EXPECT_EQ(pool.stats()[1].in_use, 1);
+        EXPECT_EQ(pool.stats()[1].slabs, 1);
+        EXPECT_EQ(pool.stats()[1].buffers, 128);
+    }
+    EXPECT_EQ(pool.stats()[1].in_use, 0);
+    // The buffer given back is taken again from the free list of the thread.
+    EXPECT_EQ(pool.acquire(512).data(), data);
+    EXPECT_EQ(pool.stats()[1].slabs, 1);
+
+    // A buffer that is too large is not pooled.
+    CBuffer large = pool.acquire(5000);
+    EXPECT_EQ(large.size(), 5000);
+    EXPECT_EQ(pool.oversize_in_use(), 1);
+    large.reset();
+    EXPECT_FALSE(large);
+    EXPECT_EQ(pool.oversize_in_use(), 0);
+
+    // Buffers can be given back on another thread.
+    std::vector<CBuffer> bufs;
+    for (int i{0}; i < 100; i++)
+        bufs.push_back(pool.acquire(100));
+    EXPECT_EQ(pool.stats()[0].in_use, 100);
+    std::thread t1([&bufs]() { bufs.clear(); });
+    t1.join();
+    EXPECT_EQ(pool.stats()[0].in_use, 0);
+    EXPECT_EQ(pool.stats()[0].slabs, 1);
+}
+
+TEST(MetricsTestSuite, sum_counters_of_all_threads) {
+    const CMetrics::Snapshot before = CMetrics::snapshot();
+
+    // Test Unit, threads record on their own slots. Slots of finished
+    // threads are still counted.
+    std::vector<std::thread> threads;
+    for (int i{0}; i < 4; i++)
+        threads.emplace_back([] {
+            for (int j{0}; j < 1000; j++)
+                CMetrics::add(Counter::server_messages);
+            CMetrics::add(Gauge::server_connections, 2);
+        });
+    for (std::thread& thread : threads)
+        thread.join();
+    CMetrics::add(Gauge::server_connections, -8);
+    CMetrics::count_error("[Server] ERROR! MSG1022: Failed to accept");
+    CMetrics::count_error("Error without message id");
+
+    const CMetrics::Snapshot after = CMetrics::snapshot();
+    EXPECT_EQ(after.get(Counter::server_messages) -
+                  before.get(Counter::server_messages),
+              4000);
+    EXPECT_EQ(after.get(Gauge::server_connections),
+              before.get(Gauge::server_connections));
+    EXPECT_EQ(after.get_errors(1022), before.get_errors(1022) + 1);
+    EXPECT_THAT(CMetrics::prometheus(),
+                ::testing::AllOf(
+                    ::testing::HasSubstr(
+                        "# TYPE upnplib_server_messages_total counter\n"),
+                    ::testing::HasSubstr(
+                        "upnplib_errors_total{msg=\"MSG1022\"} ")));
+}
+
+TEST(MetricsTestSuite, log_linear_histogram) {
+    CHistogram hist;
+    EXPECT_EQ(hist.percentile(50), 0);
+
+    // Test Unit, small values are exact, large ones within 1/32.
+    for (uint64_t value : {0, 1, 31, 32, 63})
+        EXPECT_EQ(CHistogram::highest_value(CHistogram::bucket(value)),
+                  value);
+    for (uint64_t value : {64ull, 1000ull, 123456789ull, 1ull << 35}) {
+        const uint64_t highest =
+            CHistogram::highest_value(CHistogram::bucket(value));
+        EXPECT_GE(highest, value);
+        EXPECT_LE(highest - value, value / 32);
+    }
+    EXPECT_EQ(CHistogram::bucket(UINT64_MAX), CHistogram::buckets - 1);
+
+    for (uint64_t value{1}; value <= 1000; value++)
+        hist.record(value * 1000);
+    EXPECT_EQ(hist.count(), 1000);
+    EXPECT_EQ(hist.sum(), 500500000);
+    EXPECT_NEAR(hist.percentile(50), 500000, 500000 / 32);
+    EXPECT_NEAR(hist.percentile(99), 990000, 990000 / 32);
+    EXPECT_NEAR(hist.percentile(99.9), 999000, 999000 / 32);
+    EXPECT_EQ(hist.percentile(100), hist.max());
+
+    // Merged histograms are like one histogram with all values.
+    CHistogram other;
+    for (int i{0}; i < 3000; i++)
+        other.record(5);
+    hist.merge(other);
+    EXPECT_EQ(hist.count(), 4000);
+    EXPECT_EQ(hist.percentile(75), 5);
+}
+
 TEST(ServerTcpTestSuite, listen_successful) {
     // Test Unit
     CServerTCP svrObj("4434", true);
@@ -482,6 +1009,1255 @@ TEST(ServerTcpTestSuite, listen_successful) {
     // mock socket functions.
 }
 
+TEST(ServerTcpTestSuite, epoll_serves_concurrent_connections) {
+    // With the blocking mode an idle client would block all following clients
+    // so the quit message would never be read. The event loop must serve it.
+    WINSOCK_INIT_P
+
+    ServerConfig config;
+    config.mode = ServerMode::epoll;
+    config.quit_message = true;
+    CServerTCP svrObj("4435", false, config);
+    std::thread t1(&CServerTCP::run, &svrObj);
+    while (!svrObj.ready(90))
+        ;
+
+    // Open connections that never send anything.
+    const CAddrinfo ai("", "4435", AF_UNSPEC, SOCK_STREAM,
+                       AI_NUMERICHOST | AI_NUMERICSERV);
+    CSocket idle1(AF_INET6, SOCK_STREAM);
+    CSocket idle2(AF_INET6, SOCK_STREAM);
+    ASSERT_EQ(::connect(idle1, ai->ai_addr, ai->ai_addrlen), 0);
+    ASSERT_EQ(::connect(idle2, ai->ai_addr, ai->ai_addrlen), 0);
+
+    // Test Unit
+    ASSERT_NO_THROW(quit_server("4435"));
+    t1.join();
+}
+
+TEST(ServerTcpTestSuite, sharded_server_quits_all_shards) {
+    WINSOCK_INIT_P
+
+    ServerConfig config;
+    config.mode = ServerMode::epoll;
+    config.shards = 4;
+    config.quit_message = true;
+    CServerTCP svrObj("4437", false, config);
+#ifdef __linux__
+    EXPECT_EQ(svrObj.get_shards(), 4);
+#else
+    EXPECT_EQ(svrObj.get_shards(), 1);
+#endif
+    std::thread t1(&CServerTCP::run, &svrObj);
+    while (!svrObj.ready(90))
+        ;
+
+    // Open some idle connections, they are balanced over the shards.
+    const CAddrinfo ai("", "4437", AF_UNSPEC, SOCK_STREAM,
+                       AI_NUMERICHOST | AI_NUMERICSERV);
+    std::vector<CSocket> idle;
+    for (int i{0}; i < 8; i++) {
+        idle.emplace_back(AF_INET6, SOCK_STREAM);
+        ASSERT_EQ(::connect(idle.back(), ai->ai_addr, ai->ai_addrlen), 0);
+    }
+
+    // Test Unit. The quit message only reaches one shard but all must quit.
+    ASSERT_NO_THROW(quit_server("4437"));
+    t1.join();
+}
+
+TEST(ServerTcpTestSuite, signal_readiness) {
+    WINSOCK_INIT_P
+
+    ServerConfig config;
+    config.mode = ServerMode::epoll;
+    config.shards = 2;
+    CServerTCP svrObj("4454", false, config);
+    std::promise<std::thread::id> callback;
+    svrObj.on_ready(
+        [&callback] { callback.set_value(std::this_thread::get_id()); });
+    const int ready_fd = svrObj.get_ready_fd();
+    EXPECT_FALSE(svrObj.wait_ready(std::chrono::milliseconds(1)));
+
+    // Test Unit, all ways to get the signal.
+    std::thread t1(&CServerTCP::run, &svrObj);
+#ifdef _MSC_VER
+    EXPECT_EQ(ready_fd, -1);
+#else
+    CPoller poller;
+    poller.add(ready_fd, CPoller::READABLE);
+    EXPECT_EQ(poller.wait(5000).size(), 1u);
+#endif
+    EXPECT_TRUE(svrObj.wait_ready(std::chrono::seconds(5)));
+    std::future<std::thread::id> callback_thread = callback.get_future();
+    ASSERT_EQ(callback_thread.wait_for(std::chrono::seconds(5)),
+              std::future_status::ready);
+    EXPECT_NE(callback_thread.get(), std::this_thread::get_id());
+    // Too late for a callback, it is called at once.
+    bool called{false};
+    svrObj.on_ready([&called] { called = true; });
+    EXPECT_TRUE(called);
+
+    svrObj.stop(std::chrono::seconds(1));
+    t1.join();
+}
+
+TEST(ServerTcpTestSuite, stop_drains_connections) {
+    WINSOCK_INIT_P
+
+    ServerConfig config;
+    config.mode = ServerMode::epoll;
+    config.persistent = true;
+    CServerTCP svrObj("4455", false, config);
+    std::thread t1(&CServerTCP::run, &svrObj);
+    ASSERT_TRUE(svrObj.wait_ready(std::chrono::seconds(10)));
+
+    // "Q" is only a message by default.
+    CClientConnection idle1("", "4455");
+    idle1.send_frame("Q");
+    EXPECT_EQ(idle1.recv_frame(), "Q");
+    CClientConnection idle2("", "4455");
+    idle2.send_frame("Hello");
+    EXPECT_EQ(idle2.recv_frame(), "Hello");
+    // A connection with the beginning of the next frame is not idle. The
+    // reply shows that the server has received it.
+    const CAddrinfo ai("", "4455", AF_UNSPEC, SOCK_STREAM,
+                       AI_NUMERICHOST | AI_NUMERICSERV);
+    CSocket sock(AF_INET6, SOCK_STREAM);
+    ASSERT_EQ(::connect(sock, ai->ai_addr, ai->ai_addrlen), 0);
+    std::string bytes;
+    append_frame_header(bytes, 1);
+    bytes.append("x\0\0", 3);
+    ASSERT_EQ(::send(sock, bytes.data(), bytes.size(), 0),
+              static_cast<ssize_t>(bytes.size()));
+    CClientConnection busy(std::move(sock));
+    EXPECT_EQ(busy.recv_frame(), "x");
+
+    // Test Unit
+    const CServerTCP::StopStats stats =
+        svrObj.stop(std::chrono::milliseconds(100));
+    t1.join();
+    EXPECT_EQ(stats.drained, 2);
+    EXPECT_EQ(stats.closed, 1);
+    EXPECT_THROW(idle1.recv_frame(), std::runtime_error);
+    EXPECT_THROW(busy.recv_frame(), std::runtime_error);
+    // New connections are refused.
+    CSocket refused(AF_INET6, SOCK_STREAM);
+    EXPECT_NE(::connect(refused, ai->ai_addr, ai->ai_addrlen), 0);
+}
+
+TEST(ServerTcpTestSuite, stop_serves_received_requests) {
+    WINSOCK_INIT_P
+
+    // Echo, but block on the message "wait" until it is released.
+    class CBlockingHandler : public CMessageHandler {
+      public:
+        std::atomic<bool> blocked{false};
+        std::atomic<bool> release{false};
+        void on_message(std::span<const std::byte> a_msg,
+                        CConnection& a_conn) override {
+            if (a_msg.size() == 4 && a_msg[0] == std::byte{'w'}) {
+                blocked = true;
+                while (!release)
+                    std::this_thread::yield();
+            }
+            a_conn.send(a_msg);
+        }
+    };
+    auto handler = std::make_shared<CBlockingHandler>();
+
+    ServerConfig config;
+    config.mode = ServerMode::epoll;
+    config.persistent = true;
+    config.handler = handler;
+    CServerTCP svrObj("4462", false, config);
+    std::thread t1(&CServerTCP::run, &svrObj);
+    ASSERT_TRUE(svrObj.wait_ready(std::chrono::seconds(10)));
+
+    // Test Unit, the server is stopped while a request of an idle
+    // connection is in its socket buffer but not read yet.
+    CClientConnection conn("", "4462");
+    conn.send_frame("Hello");
+    EXPECT_EQ(conn.recv_frame(), "Hello");
+    CClientConnection blocked("", "4462");
+    blocked.send_frame("wait");
+    while (!handler->blocked)
+        std::this_thread::yield();
+    conn.send_frame("late");
+    std::future<CServerTCP::StopStats> stats = std::async(
+        std::launch::async, [&svrObj] {
+            return svrObj.stop(std::chrono::seconds(5));
+        });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    handler->release = true;
+
+    EXPECT_EQ(blocked.recv_frame(), "wait");
+    EXPECT_NO_THROW(EXPECT_EQ(conn.recv_frame(), "late"));
+    EXPECT_EQ(stats.get().drained, 2);
+    t1.join();
+}
+
+TEST(ServerTcpTestSuite, serve_metrics_endpoint) {
+    WINSOCK_INIT_P
+
+    ServerConfig config;
+    config.mode = ServerMode::epoll;
+    config.persistent = true;
+    config.metrics_port = "0";
+    CServerTCP svrObj("4456", false, config);
+    ASSERT_GT(svrObj.get_metrics_port(), 0);
+    std::thread t1(&CServerTCP::run, &svrObj);
+    ASSERT_TRUE(svrObj.wait_ready(std::chrono::seconds(10)));
+    const CMetrics::Snapshot before = CMetrics::snapshot();
+
+    CClientConnection conn("", "4456");
+    conn.send_frame("Hello");
+    EXPECT_EQ(conn.recv_frame(), "Hello");
+    const CMetrics::Snapshot after = CMetrics::snapshot();
+    EXPECT_EQ(after.get(Counter::server_accepted) -
+                  before.get(Counter::server_accepted),
+              1);
+    EXPECT_EQ(after.get(Counter::server_messages) -
+                  before.get(Counter::server_messages),
+              1);
+    EXPECT_EQ(after.get(Counter::client_connects) -
+                  before.get(Counter::client_connects),
+              1);
+    // Header and payload of the frame.
+    EXPECT_EQ(after.get(Counter::server_bytes_received) -
+                  before.get(Counter::server_bytes_received),
+              9);
+    EXPECT_EQ(after.get(Counter::client_bytes_received) -
+                  before.get(Counter::client_bytes_received),
+              9);
+    EXPECT_EQ(after.get(Gauge::server_connections) -
+                  before.get(Gauge::server_connections),
+              1);
+
+    // Test Unit, scrape the metrics.
+    auto http_get = [&svrObj](const std::string& a_path) {
+        const CAddrinfo ai("", std::to_string(svrObj.get_metrics_port()),
+                           AF_UNSPEC, SOCK_STREAM,
+                           AI_NUMERICHOST | AI_NUMERICSERV);
+        CSocket sock(AF_INET6, SOCK_STREAM);
+        EXPECT_EQ(::connect(sock, ai->ai_addr, ai->ai_addrlen), 0);
+        const std::string request{"GET " + a_path +
+                                  " HTTP/1.1\r\nHost: localhost\r\n\r\n"};
+        EXPECT_EQ(::send(sock, request.data(), request.size(), 0),
+                  static_cast<ssize_t>(request.size()));
+        std::string reply;
+        char buf[4096];
+        ssize_t valread;
+        while ((valread = ::recv(sock, buf, sizeof(buf), 0)) > 0)
+            reply.append(buf, static_cast<size_t>(valread));
+        return reply;
+    };
+    const std::string reply = http_get("/metrics");
+    EXPECT_TRUE(reply.starts_with("HTTP/1.1 200 OK\r\n"));
+    EXPECT_THAT(reply, ::testing::HasSubstr(
+                           "\nupnplib_server_accepted_total "));
+    EXPECT_THAT(reply,
+                ::testing::HasSubstr("\nupnplib_server_connections "));
+    EXPECT_TRUE(http_get("/other").starts_with("HTTP/1.1 404 Not Found\r\n"));
+
+    conn.close();
+    svrObj.stop(std::chrono::seconds(1));
+    t1.join();
+    EXPECT_EQ(CMetrics::snapshot().get(Gauge::server_connections),
+              before.get(Gauge::server_connections));
+}
+
+TEST(ServerTcpTestSuite, record_latencies) {
+    WINSOCK_INIT_P
+
+    ServerConfig config;
+    config.mode = ServerMode::epoll;
+    config.persistent = true;
+    config.latency = true;
+    CServerTCP svrObj("4457", false, config);
+    std::thread t1(&CServerTCP::run, &svrObj);
+    ASSERT_TRUE(svrObj.wait_ready(std::chrono::seconds(10)));
+    // Reset the latencies.
+    for (size_t i{0}; i < CMetrics::phases; i++)
+        CMetrics::latency(static_cast<Phase>(i), true);
+
+    CClientConnection conn("", "4457");
+    for (int i{0}; i < 20; i++) {
+        conn.send_frame("Hello");
+        EXPECT_EQ(conn.recv_frame(), "Hello");
+    }
+    conn.close();
+    svrObj.stop(std::chrono::seconds(1));
+    t1.join();
+
+    // Test Unit
+    // The wait in the accept queue is only recorded from 1 ms on.
+    EXPECT_LE(CMetrics::latency(Phase::accept_wait).count(), 1);
+    EXPECT_EQ(CMetrics::latency(Phase::first_byte).count(), 1);
+    EXPECT_EQ(CMetrics::latency(Phase::write).count(), 20);
+    const CHistogram service = CMetrics::latency(Phase::service, true);
+    EXPECT_EQ(service.count(), 20);
+    EXPECT_GT(service.percentile(50), 0);
+    EXPECT_LE(service.percentile(50), service.percentile(99));
+    EXPECT_LE(service.percentile(99), service.percentile(99.9));
+    // Reset on read.
+    EXPECT_EQ(CMetrics::latency(Phase::service).count(), 0);
+    EXPECT_THAT(CMetrics::prometheus(),
+                ::testing::HasSubstr(
+                    "upnplib_server_service_seconds{quantile=\"0.99\"} "));
+}
+
+TEST(ServerTcpTestSuite, worker_pool_handles_messages) {
+    WINSOCK_INIT_P
+
+    ServerConfig config;
+    config.mode = ServerMode::epoll;
+    config.workers = 2;
+    config.quit_message = true;
+    CServerTCP svrObj("4438", false, config);
+    EXPECT_EQ(svrObj.get_worker_stats().size(), 2);
+    std::thread t1(&CServerTCP::run, &svrObj);
+    while (!svrObj.ready(90))
+        ;
+
+    const CAddrinfo ai("", "4438", AF_UNSPEC, SOCK_STREAM,
+                       AI_NUMERICHOST | AI_NUMERICSERV);
+    for (int i{0}; i < 4; i++) {
+        CSocket sock(AF_INET6, SOCK_STREAM);
+        ASSERT_EQ(::connect(sock, ai->ai_addr, ai->ai_addrlen), 0);
+        ASSERT_EQ(::send(sock, "Hello", 5, 0), 5);
+        ::shutdown(sock, SHUT_WR);
+        // Wait until the server has closed the connection.
+        char buf[8];
+        EXPECT_EQ(::recv(sock, buf, sizeof(buf), 0), 0);
+    }
+
+    // Test Unit
+    ASSERT_NO_THROW(quit_server("4438"));
+    t1.join();
+
+    // The connection with the quit message is also handled by a worker. It
+    // may not be finished yet.
+    uint64_t executed{};
+    for (int i{0}; i < 1000 && executed < 5; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        executed = 0;
+        for (const CWorkerPool::Stats& stats : svrObj.get_worker_stats())
+            executed += stats.executed;
+    }
+    EXPECT_EQ(executed, 5);
+}
+
+TEST(ServerTcpTestSuite, worker_pool_handles_frames) {
+    WINSOCK_INIT_P
+
+    // Echo, but block on the message "wait" until it is released.
+    class CBlockingHandler : public CMessageHandler {
+      public:
+        std::atomic<bool> blocked{false};
+        std::atomic<bool> release{false};
+        void on_message(std::span<const std::byte> a_msg,
+                        CConnection& a_conn) override {
+            if (a_msg.size() == 4 && a_msg[0] == std::byte{'w'}) {
+                blocked = true;
+                while (!release)
+                    std::this_thread::yield();
+            }
+            a_conn.send(a_msg);
+        }
+    };
+    auto handler = std::make_shared<CBlockingHandler>();
+
+    ServerConfig config;
+    config.mode = ServerMode::epoll;
+    config.persistent = true;
+    config.workers = 2;
+    config.handler = handler;
+    CServerTCP svrObj("4458", false, config);
+    std::thread t1(&CServerTCP::run, &svrObj);
+    ASSERT_TRUE(svrObj.wait_ready(std::chrono::seconds(10)));
+
+    // Test Unit, a blocked handler doesn't stall the other connections.
+    CClientConnection blocked("", "4458");
+    blocked.send_frame("wait");
+    while (!handler->blocked)
+        std::this_thread::yield();
+    for (int i{0}; i < 10; i++)
+        blocked.send_frame(std::to_string(i));
+    CClientConnection conn("", "4458");
+    conn.send_frame("Hello");
+    EXPECT_EQ(conn.recv_frame(), "Hello");
+    // Frames received meanwhile are answered in order.
+    handler->release = true;
+    EXPECT_EQ(blocked.recv_frame(), "wait");
+    for (int i{0}; i < 10; i++)
+        EXPECT_EQ(blocked.recv_frame(), std::to_string(i));
+
+    svrObj.stop(std::chrono::seconds(1));
+    t1.join();
+    for (const CBufferPool::Stats& stats : svrObj.get_buffer_stats())
+        EXPECT_EQ(stats.in_use, 0) << "size class " << stats.size;
+}
+
+TEST(WorkerPoolTestSuite, idle_workers_steal_tasks) {
+    std::atomic<int> done{0};
+    std::atomic<bool> release{false};
+    {
+        CWorkerPool pool(2);
+        // Block one worker, so the other one must take all other tasks.
+        pool.submit([&release] {
+            while (!release)
+                std::this_thread::yield();
+        });
+        for (int i{0}; i < 100; i++)
+            pool.submit([&done] { done++; });
+        while (done < 100)
+            std::this_thread::yield();
+        release = true;
+        // Test Unit. Destructor finishes all tasks.
+    }
+    EXPECT_EQ(done, 100);
+}
+
+TEST(ServerTcpTestSuite, io_uring_serves_concurrent_connections) {
+    // If io_uring isn't available the server falls back to blocking mode.
+    // Then we cannot test with idle connections.
+    WINSOCK_INIT_P
+
+    ServerConfig config;
+    config.mode = ServerMode::io_uring;
+    config.quit_message = true;
+    CServerTCP svrObj("4436", false, config);
+    if (svrObj.get_mode() != ServerMode::io_uring)
+        GTEST_SKIP() << "io_uring is not available, server uses blocking mode";
+    std::thread t1(&CServerTCP::run, &svrObj);
+    while (!svrObj.ready(90))
+        ;
+
+    // Open a connection that never sends anything and one that sends a
+    // message that is not the quit message.
+    const CAddrinfo ai("", "4436", AF_UNSPEC, SOCK_STREAM,
+                       AI_NUMERICHOST | AI_NUMERICSERV);
+    CSocket idle(AF_INET6, SOCK_STREAM);
+    ASSERT_EQ(::connect(idle, ai->ai_addr, ai->ai_addrlen), 0);
+    {
+        CSocket sock(AF_INET6, SOCK_STREAM);
+        ASSERT_EQ(::connect(sock, ai->ai_addr, ai->ai_addrlen), 0);
+        ASSERT_EQ(::send(sock, "Hello", 5, 0), 5);
+        ::shutdown(sock, SHUT_WR);
+    }
+
+    // Test Unit
+    ASSERT_NO_THROW(quit_server("4436"));
+    t1.join();
+}
+
+TEST(ServerTcpTestSuite, persistent_connection_echoes_frames) {
+    WINSOCK_INIT_P
+
+    const struct {
+        ServerMode mode;
+        const char* port;
+    } servers[]{{ServerMode::blocking, "4439"},
+                {ServerMode::epoll, "4440"},
+                {ServerMode::io_uring, "4441"}};
+
+    for (const auto& server : servers) {
+        ServerConfig config;
+        config.mode = server.mode;
+        config.persistent = true;
+        config.socket.nodelay = true;
+        CServerTCP svrObj(server.port, false, config);
+        std::thread t1(&CServerTCP::run, &svrObj);
+        while (!svrObj.ready(90))
+            ;
+
+        // Test Unit, many messages of different size on one connection. The
+        // large ones do not fit into the socket buffers at once.
+        CClientConnection conn("", server.port);
+        for (size_t size : {0, 1, 5, 1000, 70000, 3, 1000000, 0, 42}) {
+            const std::string msg(size, static_cast<char>('a' + size % 26));
+            conn.send_frame(msg);
+            EXPECT_EQ(conn.recv_frame(), msg);
+        }
+        // Pipelined messages are answered in order.
+        for (int i{0}; i < 10; i++)
+            conn.send_frame(std::to_string(i));
+        for (int i{0}; i < 10; i++)
+            EXPECT_EQ(conn.recv_frame(), std::to_string(i));
+
+        conn.close();
+        svrObj.stop(std::chrono::seconds(1));
+        t1.join();
+
+        // All buffers of the connections are given back to the pool.
+        size_t slabs{0};
+        for (const CBufferPool::Stats& stats : svrObj.get_buffer_stats()) {
+            EXPECT_EQ(stats.in_use, 0) << "size class " << stats.size;
+            slabs += stats.slabs;
+        }
+        EXPECT_GT(slabs, 0);
+    }
+}
+
+TEST(ServerTcpTestSuite, zerocopy_buffers_outlive_closed_connection) {
+    WINSOCK_INIT_P
+
+    ServerConfig config;
+    config.mode = ServerMode::epoll;
+    config.persistent = true;
+    config.zerocopy_threshold = 64 * 1024;
+    CServerTCP svrObj("4461", false, config);
+    if (svrObj.get_zerocopy_threshold() == 0)
+        GTEST_SKIP() << "zero copy sending is not available";
+    std::thread t1(&CServerTCP::run, &svrObj);
+    ASSERT_TRUE(svrObj.wait_ready(std::chrono::seconds(10)));
+
+    // Test Unit, the server closes the first connection right after its
+    // large reply while the client hasn't read it yet. Replies to a second
+    // connection must not overwrite the buffers still sent from.
+    const CAddrinfo ai("", "4461", AF_UNSPEC, SOCK_STREAM,
+                       AI_NUMERICHOST | AI_NUMERICSERV);
+    CSocket sock(AF_INET6, SOCK_STREAM);
+    SocketOptions opts;
+    opts.rcvbuf = 65536;
+    sock.set_options(opts);
+    ASSERT_EQ(::connect(sock, ai->ai_addr, ai->ai_addrlen), 0);
+    const std::string msg1(500000, 'a');
+    std::string bytes;
+    append_frame(bytes, msg1);
+    ASSERT_EQ(::send(sock, bytes.data(), bytes.size(), MSG_NOSIGNAL),
+              static_cast<ssize_t>(bytes.size()));
+    ::shutdown(sock, SHUT_WR);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    CClientConnection conn2("", "4461");
+    const std::string msg2(500000, 'b');
+    for (int i{0}; i < 5; i++) {
+        conn2.send_frame(msg2);
+        EXPECT_EQ(conn2.recv_frame(), msg2);
+    }
+    conn2.close();
+
+    CClientConnection conn1(std::move(sock));
+    EXPECT_NO_THROW(EXPECT_TRUE(conn1.recv_frame() == msg1));
+    EXPECT_THROW(conn1.recv_frame(), std::runtime_error);
+
+    svrObj.stop(std::chrono::seconds(5));
+    t1.join();
+
+    EXPECT_GT(svrObj.get_zerocopy_stats().completed, 0);
+    for (const CBufferPool::Stats& stats : svrObj.get_buffer_stats())
+        EXPECT_EQ(stats.in_use, 0) << "size class " << stats.size;
+}
+
+TEST(ServerTcpTestSuite, half_closed_connection_gets_all_replies) {
+    WINSOCK_INIT_P
+
+    const struct {
+        ServerMode mode;
+        const char* port;
+    } servers[]{{ServerMode::epoll, "4459"}, {ServerMode::io_uring, "4460"}};
+
+    for (const auto& server : servers) {
+        ServerConfig config;
+        config.mode = server.mode;
+        config.persistent = true;
+        CServerTCP svrObj(server.port, false, config);
+        // The blocking mode would block on writing the replies.
+        if (svrObj.get_mode() != server.mode)
+            continue;
+        std::thread t1(&CServerTCP::run, &svrObj);
+        ASSERT_TRUE(svrObj.wait_ready(std::chrono::seconds(10)));
+
+        // Test Unit, pipeline more than the socket buffers take and shut
+        // down sending before reading the replies.
+        const CAddrinfo ai("", server.port, AF_UNSPEC, SOCK_STREAM,
+                           AI_NUMERICHOST | AI_NUMERICSERV);
+        CSocket sock(AF_INET6, SOCK_STREAM);
+        SocketOptions opts;
+        opts.rcvbuf = 65536;
+        sock.set_options(opts);
+        ASSERT_EQ(::connect(sock, ai->ai_addr, ai->ai_addrlen), 0);
+        const std::string msg(500000, 'x');
+        std::string bytes;
+        for (int i{0}; i < 20; i++)
+            append_frame(bytes, std::to_string(i) + msg);
+        size_t done{0};
+        ssize_t valsend{0};
+        while (done < bytes.size() &&
+               (valsend = ::send(sock, bytes.data() + done,
+                                 bytes.size() - done, MSG_NOSIGNAL)) > 0)
+            done += static_cast<size_t>(valsend);
+        EXPECT_EQ(done, bytes.size());
+        ::shutdown(sock, SHUT_WR);
+        CClientConnection conn(std::move(sock));
+        EXPECT_NO_THROW({
+            for (int i{0}; i < 20; i++)
+                EXPECT_EQ(conn.recv_frame(), std::to_string(i) + msg);
+        });
+        // Then the server closes the connection.
+        EXPECT_THROW(conn.recv_frame(), std::runtime_error);
+
+        svrObj.stop(std::chrono::seconds(1));
+        t1.join();
+    }
+}
+
+TEST(ServerTcpTestSuite, accept_connection_storm) {
+    WINSOCK_INIT_P
+
+    // Reply with the port of the peer that was got on accept.
+    class CPeerHandler : public CMessageHandler {
+      public:
+        void on_message(std::span<const std::byte>,
+                        CConnection& a_conn) override {
+            const sockaddr_in6& peer =
+                reinterpret_cast<const sockaddr_in6&>(a_conn.peer());
+            a_conn.send(a_conn.peer_len() > 0
+                            ? std::to_string(ntohs(peer.sin6_port))
+                            : "no peer");
+        }
+    };
+
+    ServerConfig config;
+    config.mode = ServerMode::epoll;
+    config.persistent = true;
+    config.accept_batch = 4;
+    config.handler = std::make_shared<CPeerHandler>();
+    CServerTCP svrObj("4452", false, config);
+    std::thread t1(&CServerTCP::run, &svrObj);
+    while (!svrObj.ready(90))
+        ;
+
+    // Test Unit, many connections are pending at once and accepted in
+    // batches.
+    const CAddrinfo ai("::1", "4452", AF_INET6, SOCK_STREAM,
+                       AI_NUMERICHOST | AI_NUMERICSERV);
+    std::vector<std::unique_ptr<CClientConnection>> conns;
+    std::vector<uint16_t> ports;
+    for (int i{0}; i < 30; i++) {
+        CSocket sock(AF_INET6, SOCK_STREAM);
+        ASSERT_EQ(::connect(sock, ai->ai_addr, ai->ai_addrlen), 0);
+        sockaddr_in6 local{};
+        socklen_t len{sizeof(local)};
+        ::getsockname(sock, reinterpret_cast<sockaddr*>(&local), &len);
+        ports.push_back(ntohs(local.sin6_port));
+        conns.push_back(std::make_unique<CClientConnection>(std::move(sock)));
+    }
+    for (size_t i{0}; i < conns.size(); i++) {
+        conns[i]->send_frame("port?");
+        EXPECT_EQ(conns[i]->recv_frame(), std::to_string(ports[i]));
+    }
+
+    conns.clear();
+    svrObj.stop(std::chrono::seconds(1));
+    t1.join();
+}
+
+TEST(ServerTcpTestSuite, message_handler_replies) {
+    WINSOCK_INIT_P
+
+    // Reply with a borrowed prefix and a copy of the message.
+    class CReplyHandler : public CMessageHandler {
+      public:
+        void on_message(std::span<const std::byte> a_msg,
+                        CConnection& a_conn) override {
+            static constexpr char prefix[]{"Re: "};
+            a_conn.send_borrowed(std::as_bytes(std::span(prefix, 4)));
+            a_conn.send(a_msg);
+            if (a_msg.size() == 5 && a_msg[0] == std::byte{'t'})
+                throw std::runtime_error("throw");
+        }
+    };
+
+    ServerConfig config;
+    config.mode = ServerMode::epoll;
+    config.persistent = true;
+    config.handler = std::make_shared<CReplyHandler>();
+    CServerTCP svrObj("4442", false, config);
+    std::thread t1(&CServerTCP::run, &svrObj);
+    while (!svrObj.ready(90))
+        ;
+
+    // Test Unit, persistent connection.
+    CClientConnection conn("", "4442");
+    conn.send_frame("Hello");
+    EXPECT_EQ(conn.recv_frame(), "Re: ");
+    EXPECT_EQ(conn.recv_frame(), "Hello");
+    // A failing handler closes only its connection.
+    conn.send_frame("throw");
+    EXPECT_THAT([&conn]() { conn.recv_frame(); },
+                ThrowsMessage<std::runtime_error>(HasSubstr("! MSG1039: ")));
+    svrObj.stop(std::chrono::seconds(1));
+    t1.join();
+
+    // Test Unit, one shot connection. The reply is not framed.
+    config.persistent = false;
+    config.workers = 1;
+    CServerTCP svrObj2("4443", false, config);
+    std::thread t2(&CServerTCP::run, &svrObj2);
+    while (!svrObj2.ready(90))
+        ;
+    const CAddrinfo ai("", "4443", AF_UNSPEC, SOCK_STREAM,
+                       AI_NUMERICHOST | AI_NUMERICSERV);
+    CSocket sock(AF_INET6, SOCK_STREAM);
+    ASSERT_EQ(::connect(sock, ai->ai_addr, ai->ai_addrlen), 0);
+    ASSERT_EQ(::send(sock, "Hi", 2, 0), 2);
+    ::shutdown(sock, SHUT_WR);
+    char buf[16];
+    std::string reply;
+    ssize_t valread;
+    while ((valread = ::recv(sock, buf, sizeof(buf), 0)) > 0)
+        reply.append(buf, static_cast<size_t>(valread));
+    EXPECT_EQ(reply, "Re: Hi");
+
+    svrObj2.stop(std::chrono::seconds(1));
+    t2.join();
+}
+
+TEST(ServerTcpTestSuite, limit_one_shot_message_size) {
+    WINSOCK_INIT_P
+
+    // Reply with the size of the message.
+    class CSizeHandler : public CMessageHandler {
+      public:
+        void on_message(std::span<const std::byte> a_msg,
+                        CConnection& a_conn) override {
+            a_conn.send(std::to_string(a_msg.size()));
+        }
+    };
+
+    ServerConfig config;
+    config.mode = ServerMode::epoll;
+    config.max_frame_size = 1000;
+    config.handler = std::make_shared<CSizeHandler>();
+    CServerTCP svrObj("4464", false, config);
+    std::thread t1(&CServerTCP::run, &svrObj);
+    ASSERT_TRUE(svrObj.wait_ready(std::chrono::seconds(10)));
+
+    const CAddrinfo ai("", "4464", AF_UNSPEC, SOCK_STREAM,
+                       AI_NUMERICHOST | AI_NUMERICSERV);
+    auto request = [&ai](const std::string& a_msg, bool a_shutdown) {
+        CSocket sock(AF_INET6, SOCK_STREAM);
+        EXPECT_EQ(::connect(sock, ai->ai_addr, ai->ai_addrlen), 0);
+        // Don't wait forever for a server that doesn't close.
+        timeval timeout{5, 0};
+        ::setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout,
+                     sizeof(timeout));
+        EXPECT_EQ(::send(sock, a_msg.data(), a_msg.size(), MSG_NOSIGNAL),
+                  static_cast<ssize_t>(a_msg.size()));
+        if (a_shutdown)
+            ::shutdown(sock, SHUT_WR);
+        std::string reply;
+        char buf[16];
+        ssize_t valread;
+        while ((valread = ::recv(sock, buf, sizeof(buf), 0)) > 0)
+            reply.append(buf, static_cast<size_t>(valread));
+        EXPECT_FALSE(valread < 0 && errno == EWOULDBLOCK)
+            << "server didn't close the connection";
+        return reply;
+    };
+
+    // Test Unit, a message that is too large closes the connection without
+    // waiting for end of file.
+    EXPECT_EQ(request(std::string(5000, 'x'), false), "");
+    EXPECT_EQ(request(std::string(1000, 'x'), true), "1000");
+
+    svrObj.stop(std::chrono::seconds(1));
+    t1.join();
+}
+
+TEST(ServerTcpTestSuite, zerocopy_sends_large_replies) {
+    WINSOCK_INIT_P
+
+    ServerConfig config;
+    config.mode = ServerMode::epoll;
+    config.persistent = true;
+    config.zerocopy_threshold = 64 * 1024;
+    CServerTCP svrObj("4444", false, config);
+    if (svrObj.get_zerocopy_threshold() == 0)
+        GTEST_SKIP() << "zero copy sending is not available";
+    std::thread t1(&CServerTCP::run, &svrObj);
+    while (!svrObj.ready(90))
+        ;
+
+    // Test Unit, large replies are sent with zero copy, small ones not.
+    CClientConnection conn("", "4444");
+    for (int i{0}; i < 5; i++) {
+        const std::string msg(1000000, static_cast<char>('a' + i));
+        conn.send_frame(msg);
+        conn.send_frame("small");
+        EXPECT_EQ(conn.recv_frame(), msg);
+        EXPECT_EQ(conn.recv_frame(), "small");
+    }
+    conn.close();
+    svrObj.stop(std::chrono::seconds(1));
+    t1.join();
+
+    EXPECT_GT(svrObj.get_zerocopy_stats().completed, 0);
+    // Buffers are given back also if their completion wasn't received.
+    for (const CBufferPool::Stats& stats : svrObj.get_buffer_stats())
+        EXPECT_EQ(stats.in_use, 0) << "size class " << stats.size;
+}
+
+TEST(ServerUdpTestSuite, echo_datagrams_in_batches) {
+    WINSOCK_INIT_P
+
+    UdpServerConfig config;
+    config.batch = 16;
+    config.gro = true;
+    config.gso = true;
+    CServerUDP svrObj("4453", config);
+    std::thread t1(&CServerUDP::run, &svrObj);
+    while (!svrObj.ready(90))
+        ;
+
+    // Test Unit, datagrams of equal size may be coalesced resp. segmented by
+    // the kernel but must arrive separately and in order.
+    const CAddrinfo ai("::1", "4453", AF_INET6, SOCK_DGRAM,
+                       AI_NUMERICHOST | AI_NUMERICSERV);
+    CSocket sock(AF_INET6, SOCK_DGRAM);
+    ASSERT_EQ(::connect(sock, ai->ai_addr, ai->ai_addrlen), 0);
+    for (int i{0}; i < 50; i++) {
+        const std::string msg = std::to_string(100 + i) + std::string(97, '.');
+        ASSERT_EQ(::send(sock, msg.data(), 100, 0), 100);
+    }
+    char buffer[2048];
+    for (int i{0}; i < 50; i++) {
+        ASSERT_EQ(::recv(sock, buffer, sizeof(buffer), 0), 100);
+        EXPECT_EQ(std::string(buffer, 3), std::to_string(100 + i));
+    }
+    // "Q" is only a datagram by default.
+    ASSERT_EQ(::send(sock, "Q", 1, 0), 1);
+    ASSERT_EQ(::recv(sock, buffer, sizeof(buffer), 0), 1);
+    EXPECT_EQ(buffer[0], 'Q');
+
+    svrObj.stop();
+    t1.join();
+
+    const CServerUDP::Stats stats = svrObj.get_stats();
+    EXPECT_EQ(stats.received, 51u);
+    EXPECT_EQ(stats.sent, 51u);
+    EXPECT_LE(stats.recv_calls, 51u);
+    EXPECT_EQ(stats.dropped, 0u);
+    EXPECT_EQ(stats.failed, 0u);
+#ifdef __linux__
+    EXPECT_TRUE(svrObj.is_gso());
+#endif
+}
+
+TEST(ServerUdpTestSuite, drop_reply_with_too_many_buffers) {
+    WINSOCK_INIT_P
+
+    // Reply with one borrowed buffer per byte of the message.
+    class CPartsHandler : public CMessageHandler {
+      public:
+        void on_message(std::span<const std::byte> a_msg,
+                        CConnection& a_conn) override {
+            static constexpr char part[]{"."};
+            for (size_t i{0}; i < a_msg.size(); i++)
+                a_conn.send_borrowed(std::as_bytes(std::span(part, 1)));
+        }
+    };
+
+    UdpServerConfig config;
+    config.handler = std::make_shared<CPartsHandler>();
+    CServerUDP svrObj("4463", config);
+    std::thread t1(&CServerUDP::run, &svrObj);
+    ASSERT_TRUE(svrObj.wait_ready(std::chrono::seconds(10)));
+
+    // Test Unit, a reply that doesn't fit into one send call isn't sent
+    // truncated.
+    const CAddrinfo ai("::1", "4463", AF_INET6, SOCK_DGRAM,
+                       AI_NUMERICHOST | AI_NUMERICSERV);
+    CSocket sock(AF_INET6, SOCK_DGRAM);
+    ASSERT_EQ(::connect(sock, ai->ai_addr, ai->ai_addrlen), 0);
+    const std::string large(max_iov + 1, 'x');
+    const std::string small(max_iov, 'y');
+    ASSERT_EQ(::send(sock, large.data(), large.size(), 0),
+              static_cast<ssize_t>(large.size()));
+    ASSERT_EQ(::send(sock, small.data(), small.size(), 0),
+              static_cast<ssize_t>(small.size()));
+    char buffer[2048];
+    EXPECT_EQ(::recv(sock, buffer, sizeof(buffer), 0),
+              static_cast<ssize_t>(max_iov));
+
+    svrObj.stop();
+    t1.join();
+    const CServerUDP::Stats stats = svrObj.get_stats();
+    EXPECT_EQ(stats.received, 2u);
+    EXPECT_EQ(stats.sent, 1u);
+    EXPECT_EQ(stats.dropped, 1u);
+}
+
+TEST(ClientTcpTestSuite, pool_reuses_healthy_connections) {
+    WINSOCK_INIT_P
+
+    ServerConfig config;
+    config.mode = ServerMode::epoll;
+    config.persistent = true;
+    CServerTCP svrObj("4445", false, config);
+    std::thread t1(&CServerTCP::run, &svrObj);
+    while (!svrObj.ready(90))
+        ;
+
+    ClientConfig client_config;
+    client_config.min_idle = 2;
+    client_config.max_idle = 3;
+    client_config.socket.nodelay = true;
+    CClientTCP client(client_config);
+
+    // Test Unit, the first request connects the minimal idle connections in
+    // advance, the following ones reuse them.
+    EXPECT_EQ(client.request("", "4445", "Hello"), "Hello");
+    EXPECT_EQ(client.idle("", "4445"), 3);
+    for (int i{0}; i < 5; i++)
+        EXPECT_EQ(client.request("", "4445", std::to_string(i)),
+                  std::to_string(i));
+    CClientTCP::Stats stats = client.get_stats();
+    EXPECT_EQ(stats.connects, 3);
+    EXPECT_EQ(stats.reuses, 5);
+    EXPECT_EQ(stats.broken, 0);
+
+    // A connection with an unread reply fails the health check.
+    {
+        CClientTCP::CLease lease = client.checkout("", "4445");
+        lease->send_frame("unread");
+        while (lease->is_healthy())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    // A discarded connection is not given back. Checkout has skipped the
+    // broken connection and replaced it.
+    {
+        CClientTCP::CLease lease = client.checkout("", "4445");
+        lease.discard();
+        EXPECT_FALSE(lease);
+    }
+    EXPECT_EQ(client.idle("", "4445"), 2);
+    EXPECT_EQ(client.request("", "4445", "World"), "World");
+    stats = client.get_stats();
+    EXPECT_EQ(stats.connects, 5);
+    EXPECT_EQ(stats.reuses, 8);
+    EXPECT_EQ(stats.broken, 1);
+
+    client.clear();
+    svrObj.stop(std::chrono::seconds(1));
+    t1.join();
+    EXPECT_EQ(client.idle("", "4445"), 0);
+}
+
+TEST(ClientTcpTestSuite, connect_to_address_times_out) {
+    WINSOCK_INIT_P
+
+    // A listening socket that doesn't accept drops handshakes when its
+    // backlog is full.
+    CSocket listen_sock(AF_INET, SOCK_STREAM);
+    CAddrinfo ai_listen("", "4466", AF_INET, SOCK_STREAM,
+                        AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV);
+    ASSERT_NO_THROW(listen_sock.bind(ai_listen));
+    ASSERT_NO_THROW(listen_sock.listen(0));
+    const CAddrinfo ai("127.0.0.1", "4466", AF_INET, SOCK_STREAM,
+                       AI_NUMERICHOST | AI_NUMERICSERV);
+    std::vector<CSocket> pending;
+    for (int i{0}; i < 4; i++) {
+        CSocket& sock = pending.emplace_back(AF_INET, SOCK_STREAM);
+        set_nonblocking(sock);
+        ::connect(sock, ai->ai_addr, ai->ai_addrlen);
+    }
+
+    // Test Unit
+    const auto start = std::chrono::steady_clock::now();
+    EXPECT_THAT(
+        [&ai] {
+            CClientConnection conn(ai->ai_addr, ai->ai_addrlen,
+                                   default_max_frame_size, {}, 200);
+        },
+        ThrowsMessage<std::runtime_error>(HasSubstr("\"timeout\"")));
+    EXPECT_LT(std::chrono::steady_clock::now() - start,
+              std::chrono::seconds(5));
+}
+
+TEST(ClientTcpTestSuite, pool_resolves_address_again) {
+    WINSOCK_INIT_P
+
+    ServerConfig config;
+    config.mode = ServerMode::epoll;
+    config.persistent = true;
+    CServerTCP svrObj("4467", false, config);
+    std::thread t1(&CServerTCP::run, &svrObj);
+    while (!svrObj.ready(90))
+        ;
+    CAddrinfoCache& cache = CAddrinfoCache::global();
+    auto lookups = [&cache] {
+        const CAddrinfoCache::Stats stats = cache.get_stats();
+        return stats.hits + stats.misses + stats.coalesced;
+    };
+    CClientTCP client;
+
+    // Test Unit, new connections use the address of the first one until the
+    // time to live of the cache has expired.
+    cache.set_ttl(500, 5000);
+    EXPECT_EQ(client.request("", "4467", "Hello"), "Hello");
+    const size_t resolved = lookups();
+    client.clear();
+    EXPECT_EQ(client.request("", "4467", "Hello"), "Hello");
+    EXPECT_EQ(lookups(), resolved);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    cache.set_ttl(60000, 5000);
+    client.clear();
+    EXPECT_EQ(client.request("", "4467", "Hello"), "Hello");
+    EXPECT_EQ(lookups(), resolved + 1);
+
+    // A failed address is resolved again.
+    client.clear();
+    svrObj.stop(std::chrono::seconds(1));
+    t1.join();
+    EXPECT_THROW(client.request("", "4467", "Hello"), std::runtime_error);
+    EXPECT_EQ(lookups(), resolved + 2);
+}
+
+TEST(ClientTcpTestSuite, fastopen_requests) {
+    WINSOCK_INIT_P
+
+    ServerConfig config;
+    config.mode = ServerMode::epoll;
+    config.persistent = true;
+#ifdef __linux__
+    config.socket.fastopen_qlen = 16;
+#endif
+    CServerTCP svrObj("4451", false, config);
+    std::thread t1(&CServerTCP::run, &svrObj);
+    while (!svrObj.ready(90))
+        ;
+
+    // Every request gets a new connection.
+    ClientConfig client_config;
+    client_config.max_idle = 0;
+    client_config.socket.fastopen_connect = true;
+    CClientTCP client(client_config);
+
+    // Test Unit, the first connection races the addresses without TCP Fast
+    // Open. Whether the following ones are hits depends on the cookie and
+    // on the system settings, but all requests are served.
+    for (int i{0}; i < 4; i++)
+        EXPECT_EQ(client.request("", "4451", std::to_string(i)),
+                  std::to_string(i));
+    const std::string_view msgs[]{"a", "b", "c"};
+    EXPECT_EQ(client.pipeline("", "4451", msgs),
+              (std::vector<std::string>{"a", "b", "c"}));
+    CClientTCP::Stats stats = client.get_stats();
+    EXPECT_EQ(stats.connects, 5);
+#ifdef __linux__
+    EXPECT_EQ(stats.fastopen_hits + stats.fastopen_misses, 4);
+#endif
+
+    client.clear();
+    svrObj.stop(std::chrono::seconds(1));
+    t1.join();
+}
+
+TEST(ClientTcpTestSuite, pipeline_requests) {
+    WINSOCK_INIT_P
+
+    const struct {
+        ServerMode mode;
+        const char* port;
+    } servers[]{{ServerMode::blocking, "4446"}, {ServerMode::epoll, "4447"}};
+
+    // Many small messages and some that do not fit into the socket buffers.
+    std::vector<std::string> msgs;
+    for (size_t i{0}; i < 2000; i++)
+        msgs.push_back(i % 500 == 7 ? std::string(300000, 'x')
+                                    : std::to_string(i));
+    const std::vector<std::string_view> views(msgs.begin(), msgs.end());
+
+    for (const auto& server : servers) {
+        ServerConfig config;
+        config.mode = server.mode;
+        config.persistent = true;
+        CServerTCP svrObj(server.port, false, config);
+        std::thread t1(&CServerTCP::run, &svrObj);
+        while (!svrObj.ready(90))
+            ;
+
+        // Test Unit, replies are matched in order.
+        CClientTCP client;
+        EXPECT_EQ(client.pipeline("", server.port, views), msgs);
+        EXPECT_EQ(client.pipeline("", server.port, {}),
+                  std::vector<std::string>());
+        // The connection is still usable afterwards.
+        EXPECT_EQ(client.request("", server.port, "Hello"), "Hello");
+        EXPECT_EQ(client.get_stats().connects, 1);
+
+        client.clear();
+        svrObj.stop(std::chrono::seconds(1));
+        t1.join();
+    }
+}
+
+TEST(ClientTcpTestSuite, exchange_frames_with_io_uring) {
+    WINSOCK_INIT_P
+
+    ServerConfig config;
+    config.mode = ServerMode::epoll;
+    config.persistent = true;
+    CServerTCP svrObj("4465", false, config);
+    std::thread t1(&CServerTCP::run, &svrObj);
+    while (!svrObj.ready(90))
+        ;
+
+    CClientConnection conn("", "4465");
+    if (!conn.use_io_uring()) {
+        conn.close();
+        svrObj.stop(std::chrono::seconds(1));
+        t1.join();
+        GTEST_SKIP() << "io_uring is not available, client uses blocking "
+                        "system calls";
+    }
+    EXPECT_TRUE(conn.is_io_uring());
+
+    // Test Unit
+    conn.send_frame("Hello");
+    EXPECT_EQ(conn.recv_frame(), "Hello");
+    // Some messages do not fit into the socket buffers.
+    std::vector<std::string> msgs;
+    for (size_t i{0}; i < 100; i++)
+        msgs.push_back(i % 50 == 7 ? std::string(300000, 'x')
+                                   : std::to_string(i));
+    const std::vector<std::string_view> views(msgs.begin(), msgs.end());
+    EXPECT_EQ(conn.pipeline(views), msgs);
+
+    conn.close();
+    svrObj.stop(std::chrono::seconds(1));
+    t1.join();
+}
+
+// Coroutines of a server and its clients that echo frames.
+static CTask<> echo_connection(CExecutor& a_exec, SOCKET a_sfd) {
+    CConnection conn(a_sfd, true);
+    for (;;) {
+        const size_t len =
+            co_await async_read(a_exec, a_sfd, conn.receive_buffers());
+        if (len == 0)
+            break;
+        conn.received(len);
+        std::string_view msg;
+        while (conn.next_message(msg))
+            conn.send(msg);
+        while (conn.has_output()) {
+            const std::string_view out = conn.output();
+            co_await async_write(a_exec, a_sfd, std::as_bytes(std::span(out)));
+            conn.written(out.size());
+        }
+    }
+    CLOSE_SOCKET_P(a_sfd);
+}
+
+static CTask<> echo_server(CExecutor& a_exec, const CSocket& a_listen,
+                           int a_count) {
+    for (int i{0}; i < a_count; i++) {
+        const SOCKET sfd = co_await a_listen.async_accept(a_exec);
+        a_exec.spawn(echo_connection(a_exec, sfd));
+    }
+}
+
+static CTask<> echo_client(CExecutor& a_exec, const CAddrinfo& a_ai,
+                           int& a_echoed) {
+    CSocket sock(AF_INET6, SOCK_STREAM);
+    co_await sock.async_connect(a_exec, a_ai);
+    CFrameDecoder frames;
+    for (int i{0}; i < 10; i++) {
+        std::string frame;
+        append_frame(frame, std::to_string(i));
+        co_await sock.async_write(a_exec, std::as_bytes(std::span(frame)));
+        std::string_view reply;
+        while (!frames.next(reply)) {
+            std::span<std::byte> buf = frames.prepare(64)[0];
+            frames.commit(co_await sock.async_read(a_exec, buf));
+        }
+        if (reply == std::to_string(i))
+            a_echoed++;
+    }
+    ::shutdown(sock, SHUT_RDWR);
+}
+
+static CTask<> connect_refused(CExecutor& a_exec, const CAddrinfo& a_ai,
+                               std::string& a_error) {
+    CSocket sock(AF_INET6, SOCK_STREAM);
+    try {
+        co_await sock.async_connect(a_exec, a_ai);
+    } catch (const std::runtime_error& e) {
+        a_error = e.what();
+    }
+}
+
+static CTask<> stop_executor(CExecutor& a_exec) {
+    a_exec.stop();
+    co_return;
+}
+
+static CTask<> resolve_localhost(CExecutor& a_exec, uint16_t& a_port) {
+    const CAddrinfo ai =
+        co_await async_resolve(a_exec, "localhost", "50011", AF_INET);
+    a_port = ai.port();
+}
+
+TEST(ExecutorTestSuite, coroutines_serve_many_connections) {
+    WINSOCK_INIT_P
+
+    CSocket listen_sock(AF_INET6, SOCK_STREAM);
+    listen_sock.bind(CAddrinfo("", "4448", AF_INET6, SOCK_STREAM,
+                               AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV));
+    listen_sock.listen();
+    set_nonblocking(listen_sock);
+    const CAddrinfo ai("", "4448", AF_UNSPEC, SOCK_STREAM,
+                       AI_NUMERICHOST | AI_NUMERICSERV);
+
+    // Test Unit, server and clients run on one thread.
+    constexpr int clients{100};
+    CExecutor exec;
+    int echoed{0};
+    exec.spawn(echo_server(exec, listen_sock, clients));
+    for (int i{0}; i < clients; i++)
+        exec.spawn(echo_client(exec, ai, echoed));
+    exec.run();
+
+    EXPECT_EQ(echoed, clients * 10);
+    EXPECT_EQ(exec.get_running(), 0);
+    EXPECT_EQ(exec.get_failed(), 0);
+
+    // Errors are thrown by co_await.
+    const CAddrinfo closed_ai("", "4449", AF_UNSPEC, SOCK_STREAM,
+                              AI_NUMERICHOST | AI_NUMERICSERV);
+    std::string error;
+    exec.spawn(connect_refused(exec, closed_ai, error));
+    exec.run();
+    EXPECT_THAT(error, HasSubstr("! MSG1046: "));
+
+    // A waiting task is destroyed with the executor after stop.
+    exec.spawn(echo_server(exec, listen_sock, 1));
+    exec.spawn(stop_executor(exec));
+    exec.run();
+    EXPECT_EQ(exec.get_running(), 1);
+}
+
+TEST(ExecutorTestSuite, resolve_without_blocking) {
+    CExecutor exec;
+    uint16_t port1{0};
+    uint16_t port2{0};
+
+    // Test Unit, the second lookup is coalesced resp. cached.
+    exec.spawn(resolve_localhost(exec, port1));
+    exec.spawn(resolve_localhost(exec, port2));
+    exec.run();
+
+    EXPECT_EQ(port1, 50011);
+    EXPECT_EQ(port2, 50011);
+    EXPECT_EQ(exec.get_running(), 0);
+    EXPECT_EQ(exec.get_failed(), 0);
+}
+
 } // namespace upnplib
 
 int main(int argc, char** argv) {
@@ -504,16 +2280,9 @@ int main(int argc, char** argv) {
     }
 
     // Wait until the tcp server is ready.
-    constexpr int delay{90}; // polling delay in microseconds
-    constexpr int limit{10}; // limit of polling retries
-    int i;
-    for (i = 0; i < limit; i++) {
-        if (tcp_svr->ready(delay))
-            break;
-    }
-    if (i >= limit) {
-        std::clog << "ERROR! ready loop for upnplib::CServerTCP thread called "
-                  << i << " times. Check for deadlock.\n";
+    if (!tcp_svr->wait_ready(std::chrono::seconds(10))) {
+        std::clog << "ERROR! upnplib::CServerTCP thread isn't ready after "
+                     "10 seconds. Check for deadlock.\n";
         std::exit(EXIT_FAILURE);
     }
 
@@ -521,14 +2290,8 @@ int main(int argc, char** argv) {
     ::testing::InitGoogleMock(&argc, argv);
     int gtest_rc = RUN_ALL_TESTS();
 
-    try {
-        // Quit server
-        upnplib::quit_server();
-    } catch (const std::exception& e) {
-        std::clog << e.what() << "\n";
-        std::exit(EXIT_FAILURE);
-    }
-
+    // Stop server
+    tcp_svr->stop(std::chrono::seconds(1));
     t1->join();
     return gtest_rc;
 }
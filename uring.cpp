@@ -0,0 +1,303 @@
+// Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+#include "uring.hpp"
+
+#ifdef UPNPLIB_WITH_IO_URING
+#include "port.hpp"
+#include "port_sock.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <cstring>
+#include <stdexcept>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace upnplib {
+
+static inline void throw_error(std::string errmsg, int a_errno) {
+    throw std::runtime_error(errmsg + " errno(" + std::to_string(a_errno) +
+                             ")=\"" + std::strerror(a_errno) + "\"");
+}
+
+// The rings are shared with the kernel, so the indexes must be accessed with
+// acquire/release semantic.
+static inline unsigned load_acquire(unsigned* a_ptr) {
+    return std::atomic_ref<unsigned>(*a_ptr).load(std::memory_order_acquire);
+}
+
+static inline void store_release(unsigned* a_ptr, unsigned a_val) {
+    std::atomic_ref<unsigned>(*a_ptr).store(a_val, std::memory_order_release);
+}
+
+CUring::CUring(unsigned a_entries) {
+    TRACE2(this, " Construct upnplib::CUring")
+    io_uring_params params{};
+    m_ring_fd = static_cast<int>(
+        ::syscall(__NR_io_uring_setup, a_entries, &params));
+    if (m_ring_fd < 0)
+        throw_error("ERROR! MSG1031: Failed to setup io_uring:", errno);
+
+    // Map the rings into user space.
+    m_sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+        m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+    m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+    m_sq_ptr = ::mmap(nullptr, m_sq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+    m_cq_ptr = single_mmap ? m_sq_ptr
+                           : ::mmap(nullptr, m_cq_size, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, m_ring_fd,
+                                    IORING_OFF_CQ_RING);
+    void* sqes = ::mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES);
+    if (m_sq_ptr == MAP_FAILED || m_cq_ptr == MAP_FAILED ||
+        sqes == MAP_FAILED) {
+        int err{errno};
+        if (m_sq_ptr != MAP_FAILED)
+            ::munmap(m_sq_ptr, m_sq_size);
+        if (!single_mmap && m_cq_ptr != MAP_FAILED)
+            ::munmap(m_cq_ptr, m_cq_size);
+        if (sqes != MAP_FAILED)
+            ::munmap(sqes, m_sqes_size);
+        ::close(m_ring_fd);
+        throw_error("ERROR! MSG1032: Failed to map io_uring:", err);
+    }
+    m_sqes = static_cast<io_uring_sqe*>(sqes);
+
+    char* sq = static_cast<char*>(m_sq_ptr);
+    m_sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    m_sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    m_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    m_sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    m_sq_entries = params.sq_entries;
+    m_sqe_tail = *m_sq_tail;
+
+    char* cq = static_cast<char*>(m_cq_ptr);
+    m_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    m_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    m_cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+}
+
+CUring::~CUring() {
+    TRACE2(this, " Destruct upnplib::CUring")
+    if (m_br != nullptr)
+        ::munmap(m_br, m_br_size);
+    ::munmap(m_sqes, m_sqes_size);
+    if (m_cq_ptr != m_sq_ptr)
+        ::munmap(m_cq_ptr, m_cq_size);
+    ::munmap(m_sq_ptr, m_sq_size);
+    // This also cancels all pending operations, e.g. a multishot accept.
+    ::close(m_ring_fd);
+}
+
+io_uring_sqe* CUring::get_sqe() {
+    if (m_sqe_tail - load_acquire(m_sq_head) >= m_sq_entries) {
+        this->submit_and_wait(0);
+        if (m_sqe_tail - load_acquire(m_sq_head) >= m_sq_entries)
+            return nullptr;
+    }
+    const unsigned idx = m_sqe_tail & m_sq_mask;
+    io_uring_sqe* sqe = &m_sqes[idx];
+    std::memset(sqe, 0, sizeof(*sqe));
+    m_sq_array[idx] = idx;
+    m_sqe_tail++;
+    m_to_submit++;
+    return sqe;
+}
+
+unsigned CUring::submit_and_wait(unsigned a_wait_nr) {
+    store_release(m_sq_tail, m_sqe_tail);
+    const unsigned flags = a_wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    for (;;) {
+        long ret = ::syscall(__NR_io_uring_enter, m_ring_fd, m_to_submit,
+                             a_wait_nr, flags, nullptr, 0);
+        if (ret >= 0) {
+            m_to_submit -= static_cast<unsigned>(ret);
+            return static_cast<unsigned>(ret);
+        }
+        if (errno != EINTR)
+            throw_error("ERROR! MSG1033: Failed to submit to io_uring:",
+                        errno);
+    }
+}
+
+void CUring::reap(std::vector<io_uring_cqe>& a_cqes) {
+    a_cqes.clear();
+    unsigned head = *m_cq_head;
+    const unsigned tail = load_acquire(m_cq_tail);
+    for (; head != tail; head++)
+        a_cqes.push_back(m_cqes[head & m_cq_mask]);
+    store_release(m_cq_head, head);
+}
+
+void CUring::setup_buf_ring(uint16_t a_bgid, unsigned a_count,
+                            unsigned a_size) {
+    TRACE2(this, " Executing upnplib::CUring::setup_buf_ring()")
+    m_br_size = a_count * sizeof(io_uring_buf);
+    void* br = ::mmap(nullptr, m_br_size, PROT_READ | PROT_WRITE,
+                      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (br == MAP_FAILED)
+        throw_error("ERROR! MSG1034: Failed to register buffer ring:", errno);
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(br);
+    reg.ring_entries = a_count;
+    reg.bgid = a_bgid;
+    if (::syscall(__NR_io_uring_register, m_ring_fd,
+                  IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        int err{errno};
+        ::munmap(br, m_br_size);
+        throw_error("ERROR! MSG1034: Failed to register buffer ring:", err);
+    }
+    m_br = static_cast<io_uring_buf_ring*>(br);
+    m_br_mask = a_count - 1;
+    m_buf_size = a_size;
+    m_bufs.resize(static_cast<size_t>(a_count) * a_size);
+    for (unsigned bid{0}; bid < a_count; bid++)
+        this->recycle_buffer(static_cast<uint16_t>(bid));
+
+    // Registration may succeed on kernels (or emulations) that nevertheless
+    // cannot receive into the ring. So check it with a socket pair: we expect
+    // one byte with a selected buffer and then end of file.
+    int sv[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+        throw_error("ERROR! MSG1034: Failed to register buffer ring:", errno);
+    ::send(sv[1], "P", 1, MSG_NOSIGNAL);
+    ::shutdown(sv[1], SHUT_WR);
+    this->prep_recv_multishot(sv[0], a_bgid, 0);
+    bool received{false};
+    bool more{true};
+    std::vector<io_uring_cqe> cqes;
+    for (int i{0}; more && i < 4; i++) {
+        this->submit_and_wait(1);
+        this->reap(cqes);
+        for (const io_uring_cqe& cqe : cqes) {
+            more = cqe.flags & IORING_CQE_F_MORE;
+            if (cqe.res == 1 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+                received = true;
+                this->recycle_buffer(static_cast<uint16_t>(
+                    cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+            }
+        }
+    }
+    ::close(sv[0]);
+    ::close(sv[1]);
+    if (!received || more)
+        throw std::runtime_error(
+            "ERROR! MSG1034: Failed to register buffer ring: \"receive into "
+            "provided buffers not supported\"");
+}
+
+char* CUring::buffer(uint16_t a_bid) {
+    return m_bufs.data() + static_cast<size_t>(a_bid) * m_buf_size;
+}
+
+void CUring::recycle_buffer(uint16_t a_bid) {
+    io_uring_buf* buf = &m_br->bufs[m_br_tail & m_br_mask];
+    buf->addr = reinterpret_cast<uint64_t>(this->buffer(a_bid));
+    buf->len = m_buf_size;
+    buf->bid = a_bid;
+    m_br_tail++;
+    std::atomic_ref<uint16_t>(m_br->tail).store(m_br_tail,
+                                                std::memory_order_release);
+}
+
+void CUring::prep_accept_multishot(int a_fd, uint64_t a_user_data) {
+    io_uring_sqe* sqe = this->get_sqe();
+    if (sqe == nullptr)
+        throw std::runtime_error("ERROR! MSG1033: Failed to submit to "
+                                 "io_uring: \"submission queue full\"");
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = a_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = a_user_data;
+}
+
+void CUring::prep_recv_multishot(int a_fd, uint16_t a_bgid,
+                                 uint64_t a_user_data) {
+    io_uring_sqe* sqe = this->get_sqe();
+    if (sqe == nullptr)
+        throw std::runtime_error("ERROR! MSG1033: Failed to submit to "
+                                 "io_uring: \"submission queue full\"");
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = a_fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = a_bgid;
+    sqe->user_data = a_user_data;
+}
+
+void CUring::prep_send(int a_fd, const void* a_buf, unsigned a_len,
+                       uint64_t a_user_data) {
+    io_uring_sqe* sqe = this->get_sqe();
+    if (sqe == nullptr)
+        throw std::runtime_error("ERROR! MSG1033: Failed to submit to "
+                                 "io_uring: \"submission queue full\"");
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = a_fd;
+    sqe->addr = reinterpret_cast<uint64_t>(a_buf);
+    sqe->len = a_len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = a_user_data;
+}
+
+void CUring::prep_sendmsg(int a_fd, const msghdr* a_msg,
+                          uint64_t a_user_data) {
+    io_uring_sqe* sqe = this->get_sqe();
+    if (sqe == nullptr)
+        throw std::runtime_error("ERROR! MSG1033: Failed to submit to "
+                                 "io_uring: \"submission queue full\"");
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = a_fd;
+    sqe->addr = reinterpret_cast<uint64_t>(a_msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = a_user_data;
+}
+
+void CUring::prep_recvmsg(int a_fd, msghdr* a_msg, uint64_t a_user_data) {
+    io_uring_sqe* sqe = this->get_sqe();
+    if (sqe == nullptr)
+        throw std::runtime_error("ERROR! MSG1033: Failed to submit to "
+                                 "io_uring: \"submission queue full\"");
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = a_fd;
+    sqe->addr = reinterpret_cast<uint64_t>(a_msg);
+    sqe->len = 1;
+    sqe->user_data = a_user_data;
+}
+
+void CUring::prep_poll_add(int a_fd, uint64_t a_user_data) {
+    io_uring_sqe* sqe = this->get_sqe();
+    if (sqe == nullptr)
+        throw std::runtime_error("ERROR! MSG1033: Failed to submit to "
+                                 "io_uring: \"submission queue full\"");
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = a_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = a_user_data;
+}
+
+void CUring::prep_cancel(uint64_t a_target_user_data) {
+    io_uring_sqe* sqe = this->get_sqe();
+    if (sqe == nullptr)
+        throw std::runtime_error("ERROR! MSG1033: Failed to submit to "
+                                 "io_uring: \"submission queue full\"");
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = a_target_user_data;
+    sqe->user_data = 0;
+}
+
+} // namespace upnplib
+
+#endif // UPNPLIB_WITH_IO_URING
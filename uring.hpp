@@ -0,0 +1,123 @@
+#ifndef UPNPLIB_URING_HPP
+#define UPNPLIB_URING_HPP
+// Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+// Minimal io_uring wrapper
+// ========================
+// This uses the raw system calls so there is no dependency to liburing. It
+// is only compiled on Linux with kernel headers that know multishot receive
+// (Linux 6.0 and later). Then UPNPLIB_WITH_IO_URING is defined. Whether the
+// running kernel supports it is checked at runtime by the constructor.
+// REF: [Efficient IO with io_uring](https://kernel.dk/io_uring.pdf)
+
+// clang-format off
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+  #include <linux/io_uring.h>
+  #if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT)
+    #define UPNPLIB_WITH_IO_URING
+  #endif
+#endif
+// clang-format on
+
+#ifdef UPNPLIB_WITH_IO_URING
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct msghdr;
+
+namespace upnplib {
+
+// Submission and completion rings
+// -------------------------------
+// Submission queue entries are only collected with get_sqe() and handed over
+// to the kernel with one system call by submit_and_wait(). So a whole batch
+// of operations costs one system call. The object is not thread safe and
+// copying it doesn't make sense.
+class CUring {
+  public:
+    // Setup a ring with at least a_entries submission queue entries. Throws
+    // an exception if io_uring isn't available.
+    CUring(unsigned a_entries);
+    CUring(const CUring&) = delete;
+    CUring& operator=(const CUring&) = delete;
+    virtual ~CUring();
+
+    // Get a zeroed submission queue entry. If the queue is full, pending
+    // entries are submitted first.
+    io_uring_sqe* get_sqe();
+
+    // Submit all pending entries and wait until at least a_wait_nr
+    // completions are available. Returns number of submitted entries.
+    unsigned submit_and_wait(unsigned a_wait_nr);
+
+    // Move all available completions to a_cqes (it is cleared before) and
+    // mark them as seen by the application.
+    void reap(std::vector<io_uring_cqe>& a_cqes);
+
+    // Provided buffer ring
+    // --------------------
+    // Register a_count (power of 2) buffers of a_size bytes with buffer group
+    // a_bgid. The kernel selects a buffer when receiving, so no memory is
+    // bound to idle connections. Throws an exception if not supported.
+    void setup_buf_ring(uint16_t a_bgid, unsigned a_count, unsigned a_size);
+    // Get the buffer the kernel has selected for a completion.
+    char* buffer(uint16_t a_bid);
+    // Give a buffer back to the kernel after its data were consumed.
+    void recycle_buffer(uint16_t a_bid);
+
+    // Prepare common operations.
+    void prep_accept_multishot(int a_fd, uint64_t a_user_data);
+    void prep_recv_multishot(int a_fd, uint16_t a_bgid, uint64_t a_user_data);
+    void prep_send(int a_fd, const void* a_buf, unsigned a_len,
+                   uint64_t a_user_data);
+    // Vectored send and receive, a_msg must be valid until the completion.
+    void prep_sendmsg(int a_fd, const msghdr* a_msg, uint64_t a_user_data);
+    void prep_recvmsg(int a_fd, msghdr* a_msg, uint64_t a_user_data);
+    // Wait once until the file descriptor is readable, e.g. an eventfd.
+    void prep_poll_add(int a_fd, uint64_t a_user_data);
+    // Cancel the operation that was submitted with a_target_user_data. Its
+    // own completion has user_data 0.
+    void prep_cancel(uint64_t a_target_user_data);
+
+  private:
+    int m_ring_fd{-1};
+
+    // Mapped ring memory
+    void* m_sq_ptr{nullptr};
+    size_t m_sq_size{};
+    void* m_cq_ptr{nullptr};
+    size_t m_cq_size{};
+    io_uring_sqe* m_sqes{nullptr};
+    size_t m_sqes_size{};
+
+    // Pointers into the rings
+    unsigned* m_sq_head{nullptr};
+    unsigned* m_sq_tail{nullptr};
+    unsigned* m_sq_array{nullptr};
+    unsigned m_sq_mask{};
+    unsigned m_sq_entries{};
+    unsigned* m_cq_head{nullptr};
+    unsigned* m_cq_tail{nullptr};
+    io_uring_cqe* m_cqes{nullptr};
+    unsigned m_cq_mask{};
+
+    // Local tail of the submission queue and number of not submitted entries.
+    unsigned m_sqe_tail{};
+    unsigned m_to_submit{};
+
+    // Provided buffer ring
+    io_uring_buf_ring* m_br{nullptr};
+    size_t m_br_size{};
+    unsigned m_br_mask{};
+    uint16_t m_br_tail{};
+    unsigned m_buf_size{};
+    std::vector<char> m_bufs;
+};
+
+} // namespace upnplib
+
+#endif // UPNPLIB_WITH_IO_URING
+
+#endif // UPNPLIB_URING_HPP
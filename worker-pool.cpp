@@ -0,0 +1,145 @@
+// Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+#include "worker-pool.hpp"
+#include "port.hpp"
+
+#include <algorithm>
+
+namespace upnplib {
+
+namespace {
+// Pool and index of the worker that runs on the current thread, so a task
+// that submits another task can queue it to its own deque.
+thread_local const CWorkerPool* tl_pool{nullptr};
+thread_local unsigned tl_worker{0};
+} // anonymous namespace
+
+CWorkerPool::CWorkerPool(unsigned a_size) {
+    TRACE2(this, " Construct upnplib::CWorkerPool")
+    if (a_size == 0)
+        a_size = std::max(1u, std::thread::hardware_concurrency());
+
+    for (unsigned i{0}; i < a_size; i++)
+        m_workers.push_back(std::make_unique<Worker>());
+    // Start threads only after all deques exist, they steal from each other.
+    for (unsigned i{0}; i < a_size; i++)
+        m_workers[i]->thread = std::thread(&CWorkerPool::run_worker, this, i);
+}
+
+CWorkerPool::~CWorkerPool() {
+    TRACE2(this, " Destruct upnplib::CWorkerPool")
+    {
+        std::scoped_lock lock(m_idle_mutex);
+        m_stop = true;
+    }
+    m_idle_cv.notify_all();
+    for (auto& worker : m_workers)
+        worker->thread.join();
+}
+
+void CWorkerPool::submit(Task a_task) {
+    const unsigned idx = (tl_pool == this)
+                             ? tl_worker
+                             : m_next.fetch_add(1, std::memory_order_relaxed) %
+                                   static_cast<unsigned>(m_workers.size());
+    Worker& worker = *m_workers[idx];
+    {
+        std::scoped_lock lock(worker.mutex);
+        worker.tasks.push_back(std::move(a_task));
+        worker.max_queue_depth =
+            std::max(worker.max_queue_depth, worker.tasks.size());
+    }
+    // The task is queued before the epoch changes, so a worker that sees the
+    // new epoch will find it. As long as no worker is parked the shared
+    // mutex isn't touched. Holding it orders the notification after a
+    // parking worker has checked the epoch.
+    m_epoch.fetch_add(1);
+    if (m_parked.load() > 0) {
+        std::scoped_lock lock(m_idle_mutex);
+        m_idle_cv.notify_one();
+    }
+}
+
+unsigned CWorkerPool::size() const {
+    return static_cast<unsigned>(m_workers.size());
+}
+
+std::vector<CWorkerPool::Stats> CWorkerPool::stats() const {
+    std::vector<Stats> stats;
+    for (const auto& worker : m_workers) {
+        std::scoped_lock lock(worker->mutex);
+        stats.push_back({worker->tasks.size(), worker->max_queue_depth,
+                         worker->executed.load(), worker->stolen.load(),
+                         worker->failed.load()});
+    }
+    return stats;
+}
+
+bool CWorkerPool::take_task(unsigned a_idx, Task& a_task, bool& a_stolen) {
+    // Newest task of the own deque.
+    {
+        Worker& own = *m_workers[a_idx];
+        std::scoped_lock lock(own.mutex);
+        if (!own.tasks.empty()) {
+            a_task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            a_stolen = false;
+            return true;
+        }
+    }
+    // Oldest task of another worker.
+    const size_t size = m_workers.size();
+    for (size_t i{1}; i < size; i++) {
+        Worker& victim = *m_workers[(a_idx + i) % size];
+        std::scoped_lock lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            a_task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            a_stolen = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+void CWorkerPool::run_worker(unsigned a_idx) {
+    TRACE2(this, " executing upnplib::CWorkerPool::run_worker()")
+    tl_pool = this;
+    tl_worker = a_idx;
+    Worker& worker = *m_workers[a_idx];
+
+    for (;;) {
+        const uint64_t epoch = m_epoch.load();
+        Task task;
+        bool stolen{false};
+        if (!this->take_task(a_idx, task, stolen)) {
+            // Park until a task is submitted after the search, or quit if
+            // there are no more tasks after the pool was stopped.
+            m_parked.fetch_add(1);
+            if (m_epoch.load() == epoch) {
+                std::unique_lock lock(m_idle_mutex);
+                if (m_stop) {
+                    m_parked.fetch_sub(1);
+                    return;
+                }
+                m_idle_cv.wait(lock, [this, epoch] {
+                    return m_epoch.load() != epoch || m_stop;
+                });
+            }
+            m_parked.fetch_sub(1);
+            continue;
+        }
+
+        try {
+            task();
+        } catch (...) {
+            worker.failed++;
+        }
+        worker.executed++;
+        if (stolen)
+            worker.stolen++;
+    }
+}
+
+} // namespace upnplib
@@ -0,0 +1,170 @@
+#ifndef UPNPLIB_WORKER_POOL_HPP
+#define UPNPLIB_WORKER_POOL_HPP
+// Copyright (C) 2023+ GPL 3 and higher by Ingo Höft, <Ingo@Hoeft-online.de>
+// Redistribution only with this Copyright remark. Last modified: 2026-10-16
+
+#include <atomic>
+#include <concepts>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace upnplib {
+
+// Work-stealing thread pool
+// -------------------------
+// Every worker has its own deque of tasks. Tasks submitted from outside the
+// pool are distributed round robin, tasks submitted by a worker go to its own
+// deque. A worker takes its newest task first (LIFO, cache friendly). An idle
+// worker steals the oldest task of another worker (FIFO), so a slow task only
+// delays the tasks queued behind it until an idle worker takes them.
+// Each deque has its own mutex. Submitting and taking an own task only lock
+// the mutex of the worker, a worker that steals locks the mutex of its
+// victim. Only an idle worker parks on the shared mutex of the pool, and a
+// submit only takes it to wake such a worker. The destructor executes all
+// queued tasks before it joins the workers.
+class CWorkerPool {
+  public:
+    // A task is only moved, so it can own e.g. a buffer from a pool.
+    // Callables up to inline_size bytes are stored in the task itself, e.g.
+    // a lambda that owns a CBuffer. Only larger ones are allocated.
+    class Task {
+      public:
+        static constexpr size_t inline_size{12 * sizeof(void*)};
+
+        Task() = default;
+        template <typename F>
+            requires(!std::same_as<std::decay_t<F>, Task> &&
+                     std::invocable<std::decay_t<F>&>)
+        Task(F&& a_fn) {
+            using Fn = std::decay_t<F>;
+            if constexpr (sizeof(Fn) <= inline_size &&
+                          alignof(Fn) <= alignof(std::max_align_t) &&
+                          std::is_nothrow_move_constructible_v<Fn>) {
+                ::new (m_storage) Fn(std::forward<F>(a_fn));
+                m_ops = &inline_ops<Fn>;
+            } else {
+                *reinterpret_cast<Fn**>(m_storage) =
+                    new Fn(std::forward<F>(a_fn));
+                m_ops = &heap_ops<Fn>;
+            }
+        }
+        Task(Task&& that) noexcept : m_ops(that.m_ops) {
+            if (m_ops) {
+                m_ops->move(m_storage, that.m_storage);
+                that.m_ops = nullptr;
+            }
+        }
+        Task& operator=(Task&& that) noexcept {
+            if (this != &that) {
+                this->reset();
+                m_ops = that.m_ops;
+                if (m_ops) {
+                    m_ops->move(m_storage, that.m_storage);
+                    that.m_ops = nullptr;
+                }
+            }
+            return *this;
+        }
+        Task(const Task&) = delete;
+        Task& operator=(const Task&) = delete;
+        ~Task() { this->reset(); }
+
+        void operator()() { m_ops->invoke(m_storage); }
+        explicit operator bool() const { return m_ops != nullptr; }
+
+      private:
+        // Operations on the stored callable. Move constructs it into
+        // uninitialized storage and destroys the source.
+        struct Ops {
+            void (*invoke)(void* a_fn);
+            void (*move)(void* a_dst, void* a_src) noexcept;
+            void (*destroy)(void* a_fn) noexcept;
+        };
+        template <typename F>
+        static constexpr Ops inline_ops{
+            [](void* a_fn) { (*static_cast<F*>(a_fn))(); },
+            [](void* a_dst, void* a_src) noexcept {
+                ::new (a_dst) F(std::move(*static_cast<F*>(a_src)));
+                static_cast<F*>(a_src)->~F();
+            },
+            [](void* a_fn) noexcept { static_cast<F*>(a_fn)->~F(); }};
+        template <typename F>
+        static constexpr Ops heap_ops{
+            [](void* a_fn) { (**static_cast<F**>(a_fn))(); },
+            [](void* a_dst, void* a_src) noexcept {
+                *static_cast<F**>(a_dst) = *static_cast<F**>(a_src);
+            },
+            [](void* a_fn) noexcept { delete *static_cast<F**>(a_fn); }};
+
+        void reset() {
+            if (m_ops) {
+                m_ops->destroy(m_storage);
+                m_ops = nullptr;
+            }
+        }
+
+        const Ops* m_ops{nullptr};
+        alignas(std::max_align_t) std::byte m_storage[inline_size];
+    };
+
+    // Statistics of one worker.
+    struct Stats {
+        size_t queue_depth;     // Tasks queued now.
+        size_t max_queue_depth; // Maximal tasks queued so far.
+        uint64_t executed;      // Tasks executed by this worker.
+        uint64_t stolen;        // Of them, tasks stolen from other workers.
+        uint64_t failed;        // Tasks that have thrown an exception.
+    };
+
+    // Start a_size worker threads. With a_size 0 the number of CPUs is used.
+    CWorkerPool(unsigned a_size = 0);
+    CWorkerPool(const CWorkerPool&) = delete;
+    CWorkerPool& operator=(const CWorkerPool&) = delete;
+    virtual ~CWorkerPool();
+
+    // Queue a task. This method is thread safe. An exception thrown by a task
+    // is caught and counted as failed.
+    void submit(Task a_task);
+
+    // Getter for number of workers and their statistics.
+    unsigned size() const;
+    std::vector<Stats> stats() const;
+
+  private:
+    struct Worker {
+        mutable std::mutex mutex;
+        std::deque<Task> tasks;       // Protected by mutex.
+        size_t max_queue_depth{0};    // Protected by mutex.
+        std::atomic<uint64_t> executed{0};
+        std::atomic<uint64_t> stolen{0};
+        std::atomic<uint64_t> failed{0};
+        std::thread thread;
+    };
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::atomic<unsigned> m_next{0};
+
+    // Idle workers park until a task is submitted (eventcount). Every submit
+    // increments m_epoch. A worker that found no task registers in m_parked,
+    // and only parks if m_epoch hasn't changed since before it searched.
+    std::mutex m_idle_mutex;
+    std::condition_variable m_idle_cv;
+    std::atomic<uint64_t> m_epoch{0};
+    std::atomic<unsigned> m_parked{0};
+    bool m_stop{false}; // Protected by m_idle_mutex.
+
+    void run_worker(unsigned a_idx);
+    bool take_task(unsigned a_idx, Task& a_task, bool& a_stolen);
+};
+
+} // namespace upnplib
+
+#endif // UPNPLIB_WORKER_POOL_HPP